@@ -1,3 +1,6 @@
+#ifdef __linux__
+    #define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <dirent.h>
@@ -7,6 +10,31 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <pwd.h>
+#ifdef __linux__
+    #include <sys/syscall.h>
+    #include <linux/stat.h>
+    #include <linux/io_uring.h>
+    #include <sys/inotify.h>
+    #include <poll.h>
+    #include <sys/sysmacros.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+#endif
+#ifndef O_DIRECT
+    #define O_DIRECT 0
+#endif
 
 #define MAX_DEPTH 1000
 #define MAX_ITERATIONS 10000
@@ -24,8 +52,123 @@
     #define PATH_SEPARATOR "/"
 #endif
 
-unsigned long long totalDirectories = 0;
-unsigned long long processedDirectories = 0;
+#define PROGRESS_REDRAW_INTERVAL_MS 100
+#define MAX_SCAN_THREADS 256
+#define DIR_FD_CACHE_SIZE 64
+#define PARALLEL_FD_CACHE_SIZE 512
+#define GETDENTS_BUFFER_SIZE (1 << 20)
+#define SNAPSHOT_MAGIC "ONIONSNP"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_RESTART_INTERVAL 16
+#define SNAPSHOT_NO_PARENT UINT32_MAX
+#define NO_CACHED_RECORD UINT32_MAX
+#define MAX_TOP_COUNT 1000000
+#define BREAKDOWN_EXTENSION_SLOTS 4096
+#define BREAKDOWN_OWNER_SLOTS 1024
+#define MAX_EXTENSION_LENGTH 15
+#define AGE_BUCKET_COUNT 7
+#define INODE_CHUNK_SIZE 65536
+#define INODE_ARRAY_LIMIT 4096
+#define INODE_SET_SHARD_BITS 6
+#define INODE_SET_SHARDS (1 << INODE_SET_SHARD_BITS)
+#define DEFAULT_ESTIMATE_DEPTH 2
+#define DEFAULT_ESTIMATE_PROBES 16
+#define MAX_ESTIMATE_PROBES 1000000
+#define INDEX_MAGIC "ONIONIDX"
+#define INDEX_VERSION 1
+#define DIR_TREE_NO_PARENT UINT32_MAX
+#define ASYNC_WRITER_BUFFERS 2
+#define ASYNC_WRITER_BUFFER_SIZE (4 << 20)
+#define DIRECT_IO_ALIGNMENT 4096
+#define SORT_MEMORY_LIMIT (64 << 20)
+#define SORT_MERGE_FANIN 64
+#define SORT_MIN_SLICE_RECORDS 65536
+#define ORDER_MAGIC "ONIONORD"
+#define ORDER_VERSION 1
+#define DUPLICATE_EDGE_BYTES 4096
+#define DUPLICATE_READ_SIZE (1 << 20)
+#define MAX_SCAN_DEVICES 64
+#define MAX_FSTYPE_LENGTH 32
+#define DEFAULT_HDD_THREADS 2
+#define DEFAULT_EXCLUDED_FSTYPES "proc,sysfs,devtmpfs,devpts,cgroup,cgroup2,securityfs,debugfs,tracefs,pstore,bpf," \
+                                 "configfs,fusectl,mqueue,hugetlbfs,autofs,binfmt_misc,efivarfs,selinuxfs,rpc_pipefs,nsfs"
+#define STATS_HISTOGRAM_BUCKETS 32
+#define STATS_MAX_ERRNO 256
+#define DEFAULT_URING_DEPTH 64
+#define MAX_URING_DEPTH 4096
+#define BENCH_LISTING_ROUNDS 3
+#define DEFAULT_BENCH_LISTING_SIZES "10000,1000000,10000000"
+#define MAX_QUERY_NEEDLES 64
+#define MATCH_BLOCK_SIZE 32
+#define BENCH_MATCH_PATHS 1000000
+#define BENCH_MATCH_ROUNDS 3
+#define DEFAULT_BENCH_MATCH_QUERY "cache|trace -tmp library"
+#define BENCH_SCAN_ROUNDS 5
+#define DEFAULT_BENCH_SHAPES "wide,deep,small,sparse,hardlinks,symlinks"
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | \
+                      IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+#ifdef DT_UNKNOWN
+    #define DIRENT_TYPE(entry) ((entry)->d_type)
+#else
+    #define DT_UNKNOWN 0
+    #define DT_DIR 4
+    #define DT_REG 8
+    #define DIRENT_TYPE(entry) DT_UNKNOWN
+#endif
+
+typedef enum ResultFormat {
+    RESULT_FORMAT_TEXT,
+    RESULT_FORMAT_SNAPSHOT,
+    // Keeps only the largest directories and files in memory; see --top.
+    RESULT_FORMAT_TOP,
+    // Keeps every non-empty file and no directories; see --duplicates.
+    RESULT_FORMAT_DUPLICATES
+} ResultFormat;
+
+typedef struct ScanOptions {
+    int threads;
+    ResultFormat resultFormat;
+    bool useGetdents;
+    bool useIoUring;
+    unsigned uringDepth;
+    bool incremental;
+    bool buildIndex;
+    bool directIo;
+    size_t topCount;
+    bool findDuplicates;
+    bool breakdown;
+    bool diskUsage;
+    bool estimate;
+    int estimateDepth;
+    unsigned long long estimateProbes;
+    bool countExcluded;
+    // collectStats is set by either --stats (printStats) or --stats-json.
+    bool collectStats;
+    bool printStats;
+    const char *statsJsonPath;
+    bool oneFileSystem;
+    const char *excludedFsTypes;
+    int hddThreads;
+    const char *watchRoot;
+    const char *diffOld;
+    const char *diffNew;
+    unsigned long long diffThreshold;
+    const char *benchListingRoot;
+    const char *benchListingSizes;
+    const char *benchMatchQuery;
+    const char *benchScanRoot;
+    const char *benchScanShapes;
+    const char *benchJsonPath;
+    const char *deletePath;
+    bool dryRun;
+    unsigned long long deleteRate;
+} ScanOptions;
+
+ScanOptions scanOptions = { .threads = 1, .useGetdents = true, .uringDepth = DEFAULT_URING_DEPTH,
+                             .excludedFsTypes = DEFAULT_EXCLUDED_FSTYPES, .hddThreads = DEFAULT_HDD_THREADS, .benchListingSizes = DEFAULT_BENCH_LISTING_SIZES,
+                             .benchScanShapes = DEFAULT_BENCH_SHAPES,
+                             .estimateDepth = DEFAULT_ESTIMATE_DEPTH, .estimateProbes = DEFAULT_ESTIMATE_PROBES };
 
 void displayProgressBar(int processedDirectories, int totalDirectories) {
     if (totalDirectories < 0) {
@@ -80,500 +223,10140 @@ void displayProgressBar(int processedDirectories, int totalDirectories) {
 }
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
-unsigned long long getDirectorySize(const char *dirPath) {
-    if (dirPath == NULL) {
-        fprintf(stderr, "Error: dirPath is NULL\n");
-        return 0;
-    }
+// There is no counting pre-pass: every directory the walk has discovered but not yet
+// entered is still on the frontier, so processed + frontier (= discovered) is a running
+// estimate of the total that converges to the exact count as the walk proceeds.
+typedef struct ScanProgress {
+    unsigned long long processed;
+    unsigned long long discovered;
+    long long lastRedrawMs;
+    // Filled in by incremental scans.
+    unsigned long long rereadDirectories;
+    unsigned long long reusedDirectories;
+    // Directories on another filesystem that --one-file-system or --exclude-fstype left out.
+    unsigned long long skippedMounts;
+    // Directories the exclude rules pruned, and with --count-excluded the bytes below them.
+    unsigned long long excludedDirectories;
+    unsigned long long excludedBytes;
+} ScanProgress;
 
-    unsigned long long totalSize = 0;
-    DIR *dir = opendir(dirPath);
-    if (dir == NULL) {
-        fprintf(stderr, "Failed to open directory '%s'\n", dirPath);
-        return 0;
-    }
+double monotonicSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip the current and parent directory entries
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
+long long monotonicMilliseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+uint64_t xorshiftRandom(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
 
-        // Construct the full path of the file
-        char fullPath[1024]; // Adjust size as needed
-        snprintf(fullPath, sizeof(fullPath), "%s/%s", dirPath, entry->d_name);
+// Counters for --stats and --stats-json. Each thread records into its own block, so the
+// scan threads never share a cache line; blocks are merged and cleared when a report is
+// made. With stats off every hook is a single branch on scanOptions.collectStats.
+typedef enum StatsCall {
+    STATS_CALL_OPEN,
+    STATS_CALL_CLOSE,
+    STATS_CALL_GETDENTS,
+    STATS_CALL_READDIR,
+    STATS_CALL_STAT,
+    STATS_CALL_FSTAT,
+    STATS_CALL_URING_STATX,
+    STATS_CALL_URING_ENTER,
+    STATS_CALL_WRITE,
+    STATS_CALL_UNLINK,
+    STATS_CALL_COUNT
+} StatsCall;
 
-        struct stat statbuf;
-        if (stat(fullPath, &statbuf) == -1) {
-            fprintf(stderr, "Failed to get stats for '%s'\n", fullPath);
-            continue;
-        }
+const char *statsCallNames[STATS_CALL_COUNT] = {
+    "openat", "close", "getdents64", "readdir", "fstatat", "fstat", "statx (io_uring)", "io_uring_enter", "writev", "unlinkat"
+};
+
+typedef enum StatsPhase {
+    STATS_PHASE_SCAN,
+    STATS_PHASE_COUNT_DIRECTORIES,
+    STATS_PHASE_DIRECTORY_SIZE,
+    STATS_PHASE_EXPORT,
+    STATS_PHASE_PROGRESS,
+    STATS_PHASE_OUTPUT_WAIT,
+    STATS_PHASE_DELETE,
+    STATS_PHASE_ESTIMATE,
+    STATS_PHASE_COUNT
+} StatsPhase;
 
-        // Recursively call getDirectorySize if it is a directory
-        if (S_ISDIR(statbuf.st_mode)) {
-            totalSize += getDirectorySize(fullPath);
-        } else if (S_ISREG(statbuf.st_mode)) {
-            totalSize += statbuf.st_size; // Accumulate file size
+const char *statsPhaseNames[STATS_PHASE_COUNT] = {
+    "scan", "countTotalDirectories", "getDirectorySize", "export", "progress bar", "waiting for output", "delete", "estimate"
+};
+
+typedef struct ThreadStats {
+    struct ThreadStats *next;
+    bool inUse;
+    unsigned long long calls[STATS_CALL_COUNT];
+    unsigned long long failures[STATS_CALL_COUNT];
+    unsigned long long nanoseconds[STATS_CALL_COUNT];
+    // Bucket b counts calls that took [2^b, 2^(b+1)) nanoseconds; the last is open-ended.
+    unsigned long long histogram[STATS_CALL_COUNT][STATS_HISTOGRAM_BUCKETS];
+    unsigned long long errors[STATS_MAX_ERRNO];
+    unsigned long long phaseRuns[STATS_PHASE_COUNT];
+    double phaseSeconds[STATS_PHASE_COUNT];
+    unsigned long long directories;
+    unsigned long long entries;
+    unsigned long long bytes;
+} ThreadStats;
+
+_Thread_local ThreadStats *threadStats = NULL;
+ThreadStats *allThreadStats = NULL;
+pthread_mutex_t threadStatsLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Claims a block for this thread, reusing one a finished thread gave back.
+ThreadStats *currentThreadStats() {
+    if (threadStats == NULL) {
+        pthread_mutex_lock(&threadStatsLock);
+        ThreadStats *stats = allThreadStats;
+        while (stats != NULL && stats->inUse) {
+            stats = stats->next;
+        }
+        if (stats == NULL && (stats = calloc(1, sizeof(ThreadStats))) != NULL) {
+            stats->next = allThreadStats;
+            allThreadStats = stats;
         }
+        if (stats != NULL) {
+            stats->inUse = true;
+        }
+        threadStats = stats;
+        pthread_mutex_unlock(&threadStatsLock);
     }
+    return threadStats;
+}
 
-    closedir(dir);
-    return totalSize;
+// Gives this thread's block back when the thread is done; its counts stay until reported.
+void releaseThreadStats() {
+    if (threadStats != NULL) {
+        pthread_mutex_lock(&threadStatsLock);
+        threadStats->inUse = false;
+        pthread_mutex_unlock(&threadStatsLock);
+        threadStats = NULL;
+    }
 }
 
+long long statsClock() {
+    if (!scanOptions.collectStats) {
+        return 0;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
 
-void listDirectories(const char *basePath, FILE *outputFile, int depth, int *processedDirectories, int totalDirectories) {
-    if (basePath == NULL || outputFile == NULL) {
-        fprintf(stderr, "Error: basePath or outputFile is NULL\n");
+// Counts a call without timing it, with the errno it failed with or 0.
+void statsCountCall(StatsCall call, int error) {
+    if (!scanOptions.collectStats) {
         return;
     }
-
-    if (depth > MAX_DEPTH) {
-        fprintf(stderr, "Maximum recursion depth reached in directory '%s'\n", basePath);
+    ThreadStats *stats = currentThreadStats();
+    if (stats == NULL) {
         return;
     }
+    stats->calls[call]++;
+    if (error != 0) {
+        stats->failures[call]++;
+        stats->errors[error > 0 && error < STATS_MAX_ERRNO ? error : 0]++;
+    }
+}
 
-    DIR *dir = opendir(basePath);
-    if (dir == NULL) {
-        fprintf(stderr, "Failed to open directory '%s': %s\n", basePath, strerror(errno));
+// Records a call that began at started, a statsClock reading. Reads errno when failed is
+// set and leaves it as it was.
+void statsRecordCall(StatsCall call, long long started, bool failed) {
+    if (!scanOptions.collectStats) {
         return;
     }
+    int error = errno;
+    long long elapsed = MAX(statsClock() - started, 1);
+    statsCountCall(call, failed ? MAX(error, 1) : 0);
+    ThreadStats *stats = threadStats;
+    if (stats != NULL) {
+        int bucket = MIN(63 - __builtin_clzll((unsigned long long)elapsed), STATS_HISTOGRAM_BUCKETS - 1);
+        stats->nanoseconds[call] += (unsigned long long)elapsed;
+        stats->histogram[call][bucket]++;
+    }
+    errno = error;
+}
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        // Construct full path
-        char fullPath[MAX_PATH_LEN];
-        snprintf(fullPath, sizeof(fullPath), "%s%s%s", basePath, PATH_SEPARATOR, entry->d_name);
-
-        // Use stat to determine if the entry is a directory
-        struct stat statbuf;
-        if (stat(fullPath, &statbuf) != 0) {
-            // Failed to stat, skip this entry
-            continue;
-        }
+double statsPhaseStart() {
+    return scanOptions.collectStats ? monotonicSeconds() : 0;
+}
 
-        // Check if it is a directory and not "." or ".."
-        if (S_ISDIR(statbuf.st_mode) && strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-            unsigned long long size = getDirectorySize(fullPath);
-            if (fprintf(outputFile, "%s - %llu bytes\n", fullPath, size) < 0) {
-                fprintf(stderr, "Error writing to the output file\n");
-                continue;
-            }
+void statsPhaseEnd(StatsPhase phase, double started) {
+    ThreadStats *stats = scanOptions.collectStats ? currentThreadStats() : NULL;
+    if (stats != NULL) {
+        stats->phaseRuns[phase]++;
+        stats->phaseSeconds[phase] += monotonicSeconds() - started;
+    }
+}
 
-            (*processedDirectories)++;
-            displayProgressBar(*processedDirectories, totalDirectories);
-            listDirectories(fullPath, outputFile, depth + 1, processedDirectories, totalDirectories);
-        }
+void statsCountListing(unsigned long long entries, unsigned long long bytes) {
+    ThreadStats *stats = scanOptions.collectStats ? currentThreadStats() : NULL;
+    if (stats != NULL) {
+        stats->directories++;
+        stats->entries += entries;
+        stats->bytes += bytes;
     }
+}
 
-    if (closedir(dir) == -1) {
-        fprintf(stderr, "Failed to close directory '%s': %s\n", basePath, strerror(errno));
+// Counts bytes charged after the listing was counted (deferred hard links).
+void statsCountBytes(unsigned long long bytes) {
+    ThreadStats *stats = scanOptions.collectStats ? currentThreadStats() : NULL;
+    if (stats != NULL) {
+        stats->bytes += bytes;
     }
 }
 
-int countTotalDirectories(const char *basePath, int depth) {
-    if (basePath == NULL) {
-        fprintf(stderr, "Error: basePath is NULL\n");
-        return 0;
+// Adds every block into total and clears them.
+void collectThreadStats(ThreadStats *total) {
+    memset(total, 0, sizeof(*total));
+    pthread_mutex_lock(&threadStatsLock);
+    for (ThreadStats *stats = allThreadStats; stats != NULL; stats = stats->next) {
+        for (int call = 0; call < STATS_CALL_COUNT; call++) {
+            total->calls[call] += stats->calls[call];
+            total->failures[call] += stats->failures[call];
+            total->nanoseconds[call] += stats->nanoseconds[call];
+            for (int bucket = 0; bucket < STATS_HISTOGRAM_BUCKETS; bucket++) {
+                total->histogram[call][bucket] += stats->histogram[call][bucket];
+            }
+        }
+        for (int error = 0; error < STATS_MAX_ERRNO; error++) {
+            total->errors[error] += stats->errors[error];
+        }
+        for (int phase = 0; phase < STATS_PHASE_COUNT; phase++) {
+            total->phaseRuns[phase] += stats->phaseRuns[phase];
+            total->phaseSeconds[phase] += stats->phaseSeconds[phase];
+        }
+        total->directories += stats->directories;
+        total->entries += stats->entries;
+        total->bytes += stats->bytes;
+
+        ThreadStats *next = stats->next;
+        bool inUse = stats->inUse;
+        memset(stats, 0, sizeof(*stats));
+        stats->next = next;
+        stats->inUse = inUse;
     }
+    pthread_mutex_unlock(&threadStatsLock);
+}
 
-    if (depth > MAX_DEPTH) {
-        fprintf(stderr, "Maximum recursion depth reached in directory '%s'\n", basePath);
-        return 0;
+// The upper bound, in nanoseconds, of the histogram bucket holding the given quantile.
+unsigned long long statsQuantile(const ThreadStats *stats, StatsCall call, double quantile) {
+    unsigned long long timed = 0;
+    for (int bucket = 0; bucket < STATS_HISTOGRAM_BUCKETS; bucket++) {
+        timed += stats->histogram[call][bucket];
+    }
+    unsigned long long seen = 0;
+    for (int bucket = 0; bucket < STATS_HISTOGRAM_BUCKETS; bucket++) {
+        seen += stats->histogram[call][bucket];
+        if (timed > 0 && seen >= quantile * timed) {
+            return 2ULL << bucket;
+        }
     }
+    return 0;
+}
 
-    DIR *dir = opendir(basePath);
-    if (dir == NULL) {
-        fprintf(stderr, "Failed to open directory '%s': %s\n", basePath, strerror(errno));
-        return 0;
+// Seconds spent walking directories, for the entries-per-second rate.
+double statsTraversalSeconds(const ThreadStats *stats) {
+    return stats->phaseSeconds[STATS_PHASE_SCAN] + stats->phaseSeconds[STATS_PHASE_COUNT_DIRECTORIES] +
+           stats->phaseSeconds[STATS_PHASE_DIRECTORY_SIZE];
+}
+
+void printScanStats(const ThreadStats *stats, const char *operation) {
+    printf("\n--- Statistics: %s ---\n", operation);
+    printf("%-24s %8s %12s\n", "Phase", "Runs", "Seconds");
+    for (int phase = 0; phase < STATS_PHASE_COUNT; phase++) {
+        if (stats->phaseRuns[phase] > 0) {
+            printf("%-24s %8llu %12.3f\n", statsPhaseNames[phase], stats->phaseRuns[phase], stats->phaseSeconds[phase]);
+        }
     }
 
-    int count = 0;
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        // Construct the full path for each directory entry
-        char fullPath[MAX_PATH_LEN];
-        snprintf(fullPath, sizeof(fullPath), "%s%s%s", basePath, PATH_SEPARATOR, entry->d_name);
-
-        // Use stat to check if the entry is a directory
-        struct stat statbuf;
-        if (stat(fullPath, &statbuf) != 0) {
-            // Skip this entry if we can't get stats (it might not exist, be accessible, etc.)
+    printf("%-18s %12s %8s %12s %9s %9s %9s\n", "Call", "Count", "Errors", "Total ms", "Mean us", "p50 us", "p99 us");
+    for (int call = 0; call < STATS_CALL_COUNT; call++) {
+        if (stats->calls[call] == 0) {
             continue;
         }
-
-        // Check if it is a directory and not "." or ".."
-        if (S_ISDIR(statbuf.st_mode) && strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-            count += 1 + countTotalDirectories(fullPath, depth + 1); // Increment count and recurse
+        if (stats->nanoseconds[call] == 0) {
+            printf("%-18s %12llu %8llu %12s %9s %9s %9s\n", statsCallNames[call], stats->calls[call],
+                   stats->failures[call], "-", "-", "-", "-");
+            continue;
         }
+        printf("%-18s %12llu %8llu %12.1f %9.2f %9.2f %9.2f\n", statsCallNames[call], stats->calls[call],
+               stats->failures[call], stats->nanoseconds[call] / 1e6, stats->nanoseconds[call] / 1e3 / stats->calls[call],
+               statsQuantile(stats, call, 0.5) / 1e3, statsQuantile(stats, call, 0.99) / 1e3);
     }
 
-    if (closedir(dir) == -1) {
-        fprintf(stderr, "Failed to close directory '%s': %s\n", basePath, strerror(errno));
+    double seconds = statsTraversalSeconds(stats);
+    printf("%llu directories listed, %llu entries (%.0f per second), %llu bytes accounted\n", stats->directories,
+           stats->entries, seconds > 0 ? stats->entries / seconds : 0.0, stats->bytes);
+    for (int error = 0; error < STATS_MAX_ERRNO; error++) {
+        if (stats->errors[error] > 0) {
+            printf("%llu errors: %s\n", stats->errors[error], error > 0 ? strerror(error) : "other");
+        }
     }
-
-    return count;
 }
 
-bool askYesNoQuestion(const char *question) {
-    if (question == NULL) {
-        fprintf(stderr, "Error: question is NULL\n");
-        return false;
+void writeJsonString(FILE *file, const char *text) {
+    fputc('"', file);
+    for (const unsigned char *cursor = (const unsigned char *)text; *cursor != '\0'; cursor++) {
+        if (*cursor == '"' || *cursor == '\\') {
+            fprintf(file, "\\%c", *cursor);
+        } else if (*cursor < 0x20) {
+            fprintf(file, "\\u%04x", *cursor);
+        } else {
+            fputc(*cursor, file);
+        }
     }
+    fputc('"', file);
+}
 
-    char response[10];
-    printf("%s (yes/no): ", question);
-    if (fgets(response, sizeof(response), stdin) == NULL) {
-        fprintf(stderr, "Error reading input\n");
+// Appends the report as one line of JSON.
+bool writeScanStatsJson(const ThreadStats *stats, const char *operation, const char *filePath) {
+    FILE *file = fopen(filePath, "a");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open stats file '%s': %s\n", filePath, strerror(errno));
         return false;
     }
 
-    response[strcspn(response, "\n")] = 0;
+    fprintf(file, "{\"operation\":");
+    writeJsonString(file, operation);
+    fprintf(file, ",\"time\":%lld,\"phases\":{", (long long)time(NULL));
+    bool first = true;
+    for (int phase = 0; phase < STATS_PHASE_COUNT; phase++) {
+        if (stats->phaseRuns[phase] > 0) {
+            fprintf(file, "%s", first ? "" : ",");
+            writeJsonString(file, statsPhaseNames[phase]);
+            fprintf(file, ":{\"runs\":%llu,\"seconds\":%.6f}", stats->phaseRuns[phase], stats->phaseSeconds[phase]);
+            first = false;
+        }
+    }
+    fprintf(file, "},\"calls\":{");
+    first = true;
+    for (int call = 0; call < STATS_CALL_COUNT; call++) {
+        if (stats->calls[call] == 0) {
+            continue;
+        }
+        fprintf(file, "%s", first ? "" : ",");
+        writeJsonString(file, statsCallNames[call]);
+        fprintf(file, ":{\"count\":%llu,\"errors\":%llu,\"nanoseconds\":%llu,\"histogram\":[", stats->calls[call],
+                stats->failures[call], stats->nanoseconds[call]);
+        for (int bucket = 0; bucket < STATS_HISTOGRAM_BUCKETS; bucket++) {
+            fprintf(file, "%s%llu", bucket > 0 ? "," : "", stats->histogram[call][bucket]);
+        }
+        fprintf(file, "]}");
+        first = false;
+    }
+    double seconds = statsTraversalSeconds(stats);
+    fprintf(file, "},\"directories\":%llu,\"entries\":%llu,\"entriesPerSecond\":%.1f,\"bytes\":%llu,\"errors\":[",
+            stats->directories, stats->entries, seconds > 0 ? stats->entries / seconds : 0.0, stats->bytes);
+    first = true;
+    for (int error = 0; error < STATS_MAX_ERRNO; error++) {
+        if (stats->errors[error] > 0) {
+            fprintf(file, "%s{\"errno\":%d,\"message\":", first ? "" : ",", error);
+            writeJsonString(file, error > 0 ? strerror(error) : "other");
+            fprintf(file, ",\"count\":%llu}", stats->errors[error]);
+            first = false;
+        }
+    }
+    fprintf(file, "]}\n");
 
-    for (int i = 0; response[i]; i++) {
-        response[i] = tolower((unsigned char) response[i]);
+    if (fclose(file) == EOF) {
+        fprintf(stderr, "Failed to write stats file '%s': %s\n", filePath, strerror(errno));
+        return false;
     }
+    return true;
+}
 
-    return (strcmp(response, "yes") == 0);
+// Prints and writes what was recorded since the last report, if anything was.
+void reportScanStats(const char *operation) {
+    if (!scanOptions.collectStats) {
+        return;
+    }
+    ThreadStats *total = malloc(sizeof(ThreadStats));
+    if (total == NULL) {
+        return;
+    }
+    collectThreadStats(total);
+    bool recorded = false;
+    for (int phase = 0; phase < STATS_PHASE_COUNT; phase++) {
+        recorded = recorded || total->phaseRuns[phase] > 0;
+    }
+    if (recorded && scanOptions.printStats) {
+        printScanStats(total, operation);
+    }
+    if (recorded && scanOptions.statsJsonPath != NULL) {
+        writeScanStatsJson(total, operation, scanOptions.statsJsonPath);
+    }
+    free(total);
 }
 
-unsigned long long askForSizeThreshold() {
-    unsigned long long threshold = 0;
-    printf("Enter size threshold in bytes: ");
-    int result = scanf("%llu", &threshold);
+// Redraws at most every PROGRESS_REDRAW_INTERVAL_MS so terminal I/O does not scale with
+// the number of directories; force draws the final state.
+void updateScanProgress(ScanProgress *progress, bool force) {
+    if (progress == NULL) {
+        return;
+    }
 
-    while (getchar() != '\n');
+    long long now = monotonicMilliseconds();
+    if (!force && now - progress->lastRedrawMs < PROGRESS_REDRAW_INTERVAL_MS) {
+        return;
+    }
+    progress->lastRedrawMs = now;
 
-    if (result != 1) {
-        printf("Invalid input. Using default threshold of 0 (no filtering).\n");
-        threshold = 0;
+    double started = statsPhaseStart();
+    unsigned long long processed = progress->processed;
+    unsigned long long total = MAX(progress->discovered, processed);
+    // displayProgressBar works in ints; scale down huge trees rather than overflow.
+    while (total > INT_MAX) {
+        processed /= 2;
+        total /= 2;
     }
+    displayProgressBar((int)processed, (int)total);
+    statsPhaseEnd(STATS_PHASE_PROGRESS, started);
+}
 
-    return threshold;
+// Identifies a directory's state for incremental rescans: creating, removing or renaming
+// an entry changes the mtime, and replacing the directory changes device or inode.
+typedef struct DirStamp {
+    unsigned long long device;
+    unsigned long long inode;
+    long long mtime;
+    long long ctime;
+    unsigned int mtimeNsec;
+    unsigned int ctimeNsec;
+} DirStamp;
+
+DirStamp dirStampFromStat(const struct stat *statbuf) {
+    DirStamp stamp;
+    stamp.device = statbuf->st_dev;
+    stamp.inode = statbuf->st_ino;
+    stamp.mtime = statbuf->st_mtime;
+    stamp.ctime = statbuf->st_ctime;
+#ifdef __APPLE__
+    stamp.mtimeNsec = statbuf->st_mtimespec.tv_nsec;
+    stamp.ctimeNsec = statbuf->st_ctimespec.tv_nsec;
+#else
+    stamp.mtimeNsec = statbuf->st_mtim.tv_nsec;
+    stamp.ctimeNsec = statbuf->st_ctim.tv_nsec;
+#endif
+    return stamp;
 }
 
-void toLowerString(char *str) {
-    if (str == NULL) {
-        fprintf(stderr, "Error: str is NULL\n");
-        return;
-    }
+// One directory of scan output. level is 0 for the scanned directory itself and grows by
+// one per path component below it; the name is path + nameOffset.
+typedef struct ResultEntry {
+    const char *path;
+    size_t nameOffset;
+    int level;
+    unsigned long long size;
+    unsigned long long entryCount;
+    DirStamp stamp;
+} ResultEntry;
 
-    for (int i = 0; str[i]; i++) {
-        if (isalpha((unsigned char) str[i])) {
-            str[i] = tolower((unsigned char) str[i]);
-        }
+// What a listing learns about each regular file it stats, for the modes that look at files.
+typedef struct FileFacts {
+    unsigned long long size;
+    uint64_t device;
+    uint64_t inode;
+    uint32_t uid;
+    int64_t modified;
+    int64_t accessed;
+    // Allocated 512-byte blocks, and what the file added to its directory's total.
+    unsigned long long blocks;
+    unsigned long long counted;
+} FileFacts;
+
+// Keeps the largest entries offered to it in a min-heap, so the smallest kept entry is the
+// one to evict. Equal sizes rank by path, which keeps the result independent of the order
+// entries arrive in. Several scan threads may offer at once.
+typedef struct TopEntry {
+    char *path;
+    unsigned long long size;
+} TopEntry;
+
+typedef struct TopHeap {
+    pthread_mutex_t lock;
+    TopEntry *entries;
+    size_t count;
+    size_t capacity;
+    unsigned long long threshold;
+    // Smallest size that can still get in: the threshold until the heap is full, then its
+    // minimum. Read without the lock to turn most offers away cheaply.
+    atomic_ullong admission;
+} TopHeap;
+
+typedef struct TopReport {
+    TopHeap directories;
+    TopHeap files;
+} TopReport;
+
+bool topHeapInit(TopHeap *heap, size_t capacity, unsigned long long threshold) {
+    memset(heap, 0, sizeof(*heap));
+    heap->entries = calloc(capacity, sizeof(TopEntry));
+    if (heap->entries == NULL) {
+        fprintf(stderr, "Error: out of memory for the top %zu entries\n", capacity);
+        return false;
     }
+    pthread_mutex_init(&heap->lock, NULL);
+    heap->capacity = capacity;
+    heap->threshold = threshold;
+    atomic_init(&heap->admission, threshold);
+    return true;
 }
 
-void printLine(const char *path, unsigned long long size) {
-    printf("%s - %llu bytes\n", path, size);
+// True if a ranks below b: smaller, or the same size with a later path.
+bool topEntryBelow(const TopEntry *a, const TopEntry *b) {
+    if (a->size != b->size) {
+        return a->size < b->size;
+    }
+    return strcmp(a->path, b->path) > 0;
 }
 
-int exportResults(const char *inputFilePath, const char *outputFilePath, const char *searchFilter) {
-    if (inputFilePath == NULL || outputFilePath == NULL || searchFilter == NULL) {
-        perror("Error: inputFilePath, outputFilePath, or searchFilter is NULL");
-        return -1;
+void topHeapSiftUp(TopHeap *heap, size_t index) {
+    TopEntry entry = heap->entries[index];
+    while (index > 0) {
+        size_t parent = (index - 1) / 2;
+        if (!topEntryBelow(&entry, &heap->entries[parent])) {
+            break;
+        }
+        heap->entries[index] = heap->entries[parent];
+        index = parent;
     }
+    heap->entries[index] = entry;
+}
 
-    FILE *inputFile = fopen(inputFilePath, "r");
-    if (inputFile == NULL) {
-        perror("Error opening the input file for reading");
-        return -1;
+void topHeapSiftDown(TopHeap *heap, size_t index) {
+    TopEntry entry = heap->entries[index];
+    while (true) {
+        size_t child = 2 * index + 1;
+        if (child >= heap->count) {
+            break;
+        }
+        if (child + 1 < heap->count && topEntryBelow(&heap->entries[child + 1], &heap->entries[child])) {
+            child++;
+        }
+        if (!topEntryBelow(&heap->entries[child], &entry)) {
+            break;
+        }
+        heap->entries[index] = heap->entries[child];
+        index = child;
     }
+    heap->entries[index] = entry;
+}
 
-    FILE *outputFile = fopen(outputFilePath, "w");
-    if (outputFile == NULL) {
-        perror("Error opening the output file for writing");
-        fclose(inputFile);
-        return -1;
+// Offers the entry at path, or at path/name when name is not NULL. The path is only
+// copied if the entry makes it into the heap.
+void topHeapOffer(TopHeap *heap, const char *path, const char *name, unsigned long long size) {
+    if (size < atomic_load_explicit(&heap->admission, memory_order_relaxed)) {
+        return;
     }
 
-    char line[1024];
-    while (fgets(line, sizeof(line), inputFile) != NULL) {
-        unsigned long long size;
-        char path[1024];
-
-        if (sscanf(line, "%1023s - %llu", path, &size) == 2) {
-            if (strstr(path, searchFilter) || strlen(searchFilter) == 0) {
-                if (fprintf(outputFile, "%s\n", line) < 0) {
-                    perror("Error writing to the output file");
-                    fclose(inputFile);
-                    fclose(outputFile);
-                    return -1;
-                }
+    pthread_mutex_lock(&heap->lock);
+    if (size >= atomic_load_explicit(&heap->admission, memory_order_relaxed)) {
+        size_t pathLength = strlen(path);
+        size_t length = pathLength + (name != NULL ? strlen(PATH_SEPARATOR) + strlen(name) : 0);
+        char *copy = malloc(length + 1);
+        if (copy != NULL) {
+            if (name != NULL) {
+                snprintf(copy, length + 1, "%s%s%s", path, PATH_SEPARATOR, name);
+            } else {
+                memcpy(copy, path, pathLength + 1);
+            }
+            TopEntry candidate = { copy, size };
+            if (heap->count < heap->capacity) {
+                heap->entries[heap->count] = candidate;
+                topHeapSiftUp(heap, heap->count++);
+            } else if (topEntryBelow(&heap->entries[0], &candidate)) {
+                free(heap->entries[0].path);
+                heap->entries[0] = candidate;
+                topHeapSiftDown(heap, 0);
+            } else {
+                free(copy);
+            }
+            if (heap->count == heap->capacity) {
+                atomic_store(&heap->admission, heap->entries[0].size);
             }
         }
     }
+    pthread_mutex_unlock(&heap->lock);
+}
 
-    if (fclose(inputFile) == EOF) {
-        perror("Error closing the input file");
-        fclose(outputFile);
-        return -1;
+int compareTopEntries(const void *a, const void *b) {
+    const TopEntry *left = a;
+    const TopEntry *right = b;
+    if (left->size != right->size) {
+        return left->size < right->size ? 1 : -1;
     }
+    return strcmp(left->path, right->path);
+}
 
-    if (fclose(outputFile) == EOF) {
-        perror("Error closing the output file");
-        return -1;
+// Orders the kept entries largest first. The heap cannot take offers afterwards.
+void topHeapSort(TopHeap *heap) {
+    if (heap->count > 0) {
+        qsort(heap->entries, heap->count, sizeof(TopEntry), compareTopEntries);
     }
+}
 
-    printf("Exported results to %s\n", outputFilePath);
+void topHeapFree(TopHeap *heap) {
+    for (size_t i = 0; i < heap->count; i++) {
+        free(heap->entries[i].path);
+    }
+    free(heap->entries);
+    pthread_mutex_destroy(&heap->lock);
+    memset(heap, 0, sizeof(*heap));
+}
 
-    return 0;
+// Every non-empty regular file a --duplicates scan sees, kept until the scan is over and
+// the files can be grouped. Paths live in one growing buffer. Several scan threads may add
+// files at once.
+typedef struct DuplicateFile {
+    unsigned long long size;
+    uint64_t device;
+    uint64_t inode;
+    uint64_t partialHash;
+    uint64_t fullHash;
+    // Offset of the NUL-terminated path in DuplicateFinder.paths, and the path itself
+    // once the scan is over and the buffer stops moving.
+    size_t path;
+    const char *pathText;
+    // Set when the file could not be read or changed since the scan.
+    bool unreadable;
+} DuplicateFile;
+
+typedef struct DuplicateFinder {
+    pthread_mutex_t lock;
+    DuplicateFile *files;
+    size_t count;
+    size_t capacity;
+    char *paths;
+    size_t pathsSize;
+    size_t pathsCapacity;
+    bool failed;
+} DuplicateFinder;
+
+void duplicateFinderInit(DuplicateFinder *finder) {
+    memset(finder, 0, sizeof(*finder));
+    pthread_mutex_init(&finder->lock, NULL);
 }
 
-void viewLastScanResults(const char *filePath) {
-    if (filePath == NULL) {
-        perror("Error: filePath is NULL");
+void duplicateFinderFree(DuplicateFinder *finder) {
+    free(finder->files);
+    free(finder->paths);
+    pthread_mutex_destroy(&finder->lock);
+    memset(finder, 0, sizeof(*finder));
+}
+
+void duplicateFinderAdd(DuplicateFinder *finder, const char *directoryPath, const char *name, const FileFacts *file) {
+    if (file->size == 0) {
         return;
     }
+    size_t directoryLength = strlen(directoryPath);
+    size_t nameLength = strlen(name);
+    size_t pathLength = directoryLength + strlen(PATH_SEPARATOR) + nameLength;
 
-    FILE *file = fopen(filePath, "r");
-    if (file == NULL) {
-        perror("Error: Unable to open the file for reading");
+    pthread_mutex_lock(&finder->lock);
+    if (finder->failed) {
+        pthread_mutex_unlock(&finder->lock);
         return;
     }
+    if (finder->count == finder->capacity) {
+        size_t newCapacity = finder->capacity ? finder->capacity * 2 : 4096;
+        DuplicateFile *files = realloc(finder->files, newCapacity * sizeof(DuplicateFile));
+        if (files == NULL) {
+            finder->failed = true;
+            pthread_mutex_unlock(&finder->lock);
+            return;
+        }
+        finder->files = files;
+        finder->capacity = newCapacity;
+    }
+    if (finder->pathsSize + pathLength + 1 > finder->pathsCapacity) {
+        size_t newCapacity = finder->pathsCapacity ? finder->pathsCapacity * 2 : 65536;
+        while (newCapacity < finder->pathsSize + pathLength + 1) {
+            newCapacity *= 2;
+        }
+        char *paths = realloc(finder->paths, newCapacity);
+        if (paths == NULL) {
+            finder->failed = true;
+            pthread_mutex_unlock(&finder->lock);
+            return;
+        }
+        finder->paths = paths;
+        finder->pathsCapacity = newCapacity;
+    }
 
-    char searchFilter[256] = "";
-    bool isFilteringActive = false;
-    unsigned long long sizeThreshold = 0;
-    bool useSizeThreshold = false;
-    char line[1024];
-    long lastPosition = 0;
-    int iterations = 0;
+    char *path = finder->paths + finder->pathsSize;
+    memcpy(path, directoryPath, directoryLength);
+    memcpy(path + directoryLength, PATH_SEPARATOR, strlen(PATH_SEPARATOR));
+    memcpy(path + pathLength - nameLength, name, nameLength + 1);
+    finder->files[finder->count++] = (DuplicateFile){
+        .size = file->size,
+        .device = file->device,
+        .inode = file->inode,
+        .path = finder->pathsSize
+    };
+    finder->pathsSize += pathLength + 1;
+    pthread_mutex_unlock(&finder->lock);
+}
 
-    while (iterations < MAX_ITERATIONS) {
-        iterations++;
-        fseek(file, lastPosition, SEEK_SET);
-        int lineCount = 0;
+// --breakdown: bytes by file extension, by modification and access age, and by owner,
+// gathered from the stats the scan already makes. Each scan thread counts into its own
+// fixed-size open-addressing tables, claimed on its first file and merged once the scan is
+// over, so counting takes no locks and no extra I/O. Entries that do not fit a full table
+// are counted as "other".
+typedef struct BreakdownTotal {
+    unsigned long long files;
+    unsigned long long bytes;
+} BreakdownTotal;
 
-        printf("\n--- Directory Size Scanner - Last Scan Results ---\n");
-        if (isFilteringActive) {
-            printf("Current Filter: %s\n", searchFilter);
+typedef struct ExtensionSlot {
+    // Lowercased, without the dot; empty for an unused slot.
+    char extension[MAX_EXTENSION_LENGTH + 1];
+    BreakdownTotal total;
+} ExtensionSlot;
+
+typedef struct OwnerSlot {
+    bool used;
+    uint32_t uid;
+    BreakdownTotal total;
+} OwnerSlot;
+
+typedef struct BreakdownTable {
+    struct BreakdownTable *next;
+    ExtensionSlot extensions[BREAKDOWN_EXTENSION_SLOTS];
+    size_t extensionCount;
+    BreakdownTotal noExtension;
+    BreakdownTotal otherExtensions;
+    OwnerSlot owners[BREAKDOWN_OWNER_SLOTS];
+    size_t ownerCount;
+    BreakdownTotal otherOwners;
+    BreakdownTotal modified[AGE_BUCKET_COUNT];
+    BreakdownTotal accessed[AGE_BUCKET_COUNT];
+} BreakdownTable;
+
+typedef struct FileBreakdown {
+    pthread_mutex_t lock;
+    BreakdownTable *tables;
+    // Tells this scan's tables from those a thread claimed in an earlier one.
+    uint64_t generation;
+    time_t started;
+} FileBreakdown;
+
+// Upper bounds of the age buckets, in seconds before the scan started.
+const long long ageBucketLimits[AGE_BUCKET_COUNT - 1] = {
+    86400LL, 7 * 86400LL, 30 * 86400LL, 91 * 86400LL, 365 * 86400LL, 3 * 365 * 86400LL
+};
+const char *ageBucketNames[AGE_BUCKET_COUNT] = {
+    "under a day", "under a week", "under a month", "under 3 months", "under a year", "under 3 years", "3 years or more"
+};
+
+FileBreakdown fileBreakdown = { .lock = PTHREAD_MUTEX_INITIALIZER };
+_Thread_local BreakdownTable *threadBreakdown = NULL;
+_Thread_local uint64_t threadBreakdownGeneration = 0;
+
+void freeBreakdownTables(FileBreakdown *breakdown) {
+    while (breakdown->tables != NULL) {
+        BreakdownTable *next = breakdown->tables->next;
+        free(breakdown->tables);
+        breakdown->tables = next;
+    }
+}
+
+// Drops what an earlier scan counted.
+void beginFileBreakdown(FileBreakdown *breakdown) {
+    pthread_mutex_lock(&breakdown->lock);
+    freeBreakdownTables(breakdown);
+    breakdown->generation++;
+    breakdown->started = time(NULL);
+    pthread_mutex_unlock(&breakdown->lock);
+}
+
+void addBreakdownTotal(BreakdownTotal *total, unsigned long long files, unsigned long long bytes) {
+    total->files += files;
+    total->bytes += bytes;
+}
+
+int ageBucketFor(time_t started, int64_t time) {
+    long long age = (long long)started - time;
+    int bucket = 0;
+    while (bucket < AGE_BUCKET_COUNT - 1 && age >= ageBucketLimits[bucket]) {
+        bucket++;
+    }
+    return bucket;
+}
+
+// FNV-1a.
+uint64_t hashBreakdownKey(const void *key, size_t length) {
+    const unsigned char *bytes = key;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+void countExtension(BreakdownTable *table, const char *extension, unsigned long long files, unsigned long long bytes) {
+    size_t length = strlen(extension);
+    size_t slot = hashBreakdownKey(extension, length) & (BREAKDOWN_EXTENSION_SLOTS - 1);
+    while (table->extensions[slot].extension[0] != '\0' && strcmp(table->extensions[slot].extension, extension) != 0) {
+        slot = (slot + 1) & (BREAKDOWN_EXTENSION_SLOTS - 1);
+    }
+    if (table->extensions[slot].extension[0] == '\0') {
+        // Keep a free slot so probing always ends.
+        if (table->extensionCount + 1 >= BREAKDOWN_EXTENSION_SLOTS) {
+            addBreakdownTotal(&table->otherExtensions, files, bytes);
+            return;
         }
-        if (useSizeThreshold) {
-            printf("Size Threshold: %llu bytes\n", sizeThreshold);
+        memcpy(table->extensions[slot].extension, extension, length + 1);
+        table->extensionCount++;
+    }
+    addBreakdownTotal(&table->extensions[slot].total, files, bytes);
+}
+
+void countOwner(BreakdownTable *table, uint32_t uid, unsigned long long files, unsigned long long bytes) {
+    size_t slot = hashBreakdownKey(&uid, sizeof(uid)) & (BREAKDOWN_OWNER_SLOTS - 1);
+    while (table->owners[slot].used && table->owners[slot].uid != uid) {
+        slot = (slot + 1) & (BREAKDOWN_OWNER_SLOTS - 1);
+    }
+    if (!table->owners[slot].used) {
+        if (table->ownerCount + 1 >= BREAKDOWN_OWNER_SLOTS) {
+            addBreakdownTotal(&table->otherOwners, files, bytes);
+            return;
         }
-        printf("-------------------------------------------------\n");
+        table->owners[slot].used = true;
+        table->owners[slot].uid = uid;
+        table->ownerCount++;
+    }
+    addBreakdownTotal(&table->owners[slot].total, files, bytes);
+}
 
-        while (lineCount < 20 && fgets(line, sizeof(line), file) != NULL) {
-            unsigned long long size;
-            char path[1024];
+void fileBreakdownAdd(FileBreakdown *breakdown, const char *name, const FileFacts *file) {
+    if (threadBreakdown == NULL || threadBreakdownGeneration != breakdown->generation) {
+        BreakdownTable *table = calloc(1, sizeof(BreakdownTable));
+        if (table == NULL) {
+            return;
+        }
+        pthread_mutex_lock(&breakdown->lock);
+        table->next = breakdown->tables;
+        breakdown->tables = table;
+        threadBreakdownGeneration = breakdown->generation;
+        pthread_mutex_unlock(&breakdown->lock);
+        threadBreakdown = table;
+    }
+    BreakdownTable *table = threadBreakdown;
 
-            if (sscanf(line, "%1023s - %llu", path, &size) == 2) {
-                if ((!isFilteringActive || strstr(path, searchFilter)) &&
-                    (!useSizeThreshold || size >= sizeThreshold)) {
-                    printf("%s - %llu bytes\n", path, size);
-                    lineCount++;
-                }
+    // A leading dot marks a hidden file, not an extension.
+    const char *dot = strrchr(name, '.');
+    if (dot == NULL || dot == name || dot[1] == '\0') {
+        addBreakdownTotal(&table->noExtension, 1, file->counted);
+    } else if (strlen(dot + 1) > MAX_EXTENSION_LENGTH) {
+        addBreakdownTotal(&table->otherExtensions, 1, file->counted);
+    } else {
+        char extension[MAX_EXTENSION_LENGTH + 1];
+        size_t length = 0;
+        for (const char *c = dot + 1; *c != '\0'; c++) {
+            extension[length++] = (char)tolower((unsigned char)*c);
+        }
+        extension[length] = '\0';
+        countExtension(table, extension, 1, file->counted);
+    }
+    countOwner(table, file->uid, 1, file->counted);
+    addBreakdownTotal(&table->modified[ageBucketFor(breakdown->started, file->modified)], 1, file->counted);
+    addBreakdownTotal(&table->accessed[ageBucketFor(breakdown->started, file->accessed)], 1, file->counted);
+}
+
+// Folds every other thread's table into the first. Call once the scan threads are done.
+BreakdownTable *mergeFileBreakdown(FileBreakdown *breakdown) {
+    BreakdownTable *merged = breakdown->tables;
+    if (merged == NULL) {
+        return NULL;
+    }
+    for (BreakdownTable *table = merged->next; table != NULL; table = table->next) {
+        for (size_t i = 0; i < BREAKDOWN_EXTENSION_SLOTS; i++) {
+            if (table->extensions[i].extension[0] != '\0') {
+                countExtension(merged, table->extensions[i].extension, table->extensions[i].total.files, table->extensions[i].total.bytes);
+            }
+        }
+        for (size_t i = 0; i < BREAKDOWN_OWNER_SLOTS; i++) {
+            if (table->owners[i].used) {
+                countOwner(merged, table->owners[i].uid, table->owners[i].total.files, table->owners[i].total.bytes);
             }
         }
+        addBreakdownTotal(&merged->noExtension, table->noExtension.files, table->noExtension.bytes);
+        addBreakdownTotal(&merged->otherExtensions, table->otherExtensions.files, table->otherExtensions.bytes);
+        addBreakdownTotal(&merged->otherOwners, table->otherOwners.files, table->otherOwners.bytes);
+        for (int bucket = 0; bucket < AGE_BUCKET_COUNT; bucket++) {
+            addBreakdownTotal(&merged->modified[bucket], table->modified[bucket].files, table->modified[bucket].bytes);
+            addBreakdownTotal(&merged->accessed[bucket], table->accessed[bucket].files, table->accessed[bucket].bytes);
+        }
+    }
+    while (merged->next != NULL) {
+        BreakdownTable *next = merged->next->next;
+        free(merged->next);
+        merged->next = next;
+    }
+    return merged;
+}
 
+int compareExtensionSlots(const void *a, const void *b) {
+    const ExtensionSlot *left = a;
+    const ExtensionSlot *right = b;
+    if ((left->extension[0] == '\0') != (right->extension[0] == '\0')) {
+        return left->extension[0] == '\0' ? 1 : -1;
+    }
+    if (left->total.bytes != right->total.bytes) {
+        return left->total.bytes < right->total.bytes ? 1 : -1;
+    }
+    return strcmp(left->extension, right->extension);
+}
+
+int compareOwnerSlots(const void *a, const void *b) {
+    const OwnerSlot *left = a;
+    const OwnerSlot *right = b;
+    if (left->used != right->used) {
+        return left->used ? -1 : 1;
+    }
+    if (left->total.bytes != right->total.bytes) {
+        return left->total.bytes < right->total.bytes ? 1 : -1;
+    }
+    return left->uid < right->uid ? -1 : left->uid > right->uid;
+}
+
+void printBreakdownLine(const char *label, const BreakdownTotal *total) {
+    printf("  %-24s %12llu files %18llu bytes\n", label, total->files, total->bytes);
+}
+
+// Prints what the last scan counted, largest first, then forgets it.
+void printFileBreakdown(FileBreakdown *breakdown) {
+    BreakdownTable *table = mergeFileBreakdown(breakdown);
+    if (table == NULL) {
+        printf("\nNo regular files were found.\n");
+        return;
+    }
+
+    // Sorting moves entries out of their hash slots, so the table is not probed again.
+    qsort(table->extensions, BREAKDOWN_EXTENSION_SLOTS, sizeof(ExtensionSlot), compareExtensionSlots);
+    printf("\nBytes by extension (%zu extensions):\n", table->extensionCount);
+    for (size_t i = 0; i < table->extensionCount && i < LINES_PER_PAGE; i++) {
+        char label[MAX_EXTENSION_LENGTH + 2];
+        snprintf(label, sizeof(label), ".%s", table->extensions[i].extension);
+        printBreakdownLine(label, &table->extensions[i].total);
+    }
+    BreakdownTotal otherExtensions = table->otherExtensions;
+    for (size_t i = LINES_PER_PAGE; i < table->extensionCount; i++) {
+        addBreakdownTotal(&otherExtensions, table->extensions[i].total.files, table->extensions[i].total.bytes);
+    }
+    if (otherExtensions.files > 0) {
+        printBreakdownLine("(other)", &otherExtensions);
+    }
+    if (table->noExtension.files > 0) {
+        printBreakdownLine("(no extension)", &table->noExtension);
+    }
+
+    printf("\nBytes by time since last modified:\n");
+    for (int bucket = 0; bucket < AGE_BUCKET_COUNT; bucket++) {
+        printBreakdownLine(ageBucketNames[bucket], &table->modified[bucket]);
+    }
+    printf("\nBytes by time since last accessed:\n");
+    for (int bucket = 0; bucket < AGE_BUCKET_COUNT; bucket++) {
+        printBreakdownLine(ageBucketNames[bucket], &table->accessed[bucket]);
+    }
+
+    qsort(table->owners, BREAKDOWN_OWNER_SLOTS, sizeof(OwnerSlot), compareOwnerSlots);
+    printf("\nBytes by owner (%zu owners):\n", table->ownerCount);
+    for (size_t i = 0; i < table->ownerCount && i < LINES_PER_PAGE; i++) {
+        char label[64];
+        struct passwd *user = getpwuid(table->owners[i].uid);
+        if (user != NULL) {
+            snprintf(label, sizeof(label), "%s (%u)", user->pw_name, (unsigned)table->owners[i].uid);
+        } else {
+            snprintf(label, sizeof(label), "uid %u", (unsigned)table->owners[i].uid);
+        }
+        printBreakdownLine(label, &table->owners[i].total);
+    }
+    BreakdownTotal otherOwners = table->otherOwners;
+    for (size_t i = LINES_PER_PAGE; i < table->ownerCount; i++) {
+        addBreakdownTotal(&otherOwners, table->owners[i].total.files, table->owners[i].total.bytes);
+    }
+    if (otherOwners.files > 0) {
+        printBreakdownLine("(other)", &otherOwners);
+    }
+
+    pthread_mutex_lock(&breakdown->lock);
+    freeBreakdownTables(breakdown);
+    pthread_mutex_unlock(&breakdown->lock);
+}
+
+// Binary snapshot layout: SnapshotHeader, then one fixed-width SnapshotRecord per
+// directory in pre-order (record 0 is the scanned directory), then the string table, then
+// the restart table. Record i's name is the i-th string. Strings are front-coded against
+// the previous name as varint(shared prefix) varint(suffix length) suffix, and every
+// SNAPSHOT_RESTART_INTERVAL names the coding restarts from an empty prefix at an offset
+// kept in the restart table, so any name can be decoded without reading the whole table.
+typedef struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t recordCount;
+    uint64_t recordsOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+    uint64_t restartsOffset;
+    uint64_t restartCount;
+    int64_t scanStarted;
+    // scanSettingsFingerprint() of the scan that wrote the snapshot.
+    uint64_t settingsFingerprint;
+} SnapshotHeader;
+
+typedef struct SnapshotRecord {
+    uint64_t size;
+    uint64_t entryCount;
+    int64_t mtime;
+    int64_t ctime;
+    uint64_t device;
+    uint64_t inode;
+    uint32_t mtimeNsec;
+    uint32_t ctimeNsec;
+    uint32_t parent;
+    uint32_t depth;
+} SnapshotRecord;
+
+// Result files are written by a writer thread, so a slow or network-mounted output stalls
+// the writer instead of the scan. Records are copied into one of ASYNC_WRITER_BUFFERS large
+// buffers while the thread writes the others out with writev; the producer only waits when
+// every other buffer is still queued, which bounds memory to the buffers themselves. With
+// O_DIRECT every write but the last covers whole aligned blocks, and the last is written
+// after O_DIRECT has been turned off again.
+typedef struct AsyncWriter {
+    int fd;
+    bool direct;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    char *buffers[ASYNC_WRITER_BUFFERS];
+    size_t lengths[ASYNC_WRITER_BUFFERS];
+    // Buffers first, first + 1, ... (modulo ASYNC_WRITER_BUFFERS) are queued for the
+    // thread; current is the one being filled.
+    size_t first;
+    size_t queued;
+    size_t current;
+    bool closing;
+    // errno of the first failed write; later buffers are dropped.
+    int error;
+} AsyncWriter;
+
+bool writeAll(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        if (iov->iov_len == 0) {
+            iov++;
+            count--;
+            continue;
+        }
+        long long started = statsClock();
+        ssize_t written = writev(fd, iov, count);
+        statsRecordCall(STATS_CALL_WRITE, started, written < 0);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            if (written == 0) {
+                errno = EIO;
+            }
+            return false;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= (size_t)written;
+        }
+    }
+    return true;
+}
+
+// Only the final buffer can end partway through a block.
+bool asyncWriterWrite(AsyncWriter *writer, struct iovec *iov, int count) {
+    size_t tail = writer->direct ? iov[count - 1].iov_len % DIRECT_IO_ALIGNMENT : 0;
+    iov[count - 1].iov_len -= tail;
+    if (!writeAll(writer->fd, iov, count)) {
+        return false;
+    }
+    if (tail == 0) {
+        return true;
+    }
+
+    int flags = fcntl(writer->fd, F_GETFL);
+    if (flags == -1 || fcntl(writer->fd, F_SETFL, flags & ~O_DIRECT) == -1) {
+        return false;
+    }
+    writer->direct = false;
+    struct iovec last = { (char *)iov[count - 1].iov_base + iov[count - 1].iov_len, tail };
+    return writeAll(writer->fd, &last, 1);
+}
+
+void *asyncWriterThread(void *argument) {
+    AsyncWriter *writer = argument;
+    pthread_mutex_lock(&writer->lock);
+    while (true) {
+        while (writer->queued == 0 && !writer->closing) {
+            pthread_cond_wait(&writer->changed, &writer->lock);
+        }
+        if (writer->queued == 0) {
+            break;
+        }
+
+        size_t count = writer->queued;
+        struct iovec iov[ASYNC_WRITER_BUFFERS];
+        for (size_t i = 0; i < count; i++) {
+            size_t buffer = (writer->first + i) % ASYNC_WRITER_BUFFERS;
+            iov[i].iov_base = writer->buffers[buffer];
+            iov[i].iov_len = writer->lengths[buffer];
+        }
+        bool failed = writer->error != 0;
+        pthread_mutex_unlock(&writer->lock);
+
+        int error = 0;
+        if (!failed && !asyncWriterWrite(writer, iov, (int)count)) {
+            error = errno;
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        if (error != 0) {
+            writer->error = error;
+        }
+        writer->first = (writer->first + count) % ASYNC_WRITER_BUFFERS;
+        writer->queued -= count;
+        pthread_cond_broadcast(&writer->changed);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    releaseThreadStats();
+    return NULL;
+}
+
+void freeAsyncWriterBuffers(AsyncWriter *writer) {
+    for (size_t i = 0; i < ASYNC_WRITER_BUFFERS; i++) {
+        free(writer->buffers[i]);
+        writer->buffers[i] = NULL;
+    }
+}
+
+// Starts writing to fd at its current offset. Anything the caller buffered for fd must
+// already be flushed. With direct set, O_DIRECT is used when the filesystem and the current
+// offset allow it.
+bool asyncWriterStart(AsyncWriter *writer, int fd, bool direct) {
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = fd;
+    for (size_t i = 0; i < ASYNC_WRITER_BUFFERS; i++) {
+        if (posix_memalign((void **)&writer->buffers[i], DIRECT_IO_ALIGNMENT, ASYNC_WRITER_BUFFER_SIZE) != 0) {
+            writer->buffers[i] = NULL;
+            fprintf(stderr, "Error: out of memory for the output buffers\n");
+            freeAsyncWriterBuffers(writer);
+            return false;
+        }
+    }
+
+    if (direct) {
+        int flags = fcntl(fd, F_GETFL);
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+        if (O_DIRECT != 0 && flags != -1 && offset != -1 && offset % DIRECT_IO_ALIGNMENT == 0 &&
+            fcntl(fd, F_SETFL, flags | O_DIRECT) == 0) {
+            writer->direct = true;
+        } else {
+            fprintf(stderr, "O_DIRECT is not available for this output; writing through the page cache\n");
+        }
+    }
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->changed, NULL);
+    if (pthread_create(&writer->thread, NULL, asyncWriterThread, writer) != 0) {
+        fprintf(stderr, "Error: could not start the output writer thread\n");
+        pthread_mutex_destroy(&writer->lock);
+        pthread_cond_destroy(&writer->changed);
+        freeAsyncWriterBuffers(writer);
+        return false;
+    }
+    return true;
+}
+
+// Queues the current buffer and moves on to a free one, waiting if there is none.
+bool asyncWriterSubmit(AsyncWriter *writer) {
+    pthread_mutex_lock(&writer->lock);
+    writer->queued++;
+    pthread_cond_broadcast(&writer->changed);
+    if (writer->queued == ASYNC_WRITER_BUFFERS) {
+        double started = statsPhaseStart();
+        while (writer->queued == ASYNC_WRITER_BUFFERS) {
+            pthread_cond_wait(&writer->changed, &writer->lock);
+        }
+        statsPhaseEnd(STATS_PHASE_OUTPUT_WAIT, started);
+    }
+    writer->current = (writer->first + writer->queued) % ASYNC_WRITER_BUFFERS;
+    writer->lengths[writer->current] = 0;
+    int error = writer->error;
+    pthread_mutex_unlock(&writer->lock);
+
+    if (error != 0) {
+        errno = error;
+        return false;
+    }
+    return true;
+}
+
+// Buffers are only handed over full, so O_DIRECT writes stay block-aligned.
+bool asyncWriterAppend(AsyncWriter *writer, const void *data, size_t length) {
+    const char *bytes = data;
+    while (length > 0) {
+        size_t used = writer->lengths[writer->current];
+        size_t chunk = MIN(ASYNC_WRITER_BUFFER_SIZE - used, length);
+        memcpy(writer->buffers[writer->current] + used, bytes, chunk);
+        writer->lengths[writer->current] = used + chunk;
+        bytes += chunk;
+        length -= chunk;
+        if (writer->lengths[writer->current] == ASYNC_WRITER_BUFFER_SIZE && !asyncWriterSubmit(writer)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Appends "<path> - <size> bytes\n".
+bool asyncWriterAppendResultLine(AsyncWriter *writer, const char *path, unsigned long long size) {
+    char digits[24];
+    size_t digitCount = 0;
+    do {
+        digits[sizeof(digits) - ++digitCount] = (char)('0' + size % 10);
+        size /= 10;
+    } while (size > 0);
+    return asyncWriterAppend(writer, path, strlen(path)) &&
+           asyncWriterAppend(writer, " - ", 3) &&
+           asyncWriterAppend(writer, digits + sizeof(digits) - digitCount, digitCount) &&
+           asyncWriterAppend(writer, " bytes\n", 7);
+}
+
+// Writes out whatever is left and stops the thread. The fd is left open, at the end of
+// the output and without O_DIRECT. Returns false, with errno set, if any write failed.
+bool asyncWriterFinish(AsyncWriter *writer) {
+    pthread_mutex_lock(&writer->lock);
+    if (writer->lengths[writer->current] > 0) {
+        writer->queued++;
+    }
+    writer->closing = true;
+    pthread_cond_broadcast(&writer->changed);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    if (writer->direct) {
+        int flags = fcntl(writer->fd, F_GETFL);
+        if (flags != -1) {
+            fcntl(writer->fd, F_SETFL, flags & ~O_DIRECT);
+        }
+    }
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->changed);
+    freeAsyncWriterBuffers(writer);
+    if (writer->error != 0) {
+        errno = writer->error;
+        return false;
+    }
+    return true;
+}
+
+typedef struct ResultSink {
+    // Text and snapshot output go through writer to the descriptor of file.
+    FILE *file;
+    AsyncWriter writer;
+    bool writerStarted;
+    ResultFormat format;
+    bool failed;
+    TopReport *top;
+    DuplicateFinder *duplicates;
+    // Set with --breakdown, whatever the format.
+    FileBreakdown *breakdown;
+    // Snapshot writer state.
+    int64_t scanStarted;
+    FILE *strings;
+    uint64_t stringsSize;
+    uint64_t recordCount;
+    uint32_t *levelRecords;
+    size_t levelCapacity;
+    char *previousName;
+    size_t previousNameLength;
+    size_t previousNameCapacity;
+    uint64_t *restarts;
+    size_t restartCount;
+    size_t restartCapacity;
+} ResultSink;
+
+void resultSinkInit(ResultSink *sink, FILE *file, ResultFormat format) {
+    memset(sink, 0, sizeof(*sink));
+    sink->file = file;
+    sink->format = format;
+}
+
+// Directory mtimes and entry counts are only worth an extra fstat per directory when the
+// output format stores them.
+bool resultSinkNeedsDirectoryStats(const ResultSink *sink) {
+    return sink != NULL && sink->format == RESULT_FORMAT_SNAPSHOT;
+}
+
+// Only text and snapshot output is written out, in pre-order; the in-memory formats take
+// records in whatever order they complete.
+bool resultSinkWritesOutput(const ResultSink *sink) {
+    return sink->format == RESULT_FORMAT_TEXT || sink->format == RESULT_FORMAT_SNAPSHOT;
+}
+
+// Only --top, --duplicates and --breakdown look at individual files.
+bool resultSinkWantsFiles(const ResultSink *sink) {
+    return sink != NULL && (!resultSinkWritesOutput(sink) || sink->breakdown != NULL);
+}
+
+void resultSinkVisitFile(void *context, const char *directoryPath, const char *name, const FileFacts *file) {
+    ResultSink *sink = context;
+    if (sink->breakdown != NULL) {
+        fileBreakdownAdd(sink->breakdown, name, file);
+    }
+    if (sink->format == RESULT_FORMAT_DUPLICATES) {
+        duplicateFinderAdd(sink->duplicates, directoryPath, name, file);
+    } else if (sink->format == RESULT_FORMAT_TOP) {
+        topHeapOffer(&sink->top->files, directoryPath, name, file->counted);
+    }
+}
+
+size_t encodeVarint(unsigned char *buffer, uint64_t value) {
+    size_t length = 0;
+    while (value >= 0x80) {
+        buffer[length++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    buffer[length++] = (unsigned char)value;
+    return length;
+}
+
+uint64_t decodeVarint(const unsigned char **cursor, const unsigned char *end) {
+    uint64_t value = 0;
+    for (int shift = 0; *cursor < end && shift < 64; shift += 7) {
+        unsigned char byte = *(*cursor)++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            break;
+        }
+    }
+    return value;
+}
+
+bool snapshotAppendName(ResultSink *sink, const char *name) {
+    size_t nameLength = strlen(name);
+    size_t shared = 0;
+    if (sink->recordCount % SNAPSHOT_RESTART_INTERVAL == 0) {
+        if (sink->restartCount == sink->restartCapacity) {
+            size_t newCapacity = sink->restartCapacity ? sink->restartCapacity * 2 : 1024;
+            uint64_t *restarts = realloc(sink->restarts, newCapacity * sizeof(uint64_t));
+            if (restarts == NULL) {
+                return false;
+            }
+            sink->restarts = restarts;
+            sink->restartCapacity = newCapacity;
+        }
+        sink->restarts[sink->restartCount++] = sink->stringsSize;
+    } else {
+        while (shared < nameLength && shared < sink->previousNameLength && name[shared] == sink->previousName[shared]) {
+            shared++;
+        }
+    }
+
+    unsigned char prefix[20];
+    size_t prefixLength = encodeVarint(prefix, shared);
+    prefixLength += encodeVarint(prefix + prefixLength, nameLength - shared);
+    if (fwrite(prefix, 1, prefixLength, sink->strings) != prefixLength ||
+        fwrite(name + shared, 1, nameLength - shared, sink->strings) != nameLength - shared) {
+        return false;
+    }
+    sink->stringsSize += prefixLength + nameLength - shared;
+
+    if (nameLength + 1 > sink->previousNameCapacity) {
+        char *previousName = realloc(sink->previousName, nameLength + 1);
+        if (previousName == NULL) {
+            return false;
+        }
+        sink->previousName = previousName;
+        sink->previousNameCapacity = nameLength + 1;
+    }
+    memcpy(sink->previousName, name, nameLength + 1);
+    sink->previousNameLength = nameLength;
+    return true;
+}
+
+void fillSnapshotRecord(SnapshotRecord *record, const ResultEntry *entry) {
+    memset(record, 0, sizeof(*record));
+    record->size = entry->size;
+    record->entryCount = entry->entryCount;
+    record->mtime = entry->stamp.mtime;
+    record->ctime = entry->stamp.ctime;
+    record->device = entry->stamp.device;
+    record->inode = entry->stamp.inode;
+    record->mtimeNsec = entry->stamp.mtimeNsec;
+    record->ctimeNsec = entry->stamp.ctimeNsec;
+}
+
+bool snapshotAppendRecord(ResultSink *sink, const ResultEntry *entry) {
+    if ((size_t)entry->level + 1 > sink->levelCapacity) {
+        size_t newCapacity = sink->levelCapacity ? sink->levelCapacity * 2 : 64;
+        while (newCapacity < (size_t)entry->level + 1) {
+            newCapacity *= 2;
+        }
+        uint32_t *levelRecords = realloc(sink->levelRecords, newCapacity * sizeof(uint32_t));
+        if (levelRecords == NULL) {
+            return false;
+        }
+        sink->levelRecords = levelRecords;
+        sink->levelCapacity = newCapacity;
+    }
+    if (sink->recordCount >= SNAPSHOT_NO_PARENT) {
+        fprintf(stderr, "Error: too many directories for a snapshot\n");
+        return false;
+    }
+
+    SnapshotRecord record;
+    fillSnapshotRecord(&record, entry);
+    record.depth = (uint32_t)entry->level;
+    // Records arrive in pre-order, so the parent is the latest record one level up.
+    record.parent = entry->level > 0 ? sink->levelRecords[entry->level - 1] : SNAPSHOT_NO_PARENT;
+    sink->levelRecords[entry->level] = (uint32_t)sink->recordCount;
+
+    if (!asyncWriterAppend(&sink->writer, &record, sizeof(record)) || !snapshotAppendName(sink, entry->path + entry->nameOffset)) {
+        return false;
+    }
+    sink->recordCount++;
+    return true;
+}
+
+// Starts the output. Snapshots reserve the header and a placeholder root record, both
+// rewritten by resultSinkFinish once the totals are known.
+bool resultSinkBegin(ResultSink *sink, const char *rootPath) {
+    if (!resultSinkWritesOutput(sink)) {
+        return true;
+    }
+    if (fflush(sink->file) == EOF || !asyncWriterStart(&sink->writer, fileno(sink->file), scanOptions.directIo)) {
+        sink->failed = true;
+        return false;
+    }
+    sink->writerStarted = true;
+    if (sink->format != RESULT_FORMAT_SNAPSHOT) {
+        return true;
+    }
+
+    sink->scanStarted = time(NULL);
+    sink->strings = tmpfile();
+    if (sink->strings == NULL) {
+        perror("Error creating the snapshot string table");
+        sink->failed = true;
+        return false;
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    ResultEntry root = { .path = rootPath, .nameOffset = 0, .level = 0 };
+    if (!asyncWriterAppend(&sink->writer, &header, sizeof(header)) || !snapshotAppendRecord(sink, &root)) {
+        sink->failed = true;
+        return false;
+    }
+    return true;
+}
+
+void resultSinkWrite(ResultSink *sink, const ResultEntry *entry) {
+    if (sink->failed) {
+        return;
+    }
+
+    if (sink->format == RESULT_FORMAT_TOP) {
+        topHeapOffer(&sink->top->directories, entry->path, NULL, entry->size);
+        return;
+    }
+    if (sink->format == RESULT_FORMAT_DUPLICATES) {
+        return;
+    }
+    if (sink->format == RESULT_FORMAT_TEXT) {
+        if (!asyncWriterAppendResultLine(&sink->writer, entry->path, entry->size)) {
+            perror("Error writing to the output file");
+            sink->failed = true;
+        }
+        return;
+    }
+
+    if (!snapshotAppendRecord(sink, entry)) {
+        fprintf(stderr, "Error writing to the output file\n");
+        sink->failed = true;
+    }
+}
+
+uint64_t scanSettingsFingerprint();
+
+bool resultSinkFinish(ResultSink *sink, const ResultEntry *root) {
+    if (!resultSinkWritesOutput(sink)) {
+        return true;
+    }
+    if (sink->format == RESULT_FORMAT_TEXT) {
+        sink->writerStarted = false;
+        return asyncWriterFinish(&sink->writer) && !sink->failed;
+    }
+    if (sink->failed) {
+        return false;
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.recordSize = sizeof(SnapshotRecord);
+    header.recordCount = sink->recordCount;
+    header.recordsOffset = sizeof(SnapshotHeader);
+    header.stringsOffset = header.recordsOffset + header.recordCount * sizeof(SnapshotRecord);
+    header.stringsSize = sink->stringsSize;
+    // Keep the restart table 8-byte aligned for direct use from the mapping.
+    header.restartsOffset = (header.stringsOffset + header.stringsSize + 7) & ~(uint64_t)7;
+    header.restartCount = sink->restartCount;
+    header.scanStarted = sink->scanStarted;
+    header.settingsFingerprint = scanSettingsFingerprint();
+
+    char buffer[65536];
+    size_t bytes;
+    rewind(sink->strings);
+    bool written = true;
+    while (written && (bytes = fread(buffer, 1, sizeof(buffer), sink->strings)) > 0) {
+        written = asyncWriterAppend(&sink->writer, buffer, bytes);
+    }
+    static const char padding[8] = {0};
+    size_t paddingLength = header.restartsOffset - (header.stringsOffset + header.stringsSize);
+    written = written && asyncWriterAppend(&sink->writer, padding, paddingLength) &&
+              asyncWriterAppend(&sink->writer, sink->restarts, sink->restartCount * sizeof(uint64_t));
+    sink->writerStarted = false;
+    if (!asyncWriterFinish(&sink->writer) || !written) {
+        return false;
+    }
+
+    // The header and root record go in last, once everything they describe is on disk.
+    SnapshotRecord rootRecord;
+    fillSnapshotRecord(&rootRecord, root);
+    rootRecord.parent = SNAPSHOT_NO_PARENT;
+    int fd = fileno(sink->file);
+    return pwrite(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+           pwrite(fd, &rootRecord, sizeof(rootRecord), sizeof(header)) == (ssize_t)sizeof(rootRecord);
+}
+
+void resultSinkFree(ResultSink *sink) {
+    if (sink->writerStarted) {
+        asyncWriterFinish(&sink->writer);
+    }
+    if (sink->strings != NULL) {
+        fclose(sink->strings);
+    }
+    free(sink->levelRecords);
+    free(sink->previousName);
+    free(sink->restarts);
+    memset(sink, 0, sizeof(*sink));
+}
+
+typedef struct ScanRecord {
+    char *path;
+    size_t nameOffset;
+    int level;
+    unsigned long long size;
+    unsigned long long entryCount;
+    DirStamp stamp;
+    bool complete;
+} ScanRecord;
+
+// Directory records are written in pre-order (a directory before its children), but a
+// directory's size is only known once its whole subtree has been visited. Records wait
+// here until every record ahead of them is complete and are then streamed to the file.
+typedef struct ScanQueue {
+    ScanRecord *records;
+    size_t head;
+    size_t count;
+    size_t capacity;
+    size_t firstSequence;
+    ResultSink *sink;
+} ScanQueue;
+
+typedef struct NameList {
+    char **names;
+    size_t count;
+    size_t capacity;
+} NameList;
+
+bool nameListAppend(NameList *list, const char *name) {
+    if (list->count == list->capacity) {
+        size_t newCapacity = list->capacity ? list->capacity * 2 : 16;
+        char **names = realloc(list->names, newCapacity * sizeof(*names));
+        if (names == NULL) {
+            fprintf(stderr, "Error: out of memory while listing directory\n");
+            return false;
+        }
+        list->names = names;
+        list->capacity = newCapacity;
+    }
+
+    list->names[list->count] = strdup(name);
+    if (list->names[list->count] == NULL) {
+        fprintf(stderr, "Error: out of memory while listing directory\n");
+        return false;
+    }
+    list->count++;
+    return true;
+}
+
+int compareNames(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+void nameListFree(NameList *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->names[i]);
+    }
+    free(list->names);
+    list->names = NULL;
+    list->count = list->capacity = 0;
+}
+
+void scanQueueInit(ScanQueue *queue, ResultSink *sink) {
+    memset(queue, 0, sizeof(*queue));
+    queue->sink = sink;
+}
+
+size_t scanQueuePush(ScanQueue *queue, const char *path, size_t nameOffset, int level) {
+    if (!resultSinkWritesOutput(queue->sink)) {
+        // Order does not matter to the in-memory formats, so records go straight to the
+        // sink on completion and nothing waits here.
+        return 0;
+    }
+    if (queue->count == queue->capacity) {
+        if (queue->head > 0) {
+            memmove(queue->records, queue->records + queue->head, (queue->count - queue->head) * sizeof(ScanRecord));
+            queue->firstSequence += queue->head;
+            queue->count -= queue->head;
+            queue->head = 0;
+        }
+        if (queue->count == queue->capacity) {
+            size_t newCapacity = queue->capacity ? queue->capacity * 2 : 64;
+            ScanRecord *records = realloc(queue->records, newCapacity * sizeof(ScanRecord));
+            if (records == NULL) {
+                fprintf(stderr, "Error: out of memory while queueing scan results\n");
+                return SIZE_MAX;
+            }
+            queue->records = records;
+            queue->capacity = newCapacity;
+        }
+    }
+
+    ScanRecord *record = &queue->records[queue->count];
+    record->path = strdup(path);
+    if (record->path == NULL) {
+        fprintf(stderr, "Error: out of memory while queueing scan results\n");
+        return SIZE_MAX;
+    }
+    record->nameOffset = nameOffset;
+    record->level = level;
+    record->size = 0;
+    record->complete = false;
+    queue->count++;
+    return queue->firstSequence + queue->count - 1;
+}
+
+// summary must carry the record's path for sinks that take records unordered.
+void scanQueueComplete(ScanQueue *queue, size_t sequence, const ResultEntry *summary) {
+    if (!resultSinkWritesOutput(queue->sink)) {
+        resultSinkWrite(queue->sink, summary);
+        return;
+    }
+    ScanRecord *record = &queue->records[sequence - queue->firstSequence];
+    record->size = summary->size;
+    record->entryCount = summary->entryCount;
+    record->stamp = summary->stamp;
+    record->complete = true;
+
+    while (queue->head < queue->count && queue->records[queue->head].complete) {
+        record = &queue->records[queue->head];
+        ResultEntry entry = {
+            .path = record->path,
+            .nameOffset = record->nameOffset,
+            .level = record->level,
+            .size = record->size,
+            .entryCount = record->entryCount,
+            .stamp = record->stamp
+        };
+        resultSinkWrite(queue->sink, &entry);
+        free(record->path);
+        queue->head++;
+    }
+
+    if (queue->head == queue->count) {
+        queue->firstSequence += queue->count;
+        queue->head = queue->count = 0;
+    }
+}
+
+void scanQueueFree(ScanQueue *queue) {
+    for (size_t i = queue->head; i < queue->count; i++) {
+        free(queue->records[i].path);
+    }
+    free(queue->records);
+    memset(queue, 0, sizeof(*queue));
+}
+
+typedef struct PathBuffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+} PathBuffer;
+
+// Appends PATH_SEPARATOR and name, growing the buffer as needed so deep trees are never
+// truncated. Returns the previous length for pathBufferTruncate, or SIZE_MAX on failure.
+size_t pathBufferAppend(PathBuffer *buffer, const char *name, bool addSeparator) {
+    size_t previousLength = buffer->length;
+    size_t separatorLength = addSeparator ? strlen(PATH_SEPARATOR) : 0;
+    size_t nameLength = strlen(name);
+    size_t needed = previousLength + separatorLength + nameLength + 1;
+
+    if (needed > buffer->capacity) {
+        size_t newCapacity = buffer->capacity ? buffer->capacity : 256;
+        while (newCapacity < needed) {
+            newCapacity *= 2;
+        }
+        char *data = realloc(buffer->data, newCapacity);
+        if (data == NULL) {
+            fprintf(stderr, "Error: out of memory while building path\n");
+            return SIZE_MAX;
+        }
+        buffer->data = data;
+        buffer->capacity = newCapacity;
+    }
+
+    memcpy(buffer->data + previousLength, PATH_SEPARATOR, separatorLength);
+    memcpy(buffer->data + previousLength + separatorLength, name, nameLength + 1);
+    buffer->length = needed - 1;
+    return previousLength;
+}
+
+void pathBufferTruncate(PathBuffer *buffer, size_t length) {
+    buffer->length = length;
+    buffer->data[length] = '\0';
+}
+
+void pathBufferFree(PathBuffer *buffer) {
+    free(buffer->data);
+    memset(buffer, 0, sizeof(*buffer));
+}
+
+typedef struct Snapshot {
+    unsigned char *data;
+    size_t size;
+    const SnapshotHeader *header;
+    const SnapshotRecord *records;
+    const unsigned char *strings;
+    const uint64_t *restarts;
+} Snapshot;
+
+// Whether count items of unitSize bytes starting at offset lie within a file of size bytes.
+// Each term is checked before it is used, so a corrupt header can't wrap the sum.
+bool snapshotRangeFits(uint64_t offset, uint64_t count, uint64_t unitSize, uint64_t size) {
+    return offset <= size && count <= (size - offset) / unitSize;
+}
+
+// Maps a snapshot written with --format binary. Nothing is parsed up front; records and
+// names are read straight from the mapping. Returns false if the file is not a snapshot.
+bool openSnapshot(Snapshot *snapshot, const char *filePath) {
+    memset(snapshot, 0, sizeof(*snapshot));
+    int fd = open(filePath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) != 0 || (size_t)statbuf.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return false;
+    }
+
+    void *data = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    const SnapshotHeader *header = data;
+    uint64_t size = statbuf.st_size;
+    bool valid = memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0 &&
+                 header->version == SNAPSHOT_VERSION &&
+                 header->recordSize == sizeof(SnapshotRecord) &&
+                 header->recordCount > 0 &&
+                 header->recordsOffset % _Alignof(SnapshotRecord) == 0 &&
+                 snapshotRangeFits(header->recordsOffset, header->recordCount, sizeof(SnapshotRecord), size) &&
+                 snapshotRangeFits(header->stringsOffset, header->stringsSize, 1, size) &&
+                 header->restartsOffset % sizeof(uint64_t) == 0 &&
+                 snapshotRangeFits(header->restartsOffset, header->restartCount, sizeof(uint64_t), size) &&
+                 header->restartCount == (header->recordCount + SNAPSHOT_RESTART_INTERVAL - 1) / SNAPSHOT_RESTART_INTERVAL;
+    if (!valid) {
+        munmap(data, statbuf.st_size);
+        return false;
+    }
+
+    snapshot->data = data;
+    snapshot->size = statbuf.st_size;
+    snapshot->header = header;
+    snapshot->records = (const SnapshotRecord *)(snapshot->data + header->recordsOffset);
+    snapshot->strings = snapshot->data + header->stringsOffset;
+    snapshot->restarts = (const uint64_t *)(snapshot->data + header->restartsOffset);
+    return true;
+}
+
+void closeSnapshot(Snapshot *snapshot) {
+    if (snapshot->data != NULL) {
+        munmap(snapshot->data, snapshot->size);
+    }
+    memset(snapshot, 0, sizeof(*snapshot));
+}
+
+// Decodes the name of record index into name, starting from the nearest restart point.
+bool decodeSnapshotName(const Snapshot *snapshot, uint64_t index, PathBuffer *name) {
+    uint64_t restart = index / SNAPSHOT_RESTART_INTERVAL;
+    if (snapshot->restarts[restart] > snapshot->header->stringsSize) {
+        return false;
+    }
+    const unsigned char *cursor = snapshot->strings + snapshot->restarts[restart];
+    const unsigned char *end = snapshot->strings + snapshot->header->stringsSize;
+
+    if (pathBufferAppend(name, "", false) == SIZE_MAX) {
+        return false;
+    }
+    for (uint64_t i = restart * SNAPSHOT_RESTART_INTERVAL; i <= index; i++) {
+        uint64_t shared = decodeVarint(&cursor, end);
+        uint64_t suffixLength = decodeVarint(&cursor, end);
+        if (shared > name->length || suffixLength > (uint64_t)(end - cursor)) {
+            return false;
+        }
+        pathBufferTruncate(name, shared);
+        // Append the suffix through a bounded copy; it is not NUL-terminated in the table.
+        char suffix[NAME_MAX + 1];
+        while (suffixLength > 0) {
+            size_t chunk = suffixLength < NAME_MAX ? suffixLength : NAME_MAX;
+            memcpy(suffix, cursor, chunk);
+            suffix[chunk] = '\0';
+            if (pathBufferAppend(name, suffix, false) == SIZE_MAX) {
+                return false;
+            }
+            cursor += chunk;
+            suffixLength -= chunk;
+        }
+    }
+    return true;
+}
+
+// The previous snapshot, loaded for --incremental. firstChild and nextSibling link every
+// record to its subdirectories in scan order, so an unchanged directory can be listed from
+// the cache instead of from disk.
+typedef struct ScanCache {
+    Snapshot snapshot;
+    uint32_t *firstChild;
+    uint32_t *nextSibling;
+    atomic_ullong reused;
+    atomic_ullong reread;
+} ScanCache;
+
+void freeScanCache(ScanCache *cache) {
+    free(cache->firstChild);
+    free(cache->nextSibling);
+    closeSnapshot(&cache->snapshot);
+    cache->firstChild = NULL;
+    cache->nextSibling = NULL;
+}
+
+// Loads filePath as the cache for a rescan of basePath. Returns false if the file is
+// missing, is not a snapshot, is a scan of some other directory, or was taken with other
+// scan settings.
+bool loadScanCache(ScanCache *cache, const char *filePath, const char *basePath) {
+    memset(cache, 0, sizeof(*cache));
+    atomic_init(&cache->reused, 0);
+    atomic_init(&cache->reread, 0);
+    if (!openSnapshot(&cache->snapshot, filePath)) {
+        return false;
+    }
+
+    PathBuffer rootName = {0};
+    bool sameRoot = decodeSnapshotName(&cache->snapshot, 0, &rootName) && strcmp(rootName.data, basePath) == 0;
+    pathBufferFree(&rootName);
+    uint64_t count = cache->snapshot.header->recordCount;
+    if (!sameRoot || count >= NO_CACHED_RECORD) {
+        closeSnapshot(&cache->snapshot);
+        return false;
+    }
+    if (cache->snapshot.header->settingsFingerprint != scanSettingsFingerprint()) {
+        printf("The previous scan in %s used other exclude rules, filesystem options or --disk-usage\n", filePath);
+        closeSnapshot(&cache->snapshot);
+        return false;
+    }
+
+    cache->firstChild = malloc(count * sizeof(uint32_t));
+    cache->nextSibling = malloc(count * sizeof(uint32_t));
+    if (cache->firstChild == NULL || cache->nextSibling == NULL) {
+        fprintf(stderr, "Error: out of memory while loading the previous scan\n");
+        freeScanCache(cache);
+        return false;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        cache->firstChild[i] = NO_CACHED_RECORD;
+        cache->nextSibling[i] = NO_CACHED_RECORD;
+    }
+    // Walking backwards and prepending leaves every child list in scan order.
+    const SnapshotRecord *records = cache->snapshot.records;
+    for (uint64_t i = count; i-- > 1;) {
+        uint32_t parent = records[i].parent;
+        if (parent >= i) {
+            freeScanCache(cache);
+            return false;
+        }
+        cache->nextSibling[i] = cache->firstChild[parent];
+        cache->firstChild[parent] = (uint32_t)i;
+    }
+    return true;
+}
+
+// A cached directory is current if nothing about its stamp changed. Its mtime must also
+// predate the second the previous scan started: a change made in that same second may have
+// landed after the directory was read without moving the mtime.
+bool scanCacheIsCurrent(const ScanCache *cache, uint32_t record, const DirStamp *stamp) {
+    const SnapshotRecord *cached = &cache->snapshot.records[record];
+    return cached->device == stamp->device &&
+           cached->inode == stamp->inode &&
+           cached->mtime == stamp->mtime &&
+           cached->mtimeNsec == stamp->mtimeNsec &&
+           cached->ctime == stamp->ctime &&
+           cached->ctimeNsec == stamp->ctimeNsec &&
+           cached->mtime < cache->snapshot.header->scanStarted;
+}
+
+typedef struct DirHandle {
+    int fd;
+    DIR *stream;
+    // Filled by statDirectoryHandle, at most once per open.
+    bool haveStat;
+    struct stat stat;
+} DirHandle;
+
+// Opens name relative to parentFd (AT_FDCWD for plain paths). Only the start of a scan
+// follows a symlink; everything below it is opened with O_NOFOLLOW so the walk can't
+// escape the tree or loop.
+bool openDirectoryAt(int parentFd, const char *name, bool followSymlinks, DirHandle *handle) {
+    int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    if (!followSymlinks) {
+        flags |= O_NOFOLLOW;
+    }
+
+    handle->stream = NULL;
+    handle->haveStat = false;
+    long long started = statsClock();
+    handle->fd = openat(parentFd, name, flags);
+    statsRecordCall(STATS_CALL_OPEN, started, handle->fd < 0);
+    return handle->fd >= 0;
+}
+
+bool statDirectoryHandle(DirHandle *handle) {
+    if (!handle->haveStat && handle->fd >= 0) {
+        long long started = statsClock();
+        handle->haveStat = fstat(handle->fd, &handle->stat) == 0;
+        statsRecordCall(STATS_CALL_FSTAT, started, !handle->haveStat);
+    }
+    return handle->haveStat;
+}
+
+// The DIR stream is only created when readdir is actually used; the getdents64 path
+// reads the fd directly.
+DIR *directoryStream(DirHandle *handle) {
+    if (handle->stream == NULL && handle->fd >= 0) {
+        handle->stream = fdopendir(handle->fd);
+    }
+    return handle->stream;
+}
+
+void closeDirectory(DirHandle *handle, const char *displayPath) {
+    long long started = statsClock();
+    if (handle->stream != NULL) {
+        int result = closedir(handle->stream);
+        statsRecordCall(STATS_CALL_CLOSE, started, result == -1);
+        if (result == -1) {
+            fprintf(stderr, "Failed to close directory '%s': %s\n", displayPath, strerror(errno));
+        }
+    } else if (handle->fd >= 0) {
+        statsRecordCall(STATS_CALL_CLOSE, started, close(handle->fd) == -1);
+    }
+    handle->stream = NULL;
+    handle->fd = -1;
+}
+
+// A mounted filesystem, from /proc/self/mountinfo.
+typedef struct MountedDevice {
+    dev_t device;
+    char fsType[MAX_FSTYPE_LENGTH];
+    // Whether it is mounted somewhere below the start of the scan.
+    bool belowRoot;
+} MountedDevice;
+
+// Which directories a scan may enter besides those on the device it started on. Only an
+// active boundary costs an fstat per directory.
+typedef struct ScanBoundary {
+    bool active;
+    // Set when another device is mounted below the start of the scan, so directories can
+    // change device at all.
+    bool crossesMounts;
+    dev_t rootDevice;
+    MountedDevice *mounts;
+    size_t mountCount;
+    atomic_ullong skipped;
+} ScanBoundary;
+
+bool fsTypeListContains(const char *list, const char *fsType) {
+    size_t length = strlen(fsType);
+    const char *cursor = list;
+    while (cursor != NULL && *cursor != '\0') {
+        const char *comma = strchr(cursor, ',');
+        size_t itemLength = comma != NULL ? (size_t)(comma - cursor) : strlen(cursor);
+        if (itemLength == length && strncmp(cursor, fsType, length) == 0) {
+            return true;
+        }
+        cursor = comma != NULL ? comma + 1 : NULL;
+    }
+    return false;
+}
+
+// Whether the mount point field of a mountinfo line, with its octal escapes, names a
+// directory strictly below rootPath. Without a rootPath every mount counts as below it.
+bool mountPointIsBelow(const char *field, size_t length, const char *rootPath) {
+    if (rootPath == NULL) {
+        return true;
+    }
+    char *mountPoint = malloc(length + 1);
+    if (mountPoint == NULL) {
+        return true;
+    }
+    size_t used = 0;
+    for (size_t i = 0; i < length; i++) {
+        // The kernel writes space, tab, newline and backslash as \ooo.
+        if (field[i] == '\\' && i + 3 < length && field[i + 1] >= '0' && field[i + 1] <= '3') {
+            mountPoint[used++] = (char)(((field[i + 1] - '0') << 6) | ((field[i + 2] - '0') << 3) | (field[i + 3] - '0'));
+            i += 3;
+        } else {
+            mountPoint[used++] = field[i];
+        }
+    }
+    mountPoint[used] = '\0';
+
+    size_t rootLength = strlen(rootPath);
+    bool below = strcmp(rootPath, "/") == 0 ? strcmp(mountPoint, "/") != 0
+                                            : strncmp(mountPoint, rootPath, rootLength) == 0 && mountPoint[rootLength] == '/';
+    free(mountPoint);
+    return below;
+}
+
+// Reads the filesystem type of every mounted device and whether it is mounted below
+// rootPath. Elsewhere than Linux the table stays empty and only --one-file-system applies.
+void loadMountTable(ScanBoundary *boundary, const char *rootPath) {
+#ifdef __linux__
+    FILE *file = fopen("/proc/self/mountinfo", "r");
+    if (file == NULL) {
+        return;
+    }
+    char *line = NULL;
+    size_t lineCapacity = 0;
+    size_t capacity = 0;
+    while (getline(&line, &lineCapacity, file) != -1) {
+        // "id parent major:minor root mountpoint options [optional fields] - fstype source ..."
+        unsigned int major, minor;
+        MountedDevice mount;
+        const char *separator = strstr(line, " - ");
+        const char *field = line;
+        for (int i = 0; i < 4 && field != NULL; i++) {
+            field = strchr(field, ' ');
+            field = field != NULL ? field + 1 : NULL;
+        }
+        if (sscanf(line, "%*s %*s %u:%u", &major, &minor) != 2 || separator == NULL || field == NULL ||
+            sscanf(separator + 3, "%31s", mount.fsType) != 1) {
+            continue;
+        }
+        mount.device = makedev(major, minor);
+        mount.belowRoot = mountPointIsBelow(field, strcspn(field, " "), rootPath);
+        if (boundary->mountCount == capacity) {
+            size_t newCapacity = capacity ? capacity * 2 : 32;
+            MountedDevice *mounts = realloc(boundary->mounts, newCapacity * sizeof(MountedDevice));
+            if (mounts == NULL) {
+                break;
+            }
+            boundary->mounts = mounts;
+            capacity = newCapacity;
+        }
+        boundary->mounts[boundary->mountCount++] = mount;
+    }
+    free(line);
+    fclose(file);
+#endif
+}
+
+// Type exclusions only cost an fstat per directory when a mount they exclude lies below
+// basePath; --one-file-system always does, since devices such as btrfs subvolumes are not
+// in the mount table.
+void scanBoundaryInit(ScanBoundary *boundary, const char *basePath, dev_t rootDevice) {
+    memset(boundary, 0, sizeof(*boundary));
+    atomic_init(&boundary->skipped, 0);
+    boundary->rootDevice = rootDevice;
+    boundary->active = scanOptions.oneFileSystem;
+
+    char *rootPath = realpath(basePath, NULL);
+    loadMountTable(boundary, rootPath);
+    free(rootPath);
+    for (size_t i = 0; i < boundary->mountCount; i++) {
+        const MountedDevice *mount = &boundary->mounts[i];
+        if (mount->belowRoot && mount->device != rootDevice) {
+            boundary->crossesMounts = true;
+            boundary->active = boundary->active || fsTypeListContains(scanOptions.excludedFsTypes, mount->fsType);
+        }
+    }
+}
+
+void scanBoundaryFree(ScanBoundary *boundary) {
+    free(boundary->mounts);
+    boundary->mounts = NULL;
+    boundary->mountCount = 0;
+}
+
+// Called for a directory whose device differs from its parent's. The start of the scan is
+// always allowed, even on an excluded filesystem; devices missing from the mount table,
+// such as btrfs subvolumes, are only left out by --one-file-system.
+bool scanBoundaryAllows(ScanBoundary *boundary, dev_t device) {
+    bool allowed = device == boundary->rootDevice;
+    if (!allowed && !scanOptions.oneFileSystem) {
+        allowed = true;
+        for (size_t i = 0; i < boundary->mountCount; i++) {
+            if (boundary->mounts[i].device == device) {
+                allowed = !fsTypeListContains(scanOptions.excludedFsTypes, boundary->mounts[i].fsType);
+                break;
+            }
+        }
+    }
+    if (!allowed) {
+        atomic_fetch_add(&boundary->skipped, 1);
+    }
+    return allowed;
+}
+
+// Whether device is a spinning disk, from the block queue of the disk or of the disk a
+// partition belongs to. Virtual and network filesystems have no block device and count as
+// not rotational.
+bool isRotationalDevice(dev_t device) {
+#ifdef __linux__
+    if (major(device) == 0) {
+        return false;
+    }
+    const char *formats[] = { "/sys/dev/block/%u:%u/queue/rotational", "/sys/dev/block/%u:%u/../queue/rotational" };
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        char path[128];
+        snprintf(path, sizeof(path), formats[i], major(device), minor(device));
+        FILE *file = fopen(path, "r");
+        if (file != NULL) {
+            int flag = fgetc(file);
+            fclose(file);
+            return flag == '1';
+        }
+    }
+#else
+    (void)device;
+#endif
+    return false;
+}
+
+// Exclude rules, in .gitignore syntax, compiled once and tested against every directory
+// a scan lists. A pattern without a slash matches a directory's name at any depth; one
+// with a slash, or a leading one, matches its path from the start of the scan, unless it
+// begins with "**/". '*' and '?' stop at slashes, "**" does not, "[...]" is a character
+// class and a leading '!' re-includes what earlier rules excluded. Rules only ever match
+// directories, and a trailing slash is accepted and ignored.
+typedef struct ExcludeRule {
+    char *pattern;
+    bool negate;
+    // Matched against the whole path from the start of the scan.
+    bool anchored;
+    // Matched against the path rather than the name alone.
+    bool hasSlash;
+    bool literal;
+} ExcludeRule;
+
+// Literal names and anchored literal paths live in a hash table, mapped to the index of
+// the last rule naming them; only glob and unanchored path rules are tried one by one.
+typedef struct ExcludeLiteral {
+    const char *key;
+    size_t rule;
+    bool anchored;
+} ExcludeLiteral;
+
+typedef struct ExcludeRules {
+    ExcludeRule *rules;
+    size_t count;
+    size_t capacity;
+    ExcludeLiteral *literals;
+    size_t literalCount;
+    size_t literalCapacity;
+    size_t *globRules;
+    size_t globCount;
+} ExcludeRules;
+
+ExcludeRules excludeRules;
+
+uint64_t hashName(const char *name, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Hashes the settings that decide which directories a scan records and what it counts in
+// their sizes: the exclude rules, --one-file-system, --exclude-fstype and --disk-usage. A
+// snapshot only seeds an incremental rescan made with the same settings, since a cached
+// listing keeps whatever the old settings left out.
+uint64_t scanSettingsFingerprint() {
+    uint64_t fingerprint = hashName("", 0);
+    for (size_t i = 0; i < excludeRules.count; i++) {
+        const ExcludeRule *rule = &excludeRules.rules[i];
+        char flags[3] = { rule->negate ? '!' : '+', rule->anchored ? '/' : '.', '\0' };
+        fingerprint = (fingerprint ^ hashName(flags, 2)) * 0x100000001b3ULL;
+        fingerprint = (fingerprint ^ hashName(rule->pattern, strlen(rule->pattern))) * 0x100000001b3ULL;
+    }
+    char flags[3] = { scanOptions.oneFileSystem ? 'x' : '-', scanOptions.diskUsage ? 'd' : '-', '\0' };
+    fingerprint = (fingerprint ^ hashName(flags, 2)) * 0x100000001b3ULL;
+    fingerprint = (fingerprint ^ hashName(scanOptions.excludedFsTypes, strlen(scanOptions.excludedFsTypes))) * 0x100000001b3ULL;
+    return fingerprint;
+}
+
+bool globMatch(const char *pattern, const char *text);
+
+// Matches one "[...]" class at *pattern against c, advancing *pattern past it. An
+// unterminated class is matched as a literal '['.
+bool globMatchClass(const char **pattern, char c) {
+    const char *cursor = *pattern + 1;
+    bool negate = *cursor == '!' || *cursor == '^';
+    if (negate) {
+        cursor++;
+    }
+    bool matched = false;
+    const char *first = cursor;
+    while (*cursor != '\0' && (*cursor != ']' || cursor == first)) {
+        char low = *cursor;
+        if (low == '\\' && cursor[1] != '\0') {
+            low = *++cursor;
+        }
+        char high = low;
+        if (cursor[1] == '-' && cursor[2] != ']' && cursor[2] != '\0') {
+            high = cursor[2];
+            cursor += 2;
+        }
+        matched = matched || (c >= low && c <= high);
+        cursor++;
+    }
+    if (*cursor != ']') {
+        (*pattern)++;
+        return c == '[';
+    }
+    *pattern = cursor + 1;
+    return matched != negate;
+}
+
+bool globMatch(const char *pattern, const char *text) {
+    while (*pattern != '\0') {
+        if (pattern[0] == '*' && pattern[1] == '*') {
+            pattern += 2;
+            // "**/" also matches no directories at all.
+            if (*pattern == '/' && globMatch(pattern + 1, text)) {
+                return true;
+            }
+            for (;; text++) {
+                if (globMatch(pattern, text)) {
+                    return true;
+                }
+                if (*text == '\0') {
+                    return false;
+                }
+            }
+        }
+        if (*pattern == '*') {
+            pattern++;
+            for (;; text++) {
+                if (globMatch(pattern, text)) {
+                    return true;
+                }
+                if (*text == '\0' || *text == '/') {
+                    return false;
+                }
+            }
+        }
+        if (*text == '\0') {
+            return false;
+        }
+        if (*pattern == '?') {
+            if (*text == '/') {
+                return false;
+            }
+            pattern++;
+        } else if (*pattern == '[') {
+            if (*text == '/' || !globMatchClass(&pattern, *text)) {
+                return false;
+            }
+        } else {
+            if (*pattern == '\\' && pattern[1] != '\0') {
+                pattern++;
+            }
+            if (*pattern != *text) {
+                return false;
+            }
+            pattern++;
+        }
+        text++;
+    }
+    return *text == '\0';
+}
+
+bool growExcludeLiterals(ExcludeRules *rules) {
+    size_t newCapacity = rules->literalCapacity ? rules->literalCapacity * 2 : 64;
+    ExcludeLiteral *literals = calloc(newCapacity, sizeof(ExcludeLiteral));
+    if (literals == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < rules->literalCapacity; i++) {
+        const ExcludeLiteral *literal = &rules->literals[i];
+        if (literal->key != NULL) {
+            size_t slot = (hashName(literal->key, strlen(literal->key)) + literal->anchored) & (newCapacity - 1);
+            while (literals[slot].key != NULL) {
+                slot = (slot + 1) & (newCapacity - 1);
+            }
+            literals[slot] = *literal;
+        }
+    }
+    free(rules->literals);
+    rules->literals = literals;
+    rules->literalCapacity = newCapacity;
+    return true;
+}
+
+// Returns the slot holding key, or the empty slot where it belongs.
+ExcludeLiteral *findExcludeLiteral(const ExcludeRules *rules, const char *key, size_t length, bool anchored) {
+    size_t mask = rules->literalCapacity - 1;
+    size_t slot = (hashName(key, length) + anchored) & mask;
+    while (rules->literals[slot].key != NULL) {
+        const ExcludeLiteral *literal = &rules->literals[slot];
+        if (literal->anchored == anchored && strncmp(literal->key, key, length) == 0 && literal->key[length] == '\0') {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return &rules->literals[slot];
+}
+
+// Adds one line of a rule file. Blank lines and comments are accepted and ignored.
+bool addExcludeRule(ExcludeRules *rules, const char *line) {
+    size_t length = strcspn(line, "\r\n");
+    while (length > 0 && line[length - 1] == ' ' && (length < 2 || line[length - 2] != '\\')) {
+        length--;
+    }
+    if (length == 0 || line[0] == '#') {
+        return true;
+    }
+
+    ExcludeRule rule = {0};
+    if (line[0] == '!') {
+        rule.negate = true;
+        line++;
+        length--;
+    } else if (line[0] == '\\' && (line[1] == '#' || line[1] == '!')) {
+        line++;
+        length--;
+    }
+    while (length > 0 && line[length - 1] == '/') {
+        length--;
+    }
+    if (length > 0 && line[0] == '/') {
+        rule.anchored = true;
+        line++;
+        length--;
+    }
+    bool floating = false;
+    while (length >= 3 && strncmp(line, "**/", 3) == 0) {
+        floating = true;
+        line += 3;
+        length -= 3;
+    }
+    if (length == 0) {
+        return true;
+    }
+    rule.pattern = strndup(line, length);
+    if (rule.pattern == NULL) {
+        return false;
+    }
+    rule.hasSlash = strchr(rule.pattern, '/') != NULL;
+    // "a/b" is anchored, as in .gitignore; "**/a/b" is not.
+    rule.anchored = !floating && (rule.anchored || rule.hasSlash);
+    rule.literal = strpbrk(rule.pattern, "*?[\\") == NULL;
+
+    if (rules->count == rules->capacity) {
+        size_t newCapacity = rules->capacity ? rules->capacity * 2 : 16;
+        ExcludeRule *grown = realloc(rules->rules, newCapacity * sizeof(ExcludeRule));
+        size_t *globRules = realloc(rules->globRules, newCapacity * sizeof(size_t));
+        if (grown != NULL) {
+            rules->rules = grown;
+        }
+        if (globRules != NULL) {
+            rules->globRules = globRules;
+        }
+        if (grown == NULL || globRules == NULL) {
+            free(rule.pattern);
+            return false;
+        }
+        rules->capacity = newCapacity;
+    }
+    size_t index = rules->count++;
+    rules->rules[index] = rule;
+
+    if (rule.literal && (rule.anchored || !rule.hasSlash)) {
+        if (rules->literalCount * 2 >= rules->literalCapacity && !growExcludeLiterals(rules)) {
+            return false;
+        }
+        ExcludeLiteral *slot = findExcludeLiteral(rules, rule.pattern, length, rule.anchored);
+        if (slot->key == NULL) {
+            rules->literalCount++;
+        }
+        *slot = (ExcludeLiteral){ rules->rules[index].pattern, index, rule.anchored };
+    } else {
+        rules->globRules[rules->globCount++] = index;
+    }
+    return true;
+}
+
+bool loadExcludeRules(ExcludeRules *rules, const char *filePath) {
+    FILE *file = fopen(filePath, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open rule file '%s': %s\n", filePath, strerror(errno));
+        return false;
+    }
+    char *line = NULL;
+    size_t lineCapacity = 0;
+    bool ok = true;
+    while (ok && getline(&line, &lineCapacity, file) != -1) {
+        ok = addExcludeRule(rules, line);
+    }
+    free(line);
+    fclose(file);
+    if (!ok) {
+        fprintf(stderr, "Error: out of memory while reading rule file '%s'\n", filePath);
+    }
+    return ok;
+}
+
+void freeExcludeRules(ExcludeRules *rules) {
+    for (size_t i = 0; i < rules->count; i++) {
+        free(rules->rules[i].pattern);
+    }
+    free(rules->rules);
+    free(rules->literals);
+    free(rules->globRules);
+    memset(rules, 0, sizeof(*rules));
+}
+
+// Whether the directory at path, relative to the start of the scan, is excluded: the last
+// rule that matches it decides. name points at its last component within path.
+bool excludeRulesMatch(const ExcludeRules *rules, const char *path, const char *name) {
+    size_t best = SIZE_MAX;
+    if (rules->literalCount > 0) {
+        const ExcludeLiteral *byName = findExcludeLiteral(rules, name, strlen(name), false);
+        const ExcludeLiteral *byPath = findExcludeLiteral(rules, path, strlen(path), true);
+        if (byName->key != NULL) {
+            best = byName->rule;
+        }
+        if (byPath->key != NULL && (best == SIZE_MAX || byPath->rule > best)) {
+            best = byPath->rule;
+        }
+    }
+
+    for (size_t i = rules->globCount; i-- > 0;) {
+        size_t index = rules->globRules[i];
+        if (best != SIZE_MAX && index < best) {
+            break;
+        }
+        const ExcludeRule *rule = &rules->rules[index];
+        bool matched;
+        if (rule->anchored) {
+            matched = globMatch(rule->pattern, path);
+        } else if (!rule->hasSlash) {
+            matched = globMatch(rule->pattern, name);
+        } else {
+            // Try the pattern at every component boundary of the path.
+            matched = false;
+            for (const char *start = path; start != NULL && !matched; start = strchr(start, '/')) {
+                if (*start == '/') {
+                    start++;
+                }
+                matched = globMatch(rule->pattern, start);
+            }
+        }
+        if (matched) {
+            best = index;
+            break;
+        }
+    }
+    return best != SIZE_MAX && !rules->rules[best].negate;
+}
+
+typedef bool (*DirEntryVisitor)(void *context, int dirFd, const char *name, unsigned char type);
+
+bool isDotOrDotDot(const char *name) {
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+#ifdef __linux__
+typedef struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} LinuxDirent64;
+
+_Thread_local char *getdentsBuffer = NULL;
+
+// Returns false when getdents64 can't be used here and readdir should list the directory
+// instead. Once entries have been read, a failure is reported through readFailed, with
+// errno set, since starting over with readdir would visit them twice.
+bool forEachGetdentsEntry(DirHandle *handle, DirEntryVisitor visit, void *context, bool *readFailed) {
+    if (getdentsBuffer == NULL) {
+        getdentsBuffer = malloc(GETDENTS_BUFFER_SIZE);
+        if (getdentsBuffer == NULL) {
+            return false;
+        }
+    }
+
+    for (;;) {
+        long long started = statsClock();
+        long bytes = syscall(SYS_getdents64, handle->fd, getdentsBuffer, GETDENTS_BUFFER_SIZE);
+        statsRecordCall(STATS_CALL_GETDENTS, started, bytes < 0);
+        if (bytes < 0 && errno == ENOSYS) {
+            return false;
+        }
+        if (bytes < 0) {
+            *readFailed = true;
+            return true;
+        }
+        if (bytes == 0) {
+            return true;
+        }
+
+        for (long offset = 0; offset < bytes;) {
+            LinuxDirent64 *entry = (LinuxDirent64 *)(getdentsBuffer + offset);
+            offset += entry->d_reclen;
+            if (isDotOrDotDot(entry->d_name)) {
+                continue;
+            }
+            if (!visit(context, handle->fd, entry->d_name, entry->d_type)) {
+                return true;
+            }
+        }
+    }
+}
+#endif
+
+// Calls visit for every entry except "." and "..", stopping early if it returns false.
+// Returns false, with errno set, when the directory could not be read to the end; the
+// entries visited so far are all there is.
+bool forEachDirectoryEntry(DirHandle *handle, DirEntryVisitor visit, void *context) {
+#ifdef __linux__
+    bool readFailed = false;
+    if (scanOptions.useGetdents && handle->stream == NULL && forEachGetdentsEntry(handle, visit, context, &readFailed)) {
+        return !readFailed;
+    }
+#endif
+
+    DIR *stream = directoryStream(handle);
+    if (stream == NULL) {
+        return false;
+    }
+
+    for (;;) {
+        // readdir only signals an error through errno.
+        long long started = statsClock();
+        errno = 0;
+        struct dirent *entry = readdir(stream);
+        statsRecordCall(STATS_CALL_READDIR, started, entry == NULL && errno != 0);
+        if (entry == NULL) {
+            return errno == 0;
+        }
+        if (isDotOrDotDot(entry->d_name)) {
+            continue;
+        }
+        if (!visit(context, handle->fd, entry->d_name, DIRENT_TYPE(entry))) {
+            return true;
+        }
+    }
+}
+
+// The hard-linked files a --disk-usage scan has already counted, as (device, inode)
+// pairs. Only files with more than one link are added, since only they can be met twice.
+// As in a Roaring bitmap, inode numbers are grouped into chunks of 65536 by their high
+// bits. A chunk keeps a sorted array of 16-bit offsets until it holds INODE_ARRAY_LIMIT of
+// them, then becomes an 8 KiB bitmap, so a crowded chunk costs at most one bit per inode
+// number and a sparse one two bytes per inode. Chunks are spread over shards by hash, each
+// with its own lock and open-addressing table. Files are normally added in pre-order by
+// the walker or the emitting thread, so which link is charged does not depend on timing.
+// The locks are still needed: when addListingFile runs out of memory for its list of
+// linked files, it adds the file at once from whichever worker lists the directory.
+typedef struct InodeChunk {
+    uint64_t device;
+    uint64_t key;
+    // Exactly one of these is set on a chunk in use.
+    uint16_t *offsets;
+    uint64_t *bitmap;
+    uint32_t count;
+    uint32_t capacity;
+} InodeChunk;
+
+typedef struct InodeShard {
+    pthread_mutex_t lock;
+    InodeChunk *chunks;
+    size_t count;
+    size_t capacity;
+} InodeShard;
+
+typedef struct InodeSet {
+    InodeShard shards[INODE_SET_SHARDS];
+} InodeSet;
+
+InodeSet *createInodeSet() {
+    InodeSet *set = calloc(1, sizeof(InodeSet));
+    if (set == NULL) {
+        fprintf(stderr, "Error: out of memory while creating the inode set\n");
+        return NULL;
+    }
+    for (int i = 0; i < INODE_SET_SHARDS; i++) {
+        pthread_mutex_init(&set->shards[i].lock, NULL);
+    }
+    return set;
+}
+
+void freeInodeSet(InodeSet *set) {
+    if (set == NULL) {
+        return;
+    }
+    for (int i = 0; i < INODE_SET_SHARDS; i++) {
+        InodeShard *shard = &set->shards[i];
+        for (size_t j = 0; j < shard->capacity; j++) {
+            free(shard->chunks[j].offsets);
+            free(shard->chunks[j].bitmap);
+        }
+        free(shard->chunks);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(set);
+}
+
+uint64_t hashInodeChunk(uint64_t device, uint64_t key) {
+    uint64_t hash = (device * 0x9e3779b97f4a7c15ULL) ^ key;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+bool inodeChunkUsed(const InodeChunk *chunk) {
+    return chunk->offsets != NULL || chunk->bitmap != NULL;
+}
+
+// Finds the chunk for device and key in shard, or the free slot it would take.
+InodeChunk *findInodeChunk(InodeShard *shard, uint64_t device, uint64_t key, uint64_t hash) {
+    size_t slot = hash & (shard->capacity - 1);
+    while (inodeChunkUsed(&shard->chunks[slot]) && (shard->chunks[slot].device != device || shard->chunks[slot].key != key)) {
+        slot = (slot + 1) & (shard->capacity - 1);
+    }
+    return &shard->chunks[slot];
+}
+
+bool growInodeShard(InodeShard *shard) {
+    size_t newCapacity = shard->capacity ? shard->capacity * 2 : 64;
+    InodeChunk *chunks = calloc(newCapacity, sizeof(InodeChunk));
+    if (chunks == NULL) {
+        return false;
+    }
+    InodeShard grown = { .chunks = chunks, .capacity = newCapacity, .count = shard->count };
+    for (size_t i = 0; i < shard->capacity; i++) {
+        InodeChunk *chunk = &shard->chunks[i];
+        if (inodeChunkUsed(chunk)) {
+            *findInodeChunk(&grown, chunk->device, chunk->key, hashInodeChunk(chunk->device, chunk->key)) = *chunk;
+        }
+    }
+    free(shard->chunks);
+    shard->chunks = chunks;
+    shard->capacity = newCapacity;
+    return true;
+}
+
+// Adds offset to a chunk still kept as an array, turning it into a bitmap when full.
+// Returns false if it was already there.
+bool addInodeOffset(InodeChunk *chunk, uint16_t offset) {
+    size_t low = 0;
+    size_t high = chunk->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (chunk->offsets[middle] == offset) {
+            return false;
+        }
+        if (chunk->offsets[middle] < offset) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    if (chunk->count == INODE_ARRAY_LIMIT) {
+        uint64_t *bitmap = calloc(INODE_CHUNK_SIZE / 64, sizeof(uint64_t));
+        if (bitmap == NULL) {
+            return true;
+        }
+        for (uint32_t i = 0; i < chunk->count; i++) {
+            bitmap[chunk->offsets[i] / 64] |= 1ULL << (chunk->offsets[i] % 64);
+        }
+        bitmap[offset / 64] |= 1ULL << (offset % 64);
+        free(chunk->offsets);
+        chunk->offsets = NULL;
+        chunk->bitmap = bitmap;
+        chunk->count++;
+        return true;
+    }
+    if (chunk->count == chunk->capacity) {
+        uint32_t newCapacity = chunk->capacity * 2;
+        uint16_t *offsets = realloc(chunk->offsets, newCapacity * sizeof(uint16_t));
+        if (offsets == NULL) {
+            return true;
+        }
+        chunk->offsets = offsets;
+        chunk->capacity = newCapacity;
+    }
+    memmove(&chunk->offsets[low + 1], &chunk->offsets[low], (chunk->count - low) * sizeof(uint16_t));
+    chunk->offsets[low] = offset;
+    chunk->count++;
+    return true;
+}
+
+// Returns true the first time it is given an inode, false after. When memory runs out
+// the inode is reported as new, so a file is never lost from the totals, only possibly
+// counted twice.
+bool inodeSetAdd(InodeSet *set, uint64_t device, uint64_t inode) {
+    uint64_t key = inode / INODE_CHUNK_SIZE;
+    uint16_t offset = (uint16_t)(inode % INODE_CHUNK_SIZE);
+    uint64_t hash = hashInodeChunk(device, key);
+    InodeShard *shard = &set->shards[hash >> (64 - INODE_SET_SHARD_BITS)];
+
+    pthread_mutex_lock(&shard->lock);
+    bool added = true;
+    if ((shard->count + 1) * 4 > shard->capacity * 3 && !growInodeShard(shard)) {
+        pthread_mutex_unlock(&shard->lock);
+        return true;
+    }
+    InodeChunk *chunk = findInodeChunk(shard, device, key, hash);
+    if (!inodeChunkUsed(chunk)) {
+        chunk->offsets = malloc(4 * sizeof(uint16_t));
+        if (chunk->offsets == NULL) {
+            pthread_mutex_unlock(&shard->lock);
+            return true;
+        }
+        chunk->device = device;
+        chunk->key = key;
+        chunk->count = 0;
+        chunk->capacity = 4;
+        shard->count++;
+    }
+    if (chunk->bitmap != NULL) {
+        uint64_t bit = 1ULL << (offset % 64);
+        added = (chunk->bitmap[offset / 64] & bit) == 0;
+        chunk->bitmap[offset / 64] |= bit;
+        chunk->count += added;
+    } else {
+        added = addInodeOffset(chunk, offset);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return added;
+}
+
+// The bytes a regular file adds to its directory's total: its apparent size, or with
+// --disk-usage the space allocated to it. A file with several links is charged at only one
+// of them; see resolveLinkedFiles.
+unsigned long long countedFileBytes(unsigned long long size, unsigned long long blocks) {
+    return scanOptions.diskUsage ? blocks * 512 : size;
+}
+
+// A file with more than one link, met by a --disk-usage scan. It is only noted when it is
+// stat'ed; resolveLinkedFiles later charges it to the first directory in pre-order that
+// links to it, and within that directory to its first name, so the totals come out the
+// same whichever thread stat'ed which link first.
+typedef struct LinkedFile {
+    char *name;
+    FileFacts facts;
+} LinkedFile;
+
+typedef struct LinkedFileList {
+    LinkedFile *files;
+    size_t count;
+    size_t capacity;
+} LinkedFileList;
+
+void linkedFileListFree(LinkedFileList *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->files[i].name);
+    }
+    free(list->files);
+    memset(list, 0, sizeof(*list));
+}
+
+// Receives each regular file a listing stats, with its directory's path.
+typedef void (*FileVisitor)(void *context, const char *directoryPath, const char *name, const FileFacts *file);
+
+// What readDirectoryListing should do beyond collecting subdirectory names and file bytes.
+typedef struct ListingOptions {
+    bool statDirectory;
+    // The scan cache and this directory's record in it, for incremental rescans.
+    ScanCache *cache;
+    uint32_t cachedRecord;
+    FileVisitor fileVisitor;
+    void *fileContext;
+    // Passed to the file visitor and named in error messages.
+    const char *directoryPath;
+    // Subdirectories these rules match are left out of the listing. relativePath is the
+    // directory's path from the start of the scan, "" for the start itself.
+    const ExcludeRules *excludes;
+    const char *relativePath;
+    // With --disk-usage, the hard-linked files this scan has already counted; NULL to count every link.
+    InodeSet *countedInodes;
+    // Leave files with several links in DirListing.linkedFiles for the caller to resolve,
+    // instead of resolving them as soon as the directory is listed.
+    bool deferLinkedFiles;
+} ListingOptions;
+
+typedef struct DirListing {
+    const ListingOptions *options;
+    unsigned long long fileBytes;
+    unsigned long long entryCount;
+    NameList subdirs;
+    // With a scan cache, the cached record of each subdirectory or NO_CACHED_RECORD.
+    uint32_t *cachedChildren;
+    struct StatRing *ring;
+    bool haveDirectoryStat;
+    struct stat directoryStat;
+    // Subdirectories the exclude rules matched; their names are only kept for
+    // --count-excluded.
+    unsigned long long excludedCount;
+    NameList excludedSubdirs;
+    // With countedInodes, the files with several links, not yet in fileBytes.
+    LinkedFileList linkedFiles;
+} DirListing;
+
+// Adds a regular file to the listing and shows it to the file visitor. With countedInodes
+// a file with several links is only noted, for resolveLinkedFiles.
+void addListingFile(DirListing *listing, const char *name, const FileFacts *file, uint64_t links) {
+    const ListingOptions *options = listing->options;
+    if (scanOptions.diskUsage && links > 1 && options->countedInodes != NULL) {
+        LinkedFileList *list = &listing->linkedFiles;
+        if (list->count == list->capacity) {
+            size_t newCapacity = list->capacity ? list->capacity * 2 : 16;
+            LinkedFile *files = realloc(list->files, newCapacity * sizeof(LinkedFile));
+            if (files != NULL) {
+                list->files = files;
+                list->capacity = newCapacity;
+            }
+        }
+        char *copy = list->count < list->capacity ? strdup(name) : NULL;
+        if (copy != NULL) {
+            list->files[list->count].name = copy;
+            list->files[list->count].facts = *file;
+            list->count++;
+            return;
+        }
+        // Out of memory: charge the link now, which is only wrong about which link it is.
+        FileFacts charged = *file;
+        charged.counted = inodeSetAdd(options->countedInodes, file->device, file->inode) ? file->counted : 0;
+        listing->fileBytes += charged.counted;
+        if (options->fileVisitor != NULL) {
+            options->fileVisitor(options->fileContext, options->directoryPath, name, &charged);
+        }
+        return;
+    }
+    listing->fileBytes += file->counted;
+    if (options->fileVisitor != NULL) {
+        options->fileVisitor(options->fileContext, options->directoryPath, name, file);
+    }
+}
+
+int compareLinkedFiles(const void *a, const void *b) {
+    return strcmp(((const LinkedFile *)a)->name, ((const LinkedFile *)b)->name);
+}
+
+// Charges each of one directory's linked files unless an earlier link to it was charged,
+// taking the files in name order, and shows every one of them to visitor. Directories
+// must be resolved in pre-order. Returns the bytes charged and empties the list.
+unsigned long long resolveLinkedFiles(InodeSet *countedInodes, LinkedFileList *list, FileVisitor visitor, void *context,
+                                      const char *directoryPath) {
+    qsort(list->files, list->count, sizeof(LinkedFile), compareLinkedFiles);
+    unsigned long long charged = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        FileFacts *file = &list->files[i].facts;
+        if (!inodeSetAdd(countedInodes, file->device, file->inode)) {
+            file->counted = 0;
+        }
+        charged += file->counted;
+        if (visitor != NULL) {
+            visitor(context, directoryPath, list->files[i].name, file);
+        }
+    }
+    linkedFileListFree(list);
+    return charged;
+}
+
+#ifdef __linux__
+#define STAT_RING_STATX_MASK (STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_INO | STATX_UID | STATX_MTIME | STATX_ATIME | \
+                              STATX_NLINK | STATX_BLOCKS)
+
+typedef struct StatRingSlot {
+    struct statx result;
+    // Index of a tentative subdirs entry for DT_UNKNOWN names, SIZE_MAX for known files.
+    size_t subdirIndex;
+    // Set from submission until the completion is handled.
+    bool pending;
+    int dirFd;
+    char name[NAME_MAX + 1];
+} StatRingSlot;
+
+// A minimal io_uring driven through the raw syscalls. Each scan thread owns one ring and
+// keeps up to depth IORING_OP_STATX requests in flight for the directory it is listing.
+typedef struct StatRing {
+    int fd;
+    unsigned depth;
+    unsigned inFlight;
+    unsigned unsubmitted;
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+    StatRingSlot *slots;
+    unsigned *freeSlots;
+    unsigned freeCount;
+    // Set once io_uring_enter has failed for good; the thread stats synchronously from then on.
+    bool broken;
+} StatRing;
+
+_Thread_local StatRing *statRing = NULL;
+atomic_bool statRingUnavailable = false;
+
+void destroyStatRing(StatRing *ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    if (ring->cqRing != NULL && ring->cqRing != MAP_FAILED && ring->cqRing != ring->sqRing) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    if (ring->sqRing != NULL && ring->sqRing != MAP_FAILED) {
+        munmap(ring->sqRing, ring->sqRingSize);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    // Requests the kernel took before a broken ring was abandoned may still write into
+    // their slots, so those are never freed.
+    if (!ring->broken) {
+        free(ring->slots);
+    }
+    free(ring->freeSlots);
+    free(ring);
+}
+
+bool statRingSupportsStatx(int ringFd) {
+    size_t probeSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probeSize);
+    if (probe == NULL) {
+        return false;
+    }
+    bool supported = syscall(SYS_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+                     probe->last_op >= IORING_OP_STATX &&
+                     (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+StatRing *createStatRing(unsigned depth) {
+    StatRing *ring = calloc(1, sizeof(StatRing));
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(SYS_io_uring_setup, depth, &params);
+    if (ring->fd < 0 || !statRingSupportsStatx(ring->fd)) {
+        destroyStatRing(ring);
+        return NULL;
+    }
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sqRingSize = ring->cqRingSize = MAX(ring->sqRingSize, ring->cqRingSize);
+    }
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        destroyStatRing(ring);
+        return NULL;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqRing = ring->sqRing;
+    } else {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        destroyStatRing(ring);
+        return NULL;
+    }
+
+    char *sq = ring->sqRing;
+    char *cq = ring->cqRing;
+    ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // The kernel may round the ring up; never have more requests out than we asked for.
+    ring->depth = depth < params.sq_entries ? depth : params.sq_entries;
+    ring->slots = calloc(ring->depth, sizeof(StatRingSlot));
+    ring->freeSlots = calloc(ring->depth, sizeof(unsigned));
+    if (ring->slots == NULL || ring->freeSlots == NULL) {
+        destroyStatRing(ring);
+        return NULL;
+    }
+    for (unsigned i = 0; i < ring->depth; i++) {
+        ring->freeSlots[i] = i;
+    }
+    ring->freeCount = ring->depth;
+    return ring;
+}
+
+// Returns this thread's ring, or NULL when io_uring is off, unavailable or broken, in which
+// case the caller stats synchronously.
+StatRing *acquireStatRing() {
+    if (!scanOptions.useIoUring || atomic_load(&statRingUnavailable) || (statRing != NULL && statRing->broken)) {
+        return NULL;
+    }
+    if (statRing == NULL) {
+        statRing = createStatRing(scanOptions.uringDepth);
+        if (statRing == NULL && !atomic_exchange(&statRingUnavailable, true)) {
+            fprintf(stderr, "io_uring statx is unavailable (%s); using synchronous stat\n", strerror(errno));
+        }
+    }
+    return statRing;
+}
+
+// Hands the statx result in a slot to the listing; result is 0 or a negated errno.
+void completeStatRequest(StatRing *ring, unsigned slotIndex, int result, DirListing *listing) {
+    StatRingSlot *slot = &ring->slots[slotIndex];
+    bool isDirectory = result == 0 && S_ISDIR(slot->result.stx_mode);
+
+    if (result == 0 && S_ISREG(slot->result.stx_mode)) {
+        FileFacts file = {
+            .size = slot->result.stx_size,
+            .device = makedev(slot->result.stx_dev_major, slot->result.stx_dev_minor),
+            .inode = slot->result.stx_ino,
+            .uid = slot->result.stx_uid,
+            .modified = slot->result.stx_mtime.tv_sec,
+            .accessed = slot->result.stx_atime.tv_sec,
+            .blocks = slot->result.stx_blocks,
+            .counted = countedFileBytes(slot->result.stx_size, slot->result.stx_blocks)
+        };
+        addListingFile(listing, slot->name, &file, slot->result.stx_nlink);
+    }
+    if (slot->subdirIndex != SIZE_MAX && !isDirectory) {
+        // The tentative entry turned out not to be a directory; compacted after the drain.
+        free(listing->subdirs.names[slot->subdirIndex]);
+        listing->subdirs.names[slot->subdirIndex] = NULL;
+    }
+
+    slot->pending = false;
+    ring->freeSlots[ring->freeCount++] = slotIndex;
+    ring->inFlight--;
+}
+
+// Handles every completion the kernel has posted so far.
+void reapStatCompletions(StatRing *ring, DirListing *listing) {
+    unsigned head = *ring->cqHead;
+    unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+        statsCountCall(STATS_CALL_URING_STATX, -cqe->res);
+        completeStatRequest(ring, (unsigned)cqe->user_data, cqe->res, listing);
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+// Gives up on the ring after io_uring_enter failed for good. Requests the kernel has not
+// taken are withdrawn, and every request still without a completion is stat'ed here, so
+// the listing comes out complete and the thread's later listings stat synchronously.
+void abandonStatRing(StatRing *ring, DirListing *listing) {
+    __atomic_store_n(ring->sqTail, __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    ring->unsubmitted = 0;
+    reapStatCompletions(ring, listing);
+
+    for (unsigned i = 0; i < ring->depth; i++) {
+        StatRingSlot *slot = &ring->slots[i];
+        if (!slot->pending) {
+            continue;
+        }
+        long long started = statsClock();
+        long result = syscall(SYS_statx, slot->dirFd, slot->name, AT_SYMLINK_NOFOLLOW, STAT_RING_STATX_MASK, &slot->result);
+        statsRecordCall(STATS_CALL_STAT, started, result != 0);
+        completeStatRequest(ring, i, result == 0 ? 0 : -errno, listing);
+    }
+    ring->inFlight = 0;
+    ring->broken = true;
+}
+
+// Submits everything queued and reaps completions, blocking until at least minComplete
+// have arrived. On a failure that retrying won't fix the ring is abandoned.
+void reapStatRing(StatRing *ring, DirListing *listing, unsigned minComplete) {
+    for (;;) {
+        long long started = statsClock();
+        long result = syscall(SYS_io_uring_enter, ring->fd, ring->unsubmitted, minComplete,
+                              minComplete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        statsRecordCall(STATS_CALL_URING_ENTER, started, result < 0);
+        if (result >= 0) {
+            // The kernel may take fewer than were queued; the rest go with the next call.
+            ring->unsubmitted -= MIN((unsigned)result, ring->unsubmitted);
+            break;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            fprintf(stderr, "io_uring_enter failed: %s; using synchronous stat\n", strerror(errno));
+            abandonStatRing(ring, listing);
+            return;
+        }
+        // EBUSY means the completion queue is full; make room before trying again.
+        reapStatCompletions(ring, listing);
+    }
+    reapStatCompletions(ring, listing);
+}
+
+// Waits for a free slot. Returns false if the ring broke meanwhile, in which case the
+// entry must be stat'ed synchronously.
+bool reserveStatSlot(StatRing *ring, DirListing *listing) {
+    while (ring->freeCount == 0 && !ring->broken) {
+        reapStatRing(ring, listing, 1);
+    }
+    return !ring->broken;
+}
+
+// Queues a statx for name; reserveStatSlot must have succeeded first.
+void submitStatRequest(StatRing *ring, int dirFd, const char *name, size_t subdirIndex) {
+    unsigned slotIndex = ring->freeSlots[--ring->freeCount];
+    StatRingSlot *slot = &ring->slots[slotIndex];
+    snprintf(slot->name, sizeof(slot->name), "%s", name);
+    slot->subdirIndex = subdirIndex;
+    slot->dirFd = dirFd;
+    slot->pending = true;
+
+    unsigned tail = *ring->sqTail;
+    unsigned index = tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dirFd;
+    sqe->addr = (uint64_t)(uintptr_t)slot->name;
+    sqe->len = STAT_RING_STATX_MASK;
+    sqe->off = (uint64_t)(uintptr_t)&slot->result;
+    sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+    sqe->user_data = slotIndex;
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    ring->unsubmitted++;
+    ring->inFlight++;
+}
+
+// Waits for the rest of the directory's requests and drops tentative subdirectory names
+// that turned out to be something else, keeping readdir order for the ones that remain.
+void drainStatRing(StatRing *ring, DirListing *listing) {
+    while (ring->inFlight > 0 && !ring->broken) {
+        reapStatRing(ring, listing, ring->inFlight);
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < listing->subdirs.count; i++) {
+        if (listing->subdirs.names[i] != NULL) {
+            listing->subdirs.names[kept++] = listing->subdirs.names[i];
+        }
+    }
+    listing->subdirs.count = kept;
+}
+#endif
+
+// Each scan thread keeps its getdents64 buffer and io_uring between directories; call this
+// when the thread is done scanning.
+void releaseScanThreadState() {
+    releaseThreadStats();
+#ifdef __linux__
+    free(getdentsBuffer);
+    getdentsBuffer = NULL;
+    if (statRing != NULL) {
+        destroyStatRing(statRing);
+        statRing = NULL;
+    }
+#endif
+}
+
+// Sorts one entry into the listing. d_type already says whether most entries are
+// directories, so only regular files (whose size we need) and DT_UNKNOWN entries cost an
+// fstatat, which never follows symlinks. With io_uring the stat is queued instead and the
+// completion updates the listing. Returns false only when memory runs out.
+bool addListingEntry(int dirFd, const char *name, unsigned char type, DirListing *listing) {
+    listing->entryCount++;
+    if (type == DT_DIR) {
+        return nameListAppend(&listing->subdirs, name);
+    }
+    if (type != DT_REG && type != DT_UNKNOWN) {
+        // Symlinks, devices, FIFOs and sockets hold no file bytes of their own.
+        return true;
+    }
+
+#ifdef __linux__
+    if (listing->ring != NULL && reserveStatSlot(listing->ring, listing)) {
+        size_t subdirIndex = SIZE_MAX;
+        if (type == DT_UNKNOWN) {
+            // Hold the entry's place in case it is a directory.
+            if (!nameListAppend(&listing->subdirs, name)) {
+                return false;
+            }
+            subdirIndex = listing->subdirs.count - 1;
+        }
+        submitStatRequest(listing->ring, dirFd, name, subdirIndex);
+        return true;
+    }
+#endif
+
+    struct stat statbuf;
+    long long started = statsClock();
+    int result = fstatat(dirFd, name, &statbuf, AT_SYMLINK_NOFOLLOW);
+    statsRecordCall(STATS_CALL_STAT, started, result != 0);
+    if (result != 0) {
+        return true;
+    }
+
+    if (S_ISDIR(statbuf.st_mode)) {
+        return nameListAppend(&listing->subdirs, name);
+    }
+    if (S_ISREG(statbuf.st_mode)) {
+        FileFacts file = {
+            .size = statbuf.st_size,
+            .device = statbuf.st_dev,
+            .inode = statbuf.st_ino,
+            .uid = statbuf.st_uid,
+            .modified = statbuf.st_mtime,
+            .accessed = statbuf.st_atime,
+            .blocks = statbuf.st_blocks,
+            .counted = countedFileBytes(statbuf.st_size, statbuf.st_blocks)
+        };
+        addListingFile(listing, name, &file, statbuf.st_nlink);
+    }
+    return true;
+}
+
+bool listingVisitor(void *context, int dirFd, const char *name, unsigned char type) {
+    return addListingEntry(dirFd, name, type, context);
+}
+
+void freeDirectoryListing(DirListing *listing) {
+    nameListFree(&listing->subdirs);
+    nameListFree(&listing->excludedSubdirs);
+    linkedFileListFree(&listing->linkedFiles);
+    free(listing->cachedChildren);
+    listing->cachedChildren = NULL;
+}
+
+// Lists an unchanged directory from the cache: its subdirectories in the order they were
+// last scanned, and its own file bytes as the cached total minus its subdirectories'.
+bool readCachedListing(const ScanCache *cache, uint32_t record, DirListing *listing) {
+    const SnapshotRecord *records = cache->snapshot.records;
+    size_t childCount = 0;
+    for (uint32_t child = cache->firstChild[record]; child != NO_CACHED_RECORD; child = cache->nextSibling[child]) {
+        childCount++;
+    }
+    if (childCount > 0) {
+        listing->cachedChildren = malloc(childCount * sizeof(uint32_t));
+        if (listing->cachedChildren == NULL) {
+            return false;
+        }
+    }
+
+    PathBuffer name = {0};
+    unsigned long long childBytes = 0;
+    bool complete = true;
+    for (uint32_t child = cache->firstChild[record]; child != NO_CACHED_RECORD; child = cache->nextSibling[child]) {
+        if (!decodeSnapshotName(&cache->snapshot, child, &name) || !nameListAppend(&listing->subdirs, name.data)) {
+            complete = false;
+            break;
+        }
+        listing->cachedChildren[listing->subdirs.count - 1] = child;
+        childBytes += records[child].size;
+    }
+    pathBufferFree(&name);
+
+    if (!complete || childBytes > records[record].size) {
+        freeDirectoryListing(listing);
+        return false;
+    }
+    listing->fileBytes = records[record].size - childBytes;
+    listing->entryCount = records[record].entryCount;
+    return true;
+}
+
+typedef struct CachedChildName {
+    char *name;
+    uint32_t record;
+} CachedChildName;
+
+int compareCachedChildNames(const void *a, const void *b) {
+    return strcmp(((const CachedChildName *)a)->name, ((const CachedChildName *)b)->name);
+}
+
+// Finds the cached record of each subdirectory read from disk, so unchanged subtrees below
+// a changed directory are still reused. Subdirectories without one are scanned in full.
+void matchCachedChildren(const ScanCache *cache, uint32_t record, DirListing *listing) {
+    if (listing->subdirs.count == 0) {
+        return;
+    }
+    listing->cachedChildren = malloc(listing->subdirs.count * sizeof(uint32_t));
+    if (listing->cachedChildren == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < listing->subdirs.count; i++) {
+        listing->cachedChildren[i] = NO_CACHED_RECORD;
+    }
+
+    size_t cachedCount = 0;
+    for (uint32_t child = cache->firstChild[record]; child != NO_CACHED_RECORD; child = cache->nextSibling[child]) {
+        cachedCount++;
+    }
+    CachedChildName *cached = cachedCount > 0 ? calloc(cachedCount, sizeof(CachedChildName)) : NULL;
+    if (cached == NULL) {
+        return;
+    }
+
+    PathBuffer name = {0};
+    size_t decoded = 0;
+    for (uint32_t child = cache->firstChild[record]; child != NO_CACHED_RECORD; child = cache->nextSibling[child]) {
+        if (decodeSnapshotName(&cache->snapshot, child, &name) && (cached[decoded].name = strdup(name.data)) != NULL) {
+            cached[decoded++].record = child;
+        }
+    }
+    pathBufferFree(&name);
+
+    qsort(cached, decoded, sizeof(CachedChildName), compareCachedChildNames);
+    for (size_t i = 0; i < listing->subdirs.count; i++) {
+        CachedChildName key = { .name = listing->subdirs.names[i] };
+        CachedChildName *match = bsearch(&key, cached, decoded, sizeof(CachedChildName), compareCachedChildNames);
+        if (match != NULL) {
+            listing->cachedChildren[i] = match->record;
+        }
+    }
+
+    for (size_t i = 0; i < decoded; i++) {
+        free(cached[i].name);
+    }
+    free(cached);
+}
+
+// The part of a scanned path below the start of the scan, given the length of the start.
+const char *relativeScanPath(const char *path, size_t rootLength) {
+    const char *relative = path + rootLength;
+    return *relative == PATH_SEPARATOR[0] ? relative + 1 : relative;
+}
+
+// Moves the subdirectories the exclude rules match out of the listing, keeping the cached
+// records of the rest in step.
+void pruneExcludedSubdirs(DirListing *listing) {
+    const ListingOptions *options = listing->options;
+    PathBuffer path = {0};
+    if (pathBufferAppend(&path, options->relativePath, false) == SIZE_MAX) {
+        return;
+    }
+    bool atStart = options->relativePath[0] == '\0';
+
+    size_t kept = 0;
+    for (size_t i = 0; i < listing->subdirs.count; i++) {
+        char *name = listing->subdirs.names[i];
+        size_t parentLength = pathBufferAppend(&path, name, !atStart);
+        bool excluded = parentLength != SIZE_MAX &&
+                        excludeRulesMatch(options->excludes, path.data, path.data + path.length - strlen(name));
+        if (parentLength != SIZE_MAX) {
+            pathBufferTruncate(&path, parentLength);
+        }
+        if (!excluded) {
+            listing->subdirs.names[kept] = name;
+            if (listing->cachedChildren != NULL) {
+                listing->cachedChildren[kept] = listing->cachedChildren[i];
+            }
+            kept++;
+            continue;
+        }
+        listing->excludedCount++;
+        if (scanOptions.countExcluded) {
+            nameListAppend(&listing->excludedSubdirs, name);
+        }
+        free(name);
+    }
+    listing->subdirs.count = kept;
+    pathBufferFree(&path);
+}
+
+// Lists the directory open in handle; options may be NULL. With a cache and the
+// directory's previous record, an unchanged directory is listed from the cache without
+// reading it; otherwise it is read from disk and its subdirectories are matched to their
+// previous records. Cached listings have no files to visit, so a file visitor turns the
+// cache off.
+void readDirectoryListing(DirHandle *handle, DirListing *listing, const ListingOptions *options) {
+    static const ListingOptions defaultOptions = { .cachedRecord = NO_CACHED_RECORD };
+    if (options == NULL) {
+        options = &defaultOptions;
+    }
+    ScanCache *cache = options->cache;
+    uint32_t cachedRecord = options->cachedRecord;
+
+    memset(listing, 0, sizeof(*listing));
+    listing->options = options;
+    if ((options->statDirectory || cache != NULL) && statDirectoryHandle(handle)) {
+        listing->haveDirectoryStat = true;
+        listing->directoryStat = handle->stat;
+    }
+    if (cache != NULL && cachedRecord != NO_CACHED_RECORD && listing->haveDirectoryStat && options->fileVisitor == NULL) {
+        DirStamp stamp = dirStampFromStat(&listing->directoryStat);
+        if (scanCacheIsCurrent(cache, cachedRecord, &stamp) && readCachedListing(cache, cachedRecord, listing)) {
+            atomic_fetch_add(&cache->reused, 1);
+            if (options->excludes != NULL) {
+                pruneExcludedSubdirs(listing);
+            }
+            return;
+        }
+    }
+
+#ifdef __linux__
+    listing->ring = acquireStatRing();
+#endif
+    bool complete = forEachDirectoryEntry(handle, listingVisitor, listing);
+    int readError = errno;
+#ifdef __linux__
+    if (listing->ring != NULL) {
+        drainStatRing(listing->ring, listing);
+    }
+#endif
+    if (!complete) {
+        fprintf(stderr, "Failed to read directory '%s': %s\n", options->directoryPath != NULL ? options->directoryPath : ".",
+                strerror(readError));
+    }
+    if (listing->linkedFiles.count > 0 && !options->deferLinkedFiles) {
+        listing->fileBytes += resolveLinkedFiles(options->countedInodes, &listing->linkedFiles, options->fileVisitor,
+                                                 options->fileContext, options->directoryPath);
+    }
+    statsCountListing(listing->entryCount, listing->fileBytes);
+
+    if (cache != NULL) {
+        atomic_fetch_add(&cache->reread, 1);
+        if (cachedRecord != NO_CACHED_RECORD) {
+            matchCachedChildren(cache, cachedRecord, listing);
+        }
+    }
+    if (options->excludes != NULL) {
+        pruneExcludedSubdirs(listing);
+    }
+}
+
+// State for the sequential walk. handles[i] is the directory i levels below the start of
+// the scan. Children are opened relative to their parent's fd, so the kernel never
+// re-resolves the path. At most DIR_FD_CACHE_SIZE handles stay open: the shallowest are
+// evicted on the way down and reopened through ".." of their child on the way back up,
+// or by path when ".." turns out to be a different directory.
+typedef struct DirWalk {
+    DirHandle *handles;
+    size_t handleCapacity;
+    size_t lowestOpen;
+    size_t openCount;
+    PathBuffer path;
+    ScanQueue *queue;
+    bool statDirectories;
+    ScanCache *cache;
+    // Set when the sink wants every file, not just directories.
+    ResultSink *fileSink;
+    ScanProgress *progress;
+    unsigned long long directoryCount;
+    ScanBoundary boundary;
+    const ExcludeRules *excludes;
+    size_t rootLength;
+    // Set while sizing a subtree the exclude rules matched, for --count-excluded. Nothing
+    // below it is recorded, visited or matched against the rules.
+    bool measuring;
+    unsigned long long excludedDirectories;
+    unsigned long long excludedBytes;
+    InodeSet *countedInodes;
+} DirWalk;
+
+bool enterChildDirectory(DirWalk *walk, size_t level, const char *name) {
+    if (level + 2 > walk->handleCapacity) {
+        size_t newCapacity = walk->handleCapacity ? walk->handleCapacity * 2 : 64;
+        DirHandle *handles = realloc(walk->handles, newCapacity * sizeof(DirHandle));
+        if (handles == NULL) {
+            fprintf(stderr, "Error: out of memory while scanning '%s'\n", walk->path.data);
+            return false;
+        }
+        walk->handles = handles;
+        walk->handleCapacity = newCapacity;
+    }
+
+    if (walk->openCount >= DIR_FD_CACHE_SIZE && walk->lowestOpen < level) {
+        // Remember what is being closed, so the reopened handle can be checked against it.
+        statDirectoryHandle(&walk->handles[walk->lowestOpen]);
+        closeDirectory(&walk->handles[walk->lowestOpen], walk->path.data);
+        walk->lowestOpen++;
+        walk->openCount--;
+    }
+
+    if (!openDirectoryAt(walk->handles[level].fd, name, false, &walk->handles[level + 1])) {
+        fprintf(stderr, "Failed to open directory '%s': %s\n", walk->path.data, strerror(errno));
+        return false;
+    }
+    DirHandle *parent = &walk->handles[level];
+    DirHandle *child = &walk->handles[level + 1];
+    if (walk->boundary.active && statDirectoryHandle(parent) && statDirectoryHandle(child) &&
+        child->stat.st_dev != parent->stat.st_dev && !scanBoundaryAllows(&walk->boundary, child->stat.st_dev)) {
+        closeDirectory(child, walk->path.data);
+        return false;
+    }
+    walk->openCount++;
+    return true;
+}
+
+// Whether handle, just reopened, is the directory whose stat was saved when it was evicted.
+bool reopenedSameDirectory(DirHandle *handle, bool haveEvictedStat, const struct stat *evicted) {
+    if (!haveEvictedStat) {
+        return true;
+    }
+    return statDirectoryHandle(handle) && handle->stat.st_dev == evicted->st_dev && handle->stat.st_ino == evicted->st_ino;
+}
+
+// Reopens the evicted handles[level] while walk->path names its child: through ".." of
+// the child, or by the parent's full path when ".." is no longer the same directory
+// because something was renamed or moved during the scan.
+bool reopenParentDirectory(DirWalk *walk, size_t level) {
+    DirHandle *parent = &walk->handles[level];
+    bool haveEvictedStat = parent->haveStat;
+    struct stat evicted = parent->stat;
+
+    if (openDirectoryAt(walk->handles[level + 1].fd, "..", false, parent)) {
+        if (reopenedSameDirectory(parent, haveEvictedStat, &evicted)) {
+            return true;
+        }
+        closeDirectory(parent, walk->path.data);
+    }
+
+    char *separator = strrchr(walk->path.data, PATH_SEPARATOR[0]);
+    if (separator != NULL) {
+        char saved = *separator;
+        *separator = '\0';
+        bool opened = openDirectoryAt(AT_FDCWD, walk->path.data, level == 0, parent);
+        *separator = saved;
+        if (opened && reopenedSameDirectory(parent, haveEvictedStat, &evicted)) {
+            return true;
+        }
+        if (opened) {
+            closeDirectory(parent, walk->path.data);
+            errno = ESTALE;
+        }
+    }
+    fprintf(stderr, "Failed to reopen parent of '%s', skipping the rest of it: %s\n", walk->path.data, strerror(errno));
+    return false;
+}
+
+// Closes handles[level + 1] and makes sure handles[level] is open again. Returns false when
+// the parent could not be reopened, in which case the rest of it must be skipped.
+bool leaveChildDirectory(DirWalk *walk, size_t level) {
+    bool parentOpen = true;
+    if (walk->handles[level].fd < 0) {
+        parentOpen = reopenParentDirectory(walk, level);
+        if (parentOpen) {
+            walk->lowestOpen = level;
+            walk->openCount++;
+        }
+    }
+    // A handle that could not be reopened is no longer counted as open.
+    if (walk->handles[level + 1].fd >= 0) {
+        walk->openCount--;
+    }
+    closeDirectory(&walk->handles[level + 1], walk->path.data);
+    return parentOpen;
+}
+
+// Walks the tree below the directory open at handles[level] exactly once. Regular files
+// are stat'ed a single time and their sizes roll up into the parent's total on the way
+// back out; each subdirectory at or above MAX_DEPTH gets a record in the queue. Fills
+// summary with the directory's total size, entry count and stamp. cachedRecord is the
+// directory's record in the scan cache, if there is one.
+void walkDirectory(DirWalk *walk, size_t level, int depth, uint32_t cachedRecord, ResultEntry *summary) {
+    ListingOptions options = {
+        .statDirectory = walk->statDirectories && !walk->measuring,
+        .cache = walk->measuring ? NULL : walk->cache,
+        // Below MAX_DEPTH the cache has no records for a directory's children.
+        .cachedRecord = depth <= MAX_DEPTH ? cachedRecord : NO_CACHED_RECORD,
+        .fileVisitor = walk->fileSink != NULL && !walk->measuring ? resultSinkVisitFile : NULL,
+        .fileContext = walk->fileSink,
+        .directoryPath = walk->path.data,
+        .excludes = walk->measuring ? NULL : walk->excludes,
+        .relativePath = relativeScanPath(walk->path.data, walk->rootLength),
+        .countedInodes = walk->countedInodes
+    };
+    DirListing listing;
+    readDirectoryListing(&walk->handles[level], &listing, &options);
+    unsigned long long totalSize = listing.fileBytes;
+    summary->entryCount = listing.entryCount;
+    if (listing.haveDirectoryStat) {
+        summary->stamp = dirStampFromStat(&listing.directoryStat);
+    }
+
+    bool emitRecords = depth <= MAX_DEPTH && !walk->measuring;
+    if (walk->queue != NULL && depth == MAX_DEPTH + 1 && !walk->measuring) {
+        fprintf(stderr, "Maximum recursion depth reached in directory '%s'\n", walk->path.data);
+    }
+    if (emitRecords) {
+        walk->directoryCount += listing.subdirs.count;
+        if (walk->progress != NULL) {
+            walk->progress->discovered += listing.subdirs.count;
+        }
+    }
+
+    bool parentLost = false;
+    for (size_t i = 0; i < listing.subdirs.count && !parentLost; i++) {
+        size_t parentLength = pathBufferAppend(&walk->path, listing.subdirs.names[i], true);
+        if (parentLength == SIZE_MAX) {
+            break;
+        }
+
+        size_t sequence = SIZE_MAX;
+        if (emitRecords && walk->queue != NULL) {
+            sequence = scanQueuePush(walk->queue, walk->path.data, parentLength + strlen(PATH_SEPARATOR), (int)level + 1);
+            if (walk->progress != NULL) {
+                walk->progress->processed++;
+                updateScanProgress(walk->progress, false);
+            }
+        }
+
+        ResultEntry child = {0};
+        uint32_t childRecord = listing.cachedChildren != NULL ? listing.cachedChildren[i] : NO_CACHED_RECORD;
+        if (enterChildDirectory(walk, level, listing.subdirs.names[i])) {
+            walkDirectory(walk, level + 1, depth + 1, childRecord, &child);
+            parentLost = !leaveChildDirectory(walk, level);
+        }
+        if (sequence != SIZE_MAX) {
+            child.path = walk->path.data;
+            child.nameOffset = parentLength + strlen(PATH_SEPARATOR);
+            child.level = (int)level + 1;
+            scanQueueComplete(walk->queue, sequence, &child);
+        }
+        totalSize += child.size;
+        pathBufferTruncate(&walk->path, parentLength);
+    }
+
+    walk->excludedDirectories += listing.excludedCount;
+    for (size_t i = 0; i < listing.excludedSubdirs.count && !parentLost; i++) {
+        size_t parentLength = pathBufferAppend(&walk->path, listing.excludedSubdirs.names[i], true);
+        if (parentLength == SIZE_MAX) {
+            break;
+        }
+        ResultEntry child = {0};
+        if (enterChildDirectory(walk, level, listing.excludedSubdirs.names[i])) {
+            walk->measuring = true;
+            walkDirectory(walk, level + 1, depth + 1, NO_CACHED_RECORD, &child);
+            walk->measuring = false;
+            parentLost = !leaveChildDirectory(walk, level);
+        }
+        walk->excludedBytes += child.size;
+        pathBufferTruncate(&walk->path, parentLength);
+    }
+
+    freeDirectoryListing(&listing);
+    summary->size = totalSize;
+}
+
+// Scans basePath with the sequential engine, reusing unchanged directories from cache when
+// it is not NULL. root receives the totals for basePath itself when not NULL; the return
+// value is its total size.
+unsigned long long scanDirectoryTree(const char *basePath, int depth, ScanQueue *queue, ScanCache *cache, ScanProgress *progress, unsigned long long *directoryCount, ResultEntry *root) {
+    DirWalk walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.queue = queue;
+    walk.statDirectories = queue != NULL && resultSinkNeedsDirectoryStats(queue->sink);
+    walk.cache = cache;
+    walk.fileSink = queue != NULL && resultSinkWantsFiles(queue->sink) ? queue->sink : NULL;
+    walk.progress = progress;
+    walk.excludes = excludeRules.count > 0 ? &excludeRules : NULL;
+    walk.countedInodes = scanOptions.diskUsage ? createInodeSet() : NULL;
+
+    ResultEntry summary = {0};
+    walk.handles = malloc(64 * sizeof(DirHandle));
+    if (walk.handles == NULL || pathBufferAppend(&walk.path, basePath, false) == SIZE_MAX) {
+        fprintf(stderr, "Error: out of memory while scanning '%s'\n", basePath);
+    } else if (!openDirectoryAt(AT_FDCWD, basePath, true, &walk.handles[0])) {
+        fprintf(stderr, "Failed to open directory '%s': %s\n", basePath, strerror(errno));
+    } else {
+        walk.handleCapacity = 64;
+        walk.openCount = 1;
+        walk.rootLength = walk.path.length;
+        if (statDirectoryHandle(&walk.handles[0])) {
+            scanBoundaryInit(&walk.boundary, basePath, walk.handles[0].stat.st_dev);
+        }
+        walkDirectory(&walk, 0, depth, cache != NULL ? 0 : NO_CACHED_RECORD, &summary);
+        closeDirectory(&walk.handles[0], basePath);
+    }
+
+    if (directoryCount != NULL) {
+        *directoryCount = walk.directoryCount;
+    }
+    if (progress != NULL) {
+        progress->skippedMounts = atomic_load(&walk.boundary.skipped);
+        progress->excludedDirectories = walk.excludedDirectories;
+        progress->excludedBytes = walk.excludedBytes;
+    }
+    scanBoundaryFree(&walk.boundary);
+    freeInodeSet(walk.countedInodes);
+    if (root != NULL) {
+        *root = summary;
+    }
+    free(walk.handles);
+    pathBufferFree(&walk.path);
+    return summary.size;
+}
+
+unsigned long long getDirectorySize(const char *dirPath) {
+    if (dirPath == NULL) {
+        fprintf(stderr, "Error: dirPath is NULL\n");
+        return 0;
+    }
+
+    double started = statsPhaseStart();
+    unsigned long long size = scanDirectoryTree(dirPath, 0, NULL, NULL, NULL, NULL, NULL);
+    statsPhaseEnd(STATS_PHASE_DIRECTORY_SIZE, started);
+    return size;
+}
+
+// Parallel engine. The tree is materialised as ScanNodes whose children keep readdir order,
+// so the result file is identical to the sequential walk whatever the thread count.
+typedef struct ScanNode {
+    struct ScanNode *parent;
+    char *name;
+    struct ScanNode **children;
+    size_t childCount;
+    int depth;
+    uint32_t cachedRecord;
+    unsigned long long entryCount;
+    DirStamp stamp;
+    _Atomic unsigned long long size;
+    atomic_size_t pending;
+    // While a directory's fd is cached its children open relative to it; the last child
+    // to open (unopenedChildren reaching zero) closes it.
+    atomic_int fd;
+    atomic_size_t unopenedChildren;
+    atomic_bool listed;
+    atomic_bool done;
+    // The device the directory is on and the lane its children are queued in.
+    dev_t device;
+    int lane;
+    // excluded marks a directory the exclude rules matched, which is only scanned for
+    // --count-excluded; measured is set on it and everything below it.
+    bool excluded;
+    bool measured;
+    // With --disk-usage, the directory's files with several links. The emitter charges
+    // them in pre-order, once everything before the directory has been listed.
+    LinkedFileList linkedFiles;
+} ScanNode;
+
+typedef struct WorkDeque {
+    pthread_mutex_t lock;
+    ScanNode **items;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+} WorkDeque;
+
+// Directories waiting to be read on one device, with a deque per worker, and how many
+// workers may read that device at once: few for a spinning disk, which would otherwise
+// spend its time seeking, and all of them for SSDs and network filesystems.
+typedef struct DeviceLane {
+    dev_t device;
+    int limit;
+    atomic_int active;
+    WorkDeque *deques;
+} DeviceLane;
+
+typedef struct ParallelScan {
+    // Lanes are only ever added, under laneLock; laneCount is published after the lane
+    // is ready.
+    DeviceLane lanes[MAX_SCAN_DEVICES];
+    atomic_int laneCount;
+    pthread_mutex_t laneLock;
+    ScanBoundary boundary;
+    const ExcludeRules *excludes;
+    size_t rootLength;
+    atomic_ullong excludedDirectories;
+    atomic_ullong excludedBytes;
+    int workerCount;
+    atomic_bool finished;
+    atomic_ullong processed;
+    atomic_ullong discovered;
+    atomic_int cachedFds;
+    bool emitRecords;
+    bool statDirectories;
+    ScanCache *cache;
+    ResultSink *fileSink;
+    InodeSet *countedInodes;
+    // Idle workers and the emitter sleep on these instead of polling. workGeneration moves
+    // whenever work is queued or a throttled lane frees a slot; awaitedFlag is the listed
+    // or done flag the emitter is waiting for.
+    pthread_mutex_t wakeLock;
+    pthread_cond_t workReady;
+    pthread_cond_t nodeReady;
+    atomic_ullong workGeneration;
+    int idleWorkers;
+    _Atomic(atomic_bool *) awaitedFlag;
+} ParallelScan;
+
+typedef struct ScanWorker {
+    ParallelScan *scan;
+    int index;
+    unsigned int seed;
+} ScanWorker;
+
+bool workDequePush(WorkDeque *deque, ScanNode *node) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity) {
+        if (deque->head > 0) {
+            memmove(deque->items, deque->items + deque->head, (deque->tail - deque->head) * sizeof(ScanNode *));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        }
+        if (deque->tail == deque->capacity) {
+            size_t newCapacity = deque->capacity ? deque->capacity * 2 : 256;
+            ScanNode **items = realloc(deque->items, newCapacity * sizeof(ScanNode *));
+            if (items == NULL) {
+                pthread_mutex_unlock(&deque->lock);
+                fprintf(stderr, "Error: out of memory while queueing directories\n");
+                return false;
+            }
+            deque->items = items;
+            deque->capacity = newCapacity;
+        }
+    }
+    deque->items[deque->tail++] = node;
+    pthread_mutex_unlock(&deque->lock);
+    return true;
+}
+
+// The owner works depth-first from the bottom of its deque...
+ScanNode *workDequePop(WorkDeque *deque) {
+    ScanNode *node = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head) {
+        node = deque->items[--deque->tail];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return node;
+}
+
+// ...while thieves take from the top, where the oldest and usually largest subtrees sit.
+ScanNode *workDequeSteal(WorkDeque *deque) {
+    ScanNode *node = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head) {
+        node = deque->items[deque->head++];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return node;
+}
+
+// Returns the lane for device, adding one the first time the device is seen. Past
+// MAX_SCAN_DEVICES devices, new ones share fallback's lane.
+int deviceLaneFor(ParallelScan *scan, dev_t device, int fallback) {
+    int laneCount = atomic_load(&scan->laneCount);
+    for (int i = 0; i < laneCount; i++) {
+        if (scan->lanes[i].device == device) {
+            return i;
+        }
+    }
+
+    pthread_mutex_lock(&scan->laneLock);
+    int lane = fallback;
+    laneCount = atomic_load(&scan->laneCount);
+    for (int i = 0; i < laneCount; i++) {
+        if (scan->lanes[i].device == device) {
+            lane = i;
+            break;
+        }
+    }
+    if (lane == fallback && laneCount < MAX_SCAN_DEVICES) {
+        DeviceLane *added = &scan->lanes[laneCount];
+        added->deques = calloc(scan->workerCount, sizeof(WorkDeque));
+        if (added->deques != NULL) {
+            for (int i = 0; i < scan->workerCount; i++) {
+                pthread_mutex_init(&added->deques[i].lock, NULL);
+            }
+            added->device = device;
+            added->limit = isRotationalDevice(device) ? MIN(scanOptions.hddThreads, scan->workerCount) : scan->workerCount;
+            atomic_init(&added->active, 0);
+            lane = laneCount;
+            atomic_store(&scan->laneCount, laneCount + 1);
+        }
+    }
+    pthread_mutex_unlock(&scan->laneLock);
+    return lane;
+}
+
+// Finds a directory in a lane that has a worker to spare, starting from a different lane
+// for each worker so that separate disks are read at the same time. Own work comes first,
+// then stealing. On success the caller holds one of the lane's slots until it calls
+// releaseDeviceLane.
+ScanNode *takeScanNode(ScanWorker *worker, int *laneIndex) {
+    ParallelScan *scan = worker->scan;
+    int laneCount = atomic_load(&scan->laneCount);
+    for (int offset = 0; offset < laneCount; offset++) {
+        int index = (worker->index + offset) % laneCount;
+        DeviceLane *lane = &scan->lanes[index];
+        if (atomic_fetch_add(&lane->active, 1) >= lane->limit) {
+            atomic_fetch_sub(&lane->active, 1);
+            continue;
+        }
+
+        // Every deque is tried, from a random start, so that finding nothing means there
+        // was nothing to take and the worker may sleep until more is queued.
+        ScanNode *node = workDequePop(&lane->deques[worker->index]);
+        int first = rand_r(&worker->seed) % scan->workerCount;
+        for (int attempt = 0; node == NULL && attempt < scan->workerCount; attempt++) {
+            int victim = (first + attempt) % scan->workerCount;
+            if (victim != worker->index) {
+                node = workDequeSteal(&lane->deques[victim]);
+            }
+        }
+        if (node != NULL) {
+            *laneIndex = index;
+            return node;
+        }
+        atomic_fetch_sub(&lane->active, 1);
+    }
+    return NULL;
+}
+
+// Tells idle workers there may be something to take: all of them when several
+// directories were queued, one otherwise.
+void wakeScanWorkers(ParallelScan *scan, bool all) {
+    pthread_mutex_lock(&scan->wakeLock);
+    atomic_fetch_add(&scan->workGeneration, 1);
+    if (scan->idleWorkers > 0) {
+        if (all) {
+            pthread_cond_broadcast(&scan->workReady);
+        } else {
+            pthread_cond_signal(&scan->workReady);
+        }
+    }
+    pthread_mutex_unlock(&scan->wakeLock);
+}
+
+// Sleeps until work is queued after generation was read, or the scan finishes.
+void waitForScanWork(ParallelScan *scan, unsigned long long generation) {
+    pthread_mutex_lock(&scan->wakeLock);
+    scan->idleWorkers++;
+    while (atomic_load(&scan->workGeneration) == generation && !atomic_load(&scan->finished)) {
+        pthread_cond_wait(&scan->workReady, &scan->wakeLock);
+    }
+    scan->idleWorkers--;
+    pthread_mutex_unlock(&scan->wakeLock);
+}
+
+// Sets a node's listed or done flag and wakes the emitter if that is the flag it waits for.
+// The emitter may free the node once its flag is set, so only the address is compared.
+void publishScanNodeFlag(ParallelScan *scan, atomic_bool *flag) {
+    atomic_store(flag, true);
+    if (atomic_load(&scan->awaitedFlag) == flag) {
+        pthread_mutex_lock(&scan->wakeLock);
+        pthread_cond_signal(&scan->nodeReady);
+        pthread_mutex_unlock(&scan->wakeLock);
+    }
+}
+
+void releaseDeviceLane(ParallelScan *scan, int laneIndex) {
+    DeviceLane *lane = &scan->lanes[laneIndex];
+    atomic_fetch_sub(&lane->active, 1);
+    // A worker may have found the lane full and gone to sleep with work left in it.
+    if (lane->limit < scan->workerCount) {
+        wakeScanWorkers(scan, false);
+    }
+}
+
+void freeDeviceLanes(ParallelScan *scan) {
+    int laneCount = atomic_load(&scan->laneCount);
+    for (int lane = 0; lane < laneCount; lane++) {
+        for (int i = 0; i < scan->workerCount; i++) {
+            pthread_mutex_destroy(&scan->lanes[lane].deques[i].lock);
+            free(scan->lanes[lane].deques[i].items);
+        }
+        free(scan->lanes[lane].deques);
+    }
+    atomic_store(&scan->laneCount, 0);
+    pthread_mutex_destroy(&scan->laneLock);
+    pthread_mutex_destroy(&scan->wakeLock);
+    pthread_cond_destroy(&scan->workReady);
+    pthread_cond_destroy(&scan->nodeReady);
+    scanBoundaryFree(&scan->boundary);
+}
+
+bool buildNodePath(const ScanNode *node, PathBuffer *path) {
+    if (node->parent != NULL && !buildNodePath(node->parent, path)) {
+        return false;
+    }
+    return pathBufferAppend(path, node->name, node->parent != NULL) != SIZE_MAX;
+}
+
+// Rolls a finished subtree into its ancestors without locks. The last child to report
+// completes its parent, and so on up to the root.
+void completeScanNode(ParallelScan *scan, ScanNode *node) {
+    while (node != NULL) {
+        ScanNode *parent = node->parent;
+        if (parent == NULL) {
+            atomic_store(&scan->finished, true);
+            wakeScanWorkers(scan, true);
+            publishScanNodeFlag(scan, &node->done);
+            return;
+        }
+
+        if (node->excluded) {
+            atomic_fetch_add(&scan->excludedBytes, atomic_load(&node->size));
+        } else {
+            atomic_fetch_add(&parent->size, atomic_load(&node->size));
+        }
+        size_t remaining = atomic_fetch_sub(&parent->pending, 1);
+        // The emitter may free node as soon as done is set, so it is the last write.
+        publishScanNodeFlag(scan, &node->done);
+        node = remaining == 1 ? parent : NULL;
+    }
+}
+
+void releaseParentFd(ParallelScan *scan, ScanNode *node) {
+    ScanNode *parent = node->parent;
+    if (parent != NULL && atomic_fetch_sub(&parent->unopenedChildren, 1) == 1) {
+        int fd = atomic_exchange(&parent->fd, -1);
+        if (fd >= 0) {
+            long long started = statsClock();
+            statsRecordCall(STATS_CALL_CLOSE, started, close(fd) == -1);
+            atomic_fetch_sub(&scan->cachedFds, 1);
+        }
+    }
+}
+
+void scanParallelNode(ScanWorker *worker, ScanNode *node) {
+    ParallelScan *scan = worker->scan;
+    PathBuffer path = {0};
+    buildNodePath(node, &path);
+    const char *displayPath = path.data != NULL ? path.data : node->name;
+
+    DirHandle handle;
+    bool opened;
+    int parentFd = node->parent != NULL ? atomic_load(&node->parent->fd) : -1;
+    if (parentFd >= 0) {
+        opened = openDirectoryAt(parentFd, node->name, false, &handle);
+    } else {
+        // The parent's fd did not fit in the cache; fall back to the full path.
+        opened = path.data != NULL && openDirectoryAt(AT_FDCWD, path.data, node->parent == NULL, &handle);
+    }
+    if (!opened) {
+        fprintf(stderr, "Failed to open directory '%s': %s\n", displayPath, strerror(errno));
+    }
+    releaseParentFd(scan, node);
+
+    // Children are queued by device, so when the scan can reach other devices every
+    // directory is stat'ed to find mount points.
+    if (node->parent != NULL) {
+        node->device = node->parent->device;
+        node->lane = node->parent->lane;
+    }
+    bool checkDevice = scan->boundary.active || scan->boundary.crossesMounts;
+    if (opened && node->parent != NULL && checkDevice && statDirectoryHandle(&handle) && handle.stat.st_dev != node->device) {
+        if (scan->boundary.active && !scanBoundaryAllows(&scan->boundary, handle.stat.st_dev)) {
+            closeDirectory(&handle, displayPath);
+            opened = false;
+        } else {
+            node->device = handle.stat.st_dev;
+            node->lane = deviceLaneFor(scan, node->device, node->lane);
+        }
+    }
+
+    DirListing listing = {0};
+    if (opened) {
+        ListingOptions options = {
+            .statDirectory = scan->statDirectories && !node->measured,
+            .cache = node->measured ? NULL : scan->cache,
+            .cachedRecord = node->depth <= MAX_DEPTH ? node->cachedRecord : NO_CACHED_RECORD,
+            .fileVisitor = scan->fileSink != NULL && !node->measured ? resultSinkVisitFile : NULL,
+            .fileContext = scan->fileSink,
+            .directoryPath = displayPath,
+            .excludes = node->measured || path.data == NULL ? NULL : scan->excludes,
+            .relativePath = path.data != NULL ? relativeScanPath(path.data, scan->rootLength) : "",
+            .countedInodes = scan->countedInodes,
+            .deferLinkedFiles = true
+        };
+        readDirectoryListing(&handle, &listing, &options);
+        node->linkedFiles = listing.linkedFiles;
+        memset(&listing.linkedFiles, 0, sizeof(listing.linkedFiles));
+    }
+
+    if (scan->emitRecords && node->depth == MAX_DEPTH + 1 && !node->measured) {
+        fprintf(stderr, "Maximum recursion depth reached in directory '%s'\n", displayPath);
+    }
+    if (!node->measured) {
+        atomic_fetch_add(&scan->excludedDirectories, listing.excludedCount);
+    }
+
+    // Excluded subdirectories go after the rest, so they are scanned last.
+    size_t listedCount = listing.subdirs.count + listing.excludedSubdirs.count;
+    ScanNode **children = NULL;
+    if (listedCount > 0) {
+        children = calloc(listedCount, sizeof(ScanNode *));
+    }
+    size_t childCount = 0;
+    size_t recordedCount = 0;
+    for (size_t i = 0; children != NULL && i < listedCount; i++) {
+        bool excluded = i >= listing.subdirs.count;
+        NameList *names = excluded ? &listing.excludedSubdirs : &listing.subdirs;
+        size_t index = excluded ? i - listing.subdirs.count : i;
+        ScanNode *child = calloc(1, sizeof(ScanNode));
+        if (child == NULL) {
+            fprintf(stderr, "Error: out of memory while scanning '%s'\n", displayPath);
+            break;
+        }
+        // Hand the name over instead of copying it.
+        child->name = names->names[index];
+        names->names[index] = NULL;
+        child->parent = node;
+        child->depth = node->depth + 1;
+        child->excluded = excluded;
+        child->measured = excluded || node->measured;
+        child->cachedRecord = !excluded && listing.cachedChildren != NULL ? listing.cachedChildren[i] : NO_CACHED_RECORD;
+        atomic_init(&child->fd, -1);
+        children[childCount++] = child;
+        recordedCount += !child->measured;
+    }
+    freeDirectoryListing(&listing);
+
+    int keptFd = -1;
+    if (opened) {
+        if (childCount > 0 && atomic_fetch_add(&scan->cachedFds, 1) < PARALLEL_FD_CACHE_SIZE) {
+            if (handle.stream == NULL) {
+                keptFd = handle.fd;
+                handle.fd = -1;
+            } else {
+                // Keep the descriptor but drop the DIR stream and its buffer.
+                keptFd = dup(handle.fd);
+            }
+            if (keptFd < 0) {
+                atomic_fetch_sub(&scan->cachedFds, 1);
+            }
+        } else if (childCount > 0) {
+            atomic_fetch_sub(&scan->cachedFds, 1);
+        }
+        closeDirectory(&handle, displayPath);
+    }
+
+    atomic_store(&node->size, listing.fileBytes);
+    node->entryCount = listing.entryCount;
+    if (listing.haveDirectoryStat) {
+        node->stamp = dirStampFromStat(&listing.directoryStat);
+    }
+    node->children = children;
+    node->childCount = childCount;
+    atomic_store(&node->pending, childCount);
+    atomic_store(&node->unopenedChildren, childCount);
+    atomic_store(&node->fd, keptFd);
+    publishScanNodeFlag(scan, &node->listed);
+    pathBufferFree(&path);
+
+    if (node->depth <= MAX_DEPTH) {
+        atomic_fetch_add(&scan->discovered, recordedCount);
+    }
+    if (node->depth <= MAX_DEPTH + 1 && node->parent != NULL && !node->measured) {
+        atomic_fetch_add(&scan->processed, 1);
+    }
+
+    if (childCount == 0) {
+        completeScanNode(scan, node);
+        return;
+    }
+
+    // Pushed in reverse so the owner pops them in readdir order.
+    bool pushed = false;
+    for (size_t i = childCount; i-- > 0;) {
+        if (workDequePush(&scan->lanes[node->lane].deques[worker->index], children[i])) {
+            pushed = true;
+        } else {
+            // Treat an unqueued directory as empty rather than hanging the scan.
+            releaseParentFd(scan, children[i]);
+            atomic_store(&children[i]->listed, true);
+            completeScanNode(scan, children[i]);
+        }
+    }
+    if (pushed) {
+        wakeScanWorkers(scan, childCount > 1);
+    }
+}
+
+void *parallelScanWorker(void *argument) {
+    ScanWorker *worker = argument;
+    ParallelScan *scan = worker->scan;
+
+    while (!atomic_load(&scan->finished)) {
+        unsigned long long generation = atomic_load(&scan->workGeneration);
+        int lane;
+        ScanNode *node = takeScanNode(worker, &lane);
+        if (node == NULL) {
+            waitForScanWork(scan, generation);
+            continue;
+        }
+        scanParallelNode(worker, node);
+        releaseDeviceLane(scan, lane);
+    }
+    releaseScanThreadState();
+    return NULL;
+}
+
+// Sleeps until flag is published, waking every PROGRESS_REDRAW_INTERVAL_MS to redraw
+// progress when there is any.
+void waitForScanNode(ParallelScan *scan, atomic_bool *flag, ScanProgress *progress) {
+    if (atomic_load(flag)) {
+        return;
+    }
+    atomic_store(&scan->awaitedFlag, flag);
+    while (!atomic_load(flag)) {
+        if (progress != NULL) {
+            progress->processed = atomic_load(&scan->processed);
+            progress->discovered = atomic_load(&scan->discovered);
+            updateScanProgress(progress, false);
+        }
+        pthread_mutex_lock(&scan->wakeLock);
+        if (!atomic_load(flag)) {
+            if (progress != NULL) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_MONOTONIC, &deadline);
+                deadline.tv_nsec += PROGRESS_REDRAW_INTERVAL_MS * 1000000L;
+                deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+                deadline.tv_nsec %= 1000000000L;
+                pthread_cond_timedwait(&scan->nodeReady, &scan->wakeLock, &deadline);
+            } else {
+                pthread_cond_wait(&scan->nodeReady, &scan->wakeLock);
+            }
+        }
+        pthread_mutex_unlock(&scan->wakeLock);
+    }
+    atomic_store(&scan->awaitedFlag, NULL);
+}
+
+// Charges the linked files of a finished subtree, whose path is in path, in pre-order and
+// adds them to the sizes of the nodes they belong to. What an excluded subtree charges goes
+// to the excluded total instead of its parent. Returns the bytes charged for node's parent.
+unsigned long long resolveSubtreeLinks(ParallelScan *scan, ScanNode *node, PathBuffer *path) {
+    unsigned long long charged = 0;
+    if (node->linkedFiles.count > 0) {
+        FileVisitor visitor = scan->fileSink != NULL && !node->measured ? resultSinkVisitFile : NULL;
+        charged = resolveLinkedFiles(scan->countedInodes, &node->linkedFiles, visitor, scan->fileSink, path->data);
+        statsCountBytes(charged);
+    }
+    for (size_t i = 0; i < node->childCount; i++) {
+        ScanNode *child = node->children[i];
+        size_t parentLength = pathBufferAppend(path, child->name, true);
+        if (parentLength == SIZE_MAX) {
+            linkedFileListFree(&child->linkedFiles);
+            continue;
+        }
+        charged += resolveSubtreeLinks(scan, child, path);
+        pathBufferTruncate(path, parentLength);
+    }
+    atomic_fetch_add(&node->size, charged);
+    if (node->excluded) {
+        atomic_fetch_add(&scan->excludedBytes, charged);
+        return 0;
+    }
+    return charged;
+}
+
+// Emits records in pre-order as soon as each subtree is done, freeing emitted subtrees so
+// memory is bounded by the part of the tree still in flight. With --disk-usage the start's
+// own linked files are charged first, then each subtree directly below it before its
+// record is written; everything in front of it in pre-order is listed by then.
+void emitParallelSubtree(ParallelScan *scan, ScanNode *node, int level, PathBuffer *path, ResultSink *sink, ScanProgress *progress) {
+    waitForScanNode(scan, &node->listed, progress);
+    bool resolveLinks = level == 0 && scan->countedInodes != NULL;
+    unsigned long long charged = 0;
+    if (resolveLinks && node->linkedFiles.count > 0) {
+        charged = resolveLinkedFiles(scan->countedInodes, &node->linkedFiles, scan->fileSink != NULL ? resultSinkVisitFile : NULL,
+                                     scan->fileSink, path->data);
+        statsCountBytes(charged);
+    }
+
+    for (size_t i = 0; i < node->childCount; i++) {
+        ScanNode *child = node->children[i];
+        waitForScanNode(scan, &child->done, progress);
+
+        size_t parentLength = pathBufferAppend(path, child->name, true);
+        if (parentLength != SIZE_MAX && resolveLinks) {
+            charged += resolveSubtreeLinks(scan, child, path);
+        }
+        if (parentLength != SIZE_MAX) {
+            if (sink != NULL && node->depth <= MAX_DEPTH && !child->measured) {
+                ResultEntry entry = {
+                    .path = path->data,
+                    .nameOffset = parentLength + strlen(PATH_SEPARATOR),
+                    .level = level + 1,
+                    .size = atomic_load(&child->size),
+                    .entryCount = child->entryCount,
+                    .stamp = child->stamp
+                };
+                resultSinkWrite(sink, &entry);
+            }
+            // A measured subtree is only waited for and freed.
+            emitParallelSubtree(scan, child, level + 1, path, child->measured ? NULL : sink, progress);
+            pathBufferTruncate(path, parentLength);
+        }
+
+        linkedFileListFree(&child->linkedFiles);
+        free(child->children);
+        free(child->name);
+        free(child);
+    }
+    atomic_fetch_add(&node->size, charged);
+}
+
+unsigned long long scanDirectoryTreeParallel(const char *basePath, int depth, ResultSink *sink, ScanCache *cache, ScanProgress *progress, int threadCount, ResultEntry *rootSummary) {
+    ParallelScan scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.workerCount = threadCount;
+    scan.emitRecords = sink != NULL;
+    scan.statDirectories = resultSinkNeedsDirectoryStats(sink);
+    scan.cache = cache;
+    scan.fileSink = resultSinkWantsFiles(sink) ? sink : NULL;
+    atomic_init(&scan.finished, false);
+    atomic_init(&scan.processed, 0);
+    atomic_init(&scan.discovered, 0);
+    atomic_init(&scan.cachedFds, 0);
+    atomic_init(&scan.laneCount, 0);
+    pthread_mutex_init(&scan.laneLock, NULL);
+    pthread_mutex_init(&scan.wakeLock, NULL);
+    pthread_cond_init(&scan.workReady, NULL);
+    pthread_condattr_t nodeReadyAttributes;
+    pthread_condattr_init(&nodeReadyAttributes);
+    pthread_condattr_setclock(&nodeReadyAttributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&scan.nodeReady, &nodeReadyAttributes);
+    pthread_condattr_destroy(&nodeReadyAttributes);
+    atomic_init(&scan.workGeneration, 0);
+    atomic_init(&scan.awaitedFlag, NULL);
+    scan.excludes = excludeRules.count > 0 ? &excludeRules : NULL;
+    scan.rootLength = strlen(basePath);
+    scan.countedInodes = scanOptions.diskUsage ? createInodeSet() : NULL;
+    atomic_init(&scan.excludedDirectories, 0);
+    atomic_init(&scan.excludedBytes, 0);
+
+    ScanNode root;
+    memset(&root, 0, sizeof(root));
+    root.name = (char *)basePath;
+    root.depth = depth;
+    root.cachedRecord = cache != NULL ? 0 : NO_CACHED_RECORD;
+    atomic_init(&root.fd, -1);
+    struct stat rootStat;
+    if (stat(basePath, &rootStat) == 0) {
+        root.device = rootStat.st_dev;
+    }
+    scanBoundaryInit(&scan.boundary, basePath, root.device);
+
+    root.lane = deviceLaneFor(&scan, root.device, -1);
+    ScanWorker *workers = calloc(threadCount, sizeof(ScanWorker));
+    pthread_t *threads = calloc(threadCount, sizeof(pthread_t));
+    if (root.lane < 0 || workers == NULL || threads == NULL) {
+        fprintf(stderr, "Error: out of memory while starting scan threads\n");
+        freeDeviceLanes(&scan);
+        freeInodeSet(scan.countedInodes);
+        free(workers);
+        free(threads);
+        return 0;
+    }
+
+    for (int i = 0; i < threadCount; i++) {
+        workers[i].scan = &scan;
+        workers[i].index = i;
+        workers[i].seed = (unsigned int)i * 2654435761u + 1;
+    }
+    workDequePush(&scan.lanes[root.lane].deques[0], &root);
+
+    int started = 0;
+    for (; started < threadCount; started++) {
+        if (pthread_create(&threads[started], NULL, parallelScanWorker, &workers[started]) != 0) {
+            fprintf(stderr, "Failed to start scan thread: %s\n", strerror(errno));
+            break;
+        }
+    }
+    if (started == 0) {
+        // No worker could start; do the work on this thread instead.
+        while (!atomic_load(&scan.finished)) {
+            int lane;
+            ScanNode *node = takeScanNode(&workers[0], &lane);
+            if (node != NULL) {
+                scanParallelNode(&workers[0], node);
+                releaseDeviceLane(&scan, lane);
+            }
+        }
+    }
+
+    PathBuffer path = {0};
+    if (pathBufferAppend(&path, basePath, false) != SIZE_MAX) {
+        emitParallelSubtree(&scan, &root, 0, &path, sink, progress);
+    }
+    waitForScanNode(&scan, &root.done, progress);
+    pathBufferFree(&path);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    freeDeviceLanes(&scan);
+    freeInodeSet(scan.countedInodes);
+    free(root.children);
+    free(workers);
+    free(threads);
+
+    if (progress != NULL) {
+        progress->processed = atomic_load(&scan.processed);
+        progress->discovered = atomic_load(&scan.discovered);
+        progress->skippedMounts = atomic_load(&scan.boundary.skipped);
+        progress->excludedDirectories = atomic_load(&scan.excludedDirectories);
+        progress->excludedBytes = atomic_load(&scan.excludedBytes);
+    }
+    if (rootSummary != NULL) {
+        rootSummary->size = atomic_load(&root.size);
+        rootSummary->entryCount = root.entryCount;
+        rootSummary->stamp = root.stamp;
+    }
+    return atomic_load(&root.size);
+}
+
+// Runs whichever engine --threads selects and streams every directory record into sink.
+// cache, when not NULL, holds the previous scan of basePath for an incremental rescan.
+bool scanIntoSink(const char *basePath, int depth, ResultSink *sink, ScanCache *cache, ScanProgress *progress) {
+    if (!resultSinkBegin(sink, basePath)) {
+        return false;
+    }
+    if (scanOptions.breakdown) {
+        beginFileBreakdown(&fileBreakdown);
+        sink->breakdown = &fileBreakdown;
+    }
+
+    double started = statsPhaseStart();
+    ResultEntry root = { .path = basePath, .nameOffset = 0, .level = 0 };
+    if (scanOptions.threads > 1) {
+        scanDirectoryTreeParallel(basePath, depth, sink, cache, progress, scanOptions.threads, &root);
+    } else {
+        ScanQueue queue;
+        scanQueueInit(&queue, sink);
+        scanDirectoryTree(basePath, depth, &queue, cache, progress, NULL, &root);
+        scanQueueFree(&queue);
+    }
+
+    bool finished = resultSinkFinish(sink, &root);
+    statsPhaseEnd(STATS_PHASE_SCAN, started);
+    if (!finished) {
+        fprintf(stderr, "Error writing to the output file\n");
+        return false;
+    }
+    return !sink->failed;
+}
+
+void listDirectories(const char *basePath, FILE *outputFile, int depth, ScanProgress *progress) {
+    if (basePath == NULL || outputFile == NULL) {
+        fprintf(stderr, "Error: basePath or outputFile is NULL\n");
+        return;
+    }
+
+    if (depth > MAX_DEPTH) {
+        fprintf(stderr, "Maximum recursion depth reached in directory '%s'\n", basePath);
+        return;
+    }
+
+    ResultSink sink;
+    resultSinkInit(&sink, outputFile, RESULT_FORMAT_TEXT);
+    scanIntoSink(basePath, depth, &sink, NULL, progress);
+    resultSinkFree(&sink);
+}
+
+// Scans basePath in the format given by --format and writes the results to
+// outputFilePath. With --incremental the snapshot already in outputFilePath seeds the scan;
+// it stays mapped while the new one is written beside it, which then replaces it.
+// Returns false if the output could not be written.
+bool writeScanResults(const char *basePath, const char *outputFilePath, ScanProgress *progress) {
+    ScanCache cache;
+    ScanCache *previous = NULL;
+    PathBuffer writePath = {0};
+    if (pathBufferAppend(&writePath, outputFilePath, false) == SIZE_MAX) {
+        return false;
+    }
+    if (scanOptions.incremental) {
+        if (loadScanCache(&cache, outputFilePath, basePath)) {
+            previous = &cache;
+        } else {
+            printf("No previous snapshot of %s in %s; scanning everything\n", basePath, outputFilePath);
+        }
+        if (pathBufferAppend(&writePath, ".tmp", false) == SIZE_MAX) {
+            if (previous != NULL) {
+                freeScanCache(previous);
+            }
+            pathBufferFree(&writePath);
+            return false;
+        }
+    }
+
+    FILE *outputFile = fopen(writePath.data, scanOptions.resultFormat == RESULT_FORMAT_SNAPSHOT ? "wb" : "w");
+    if (outputFile == NULL) {
+        perror("Error opening the output file");
+        if (previous != NULL) {
+            freeScanCache(previous);
+        }
+        pathBufferFree(&writePath);
+        return false;
+    }
+
+    ResultSink sink;
+    resultSinkInit(&sink, outputFile, scanOptions.resultFormat);
+    bool written = scanIntoSink(basePath, 0, &sink, previous, progress);
+    resultSinkFree(&sink);
+
+    if (previous != NULL) {
+        if (progress != NULL) {
+            progress->rereadDirectories = atomic_load(&previous->reread);
+            progress->reusedDirectories = atomic_load(&previous->reused);
+        }
+        freeScanCache(previous);
+    }
+    if (fclose(outputFile) == EOF) {
+        perror("Error closing the output file");
+        written = false;
+    }
+    if (scanOptions.incremental) {
+        if (!written) {
+            unlink(writePath.data);
+        } else if (rename(writePath.data, outputFilePath) != 0) {
+            perror("Error replacing the output file");
+            written = false;
+        }
+    }
+    pathBufferFree(&writePath);
+    return written;
+}
+
+int countTotalDirectories(const char *basePath, int depth) {
+    if (basePath == NULL) {
+        fprintf(stderr, "Error: basePath is NULL\n");
+        return 0;
+    }
+
+    if (depth > MAX_DEPTH) {
+        fprintf(stderr, "Maximum recursion depth reached in directory '%s'\n", basePath);
+        return 0;
+    }
+
+    unsigned long long count = 0;
+    double started = statsPhaseStart();
+    scanDirectoryTree(basePath, depth, NULL, NULL, NULL, &count, NULL);
+    statsPhaseEnd(STATS_PHASE_COUNT_DIRECTORIES, started);
+    return count > INT_MAX ? INT_MAX : (int)count;
+}
+
+bool askYesNoQuestion(const char *question) {
+    if (question == NULL) {
+        fprintf(stderr, "Error: question is NULL\n");
+        return false;
+    }
+
+    char response[10];
+    printf("%s (yes/no): ", question);
+    if (fgets(response, sizeof(response), stdin) == NULL) {
+        fprintf(stderr, "Error reading input\n");
+        return false;
+    }
+
+    response[strcspn(response, "\n")] = 0;
+
+    for (int i = 0; response[i]; i++) {
+        response[i] = tolower((unsigned char) response[i]);
+    }
+
+    return (strcmp(response, "yes") == 0);
+}
+
+unsigned long long askForSizeThreshold() {
+    unsigned long long threshold = 0;
+    printf("Enter size threshold in bytes: ");
+    int result = scanf("%llu", &threshold);
+
+    while (getchar() != '\n');
+
+    if (result != 1) {
+        printf("Invalid input. Using default threshold of 0 (no filtering).\n");
+        threshold = 0;
+    }
+
+    return threshold;
+}
+
+void toLowerString(char *str) {
+    if (str == NULL) {
+        fprintf(stderr, "Error: str is NULL\n");
+        return;
+    }
+
+    for (int i = 0; str[i]; i++) {
+        if (isalpha((unsigned char) str[i])) {
+            str[i] = tolower((unsigned char) str[i]);
+        }
+    }
+}
+
+void printLine(const char *path, unsigned long long size) {
+    printf("%s - %llu bytes\n", path, size);
+}
+
+// Scans basePath keeping only the --top largest directories and files at or above
+// threshold, then prints both lists largest first. Nothing is written to disk.
+bool reportLargestEntries(const char *basePath, unsigned long long threshold, ScanProgress *progress) {
+    TopReport report;
+    if (!topHeapInit(&report.directories, scanOptions.topCount, threshold)) {
+        return false;
+    }
+    if (!topHeapInit(&report.files, scanOptions.topCount, threshold)) {
+        topHeapFree(&report.directories);
+        return false;
+    }
+
+    ResultSink sink;
+    resultSinkInit(&sink, NULL, RESULT_FORMAT_TOP);
+    sink.top = &report;
+    bool scanned = scanIntoSink(basePath, 0, &sink, NULL, progress);
+    resultSinkFree(&sink);
+
+    if (scanned) {
+        if (progress != NULL) {
+            updateScanProgress(progress, true);
+        }
+        topHeapSort(&report.directories);
+        topHeapSort(&report.files);
+        printf("\n\nLargest %zu directories:\n", report.directories.count);
+        for (size_t i = 0; i < report.directories.count; i++) {
+            printLine(report.directories.entries[i].path, report.directories.entries[i].size);
+        }
+        printf("\nLargest %zu files:\n", report.files.count);
+        for (size_t i = 0; i < report.files.count; i++) {
+            printLine(report.files.entries[i].path, report.files.entries[i].size);
+        }
+    }
+    topHeapFree(&report.directories);
+    topHeapFree(&report.files);
+    return scanned;
+}
+
+// Estimate mode. The top --estimate-depth levels below the start are listed in full; each
+// directory one level further down is sized by Knuth's tree-size estimator. A probe walks
+// from it to a leaf, choosing one subdirectory uniformly at random at each level, and
+// counts each level's file bytes times the product of the branching factors above it. The
+// mean of many probes is an unbiased estimate of the subtree's total, and their spread
+// gives its standard error. The estimator is heavily right-skewed: a few rare paths into
+// large subtrees carry most of the total, so with few probes the mean usually falls short
+// and the spread understates the error. The standard error is therefore shown as a rough
+// guide, not as a confidence interval. Refining doubles the probes and scans the least certain
+// subtrees exactly, so repeated refinement ends in an exact scan. The same probes estimate
+// how many directories a subtree holds; once they have listed that many, it is cheaper to
+// scan the subtree than to sample it further.
+typedef struct EstimateNode {
+    size_t parent;
+    char *path;
+    int level;
+    // Below the listed levels, sized by probes until it is scanned exactly.
+    bool sampled;
+    bool exact;
+    unsigned long long fileBytes;
+    // Running mean and sum of squared deviations of the probe results (Welford).
+    unsigned long long probes;
+    double mean;
+    double m2;
+    double directories;
+    unsigned long long listings;
+    // This directory's total and the variance of that total, children included.
+    double bytes;
+    double variance;
+} EstimateNode;
+
+typedef struct Estimate {
+    EstimateNode *nodes;
+    size_t count;
+    size_t capacity;
+    uint64_t random;
+    ScanBoundary boundary;
+    const ExcludeRules *excludes;
+    size_t rootLength;
+} Estimate;
+
+bool addEstimateNode(Estimate *estimate, size_t parent, const char *path, int level) {
+    if (estimate->count == estimate->capacity) {
+        size_t newCapacity = estimate->capacity ? estimate->capacity * 2 : 64;
+        EstimateNode *nodes = realloc(estimate->nodes, newCapacity * sizeof(EstimateNode));
+        if (nodes == NULL) {
+            fprintf(stderr, "Error: out of memory while estimating\n");
+            return false;
+        }
+        estimate->nodes = nodes;
+        estimate->capacity = newCapacity;
+    }
+    EstimateNode *node = &estimate->nodes[estimate->count];
+    memset(node, 0, sizeof(*node));
+    node->parent = parent;
+    node->level = level;
+    node->path = strdup(path);
+    if (node->path == NULL) {
+        fprintf(stderr, "Error: out of memory while estimating\n");
+        return false;
+    }
+    estimate->count++;
+    return true;
+}
+
+// Opens a directory of the estimate, refusing mount points the scan would skip.
+bool openEstimateDirectory(Estimate *estimate, int parentFd, const char *name, bool isRoot, DirHandle *handle) {
+    if (!openDirectoryAt(parentFd, name, isRoot, handle)) {
+        return false;
+    }
+    if (!isRoot && estimate->boundary.active && statDirectoryHandle(handle) &&
+        !scanBoundaryAllows(&estimate->boundary, handle->stat.st_dev)) {
+        closeDirectory(handle, name);
+        errno = 0;
+        return false;
+    }
+    return true;
+}
+
+void listEstimateDirectory(Estimate *estimate, DirHandle *handle, const char *path, DirListing *listing) {
+    ListingOptions options = {
+        .cachedRecord = NO_CACHED_RECORD,
+        .directoryPath = path,
+        .excludes = estimate->excludes,
+        .relativePath = relativeScanPath(path, estimate->rootLength)
+    };
+    readDirectoryListing(handle, listing, &options);
+    // The listing keeps a pointer to options, which are gone once this returns.
+    listing->options = NULL;
+}
+
+// Lists the top levels in full, adding each subdirectory below them as a sampled node.
+bool enumerateEstimateLevels(Estimate *estimate, int depth) {
+    PathBuffer path = {0};
+    bool ok = true;
+    for (size_t i = 0; ok && i < estimate->count; i++) {
+        if (estimate->nodes[i].level >= depth) {
+            estimate->nodes[i].sampled = true;
+            continue;
+        }
+        estimate->nodes[i].exact = true;
+        DirHandle handle;
+        if (!openEstimateDirectory(estimate, AT_FDCWD, estimate->nodes[i].path, i == 0, &handle)) {
+            if (errno != 0) {
+                fprintf(stderr, "Failed to open directory '%s': %s\n", estimate->nodes[i].path, strerror(errno));
+            }
+            continue;
+        }
+        DirListing listing;
+        listEstimateDirectory(estimate, &handle, estimate->nodes[i].path, &listing);
+        estimate->nodes[i].fileBytes = listing.fileBytes;
+        if (path.data != NULL) {
+            pathBufferTruncate(&path, 0);
+        }
+        ok = pathBufferAppend(&path, estimate->nodes[i].path, false) != SIZE_MAX;
+        for (size_t j = 0; ok && j < listing.subdirs.count; j++) {
+            size_t parentLength = pathBufferAppend(&path, listing.subdirs.names[j], true);
+            ok = parentLength != SIZE_MAX && addEstimateNode(estimate, i, path.data, estimate->nodes[i].level + 1);
+            if (parentLength != SIZE_MAX) {
+                pathBufferTruncate(&path, parentLength);
+            }
+        }
+        freeDirectoryListing(&listing);
+        closeDirectory(&handle, estimate->nodes[i].path);
+    }
+    pathBufferFree(&path);
+    return ok;
+}
+
+// One probe below a sampled directory, given the directory's own listing. Adds its
+// estimate of the directories in the subtree to directories and the listings it read to
+// listings. path holds the directory's path and is restored before returning.
+double probeEstimateSubtree(Estimate *estimate, DirHandle *start, const DirListing *startListing, PathBuffer *path, double *directories, unsigned long long *listings) {
+    size_t startLength = path->length;
+    double total = (double)startListing->fileBytes;
+    double weight = (double)startListing->subdirs.count;
+    *directories += 1;
+    const NameList *subdirs = &startListing->subdirs;
+    DirHandle current = *start;
+    DirListing listing;
+    bool haveListing = false;
+
+    while (subdirs->count > 0) {
+        const char *name = subdirs->names[xorshiftRandom(&estimate->random) % subdirs->count];
+        DirHandle child;
+        bool opened = pathBufferAppend(path, name, true) != SIZE_MAX &&
+                      openEstimateDirectory(estimate, current.fd, name, false, &child);
+        if (haveListing) {
+            freeDirectoryListing(&listing);
+            closeDirectory(&current, path->data);
+            haveListing = false;
+        }
+        if (!opened) {
+            // Counts as empty, as an unreadable directory does in a scan.
+            break;
+        }
+        current = child;
+        listEstimateDirectory(estimate, &current, path->data, &listing);
+        haveListing = true;
+        *directories += weight;
+        (*listings)++;
+        total += weight * (double)listing.fileBytes;
+        weight *= (double)listing.subdirs.count;
+        subdirs = &listing.subdirs;
+    }
+    if (haveListing) {
+        freeDirectoryListing(&listing);
+        closeDirectory(&current, path->data);
+    }
+    pathBufferTruncate(path, startLength);
+    return total;
+}
+
+// Adds probes more probes to a sampled directory. One without subdirectories is sized
+// exactly by its own listing.
+void sampleEstimateNode(Estimate *estimate, EstimateNode *node, unsigned long long probes) {
+    DirHandle handle;
+    if (!openEstimateDirectory(estimate, AT_FDCWD, node->path, false, &handle)) {
+        if (errno != 0) {
+            fprintf(stderr, "Failed to open directory '%s': %s\n", node->path, strerror(errno));
+        }
+        node->exact = true;
+        node->mean = 0;
+        return;
+    }
+    PathBuffer path = {0};
+    DirListing listing;
+    listEstimateDirectory(estimate, &handle, node->path, &listing);
+    if (listing.subdirs.count == 0) {
+        node->exact = true;
+        node->mean = (double)listing.fileBytes;
+    } else if (pathBufferAppend(&path, node->path, false) != SIZE_MAX) {
+        double directories = node->directories * (double)node->probes;
+        for (unsigned long long i = 0; i < probes; i++) {
+            double sample = probeEstimateSubtree(estimate, &handle, &listing, &path, &directories, &node->listings);
+            node->probes++;
+            double delta = sample - node->mean;
+            node->mean += delta / (double)node->probes;
+            node->m2 += delta * (sample - node->mean);
+        }
+        node->directories = directories / (double)node->probes;
+    }
+    pathBufferFree(&path);
+    freeDirectoryListing(&listing);
+    closeDirectory(&handle, node->path);
+}
+
+// Sizes a sampled directory exactly with the scan's own walk.
+void settleEstimateNode(Estimate *estimate, EstimateNode *node) {
+    DirWalk walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.excludes = estimate->excludes;
+    ResultEntry summary = {0};
+    walk.handles = malloc(64 * sizeof(DirHandle));
+    if (walk.handles != NULL && pathBufferAppend(&walk.path, node->path, false) != SIZE_MAX &&
+        openEstimateDirectory(estimate, AT_FDCWD, node->path, false, &walk.handles[0])) {
+        walk.handleCapacity = 64;
+        walk.openCount = 1;
+        walk.rootLength = estimate->rootLength;
+        walk.boundary = estimate->boundary;
+        walkDirectory(&walk, 0, 0, NO_CACHED_RECORD, &summary);
+        closeDirectory(&walk.handles[0], node->path);
+    }
+    free(walk.handles);
+    pathBufferFree(&walk.path);
+    node->exact = true;
+    node->mean = (double)summary.size;
+    node->m2 = 0;
+}
+
+// Rolls the sampled totals up into every listed directory. Children always come after
+// their parent in the node array.
+void sumEstimate(Estimate *estimate) {
+    for (size_t i = 0; i < estimate->count; i++) {
+        EstimateNode *node = &estimate->nodes[i];
+        node->bytes = node->sampled ? node->mean : (double)node->fileBytes;
+        node->variance = node->sampled && !node->exact && node->probes > 1 ? node->m2 / (double)(node->probes - 1) / (double)node->probes : 0;
+    }
+    for (size_t i = estimate->count; i-- > 1;) {
+        EstimateNode *parent = &estimate->nodes[estimate->nodes[i].parent];
+        parent->bytes += estimate->nodes[i].bytes;
+        parent->variance += estimate->nodes[i].variance;
+    }
+}
+
+void printEstimateLine(const EstimateNode *node) {
+    double standardError = sqrt(node->variance);
+    if (standardError < 0.5) {
+        printLine(node->path, (unsigned long long)llround(node->bytes));
+    } else {
+        printf("%s - about %llu bytes, standard error %llu (%.1f%%)\n", node->path, (unsigned long long)llround(node->bytes),
+               (unsigned long long)llround(standardError), node->bytes > 0 ? 100.0 * standardError / node->bytes : 100.0);
+    }
+}
+
+int compareEstimateNodesBySize(const void *a, const void *b) {
+    const EstimateNode *left = *(EstimateNode *const *)a;
+    const EstimateNode *right = *(EstimateNode *const *)b;
+    return left->bytes < right->bytes ? 1 : left->bytes > right->bytes ? -1 : 0;
+}
+
+int compareEstimateNodesByVariance(const void *a, const void *b) {
+    const EstimateNode *left = *(EstimateNode *const *)a;
+    const EstimateNode *right = *(EstimateNode *const *)b;
+    return left->variance < right->variance ? 1 : left->variance > right->variance ? -1 : 0;
+}
+
+// Prints the largest directories directly below the start, then the start's total.
+void printEstimate(Estimate *estimate, int round, double seconds) {
+    EstimateNode **children = malloc(estimate->count * sizeof(EstimateNode *));
+    size_t childCount = 0;
+    size_t pending = 0;
+    unsigned long long probes = 0;
+    for (size_t i = 1; i < estimate->count; i++) {
+        if (children != NULL && estimate->nodes[i].parent == 0) {
+            children[childCount++] = &estimate->nodes[i];
+        }
+        pending += estimate->nodes[i].sampled && !estimate->nodes[i].exact;
+        probes += estimate->nodes[i].probes;
+    }
+    printf("\nEstimate after round %d (%.1f s, %llu probes, %zu subtrees still estimated):\n", round, seconds, probes, pending);
+    if (children != NULL) {
+        qsort(children, childCount, sizeof(EstimateNode *), compareEstimateNodesBySize);
+        for (size_t i = 0; i < childCount && i < LINES_PER_PAGE; i++) {
+            printEstimateLine(children[i]);
+        }
+        if (childCount > LINES_PER_PAGE) {
+            printf("... and %zu more directories\n", childCount - LINES_PER_PAGE);
+        }
+    }
+    printf("Total: ");
+    printEstimateLine(&estimate->nodes[0]);
+    free(children);
+}
+
+// Doubles the probes of every subtree still estimated, then scans exactly the least
+// certain ones until half of the remaining variance is gone. Subtrees whose probes have
+// already listed as many directories as they are estimated to hold are scanned instead of
+// sampled. Returns how many subtrees are still estimated.
+size_t refineEstimate(Estimate *estimate) {
+    EstimateNode **pending = malloc(estimate->count * sizeof(EstimateNode *));
+    if (pending == NULL) {
+        fprintf(stderr, "Error: out of memory while estimating\n");
+        return 0;
+    }
+    size_t pendingCount = 0;
+    double variance = 0;
+    for (size_t i = 0; i < estimate->count; i++) {
+        EstimateNode *node = &estimate->nodes[i];
+        if (node->sampled && !node->exact && (double)node->listings >= node->directories) {
+            settleEstimateNode(estimate, node);
+        } else if (node->sampled && !node->exact) {
+            sampleEstimateNode(estimate, node, MAX(node->probes, 1));
+        }
+    }
+    sumEstimate(estimate);
+    for (size_t i = 0; i < estimate->count; i++) {
+        if (estimate->nodes[i].sampled && !estimate->nodes[i].exact) {
+            pending[pendingCount++] = &estimate->nodes[i];
+            variance += estimate->nodes[i].variance;
+        }
+    }
+
+    qsort(pending, pendingCount, sizeof(EstimateNode *), compareEstimateNodesByVariance);
+    double settled = 0;
+    size_t settledCount = 0;
+    while (settledCount < pendingCount && (settledCount == 0 || settled < variance / 2)) {
+        settled += pending[settledCount]->variance;
+        settleEstimateNode(estimate, pending[settledCount]);
+        settledCount++;
+    }
+    free(pending);
+    sumEstimate(estimate);
+    return pendingCount - settledCount;
+}
+
+// Estimates the size of basePath, then refines the estimate for as long as the user asks.
+bool reportEstimate(const char *basePath) {
+    Estimate estimate;
+    memset(&estimate, 0, sizeof(estimate));
+    estimate.random = (uint64_t)monotonicMilliseconds() * 0x9e3779b97f4a7c15ULL ^ (uint64_t)getpid();
+    estimate.random = estimate.random != 0 ? estimate.random : 1;
+    estimate.excludes = excludeRules.count > 0 ? &excludeRules : NULL;
+    estimate.rootLength = strlen(basePath);
+    struct stat rootStat;
+    if (stat(basePath, &rootStat) != 0 || !addEstimateNode(&estimate, SIZE_MAX, basePath, 0)) {
+        fprintf(stderr, "Failed to open directory '%s': %s\n", basePath, strerror(errno));
+        free(estimate.nodes);
+        return false;
+    }
+    scanBoundaryInit(&estimate.boundary, basePath, rootStat.st_dev);
+
+    double phaseStarted = statsPhaseStart();
+    double started = monotonicSeconds();
+    bool ok = enumerateEstimateLevels(&estimate, scanOptions.estimateDepth);
+    size_t pending = 0;
+    for (size_t i = 0; ok && i < estimate.count; i++) {
+        if (estimate.nodes[i].sampled) {
+            sampleEstimateNode(&estimate, &estimate.nodes[i], scanOptions.estimateProbes);
+            pending += !estimate.nodes[i].exact;
+        }
+    }
+    sumEstimate(&estimate);
+    statsPhaseEnd(STATS_PHASE_ESTIMATE, phaseStarted);
+    if (ok) {
+        printEstimate(&estimate, 1, monotonicSeconds() - started);
+    }
+
+    for (int round = 2; ok && pending > 0 && askYesNoQuestion("Refine the estimate?"); round++) {
+        phaseStarted = statsPhaseStart();
+        started = monotonicSeconds();
+        pending = refineEstimate(&estimate);
+        statsPhaseEnd(STATS_PHASE_ESTIMATE, phaseStarted);
+        printEstimate(&estimate, round, monotonicSeconds() - started);
+    }
+    if (ok && pending == 0) {
+        printf("Every directory has been sized exactly.\n");
+    }
+
+    for (size_t i = 0; i < estimate.count; i++) {
+        free(estimate.nodes[i].path);
+    }
+    free(estimate.nodes);
+    scanBoundaryFree(&estimate.boundary);
+    return ok;
+}
+
+// XXH64, for telling file contents apart quickly. Not cryptographic.
+#define XXH_PRIME1 11400714785074694791ULL
+#define XXH_PRIME2 14029467366897019727ULL
+#define XXH_PRIME3 1609587929392839161ULL
+#define XXH_PRIME4 9650029242287828579ULL
+#define XXH_PRIME5 2870177450012600261ULL
+
+uint64_t rotateLeft64(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+uint64_t xxh64Round(uint64_t accumulator, uint64_t input) {
+    accumulator += input * XXH_PRIME2;
+    return rotateLeft64(accumulator, 31) * XXH_PRIME1;
+}
+
+uint64_t xxh64Merge(uint64_t hash, uint64_t accumulator) {
+    hash ^= xxh64Round(0, accumulator);
+    return hash * XXH_PRIME1 + XXH_PRIME4;
+}
+
+uint64_t xxh64(const void *data, size_t length, uint64_t seed) {
+    const unsigned char *cursor = data;
+    const unsigned char *end = cursor + length;
+    uint64_t hash;
+    if (length >= 32) {
+        uint64_t lanes[4] = { seed + XXH_PRIME1 + XXH_PRIME2, seed + XXH_PRIME2, seed, seed - XXH_PRIME1 };
+        for (; cursor + 32 <= end; cursor += 32) {
+            for (int lane = 0; lane < 4; lane++) {
+                uint64_t input;
+                memcpy(&input, cursor + 8 * lane, sizeof(input));
+                lanes[lane] = xxh64Round(lanes[lane], input);
+            }
+        }
+        hash = rotateLeft64(lanes[0], 1) + rotateLeft64(lanes[1], 7) + rotateLeft64(lanes[2], 12) + rotateLeft64(lanes[3], 18);
+        for (int lane = 0; lane < 4; lane++) {
+            hash = xxh64Merge(hash, lanes[lane]);
+        }
+    } else {
+        hash = seed + XXH_PRIME5;
+    }
+    hash += length;
+
+    for (; cursor + 8 <= end; cursor += 8) {
+        uint64_t input;
+        memcpy(&input, cursor, sizeof(input));
+        hash ^= xxh64Round(0, input);
+        hash = rotateLeft64(hash, 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (cursor + 4 <= end) {
+        uint32_t input;
+        memcpy(&input, cursor, sizeof(input));
+        hash ^= input * XXH_PRIME1;
+        hash = rotateLeft64(hash, 23) * XXH_PRIME2 + XXH_PRIME3;
+        cursor += 4;
+    }
+    for (; cursor < end; cursor++) {
+        hash ^= *cursor * XXH_PRIME5;
+        hash = rotateLeft64(hash, 11) * XXH_PRIME1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// Reads up to length bytes at offset, stopping early only at the end of the file.
+ssize_t preadFully(int fd, unsigned char *buffer, size_t length, off_t offset) {
+    size_t total = 0;
+    while (total < length) {
+        ssize_t bytes = pread(fd, buffer + total, length - total, offset + (off_t)total);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 0) {
+            return -1;
+        }
+        if (bytes == 0) {
+            break;
+        }
+        total += (size_t)bytes;
+    }
+    return (ssize_t)total;
+}
+
+// Hashes the first and last DUPLICATE_EDGE_BYTES of a file, which covers all of a file of
+// up to twice that, or with full set the whole file in DUPLICATE_READ_SIZE sequential
+// reads. Returns false if the file cannot be read or is no longer what the scan saw.
+bool hashDuplicateFile(DuplicateFile *file, bool full, unsigned char *buffer) {
+    int fd = open(file->pathText, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) != 0 || !S_ISREG(statbuf.st_mode) || (unsigned long long)statbuf.st_size != file->size ||
+        (uint64_t)statbuf.st_ino != file->inode || (uint64_t)statbuf.st_dev != file->device) {
+        close(fd);
+        return false;
+    }
+
+    uint64_t hash = file->size;
+    bool ok = true;
+    if (!full) {
+        size_t head = (size_t)MIN(file->size, DUPLICATE_EDGE_BYTES);
+        ok = preadFully(fd, buffer, head, 0) == (ssize_t)head;
+        hash = xxh64(buffer, head, hash);
+        if (ok && file->size > DUPLICATE_EDGE_BYTES) {
+            size_t tail = (size_t)MIN(file->size - DUPLICATE_EDGE_BYTES, DUPLICATE_EDGE_BYTES);
+            ok = preadFully(fd, buffer, tail, (off_t)(file->size - tail)) == (ssize_t)tail;
+            hash = xxh64(buffer, tail, hash);
+        }
+        file->partialHash = hash;
+        if (file->size <= 2 * DUPLICATE_EDGE_BYTES) {
+            file->fullHash = hash;
+        }
+    } else {
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        unsigned long long total = 0;
+        while (ok) {
+            ssize_t bytes = preadFully(fd, buffer, DUPLICATE_READ_SIZE, (off_t)total);
+            ok = bytes >= 0;
+            if (bytes <= 0) {
+                break;
+            }
+            hash = xxh64(buffer, (size_t)bytes, hash);
+            total += (unsigned long long)bytes;
+            if ((size_t)bytes < DUPLICATE_READ_SIZE) {
+                break;
+            }
+        }
+        ok = ok && total == file->size;
+        file->fullHash = hash;
+    }
+    close(fd);
+    return ok;
+}
+
+// One hashing pass over files, shared out between threads one file at a time.
+typedef struct HashPass {
+    DuplicateFile *files;
+    size_t count;
+    bool full;
+    atomic_size_t next;
+} HashPass;
+
+void *hashPassWorker(void *argument) {
+    HashPass *pass = argument;
+    unsigned char *buffer = malloc(pass->full ? DUPLICATE_READ_SIZE : DUPLICATE_EDGE_BYTES);
+    size_t i;
+    while ((i = atomic_fetch_add(&pass->next, 1)) < pass->count) {
+        DuplicateFile *file = &pass->files[i];
+        if (pass->full && file->size <= 2 * DUPLICATE_EDGE_BYTES) {
+            continue;
+        }
+        if (buffer == NULL || !hashDuplicateFile(file, pass->full, buffer)) {
+            file->unreadable = true;
+        }
+    }
+    free(buffer);
+    releaseThreadStats();
+    return NULL;
+}
+
+// Uses the --threads workers, or one per CPU when the scan itself is single-threaded.
+void runHashPass(DuplicateFile *files, size_t count, bool full) {
+    HashPass pass = { .files = files, .count = count, .full = full };
+    atomic_init(&pass.next, 0);
+    long threads = scanOptions.threads > 1 ? scanOptions.threads : sysconf(_SC_NPROCESSORS_ONLN);
+    threads = MAX(1, MIN(MIN(threads, MAX_SCAN_THREADS), (long)count));
+
+    pthread_t workers[MAX_SCAN_THREADS];
+    long started = 0;
+    while (started < threads - 1 && pthread_create(&workers[started], NULL, hashPassWorker, &pass) == 0) {
+        started++;
+    }
+    hashPassWorker(&pass);
+    for (long i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+}
+
+// Largest first, then by the key each stage groups on.
+int compareDuplicatesByInode(const void *a, const void *b) {
+    const DuplicateFile *left = a;
+    const DuplicateFile *right = b;
+    if (left->size != right->size) {
+        return left->size > right->size ? -1 : 1;
+    }
+    if (left->device != right->device) {
+        return left->device < right->device ? -1 : 1;
+    }
+    if (left->inode != right->inode) {
+        return left->inode < right->inode ? -1 : 1;
+    }
+    return strcmp(left->pathText, right->pathText);
+}
+
+int compareDuplicatesByPartialHash(const void *a, const void *b) {
+    const DuplicateFile *left = a;
+    const DuplicateFile *right = b;
+    if (left->size != right->size) {
+        return left->size > right->size ? -1 : 1;
+    }
+    return left->partialHash < right->partialHash ? -1 : left->partialHash > right->partialHash;
+}
+
+int compareDuplicatesByFullHash(const void *a, const void *b) {
+    const DuplicateFile *left = a;
+    const DuplicateFile *right = b;
+    if (left->size != right->size) {
+        return left->size > right->size ? -1 : 1;
+    }
+    if (left->fullHash != right->fullHash) {
+        return left->fullHash < right->fullHash ? -1 : 1;
+    }
+    return strcmp(left->pathText, right->pathText);
+}
+
+// Sorts files and keeps only those that share their size and the stage's hash with at
+// least one other readable file; returns how many are left at the front of the array.
+size_t keepDuplicateCandidates(DuplicateFile *files, size_t count, int (*compare)(const void *, const void *), bool full) {
+    size_t readable = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!files[i].unreadable) {
+            files[readable++] = files[i];
+        }
+    }
+    if (readable == 0) {
+        return 0;
+    }
+    qsort(files, readable, sizeof(DuplicateFile), compare);
+
+    size_t kept = 0;
+    for (size_t i = 0; i < readable;) {
+        size_t end = i + 1;
+        uint64_t hash = full ? files[i].fullHash : files[i].partialHash;
+        while (end < readable && files[end].size == files[i].size && (full ? files[end].fullHash : files[end].partialHash) == hash) {
+            end++;
+        }
+        if (end - i >= 2) {
+            memmove(&files[kept], &files[i], (end - i) * sizeof(DuplicateFile));
+            kept += end - i;
+        }
+        i = end;
+    }
+    return kept;
+}
+
+typedef struct DuplicateGroup {
+    size_t first;
+    size_t count;
+    unsigned long long reclaimable;
+} DuplicateGroup;
+
+int compareDuplicateGroups(const void *a, const void *b) {
+    const DuplicateGroup *left = a;
+    const DuplicateGroup *right = b;
+    if (left->reclaimable != right->reclaimable) {
+        return left->reclaimable > right->reclaimable ? -1 : 1;
+    }
+    return left->first < right->first ? -1 : left->first > right->first;
+}
+
+// Scans basePath collecting every non-empty file, then narrows them down in stages: files
+// whose size no other file has are dropped, then hard links of the same inode are merged,
+// then files whose first and last DUPLICATE_EDGE_BYTES differ from the rest, and only the
+// survivors are read in full. Prints each group of identical files, most reclaimable
+// space first. Nothing is written to disk.
+bool reportDuplicateFiles(const char *basePath, ScanProgress *progress) {
+    DuplicateFinder finder;
+    duplicateFinderInit(&finder);
+    ResultSink sink;
+    resultSinkInit(&sink, NULL, RESULT_FORMAT_DUPLICATES);
+    sink.duplicates = &finder;
+    bool scanned = scanIntoSink(basePath, 0, &sink, NULL, progress);
+    resultSinkFree(&sink);
+    if (progress != NULL) {
+        updateScanProgress(progress, true);
+    }
+    if (!scanned || finder.failed) {
+        if (finder.failed) {
+            fprintf(stderr, "Error: out of memory while collecting files\n");
+        }
+        duplicateFinderFree(&finder);
+        return false;
+    }
+
+    DuplicateFile *files = finder.files;
+    size_t scannedFiles = finder.count;
+    for (size_t i = 0; i < finder.count; i++) {
+        files[i].pathText = finder.paths + files[i].path;
+    }
+
+    // Same size, with each inode once under its first path.
+    qsort(files, finder.count, sizeof(DuplicateFile), compareDuplicatesByInode);
+    size_t count = 0;
+    unsigned long long hardLinks = 0;
+    for (size_t i = 0; i < finder.count;) {
+        size_t end = i;
+        size_t groupStart = count;
+        while (end < finder.count && files[end].size == files[i].size) {
+            if (end > i && files[end].device == files[end - 1].device && files[end].inode == files[end - 1].inode) {
+                hardLinks++;
+            } else {
+                files[count++] = files[end];
+            }
+            end++;
+        }
+        if (count - groupStart < 2) {
+            count = groupStart;
+        }
+        i = end;
+    }
+    size_t sameSize = count;
+
+    runHashPass(files, count, false);
+    count = keepDuplicateCandidates(files, count, compareDuplicatesByPartialHash, false);
+    size_t samePartialHash = count;
+    runHashPass(files, count, true);
+    count = keepDuplicateCandidates(files, count, compareDuplicatesByFullHash, true);
+
+    size_t groupCount = 0;
+    DuplicateGroup *groups = malloc(MAX(count / 2, 1) * sizeof(DuplicateGroup));
+    if (groups == NULL) {
+        fprintf(stderr, "Error: out of memory while grouping duplicates\n");
+        duplicateFinderFree(&finder);
+        return false;
+    }
+    unsigned long long reclaimable = 0;
+    for (size_t i = 0; i < count;) {
+        size_t end = i + 1;
+        while (end < count && files[end].size == files[i].size && files[end].fullHash == files[i].fullHash) {
+            end++;
+        }
+        groups[groupCount++] = (DuplicateGroup){ i, end - i, files[i].size * (end - i - 1) };
+        reclaimable += files[i].size * (end - i - 1);
+        i = end;
+    }
+    qsort(groups, groupCount, sizeof(DuplicateGroup), compareDuplicateGroups);
+
+    printf("\n\nDuplicate files, most reclaimable space first:\n");
+    for (size_t g = 0; g < groupCount; g++) {
+        const DuplicateGroup *group = &groups[g];
+        printf("%zu copies of %llu bytes (%llu bytes reclaimable):\n", group->count, files[group->first].size, group->reclaimable);
+        for (size_t i = group->first; i < group->first + group->count; i++) {
+            printf("    %s\n", files[i].pathText);
+        }
+    }
+    printf("%zu files scanned, %zu share a size, %zu share their first and last %d bytes, %zu are duplicates "
+           "(%llu hard links skipped)\n", scannedFiles, sameSize, samePartialHash, DUPLICATE_EDGE_BYTES, count, hardLinks);
+    printf("%zu duplicate groups, %llu bytes reclaimable\n", groupCount, reclaimable);
+
+    free(groups);
+    duplicateFinderFree(&finder);
+    return true;
+}
+
+// Sequential access to a result file in either format. Text lines are parsed as they are
+// read; snapshot records are read from the mapping and their paths rebuilt from parent
+// links, reusing the ancestors already on the path stack.
+typedef struct ResultReader {
+    bool isSnapshot;
+    bool atEnd;
+    Snapshot snapshot;
+    uint64_t nextRecord;
+    uint32_t *stackRecords;
+    size_t *stackLengths;
+    size_t stackCapacity;
+    PathBuffer name;
+    PathBuffer path;
+    FILE *file;
+    char *line;
+    size_t lineCapacity;
+} ResultReader;
+
+bool openResultReader(ResultReader *reader, const char *filePath) {
+    memset(reader, 0, sizeof(*reader));
+    if (openSnapshot(&reader->snapshot, filePath)) {
+        reader->isSnapshot = true;
+        // Record 0 is the scanned directory itself, which the text format never lists.
+        reader->nextRecord = 1;
+        return true;
+    }
+
+    reader->file = fopen(filePath, "r");
+    return reader->file != NULL;
+}
+
+void closeResultReader(ResultReader *reader) {
+    if (reader->isSnapshot) {
+        closeSnapshot(&reader->snapshot);
+    }
+    if (reader->file != NULL) {
+        fclose(reader->file);
+    }
+    free(reader->stackRecords);
+    free(reader->stackLengths);
+    free(reader->line);
+    pathBufferFree(&reader->name);
+    pathBufferFree(&reader->path);
+    memset(reader, 0, sizeof(*reader));
+}
+
+bool buildSnapshotPath(ResultReader *reader, uint32_t index) {
+    const SnapshotRecord *record = &reader->snapshot.records[index];
+    size_t depth = record->depth;
+    if (depth + 1 > reader->stackCapacity) {
+        size_t newCapacity = reader->stackCapacity ? reader->stackCapacity * 2 : 64;
+        while (newCapacity < depth + 1) {
+            newCapacity *= 2;
+        }
+        uint32_t *stackRecords = realloc(reader->stackRecords, newCapacity * sizeof(uint32_t));
+        if (stackRecords == NULL) {
+            return false;
+        }
+        reader->stackRecords = stackRecords;
+        size_t *stackLengths = realloc(reader->stackLengths, newCapacity * sizeof(size_t));
+        if (stackLengths == NULL) {
+            return false;
+        }
+        reader->stackLengths = stackLengths;
+        for (size_t i = reader->stackCapacity; i < newCapacity; i++) {
+            reader->stackRecords[i] = SNAPSHOT_NO_PARENT;
+        }
+        reader->stackCapacity = newCapacity;
+    }
+
+    reader->name.length = 0;
+    if (!decodeSnapshotName(&reader->snapshot, index, &reader->name)) {
+        return false;
+    }
+
+    if (depth == 0) {
+        reader->path.length = 0;
+        if (pathBufferAppend(&reader->path, reader->name.data, false) == SIZE_MAX) {
+            return false;
+        }
+    } else {
+        // Parents always precede their children, which also rules out cycles.
+        if (record->parent >= index || reader->snapshot.records[record->parent].depth + 1 != depth) {
+            return false;
+        }
+        if (reader->stackRecords[depth - 1] != record->parent) {
+            char *name = strdup(reader->name.data);
+            bool built = name != NULL && buildSnapshotPath(reader, record->parent);
+            if (built) {
+                reader->name.length = 0;
+                built = pathBufferAppend(&reader->name, name, false) != SIZE_MAX;
+            }
+            free(name);
+            if (!built) {
+                return false;
+            }
+        }
+        pathBufferTruncate(&reader->path, reader->stackLengths[depth - 1]);
+        if (pathBufferAppend(&reader->path, reader->name.data, true) == SIZE_MAX) {
+            return false;
+        }
+    }
+
+    reader->stackRecords[depth] = index;
+    reader->stackLengths[depth] = reader->path.length;
+    for (size_t i = depth + 1; i < reader->stackCapacity && reader->stackRecords[i] != SNAPSHOT_NO_PARENT; i++) {
+        reader->stackRecords[i] = SNAPSHOT_NO_PARENT;
+    }
+    return true;
+}
+
+// Parses "<path> - <size> bytes". The last " - " separates the size, so paths containing
+// spaces or dashes survive the round trip.
+bool parseResultLine(char *line, ResultEntry *entry) {
+    line[strcspn(line, "\n")] = '\0';
+
+    char *separator = NULL;
+    for (char *candidate = strstr(line, " - "); candidate != NULL; candidate = strstr(candidate + 1, " - ")) {
+        separator = candidate;
+    }
+    if (separator == NULL) {
+        return false;
+    }
+
+    char *end;
+    unsigned long long size = strtoull(separator + 3, &end, 10);
+    if (end == separator + 3) {
+        return false;
+    }
+
+    *separator = '\0';
+    memset(entry, 0, sizeof(*entry));
+    entry->path = line;
+    const char *lastSeparator = strrchr(line, PATH_SEPARATOR[0]);
+    entry->nameOffset = lastSeparator != NULL ? (size_t)(lastSeparator - line) + 1 : 0;
+    entry->size = size;
+    return true;
+}
+
+// Fills entry with the next result; entry->path stays valid until the next call.
+bool readNextResult(ResultReader *reader, ResultEntry *entry) {
+    if (reader->isSnapshot) {
+        if (reader->nextRecord >= reader->snapshot.header->recordCount) {
+            reader->atEnd = true;
+            return false;
+        }
+
+        uint32_t index = (uint32_t)reader->nextRecord++;
+        if (!buildSnapshotPath(reader, index)) {
+            fprintf(stderr, "Error: snapshot record %u is corrupt\n", index);
+            reader->atEnd = true;
+            return false;
+        }
+
+        const SnapshotRecord *record = &reader->snapshot.records[index];
+        memset(entry, 0, sizeof(*entry));
+        entry->path = reader->path.data;
+        entry->nameOffset = reader->path.length - strlen(reader->name.data);
+        entry->level = record->depth;
+        entry->size = record->size;
+        entry->entryCount = record->entryCount;
+        entry->stamp.mtime = record->mtime;
+        entry->stamp.ctime = record->ctime;
+        entry->stamp.device = record->device;
+        entry->stamp.inode = record->inode;
+        entry->stamp.mtimeNsec = record->mtimeNsec;
+        entry->stamp.ctimeNsec = record->ctimeNsec;
+        return true;
+    }
+
+    while (getline(&reader->line, &reader->lineCapacity, reader->file) != -1) {
+        if (parseResultLine(reader->line, entry)) {
+            return true;
+        }
+    }
+    reader->atEnd = true;
+    return false;
+}
+
+// Positions are byte offsets for text files and record numbers for snapshots; 0 is always
+// the first result.
+long long resultReaderTell(ResultReader *reader) {
+    return reader->isSnapshot ? (long long)reader->nextRecord - 1 : (long long)ftello(reader->file);
+}
+
+void resultReaderSeek(ResultReader *reader, long long position) {
+    reader->atEnd = false;
+    if (reader->isSnapshot) {
+        reader->nextRecord = (uint64_t)position + 1;
+    } else {
+        fseeko(reader->file, position, SEEK_SET);
+    }
+}
+
+// In-memory model of a result file: one DirTreeNode per result in pre-order, holding only
+// its own name, its parent and its totals. Names are interned in a bump-allocated arena,
+// so a name shared by many directories ("src", "node_modules") is stored once and the
+// common prefix of a path is its parent's; full paths are only built when printed. As in
+// the search index, a result whose parent is not in the file is named by its whole path.
+// The viewer's Largest command queries it. --diff and the sorted views stream through
+// ExternalSorter instead, since they must work on result files larger than memory.
+typedef struct DirTreeNode {
+    unsigned long long size;
+    unsigned long long entryCount;
+    uint32_t parent;
+    // Offset of the NUL-terminated name in DirTree.names.
+    uint32_t name;
+    // One past the last node below this one.
+    uint32_t subtreeEnd;
+    uint32_t depth;
+} DirTreeNode;
+
+typedef struct DirTree {
+    DirTreeNode *nodes;
+    size_t nodeCount;
+    size_t nodeCapacity;
+    char *names;
+    size_t namesSize;
+    size_t namesCapacity;
+    // Open-addressed table of name offsets + 1 (0 is an empty slot), only kept while the
+    // tree is being built.
+    uint32_t *internSlots;
+    size_t internCount;
+    size_t internCapacity;
+} DirTree;
+
+void freeDirTree(DirTree *tree) {
+    free(tree->nodes);
+    free(tree->names);
+    free(tree->internSlots);
+    memset(tree, 0, sizeof(*tree));
+}
+
+bool growInternTable(DirTree *tree) {
+    size_t newCapacity = tree->internCapacity ? tree->internCapacity * 2 : 4096;
+    uint32_t *slots = calloc(newCapacity, sizeof(uint32_t));
+    if (slots == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < tree->internCapacity; i++) {
+        uint32_t stored = tree->internSlots[i];
+        if (stored == 0) {
+            continue;
+        }
+        const char *name = tree->names + stored - 1;
+        size_t slot = hashName(name, strlen(name)) & (newCapacity - 1);
+        while (slots[slot] != 0) {
+            slot = (slot + 1) & (newCapacity - 1);
+        }
+        slots[slot] = stored;
+    }
+    free(tree->internSlots);
+    tree->internSlots = slots;
+    tree->internCapacity = newCapacity;
+    return true;
+}
+
+// Returns the arena offset of name, adding it if it is new, or UINT32_MAX.
+uint32_t dirTreeIntern(DirTree *tree, const char *name, size_t length) {
+    if ((tree->internCount + 1) * 10 > tree->internCapacity * 7 && !growInternTable(tree)) {
+        return UINT32_MAX;
+    }
+    size_t mask = tree->internCapacity - 1;
+    size_t slot = hashName(name, length) & mask;
+    for (; tree->internSlots[slot] != 0; slot = (slot + 1) & mask) {
+        const char *candidate = tree->names + tree->internSlots[slot] - 1;
+        if (strncmp(candidate, name, length) == 0 && candidate[length] == '\0') {
+            return tree->internSlots[slot] - 1;
+        }
+    }
+
+    if (tree->namesSize + length + 1 >= UINT32_MAX) {
+        return UINT32_MAX;
+    }
+    if (tree->namesSize + length + 1 > tree->namesCapacity) {
+        size_t newCapacity = tree->namesCapacity ? tree->namesCapacity * 2 : 65536;
+        while (newCapacity < tree->namesSize + length + 1) {
+            newCapacity *= 2;
+        }
+        char *names = realloc(tree->names, newCapacity);
+        if (names == NULL) {
+            return UINT32_MAX;
+        }
+        tree->names = names;
+        tree->namesCapacity = newCapacity;
+    }
+    uint32_t offset = (uint32_t)tree->namesSize;
+    memcpy(tree->names + offset, name, length);
+    tree->names[offset + length] = '\0';
+    tree->namesSize += length + 1;
+    tree->internSlots[slot] = offset + 1;
+    tree->internCount++;
+    return offset;
+}
+
+// Appends a node below parent (DIR_TREE_NO_PARENT for a top-level one) and returns its
+// index, or DIR_TREE_NO_PARENT. Nodes must be appended in pre-order.
+uint32_t dirTreeAppend(DirTree *tree, uint32_t parent, const char *name, size_t nameLength, unsigned long long size, unsigned long long entryCount) {
+    if (tree->nodeCount >= DIR_TREE_NO_PARENT) {
+        return DIR_TREE_NO_PARENT;
+    }
+    if (tree->nodeCount == tree->nodeCapacity) {
+        size_t newCapacity = tree->nodeCapacity ? tree->nodeCapacity * 2 : 4096;
+        DirTreeNode *nodes = realloc(tree->nodes, newCapacity * sizeof(DirTreeNode));
+        if (nodes == NULL) {
+            return DIR_TREE_NO_PARENT;
+        }
+        tree->nodes = nodes;
+        tree->nodeCapacity = newCapacity;
+    }
+    uint32_t nameOffset = dirTreeIntern(tree, name, nameLength);
+    if (nameOffset == UINT32_MAX) {
+        return DIR_TREE_NO_PARENT;
+    }
+
+    uint32_t index = (uint32_t)tree->nodeCount++;
+    tree->nodes[index] = (DirTreeNode){
+        .size = size,
+        .entryCount = entryCount,
+        .parent = parent,
+        .name = nameOffset,
+        .subtreeEnd = index + 1,
+        .depth = parent == DIR_TREE_NO_PARENT ? 0 : tree->nodes[parent].depth + 1
+    };
+    return index;
+}
+
+bool dirTreeBuildPath(const DirTree *tree, uint32_t index, PathBuffer *path) {
+    const DirTreeNode *node = &tree->nodes[index];
+    if (node->parent != DIR_TREE_NO_PARENT && !dirTreeBuildPath(tree, node->parent, path)) {
+        return false;
+    }
+    return pathBufferAppend(path, tree->names + node->name, node->parent != DIR_TREE_NO_PARENT) != SIZE_MAX;
+}
+
+// Reads every result of a text or snapshot result file into tree.
+bool loadDirTree(DirTree *tree, const char *resultsPath) {
+    memset(tree, 0, sizeof(*tree));
+    ResultReader reader;
+    if (!openResultReader(&reader, resultsPath)) {
+        perror("Error opening the results");
+        return false;
+    }
+
+    // Nodes still open above the current one, with the lengths of their paths, which are
+    // prefixes of the previous path.
+    uint32_t *open = NULL;
+    size_t *openLengths = NULL;
+    size_t openCount = 0;
+    size_t openCapacity = 0;
+    PathBuffer previous = {0};
+    bool ok = true;
+
+    ResultEntry entry;
+    while (ok && readNextResult(&reader, &entry)) {
+        size_t pathLength = strlen(entry.path);
+        while (openCount > 0) {
+            size_t parentLength = openLengths[openCount - 1];
+            if (pathLength > parentLength && strncmp(entry.path, previous.data, parentLength) == 0 &&
+                entry.path[parentLength] == PATH_SEPARATOR[0]) {
+                break;
+            }
+            tree->nodes[open[--openCount]].subtreeEnd = (uint32_t)tree->nodeCount;
+        }
+        uint32_t parent = openCount > 0 ? open[openCount - 1] : DIR_TREE_NO_PARENT;
+        size_t nameStart = openCount > 0 ? openLengths[openCount - 1] + 1 : 0;
+
+        if (openCount == openCapacity) {
+            openCapacity = openCapacity ? openCapacity * 2 : 64;
+            uint32_t *grownOpen = realloc(open, openCapacity * sizeof(uint32_t));
+            size_t *grownLengths = grownOpen != NULL ? realloc(openLengths, openCapacity * sizeof(size_t)) : NULL;
+            if (grownOpen != NULL) {
+                open = grownOpen;
+            }
+            if (grownLengths != NULL) {
+                openLengths = grownLengths;
+            }
+            ok = grownOpen != NULL && grownLengths != NULL;
+        }
+        uint32_t index = ok ? dirTreeAppend(tree, parent, entry.path + nameStart, pathLength - nameStart, entry.size, entry.entryCount)
+                            : DIR_TREE_NO_PARENT;
+        if (index == DIR_TREE_NO_PARENT) {
+            fprintf(stderr, "Error: out of memory while loading %s\n", resultsPath);
+            ok = false;
+            break;
+        }
+        open[openCount] = index;
+        openLengths[openCount++] = pathLength;
+        previous.length = 0;
+        ok = pathBufferAppend(&previous, entry.path, false) != SIZE_MAX;
+    }
+    while (openCount > 0) {
+        tree->nodes[open[--openCount]].subtreeEnd = (uint32_t)tree->nodeCount;
+    }
+
+    // The tree is read-only from here on, so the intern table is not needed any more.
+    free(tree->internSlots);
+    tree->internSlots = NULL;
+    tree->internCount = 0;
+    tree->internCapacity = 0;
+
+    free(open);
+    free(openLengths);
+    pathBufferFree(&previous);
+    closeResultReader(&reader);
+    if (!ok) {
+        freeDirTree(tree);
+    }
+    return ok;
+}
+
+// The tree of the last result file loaded, kept until that file changes so repeated
+// queries do not read it again.
+typedef struct LoadedDirTree {
+    DirTree tree;
+    char *path;
+    off_t size;
+    DirStamp stamp;
+    bool loaded;
+} LoadedDirTree;
+
+LoadedDirTree loadedDirTree;
+
+const DirTree *cachedDirTree(const char *resultsPath) {
+    struct stat resultsStat;
+    if (stat(resultsPath, &resultsStat) != 0) {
+        perror("Error opening the results");
+        return NULL;
+    }
+    DirStamp stamp = dirStampFromStat(&resultsStat);
+    if (loadedDirTree.loaded && strcmp(loadedDirTree.path, resultsPath) == 0 &&
+        loadedDirTree.size == resultsStat.st_size && loadedDirTree.stamp.inode == stamp.inode &&
+        loadedDirTree.stamp.mtime == stamp.mtime && loadedDirTree.stamp.mtimeNsec == stamp.mtimeNsec) {
+        return &loadedDirTree.tree;
+    }
+
+    if (loadedDirTree.loaded) {
+        freeDirTree(&loadedDirTree.tree);
+        free(loadedDirTree.path);
+        loadedDirTree.loaded = false;
+    }
+    loadedDirTree.path = strdup(resultsPath);
+    if (loadedDirTree.path == NULL || !loadDirTree(&loadedDirTree.tree, resultsPath)) {
+        free(loadedDirTree.path);
+        loadedDirTree.path = NULL;
+        return NULL;
+    }
+    loadedDirTree.size = resultsStat.st_size;
+    loadedDirTree.stamp = stamp;
+    loadedDirTree.loaded = true;
+
+    const DirTree *tree = &loadedDirTree.tree;
+    printf("Loaded %zu directories: %zu bytes of nodes and %zu bytes of names (%.1f bytes per directory)\n",
+           tree->nodeCount, tree->nodeCount * sizeof(DirTreeNode), tree->namesSize,
+           tree->nodeCount > 0 ? (double)(tree->nodeCount * sizeof(DirTreeNode) + tree->namesSize) / tree->nodeCount : 0);
+    return tree;
+}
+
+// Larger sizes rank first and equal sizes keep their order in the tree.
+bool dirTreeNodeBelow(const DirTree *tree, uint32_t a, uint32_t b) {
+    if (tree->nodes[a].size != tree->nodes[b].size) {
+        return tree->nodes[a].size < tree->nodes[b].size;
+    }
+    return a > b;
+}
+
+void dirTreeHeapSiftDown(const DirTree *tree, uint32_t *heap, size_t count, size_t index) {
+    while (true) {
+        size_t smallest = index;
+        size_t left = 2 * index + 1;
+        size_t right = left + 1;
+        if (left < count && dirTreeNodeBelow(tree, heap[left], heap[smallest])) {
+            smallest = left;
+        }
+        if (right < count && dirTreeNodeBelow(tree, heap[right], heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == index) {
+            return;
+        }
+        uint32_t swap = heap[index];
+        heap[index] = heap[smallest];
+        heap[smallest] = swap;
+        index = smallest;
+    }
+}
+
+// Fills largest with the indexes of the count largest nodes, largest first, and returns
+// how many there were.
+size_t dirTreeLargest(const DirTree *tree, uint32_t *largest, size_t count) {
+    size_t kept = 0;
+    for (size_t i = 0; i < tree->nodeCount && count > 0; i++) {
+        uint32_t index = (uint32_t)i;
+        if (kept < count) {
+            // Sift up.
+            size_t position = kept++;
+            largest[position] = index;
+            while (position > 0 && dirTreeNodeBelow(tree, largest[position], largest[(position - 1) / 2])) {
+                uint32_t swap = largest[position];
+                largest[position] = largest[(position - 1) / 2];
+                largest[(position - 1) / 2] = swap;
+                position = (position - 1) / 2;
+            }
+        } else if (dirTreeNodeBelow(tree, largest[0], index)) {
+            largest[0] = index;
+            dirTreeHeapSiftDown(tree, largest, kept, 0);
+        }
+    }
+    // Popping the minimum to the back leaves the array largest first.
+    for (size_t end = kept; end > 1; end--) {
+        uint32_t swap = largest[0];
+        largest[0] = largest[end - 1];
+        largest[end - 1] = swap;
+        dirTreeHeapSiftDown(tree, largest, end - 1, 0);
+    }
+    return kept;
+}
+
+void printLargestDirectories(const char *resultsPath, size_t count) {
+    const DirTree *tree = cachedDirTree(resultsPath);
+    if (tree == NULL) {
+        return;
+    }
+    uint32_t *largest = malloc(MAX(count, 1) * sizeof(uint32_t));
+    if (largest == NULL) {
+        fprintf(stderr, "Error: out of memory while ranking directories\n");
+        return;
+    }
+    size_t found = dirTreeLargest(tree, largest, count);
+    PathBuffer path = {0};
+    for (size_t i = 0; i < found; i++) {
+        path.length = 0;
+        if (!dirTreeBuildPath(tree, largest[i], &path)) {
+            break;
+        }
+        printLine(path.data, tree->nodes[largest[i]].size);
+    }
+    pathBufferFree(&path);
+    free(largest);
+}
+
+// Sorts variable-length records by key in bounded memory. Records collect in a buffer of
+// SORT_MEMORY_LIMIT bytes; each time it fills up it is sorted and written out as a run to a
+// temporary file, and the runs are merged back SORT_MERGE_FANIN at a time. Keys compare
+// as bytes, a shorter key first on a tie, so callers encode numbers big-endian. The sort is
+// not stable, since runs are sorted with qsort, so callers make every key unique, for
+// instance by ending it with the record's path.
+typedef struct SortRecordHeader {
+    uint32_t keyLength;
+    uint32_t payloadLength;
+} SortRecordHeader;
+
+typedef struct SortRun {
+    FILE *file;
+    // Header, key and payload of the run's current record.
+    char *record;
+    size_t capacity;
+} SortRun;
+
+typedef struct SortMerge {
+    SortRun *runs;
+    size_t runCount;
+    // Min-heap of the runs that still have a current record.
+    size_t *heap;
+    size_t heapCount;
+    // The run whose record was returned last; it moves on at the next call.
+    size_t lastRun;
+    bool failed;
+} SortMerge;
+
+typedef struct ExternalSorter {
+    char *buffer;
+    size_t used;
+    char **records;
+    size_t recordCount;
+    size_t recordCapacity;
+    FILE **runs;
+    size_t runCount;
+    size_t runCapacity;
+    bool failed;
+    // Reading back: from records when nothing was spilled, otherwise through merge.
+    size_t next;
+    SortMerge merge;
+} ExternalSorter;
+
+size_t sortRecordSize(const char *record) {
+    SortRecordHeader header;
+    memcpy(&header, record, sizeof(header));
+    return sizeof(header) + header.keyLength + header.payloadLength;
+}
+
+int compareSortKeys(const char *a, size_t aLength, const char *b, size_t bLength) {
+    int order = memcmp(a, b, MIN(aLength, bLength));
+    if (order != 0) {
+        return order;
+    }
+    return aLength < bLength ? -1 : aLength > bLength;
+}
+
+int compareSortRecords(const char *a, const char *b) {
+    SortRecordHeader aHeader;
+    SortRecordHeader bHeader;
+    memcpy(&aHeader, a, sizeof(aHeader));
+    memcpy(&bHeader, b, sizeof(bHeader));
+    return compareSortKeys(a + sizeof(aHeader), aHeader.keyLength, b + sizeof(bHeader), bHeader.keyLength);
+}
+
+int compareSortRecordPointers(const void *a, const void *b) {
+    return compareSortRecords(*(char *const *)a, *(char *const *)b);
+}
+
+bool readSortRun(SortRun *run) {
+    SortRecordHeader header;
+    if (fread(&header, sizeof(header), 1, run->file) != 1) {
+        return false;
+    }
+    size_t size = sizeof(header) + header.keyLength + header.payloadLength;
+    if (size > run->capacity) {
+        char *record = realloc(run->record, size);
+        if (record == NULL) {
+            return false;
+        }
+        run->record = record;
+        run->capacity = size;
+    }
+    memcpy(run->record, &header, sizeof(header));
+    return fread(run->record + sizeof(header), 1, size - sizeof(header), run->file) == size - sizeof(header);
+}
+
+bool sortMergeBelow(const SortMerge *merge, size_t a, size_t b) {
+    int order = compareSortRecords(merge->runs[a].record, merge->runs[b].record);
+    // Ties go to the earlier run so the heap order is fully defined.
+    return order < 0 || (order == 0 && a < b);
+}
+
+void sortMergeSiftDown(SortMerge *merge, size_t index) {
+    while (true) {
+        size_t smallest = index;
+        size_t left = 2 * index + 1;
+        size_t right = left + 1;
+        if (left < merge->heapCount && sortMergeBelow(merge, merge->heap[left], merge->heap[smallest])) {
+            smallest = left;
+        }
+        if (right < merge->heapCount && sortMergeBelow(merge, merge->heap[right], merge->heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == index) {
+            return;
+        }
+        size_t swap = merge->heap[index];
+        merge->heap[index] = merge->heap[smallest];
+        merge->heap[smallest] = swap;
+        index = smallest;
+    }
+}
+
+// Takes ownership of the run files.
+bool sortMergeStart(SortMerge *merge, FILE **files, size_t count) {
+    memset(merge, 0, sizeof(*merge));
+    merge->lastRun = SIZE_MAX;
+    merge->runs = calloc(MAX(count, 1), sizeof(SortRun));
+    merge->heap = calloc(MAX(count, 1), sizeof(size_t));
+    if (merge->runs == NULL || merge->heap == NULL) {
+        for (size_t i = 0; i < count; i++) {
+            fclose(files[i]);
+        }
+        merge->failed = true;
+        return false;
+    }
+    merge->runCount = count;
+    for (size_t i = 0; i < count; i++) {
+        merge->runs[i].file = files[i];
+        rewind(files[i]);
+        if (readSortRun(&merge->runs[i])) {
+            merge->heap[merge->heapCount++] = i;
+        } else if (ferror(files[i])) {
+            merge->failed = true;
+        }
+    }
+    for (size_t i = merge->heapCount / 2; i-- > 0;) {
+        sortMergeSiftDown(merge, i);
+    }
+    return !merge->failed;
+}
+
+// Returns the next record, valid until the next call, or NULL at the end.
+const char *sortMergeNext(SortMerge *merge) {
+    if (merge->lastRun != SIZE_MAX) {
+        SortRun *run = &merge->runs[merge->lastRun];
+        if (!readSortRun(run)) {
+            if (ferror(run->file)) {
+                merge->failed = true;
+            }
+            merge->heap[0] = merge->heap[--merge->heapCount];
+        }
+        sortMergeSiftDown(merge, 0);
+        merge->lastRun = SIZE_MAX;
+    }
+    if (merge->heapCount == 0 || merge->failed) {
+        return NULL;
+    }
+    merge->lastRun = merge->heap[0];
+    return merge->runs[merge->lastRun].record;
+}
+
+void sortMergeFree(SortMerge *merge) {
+    for (size_t i = 0; i < merge->runCount; i++) {
+        fclose(merge->runs[i].file);
+        free(merge->runs[i].record);
+    }
+    free(merge->runs);
+    free(merge->heap);
+    memset(merge, 0, sizeof(*merge));
+}
+
+bool externalSorterAddRun(ExternalSorter *sorter, FILE *run) {
+    if (sorter->runCount == sorter->runCapacity) {
+        size_t newCapacity = sorter->runCapacity ? sorter->runCapacity * 2 : 16;
+        FILE **runs = realloc(sorter->runs, newCapacity * sizeof(FILE *));
+        if (runs == NULL) {
+            return false;
+        }
+        sorter->runs = runs;
+        sorter->runCapacity = newCapacity;
+    }
+    sorter->runs[sorter->runCount++] = run;
+    return true;
+}
+
+// A contiguous slice of the buffered records, sorted and written out as one run.
+typedef struct SortSlice {
+    char **records;
+    size_t count;
+    FILE *run;
+    int error;
+} SortSlice;
+
+void *sortSliceWorker(void *argument) {
+    SortSlice *slice = argument;
+    qsort(slice->records, slice->count, sizeof(char *), compareSortRecordPointers);
+    slice->run = tmpfile();
+    bool written = slice->run != NULL;
+    for (size_t i = 0; written && i < slice->count; i++) {
+        size_t size = sortRecordSize(slice->records[i]);
+        written = fwrite(slice->records[i], 1, size, slice->run) == size;
+    }
+    written = written && fflush(slice->run) != EOF;
+    slice->error = written ? 0 : errno != 0 ? errno : EIO;
+    return NULL;
+}
+
+// Writes the buffered records out as sorted runs. A full buffer is cut into one slice per
+// thread, --threads or one per CPU as for hashing, and the slices are sorted and written
+// at the same time as runs of their own.
+bool externalSorterSpill(ExternalSorter *sorter) {
+    long threads = scanOptions.threads > 1 ? scanOptions.threads : sysconf(_SC_NPROCESSORS_ONLN);
+    size_t sliceCount = (size_t)MAX(1, MIN(MIN(threads, MAX_SCAN_THREADS), (long)(sorter->recordCount / SORT_MIN_SLICE_RECORDS)));
+    SortSlice slices[MAX_SCAN_THREADS];
+    pthread_t workers[MAX_SCAN_THREADS];
+    bool started[MAX_SCAN_THREADS];
+    for (size_t i = 0; i < sliceCount; i++) {
+        size_t first = sorter->recordCount * i / sliceCount;
+        slices[i] = (SortSlice){ sorter->records + first, sorter->recordCount * (i + 1) / sliceCount - first, NULL, 0 };
+        started[i] = i > 0 && pthread_create(&workers[i], NULL, sortSliceWorker, &slices[i]) == 0;
+    }
+    for (size_t i = 0; i < sliceCount; i++) {
+        if (started[i]) {
+            pthread_join(workers[i], NULL);
+        } else {
+            sortSliceWorker(&slices[i]);
+        }
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < sliceCount; i++) {
+        if (ok && slices[i].error != 0) {
+            errno = slices[i].error;
+            perror("Error writing a temporary sort file");
+            ok = false;
+        }
+        if (slices[i].run != NULL && (!ok || !externalSorterAddRun(sorter, slices[i].run))) {
+            fclose(slices[i].run);
+            ok = false;
+        }
+    }
+    sorter->used = 0;
+    sorter->recordCount = 0;
+    return ok;
+}
+
+bool externalSorterAdd(ExternalSorter *sorter, const void *key, size_t keyLength, const void *payload, size_t payloadLength) {
+    if (sorter->failed) {
+        return false;
+    }
+    SortRecordHeader header = { (uint32_t)keyLength, (uint32_t)payloadLength };
+    size_t size = sizeof(header) + keyLength + payloadLength;
+    if (size > SORT_MEMORY_LIMIT / 2) {
+        fprintf(stderr, "Error: sort record of %zu bytes is too large\n", size);
+        sorter->failed = true;
+        return false;
+    }
+    if (sorter->buffer == NULL && (sorter->buffer = malloc(SORT_MEMORY_LIMIT)) == NULL) {
+        fprintf(stderr, "Error: out of memory while sorting\n");
+        sorter->failed = true;
+        return false;
+    }
+    // The record pointers count against the limit too.
+    size_t pointerBytes = (sorter->recordCount + 1) * sizeof(char *);
+    if (sorter->used + size + pointerBytes > SORT_MEMORY_LIMIT && !externalSorterSpill(sorter)) {
+        sorter->failed = true;
+        return false;
+    }
+    if (sorter->recordCount == sorter->recordCapacity) {
+        size_t newCapacity = sorter->recordCapacity ? sorter->recordCapacity * 2 : 4096;
+        char **records = realloc(sorter->records, newCapacity * sizeof(char *));
+        if (records == NULL) {
+            fprintf(stderr, "Error: out of memory while sorting\n");
+            sorter->failed = true;
+            return false;
+        }
+        sorter->records = records;
+        sorter->recordCapacity = newCapacity;
+    }
+
+    char *record = sorter->buffer + sorter->used;
+    memcpy(record, &header, sizeof(header));
+    memcpy(record + sizeof(header), key, keyLength);
+    memcpy(record + sizeof(header) + keyLength, payload, payloadLength);
+    sorter->records[sorter->recordCount++] = record;
+    sorter->used += size;
+    return true;
+}
+
+// Merges runs down to at most SORT_MERGE_FANIN and starts reading records back in order.
+bool externalSorterFinish(ExternalSorter *sorter) {
+    if (sorter->failed) {
+        return false;
+    }
+    if (sorter->runCount == 0) {
+        if (sorter->recordCount > 0) {
+            qsort(sorter->records, sorter->recordCount, sizeof(char *), compareSortRecordPointers);
+        }
+        return true;
+    }
+    if (sorter->recordCount > 0 && !externalSorterSpill(sorter)) {
+        sorter->failed = true;
+        return false;
+    }
+    free(sorter->buffer);
+    sorter->buffer = NULL;
+
+    while (sorter->runCount > SORT_MERGE_FANIN) {
+        size_t merged = 0;
+        for (size_t first = 0; first < sorter->runCount; first += SORT_MERGE_FANIN) {
+            size_t count = MIN(SORT_MERGE_FANIN, sorter->runCount - first);
+            FILE *output = tmpfile();
+            SortMerge merge;
+            bool ok = output != NULL && sortMergeStart(&merge, sorter->runs + first, count);
+            const char *record;
+            while (ok && (record = sortMergeNext(&merge)) != NULL) {
+                size_t size = sortRecordSize(record);
+                ok = fwrite(record, 1, size, output) == size;
+            }
+            ok = ok && !merge.failed && fflush(output) != EOF;
+            sortMergeFree(&merge);
+            if (!ok) {
+                perror("Error merging temporary sort files");
+                if (output != NULL) {
+                    fclose(output);
+                }
+                // Runs not merged yet are still open.
+                for (size_t i = first + count; i < sorter->runCount; i++) {
+                    fclose(sorter->runs[i]);
+                }
+                sorter->runCount = merged;
+                sorter->failed = true;
+                return false;
+            }
+            sorter->runs[merged++] = output;
+        }
+        sorter->runCount = merged;
+    }
+
+    bool started = sortMergeStart(&sorter->merge, sorter->runs, sorter->runCount);
+    // The merge owns the files now.
+    sorter->runCount = 0;
+    if (!started) {
+        sorter->failed = true;
+    }
+    return started;
+}
+
+bool externalSorterNext(ExternalSorter *sorter, const char **key, size_t *keyLength, const char **payload, size_t *payloadLength) {
+    const char *record;
+    if (sorter->merge.runs != NULL) {
+        record = sortMergeNext(&sorter->merge);
+        if (sorter->merge.failed) {
+            sorter->failed = true;
+        }
+    } else {
+        record = sorter->next < sorter->recordCount ? sorter->records[sorter->next++] : NULL;
+    }
+    if (record == NULL) {
+        return false;
+    }
+    SortRecordHeader header;
+    memcpy(&header, record, sizeof(header));
+    *key = record + sizeof(header);
+    *keyLength = header.keyLength;
+    *payload = record + sizeof(header) + header.keyLength;
+    *payloadLength = header.payloadLength;
+    return true;
+}
+
+void externalSorterFree(ExternalSorter *sorter) {
+    for (size_t i = 0; i < sorter->runCount; i++) {
+        fclose(sorter->runs[i]);
+    }
+    if (sorter->merge.runs != NULL) {
+        sortMergeFree(&sorter->merge);
+    }
+    free(sorter->runs);
+    free(sorter->records);
+    free(sorter->buffer);
+    memset(sorter, 0, sizeof(*sorter));
+}
+
+void encodeBigEndian64(unsigned char *bytes, uint64_t value) {
+    for (int i = 7; i >= 0; i--) {
+        bytes[i] = (unsigned char)value;
+        value >>= 8;
+    }
+}
+
+// Compares two scans: every result of each is sorted by path, the sorted streams are
+// merge-joined, and the directories added, removed or changed by at least threshold bytes
+// are sorted again by how much they changed. Both sorts are external, so memory does not
+// grow with the number of results.
+typedef struct DiffChange {
+    unsigned long long oldSize;
+    unsigned long long newSize;
+    unsigned char kind;
+} DiffChange;
+
+enum { DIFF_ADDED, DIFF_REMOVED, DIFF_CHANGED };
+
+// What a result file holds in all. Every size already includes its subdirectories, so
+// only the results whose parent is not in the file are summed. A snapshot also records
+// the start of the scan, which adds the files directly inside it.
+typedef struct ResultTotals {
+    unsigned long long topLevelBytes;
+    unsigned long long rootBytes;
+    bool haveRoot;
+} ResultTotals;
+
+bool sortResultsByPath(const char *resultsPath, ExternalSorter *sorter, ResultTotals *totals) {
+    ResultReader reader;
+    if (!openResultReader(&reader, resultsPath)) {
+        fprintf(stderr, "Error opening %s: %s\n", resultsPath, strerror(errno));
+        return false;
+    }
+    memset(totals, 0, sizeof(*totals));
+    if (reader.isSnapshot) {
+        totals->rootBytes = reader.snapshot.records[0].size;
+        totals->haveRoot = true;
+    }
+
+    // Results are in pre-order, so everything below a top-level result follows it directly.
+    PathBuffer topLevel = {0};
+    ResultEntry entry;
+    bool ok = true;
+    while (ok && readNextResult(&reader, &entry)) {
+        size_t length = topLevel.length;
+        bool below = topLevel.data != NULL && strncmp(entry.path, topLevel.data, length) == 0 && entry.path[length] == PATH_SEPARATOR[0];
+        if (!below) {
+            totals->topLevelBytes += entry.size;
+            if (topLevel.data != NULL) {
+                pathBufferTruncate(&topLevel, 0);
+            }
+            ok = pathBufferAppend(&topLevel, entry.path, false) != SIZE_MAX;
+        }
+        ok = ok && externalSorterAdd(sorter, entry.path, strlen(entry.path), &entry.size, sizeof(entry.size));
+    }
+    pathBufferFree(&topLevel);
+    closeResultReader(&reader);
+    return ok && externalSorterFinish(sorter);
+}
+
+bool nextSortedResult(ExternalSorter *sorter, const char **path, size_t *pathLength, unsigned long long *size) {
+    const char *payload;
+    size_t payloadLength;
+    if (!externalSorterNext(sorter, path, pathLength, &payload, &payloadLength) || payloadLength != sizeof(*size)) {
+        return false;
+    }
+    memcpy(size, payload, sizeof(*size));
+    return true;
+}
+
+bool addDiffChange(ExternalSorter *changes, const char *path, size_t pathLength, unsigned char kind,
+                   unsigned long long oldSize, unsigned long long newSize, unsigned long long threshold) {
+    unsigned long long delta = newSize > oldSize ? newSize - oldSize : oldSize - newSize;
+    if (delta < threshold || (kind == DIFF_CHANGED && delta == 0)) {
+        return true;
+    }
+
+    // Largest change first, then by path.
+    size_t keyLength = 8 + pathLength;
+    unsigned char *key = malloc(keyLength);
+    if (key == NULL) {
+        fprintf(stderr, "Error: out of memory while comparing scans\n");
+        return false;
+    }
+    encodeBigEndian64(key, UINT64_MAX - delta);
+    memcpy(key + 8, path, pathLength);
+    DiffChange change;
+    memset(&change, 0, sizeof(change));
+    change.oldSize = oldSize;
+    change.newSize = newSize;
+    change.kind = kind;
+    bool added = externalSorterAdd(changes, key, keyLength, &change, sizeof(change));
+    free(key);
+    return added;
+}
+
+bool joinSortedResults(ExternalSorter *oldSorted, ExternalSorter *newSorted, ExternalSorter *changes, unsigned long long threshold) {
+    const char *oldPath = NULL;
+    const char *newPath = NULL;
+    size_t oldLength = 0;
+    size_t newLength = 0;
+    unsigned long long oldSize = 0;
+    unsigned long long newSize = 0;
+    bool haveOld = nextSortedResult(oldSorted, &oldPath, &oldLength, &oldSize);
+    bool haveNew = nextSortedResult(newSorted, &newPath, &newLength, &newSize);
+    bool ok = true;
+    while (ok && (haveOld || haveNew)) {
+        int order = !haveOld ? 1 : !haveNew ? -1 : compareSortKeys(oldPath, oldLength, newPath, newLength);
+        if (order < 0) {
+            ok = addDiffChange(changes, oldPath, oldLength, DIFF_REMOVED, oldSize, 0, threshold);
+            haveOld = nextSortedResult(oldSorted, &oldPath, &oldLength, &oldSize);
+        } else if (order > 0) {
+            ok = addDiffChange(changes, newPath, newLength, DIFF_ADDED, 0, newSize, threshold);
+            haveNew = nextSortedResult(newSorted, &newPath, &newLength, &newSize);
+        } else {
+            ok = addDiffChange(changes, newPath, newLength, DIFF_CHANGED, oldSize, newSize, threshold);
+            haveOld = nextSortedResult(oldSorted, &oldPath, &oldLength, &oldSize);
+            haveNew = nextSortedResult(newSorted, &newPath, &newLength, &newSize);
+        }
+    }
+    return ok && !oldSorted->failed && !newSorted->failed;
+}
+
+// net is the change in the scans' totals, not the sum of the deltas listed: a directory's
+// delta is already part of each of its ancestors'.
+bool printDiffChanges(ExternalSorter *changes, long long net) {
+    static const char *kindNames[] = { "added", "removed", "changed" };
+    unsigned long long counts[3] = {0};
+    const char *key;
+    const char *payload;
+    size_t keyLength;
+    size_t payloadLength;
+    printf("%-8s %20s  %s\n", "change", "delta (bytes)", "path");
+    while (externalSorterNext(changes, &key, &keyLength, &payload, &payloadLength)) {
+        DiffChange change;
+        memcpy(&change, payload, sizeof(change));
+        long long delta = (long long)change.newSize - (long long)change.oldSize;
+        printf("%-8s %+20lld  %.*s\n", kindNames[change.kind], delta, (int)(keyLength - 8), key + 8);
+        counts[change.kind]++;
+    }
+    if (changes->failed) {
+        fprintf(stderr, "Error reading back the sorted changes\n");
+        return false;
+    }
+    printf("%llu added, %llu removed, %llu changed; net %+lld bytes\n",
+           counts[DIFF_ADDED], counts[DIFF_REMOVED], counts[DIFF_CHANGED], net);
+    return true;
+}
+
+int runDiffMode(const char *oldResults, const char *newResults, unsigned long long threshold) {
+    ExternalSorter oldSorted = {0};
+    ExternalSorter newSorted = {0};
+    ExternalSorter changes = {0};
+    ResultTotals oldTotals;
+    ResultTotals newTotals;
+    bool ok = sortResultsByPath(oldResults, &oldSorted, &oldTotals) && sortResultsByPath(newResults, &newSorted, &newTotals);
+    if (ok && (!joinSortedResults(&oldSorted, &newSorted, &changes, threshold) || !externalSorterFinish(&changes))) {
+        fprintf(stderr, "Error comparing %s with %s\n", oldResults, newResults);
+        ok = false;
+    }
+    // Text results have no line for the start of the scan, so unless both are snapshots the
+    // files directly inside it are left out on both sides.
+    bool bothRoots = ok && oldTotals.haveRoot && newTotals.haveRoot;
+    long long net = bothRoots ? (long long)newTotals.rootBytes - (long long)oldTotals.rootBytes
+                              : (long long)newTotals.topLevelBytes - (long long)oldTotals.topLevelBytes;
+    ok = ok && printDiffChanges(&changes, net);
+
+    externalSorterFree(&oldSorted);
+    externalSorterFree(&newSorted);
+    externalSorterFree(&changes);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Search index kept next to a result file as <results>.idx. Each result indexes the
+// trigrams of its own name, lowercased: its path past its parent result's, or the whole
+// path for a result whose parent is not in the file. Results are in pre-order, so a result
+// and everything below it are a run of ordinals ending at its subtree end, and a query
+// fragment found in a result's path is found in every path of that run.
+typedef struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    // The result file the index was built from; any other version of it is not covered.
+    uint64_t resultsSize;
+    int64_t resultsMtime;
+    int64_t resultsMtimeNsec;
+    uint64_t entryCount;
+    uint64_t positionsOffset;
+    uint64_t subtreeEndsOffset;
+    uint64_t trigramCount;
+    uint64_t trigramsOffset;
+    uint64_t postingsOffset;
+    uint64_t postingsSize;
+} IndexHeader;
+
+// Postings are ascending ordinals stored as varint deltas.
+typedef struct IndexTrigram {
+    uint32_t trigram;
+    uint32_t postingCount;
+    uint64_t postingsOffset;
+} IndexTrigram;
+
+typedef struct PostingBuilder {
+    uint32_t trigram;
+    uint32_t count;
+    uint32_t lastOrdinal;
+    unsigned char *data;
+    size_t length;
+    size_t capacity;
+} PostingBuilder;
+
+// Open-addressed table of posting lists; a slot with count 0 is free.
+typedef struct IndexBuilder {
+    PostingBuilder *table;
+    size_t capacity;
+    size_t used;
+} IndexBuilder;
+
+uint32_t trigramAt(const char *text) {
+    return (uint32_t)tolower((unsigned char)text[0]) << 16 |
+           (uint32_t)tolower((unsigned char)text[1]) << 8 |
+           (uint32_t)tolower((unsigned char)text[2]);
+}
+
+size_t trigramSlot(uint32_t trigram, size_t capacity) {
+    return (size_t)(trigram * 2654435761u) & (capacity - 1);
+}
+
+PostingBuilder *indexBuilderLookup(IndexBuilder *builder, uint32_t trigram) {
+    if ((builder->used + 1) * 2 > builder->capacity) {
+        size_t newCapacity = builder->capacity ? builder->capacity * 2 : 4096;
+        PostingBuilder *table = calloc(newCapacity, sizeof(PostingBuilder));
+        if (table == NULL) {
+            return NULL;
+        }
+        for (size_t i = 0; i < builder->capacity; i++) {
+            if (builder->table[i].count > 0) {
+                size_t slot = trigramSlot(builder->table[i].trigram, newCapacity);
+                while (table[slot].count > 0) {
+                    slot = (slot + 1) & (newCapacity - 1);
+                }
+                table[slot] = builder->table[i];
+            }
+        }
+        free(builder->table);
+        builder->table = table;
+        builder->capacity = newCapacity;
+    }
+
+    size_t slot = trigramSlot(trigram, builder->capacity);
+    while (builder->table[slot].count > 0 && builder->table[slot].trigram != trigram) {
+        slot = (slot + 1) & (builder->capacity - 1);
+    }
+    if (builder->table[slot].count == 0) {
+        builder->table[slot].trigram = trigram;
+        builder->used++;
+    }
+    return &builder->table[slot];
+}
+
+bool indexBuilderAdd(IndexBuilder *builder, const char *name, uint32_t ordinal) {
+    size_t length = strlen(name);
+    for (size_t i = 0; i + 3 <= length; i++) {
+        PostingBuilder *posting = indexBuilderLookup(builder, trigramAt(name + i));
+        if (posting == NULL) {
+            return false;
+        }
+        if (posting->count > 0 && posting->lastOrdinal == ordinal) {
+            continue;
+        }
+        if (posting->length + 10 > posting->capacity) {
+            size_t newCapacity = posting->capacity ? posting->capacity * 2 : 16;
+            unsigned char *data = realloc(posting->data, newCapacity);
+            if (data == NULL) {
+                return false;
+            }
+            posting->data = data;
+            posting->capacity = newCapacity;
+        }
+        uint32_t delta = posting->count > 0 ? ordinal - posting->lastOrdinal : ordinal;
+        posting->length += encodeVarint(posting->data + posting->length, delta);
+        posting->lastOrdinal = ordinal;
+        posting->count++;
+    }
+    return true;
+}
+
+void indexBuilderFree(IndexBuilder *builder) {
+    for (size_t i = 0; i < builder->capacity; i++) {
+        free(builder->table[i].data);
+    }
+    free(builder->table);
+    memset(builder, 0, sizeof(*builder));
+}
+
+int compareIndexTrigrams(const void *a, const void *b) {
+    uint32_t left = ((const IndexTrigram *)a)->trigram;
+    uint32_t right = ((const IndexTrigram *)b)->trigram;
+    return left < right ? -1 : left > right;
+}
+
+bool indexPathFor(const char *resultsPath, const char *suffix, PathBuffer *path) {
+    return pathBufferAppend(path, resultsPath, false) != SIZE_MAX &&
+           pathBufferAppend(path, suffix, false) != SIZE_MAX;
+}
+
+// Writes the postings, trigram table and header once every result has been added.
+bool finishResultIndex(FILE *file, IndexHeader *header, IndexBuilder *builder, const uint32_t *subtreeEnds) {
+    static const char padding[8] = {0};
+    header->subtreeEndsOffset = header->positionsOffset + header->entryCount * sizeof(uint64_t);
+    size_t endsBytes = header->entryCount * sizeof(uint32_t);
+    size_t paddingLength = (8 - endsBytes % 8) % 8;
+    if (fwrite(subtreeEnds, sizeof(uint32_t), header->entryCount, file) != header->entryCount ||
+        fwrite(padding, 1, paddingLength, file) != paddingLength) {
+        return false;
+    }
+
+    IndexTrigram *trigrams = builder->used > 0 ? malloc(builder->used * sizeof(IndexTrigram)) : NULL;
+    size_t *slots = builder->used > 0 ? malloc(builder->used * sizeof(size_t)) : NULL;
+    if (builder->used > 0 && (trigrams == NULL || slots == NULL)) {
+        free(trigrams);
+        free(slots);
+        return false;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < builder->capacity; i++) {
+        if (builder->table[i].count > 0) {
+            trigrams[count].trigram = builder->table[i].trigram;
+            trigrams[count].postingCount = builder->table[i].count;
+            count++;
+        }
+    }
+    if (count > 0) {
+        qsort(trigrams, count, sizeof(IndexTrigram), compareIndexTrigrams);
+    }
+
+    header->trigramCount = count;
+    header->trigramsOffset = header->subtreeEndsOffset + endsBytes + paddingLength;
+    header->postingsOffset = header->trigramsOffset + count * sizeof(IndexTrigram);
+    uint64_t offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        PostingBuilder *posting = indexBuilderLookup(builder, trigrams[i].trigram);
+        trigrams[i].postingsOffset = offset;
+        offset += posting->length;
+        slots[i] = (size_t)(posting - builder->table);
+    }
+    header->postingsSize = offset;
+
+    bool written = fwrite(trigrams, sizeof(IndexTrigram), count, file) == count;
+    for (size_t i = 0; written && i < count; i++) {
+        const PostingBuilder *posting = &builder->table[slots[i]];
+        written = fwrite(posting->data, 1, posting->length, file) == posting->length;
+    }
+    free(trigrams);
+    free(slots);
+    return written && fseeko(file, 0, SEEK_SET) == 0 && fwrite(header, sizeof(*header), 1, file) == 1;
+}
+
+// Builds <resultsPath>.idx from a result file in either format. Returns false and leaves
+// any previous index alone if it cannot be written.
+bool buildResultIndex(const char *resultsPath) {
+    struct stat resultsStat;
+    ResultReader reader;
+    if (stat(resultsPath, &resultsStat) != 0 || !openResultReader(&reader, resultsPath)) {
+        perror("Error opening the results to index");
+        return false;
+    }
+
+    PathBuffer indexPath = {0};
+    PathBuffer tempPath = {0};
+    FILE *file = NULL;
+    if (indexPathFor(resultsPath, ".idx", &indexPath) && indexPathFor(resultsPath, ".idx.tmp", &tempPath)) {
+        file = fopen(tempPath.data, "wb");
+    }
+    if (file == NULL) {
+        perror("Error creating the search index");
+        closeResultReader(&reader);
+        pathBufferFree(&indexPath);
+        pathBufferFree(&tempPath);
+        return false;
+    }
+
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.resultsSize = resultsStat.st_size;
+    DirStamp resultsStamp = dirStampFromStat(&resultsStat);
+    header.resultsMtime = resultsStamp.mtime;
+    header.resultsMtimeNsec = resultsStamp.mtimeNsec;
+    header.positionsOffset = sizeof(IndexHeader);
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+    IndexBuilder builder = {0};
+    uint32_t *subtreeEnds = NULL;
+    size_t endsCapacity = 0;
+    // Results still open above the current one, with their path lengths; the current
+    // path starts with each of theirs.
+    uint32_t *open = NULL;
+    size_t *openLengths = NULL;
+    size_t openCount = 0;
+    size_t openCapacity = 0;
+    PathBuffer previous = {0};
+
+    uint64_t ordinal = 0;
+    long long position = resultReaderTell(&reader);
+    ResultEntry entry;
+    while (ok && readNextResult(&reader, &entry)) {
+        if (ordinal >= UINT32_MAX) {
+            fprintf(stderr, "Error: too many results to index\n");
+            ok = false;
+            break;
+        }
+        uint64_t storedPosition = (uint64_t)position;
+        size_t pathLength = strlen(entry.path);
+        while (openCount > 0) {
+            size_t parentLength = openLengths[openCount - 1];
+            if (pathLength > parentLength && strncmp(entry.path, previous.data, parentLength) == 0 &&
+                entry.path[parentLength] == PATH_SEPARATOR[0]) {
+                break;
+            }
+            subtreeEnds[open[--openCount]] = (uint32_t)ordinal;
+        }
+        const char *name = openCount > 0 ? entry.path + openLengths[openCount - 1] + 1 : entry.path;
+
+        if (ordinal == endsCapacity) {
+            endsCapacity = endsCapacity ? endsCapacity * 2 : 1024;
+            uint32_t *ends = realloc(subtreeEnds, endsCapacity * sizeof(uint32_t));
+            ok = ends != NULL;
+            if (ok) {
+                subtreeEnds = ends;
+            }
+        }
+        if (ok && openCount == openCapacity) {
+            openCapacity = openCapacity ? openCapacity * 2 : 64;
+            uint32_t *grownOpen = realloc(open, openCapacity * sizeof(uint32_t));
+            size_t *grownLengths = grownOpen != NULL ? realloc(openLengths, openCapacity * sizeof(size_t)) : NULL;
+            if (grownOpen != NULL) {
+                open = grownOpen;
+            }
+            if (grownLengths != NULL) {
+                openLengths = grownLengths;
+            }
+            ok = grownOpen != NULL && grownLengths != NULL;
+        }
+        ok = ok && fwrite(&storedPosition, sizeof(storedPosition), 1, file) == 1 &&
+             indexBuilderAdd(&builder, name, (uint32_t)ordinal);
+        if (!ok) {
+            break;
+        }
+        open[openCount] = (uint32_t)ordinal;
+        openLengths[openCount++] = pathLength;
+        previous.length = 0;
+        ok = pathBufferAppend(&previous, entry.path, false) != SIZE_MAX;
+
+        ordinal++;
+        position = resultReaderTell(&reader);
+    }
+    while (openCount > 0) {
+        subtreeEnds[open[--openCount]] = (uint32_t)ordinal;
+    }
+
+    header.entryCount = ordinal;
+    ok = ok && finishResultIndex(file, &header, &builder, subtreeEnds);
+    if (fclose(file) == EOF) {
+        ok = false;
+    }
+    if (ok && rename(tempPath.data, indexPath.data) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        fprintf(stderr, "Error writing the search index %s\n", indexPath.data);
+        unlink(tempPath.data);
+    }
+
+    indexBuilderFree(&builder);
+    free(subtreeEnds);
+    free(open);
+    free(openLengths);
+    pathBufferFree(&previous);
+    pathBufferFree(&indexPath);
+    pathBufferFree(&tempPath);
+    closeResultReader(&reader);
+    return ok;
+}
+
+typedef struct ResultIndex {
+    unsigned char *data;
+    size_t size;
+    const IndexHeader *header;
+    const uint64_t *positions;
+    const uint32_t *subtreeEnds;
+    const IndexTrigram *trigrams;
+    const unsigned char *postings;
+} ResultIndex;
+
+// Maps the index of the result file at resultsPath. Returns false if there is none or it
+// was built from a different version of the results.
+bool openResultIndex(ResultIndex *index, const char *resultsPath) {
+    memset(index, 0, sizeof(*index));
+    PathBuffer indexPath = {0};
+    struct stat resultsStat;
+    struct stat indexStat;
+    int fd = -1;
+    if (stat(resultsPath, &resultsStat) == 0 && indexPathFor(resultsPath, ".idx", &indexPath)) {
+        fd = open(indexPath.data, O_RDONLY | O_CLOEXEC);
+    }
+    if (fd < 0 || fstat(fd, &indexStat) != 0 || (size_t)indexStat.st_size < sizeof(IndexHeader)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        pathBufferFree(&indexPath);
+        return false;
+    }
+
+    void *data = mmap(NULL, indexStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        pathBufferFree(&indexPath);
+        return false;
+    }
+
+    const IndexHeader *header = data;
+    uint64_t size = indexStat.st_size;
+    DirStamp resultsStamp = dirStampFromStat(&resultsStat);
+    bool valid = memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) == 0 &&
+                 header->version == INDEX_VERSION &&
+                 header->entryCount < UINT32_MAX &&
+                 header->positionsOffset + header->entryCount * sizeof(uint64_t) <= size &&
+                 header->subtreeEndsOffset + header->entryCount * sizeof(uint32_t) <= size &&
+                 header->trigramsOffset % sizeof(uint64_t) == 0 &&
+                 header->trigramsOffset + header->trigramCount * sizeof(IndexTrigram) <= size &&
+                 header->postingsOffset + header->postingsSize <= size;
+    bool current = valid &&
+                   header->resultsSize == (uint64_t)resultsStat.st_size &&
+                   header->resultsMtime == resultsStamp.mtime &&
+                   header->resultsMtimeNsec == resultsStamp.mtimeNsec;
+    if (!current) {
+        if (valid) {
+            printf("Search index %s is out of date; searching without it\n", indexPath.data);
+        }
+        munmap(data, indexStat.st_size);
+        pathBufferFree(&indexPath);
+        return false;
+    }
+    pathBufferFree(&indexPath);
+
+    index->data = data;
+    index->size = indexStat.st_size;
+    index->header = header;
+    index->positions = (const uint64_t *)(index->data + header->positionsOffset);
+    index->subtreeEnds = (const uint32_t *)(index->data + header->subtreeEndsOffset);
+    index->trigrams = (const IndexTrigram *)(index->data + header->trigramsOffset);
+    index->postings = index->data + header->postingsOffset;
+    return true;
+}
+
+void closeResultIndex(ResultIndex *index) {
+    if (index->data != NULL) {
+        munmap(index->data, index->size);
+    }
+    memset(index, 0, sizeof(*index));
+}
+
+typedef struct PostingCursor {
+    const unsigned char *cursor;
+    const unsigned char *end;
+    uint32_t remaining;
+    uint64_t current;
+} PostingCursor;
+
+bool postingCursorNext(PostingCursor *posting, bool first) {
+    if (posting->remaining == 0) {
+        return false;
+    }
+    uint64_t delta = decodeVarint(&posting->cursor, posting->end);
+    posting->current = first ? delta : posting->current + delta;
+    posting->remaining--;
+    return true;
+}
+
+int comparePostingCursors(const void *a, const void *b) {
+    uint32_t left = ((const PostingCursor *)a)->remaining;
+    uint32_t right = ((const PostingCursor *)b)->remaining;
+    return left < right ? -1 : left > right;
+}
+
+typedef struct SearchRange {
+    uint64_t start;
+    uint64_t end;
+} SearchRange;
+
+// Finds the runs of results whose paths contain the longest separator-free fragment of
+// lowerQuery: the results whose names hold every trigram of the fragment and whose path
+// really contains it, each with everything below it. Returns false when no fragment is
+// three characters long, as the index cannot narrow such a search.
+bool planIndexedSearch(const ResultIndex *index, ResultReader *reader, const char *lowerQuery, SearchRange **rangesOut, size_t *rangeCountOut) {
+    const char *fragment = NULL;
+    size_t fragmentLength = 0;
+    for (const char *cursor = lowerQuery; *cursor != '\0';) {
+        size_t length = strcspn(cursor, PATH_SEPARATOR);
+        if (length > fragmentLength) {
+            fragment = cursor;
+            fragmentLength = length;
+        }
+        cursor += length;
+        cursor += strspn(cursor, PATH_SEPARATOR);
+    }
+    if (fragmentLength < 3) {
+        return false;
+    }
+    char *needle = strndup(fragment, fragmentLength);
+    PostingCursor *postings = calloc(fragmentLength - 2, sizeof(PostingCursor));
+    if (needle == NULL || postings == NULL) {
+        free(needle);
+        free(postings);
+        return false;
+    }
+
+    size_t postingCount = 0;
+    bool missing = false;
+    for (size_t i = 0; i + 3 <= fragmentLength && !missing; i++) {
+        IndexTrigram key = { .trigram = trigramAt(needle + i) };
+        const IndexTrigram *found = bsearch(&key, index->trigrams, index->header->trigramCount, sizeof(IndexTrigram), compareIndexTrigrams);
+        if (found == NULL || found->postingsOffset > index->header->postingsSize) {
+            missing = true;
+            break;
+        }
+        PostingCursor posting = {
+            .cursor = index->postings + found->postingsOffset,
+            .end = index->postings + index->header->postingsSize,
+            .remaining = found->postingCount
+        };
+        postings[postingCount++] = posting;
+    }
+
+    SearchRange *ranges = NULL;
+    size_t rangeCount = 0;
+    size_t rangeCapacity = 0;
+    uint64_t coveredEnd = 0;
+    char *lowerPath = NULL;
+    if (!missing) {
+        // Walk the rarest list and leapfrog the others up to each of its ordinals.
+        qsort(postings, postingCount, sizeof(PostingCursor), comparePostingCursors);
+        bool *started = calloc(postingCount, sizeof(bool));
+        bool exhausted = started == NULL;
+        while (!exhausted && postingCursorNext(&postings[0], !started[0])) {
+            started[0] = true;
+            uint64_t candidate = postings[0].current;
+            bool everywhere = true;
+            for (size_t i = 1; i < postingCount && everywhere; i++) {
+                while (!started[i] || postings[i].current < candidate) {
+                    if (!postingCursorNext(&postings[i], !started[i])) {
+                        exhausted = true;
+                        break;
+                    }
+                    started[i] = true;
+                }
+                everywhere = !exhausted && postings[i].current == candidate;
+            }
+            if (!everywhere || candidate < coveredEnd || candidate >= index->header->entryCount) {
+                continue;
+            }
+
+            ResultEntry entry;
+            resultReaderSeek(reader, (long long)index->positions[candidate]);
+            if (!readNextResult(reader, &entry)) {
+                continue;
+            }
+            free(lowerPath);
+            lowerPath = strdup(entry.path);
+            if (lowerPath == NULL) {
+                break;
+            }
+            toLowerString(lowerPath);
+            if (strstr(lowerPath, needle) == NULL) {
+                continue;
+            }
+
+            if (rangeCount == rangeCapacity) {
+                rangeCapacity = rangeCapacity ? rangeCapacity * 2 : 64;
+                SearchRange *grown = realloc(ranges, rangeCapacity * sizeof(SearchRange));
+                if (grown == NULL) {
+                    break;
+                }
+                ranges = grown;
+            }
+            coveredEnd = MAX(index->subtreeEnds[candidate], candidate + 1);
+            ranges[rangeCount++] = (SearchRange){ candidate, coveredEnd };
+        }
+        free(started);
+    }
+
+    free(lowerPath);
+    free(needle);
+    free(postings);
+    *rangesOut = ranges;
+    *rangeCountOut = rangeCount;
+    return true;
+}
+
+// Keyword queries for filtering result paths. Words separated by spaces must all occur,
+// a|b accepts either alternative, -word rejects paths that contain it and "..." keeps
+// spaces inside one word. All needles are looked for in a single pass over the path: each
+// block of bytes is loaded once, case-folded in registers and compared against the first
+// and last byte of every needle not found yet, and only positions where both line up are
+// checked byte by byte.
+typedef struct KeywordNeedle {
+    // Already folded to lower case when the query ignores case.
+    char *text;
+    size_t length;
+} KeywordNeedle;
+
+typedef struct KeywordTerm {
+    // One bit per alternative in KeywordQuery.needles.
+    uint64_t needles;
+    bool exclude;
+} KeywordTerm;
+
+typedef struct KeywordQuery KeywordQuery;
+
+// Returns which of the wanted needles occur in the first length bytes of text. text must be
+// readable for longestNeedle + MATCH_BLOCK_SIZE bytes past length; what those bytes hold
+// does not matter, since a candidate running past length is never compared.
+typedef uint64_t (*NeedleScanner)(const KeywordQuery *query, const unsigned char *text, size_t length, uint64_t wanted);
+
+struct KeywordQuery {
+    KeywordNeedle needles[MAX_QUERY_NEEDLES];
+    size_t needleCount;
+    KeywordTerm terms[MAX_QUERY_NEEDLES];
+    size_t termCount;
+    size_t longestNeedle;
+    bool ignoreCase;
+    NeedleScanner scanner;
+    unsigned char *padded;
+    size_t paddedCapacity;
+};
+
+unsigned char foldByte(unsigned char c, bool ignoreCase) {
+    return ignoreCase && (unsigned char)(c - 'A') < 26 ? c | 0x20 : c;
+}
+
+bool foldedEqual(const unsigned char *text, const char *needle, size_t length, bool ignoreCase) {
+    if (!ignoreCase) {
+        return memcmp(text, needle, length) == 0;
+    }
+    for (size_t i = 0; i < length; i++) {
+        if (foldByte(text[i], true) != (unsigned char)needle[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// mask has a bit for every position from base on where the needle's first and last bytes
+// both match.
+bool verifyNeedleCandidates(const KeywordNeedle *needle, const unsigned char *text, size_t length, size_t base, uint32_t mask, bool ignoreCase) {
+    while (mask != 0) {
+        size_t position = base + (size_t)__builtin_ctz(mask);
+        if (position + needle->length > length) {
+            return false;
+        }
+        if (needle->length <= 2 || foldedEqual(text + position + 1, needle->text + 1, needle->length - 2, ignoreCase)) {
+            return true;
+        }
+        mask &= mask - 1;
+    }
+    return false;
+}
+
+uint64_t scanNeedlesScalar(const KeywordQuery *query, const unsigned char *text, size_t length, uint64_t wanted) {
+    uint64_t found = 0;
+    for (size_t i = 0; i < length && found != wanted; i++) {
+        unsigned char c = foldByte(text[i], query->ignoreCase);
+        for (uint64_t pending = wanted & ~found; pending != 0; pending &= pending - 1) {
+            int k = __builtin_ctzll(pending);
+            const KeywordNeedle *needle = &query->needles[k];
+            if ((unsigned char)needle->text[0] == c && i + needle->length <= length &&
+                foldedEqual(text + i + 1, needle->text + 1, needle->length - 1, query->ignoreCase)) {
+                found |= 1ULL << k;
+            }
+        }
+    }
+    return found;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Sets bit 5 of every byte in 'A'..'Z' when foldMask is 0x20. Adding 0x3f moves 'A'..'Z'
+// to the bottom of the signed byte range, so one signed compare finds them.
+__attribute__((target("sse2")))
+__m128i foldBlockSse2(__m128i block, __m128i foldMask) {
+    __m128i upper = _mm_cmplt_epi8(_mm_add_epi8(block, _mm_set1_epi8(0x3f)), _mm_set1_epi8(-102));
+    return _mm_or_si128(block, _mm_and_si128(upper, foldMask));
+}
+
+__attribute__((target("sse2")))
+uint64_t scanNeedlesSse2(const KeywordQuery *query, const unsigned char *text, size_t length, uint64_t wanted) {
+    __m128i foldMask = _mm_set1_epi8(query->ignoreCase ? 0x20 : 0);
+    uint64_t found = 0;
+    for (size_t i = 0; i < length && found != wanted; i += 16) {
+        __m128i block = foldBlockSse2(_mm_loadu_si128((const __m128i *)(text + i)), foldMask);
+        for (uint64_t pending = wanted & ~found; pending != 0; pending &= pending - 1) {
+            int k = __builtin_ctzll(pending);
+            const KeywordNeedle *needle = &query->needles[k];
+            __m128i last = foldBlockSse2(_mm_loadu_si128((const __m128i *)(text + i + needle->length - 1)), foldMask);
+            __m128i firstHits = _mm_cmpeq_epi8(block, _mm_set1_epi8(needle->text[0]));
+            __m128i lastHits = _mm_cmpeq_epi8(last, _mm_set1_epi8(needle->text[needle->length - 1]));
+            uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(firstHits, lastHits));
+            if (mask != 0 && verifyNeedleCandidates(needle, text, length, i, mask, query->ignoreCase)) {
+                found |= 1ULL << k;
+            }
+        }
+    }
+    return found;
+}
+
+__attribute__((target("avx2")))
+__m256i foldBlockAvx2(__m256i block, __m256i foldMask) {
+    __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(-102), _mm256_add_epi8(block, _mm256_set1_epi8(0x3f)));
+    return _mm256_or_si256(block, _mm256_and_si256(upper, foldMask));
+}
+
+__attribute__((target("avx2")))
+uint64_t scanNeedlesAvx2(const KeywordQuery *query, const unsigned char *text, size_t length, uint64_t wanted) {
+    __m256i foldMask = _mm256_set1_epi8(query->ignoreCase ? 0x20 : 0);
+    uint64_t found = 0;
+    for (size_t i = 0; i < length && found != wanted; i += 32) {
+        __m256i block = foldBlockAvx2(_mm256_loadu_si256((const __m256i *)(text + i)), foldMask);
+        for (uint64_t pending = wanted & ~found; pending != 0; pending &= pending - 1) {
+            int k = __builtin_ctzll(pending);
+            const KeywordNeedle *needle = &query->needles[k];
+            __m256i last = foldBlockAvx2(_mm256_loadu_si256((const __m256i *)(text + i + needle->length - 1)), foldMask);
+            __m256i firstHits = _mm256_cmpeq_epi8(block, _mm256_set1_epi8(needle->text[0]));
+            __m256i lastHits = _mm256_cmpeq_epi8(last, _mm256_set1_epi8(needle->text[needle->length - 1]));
+            uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(firstHits, lastHits));
+            if (mask != 0 && verifyNeedleCandidates(needle, text, length, i, mask, query->ignoreCase)) {
+                found |= 1ULL << k;
+            }
+        }
+    }
+    return found;
+}
+#endif
+
+NeedleScanner selectNeedleScanner() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return scanNeedlesAvx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return scanNeedlesSse2;
+    }
+#endif
+    return scanNeedlesScalar;
+}
+
+void freeKeywordQuery(KeywordQuery *query) {
+    for (size_t i = 0; i < query->needleCount; i++) {
+        free(query->needles[i].text);
+    }
+    free(query->padded);
+    memset(query, 0, sizeof(*query));
+}
+
+bool addKeywordNeedle(KeywordQuery *query, KeywordTerm *term, const char *text, size_t length) {
+    if (query->needleCount == MAX_QUERY_NEEDLES) {
+        fprintf(stderr, "Error: a search can use at most %d keywords\n", MAX_QUERY_NEEDLES);
+        return false;
+    }
+    char *needle = strndup(text, length);
+    if (needle == NULL) {
+        fprintf(stderr, "Error: out of memory while searching\n");
+        return false;
+    }
+    if (query->ignoreCase) {
+        toLowerString(needle);
+    }
+    term->needles |= 1ULL << query->needleCount;
+    query->needles[query->needleCount++] = (KeywordNeedle){ needle, length };
+    query->longestNeedle = MAX(query->longestNeedle, length);
+    return true;
+}
+
+bool compileKeywordQuery(KeywordQuery *query, const char *text, bool ignoreCase) {
+    memset(query, 0, sizeof(*query));
+    query->ignoreCase = ignoreCase;
+    query->scanner = selectNeedleScanner();
+
+    const char *cursor = text;
+    while (true) {
+        cursor += strspn(cursor, " \t");
+        if (*cursor == '\0') {
+            break;
+        }
+        KeywordTerm term = { 0 };
+        if (cursor[0] == '-' && cursor[1] != '\0' && cursor[1] != ' ' && cursor[1] != '\t') {
+            term.exclude = true;
+            cursor++;
+        }
+        while (true) {
+            const char *start = cursor;
+            size_t length;
+            if (*cursor == '"') {
+                start = ++cursor;
+                length = strcspn(cursor, "\"");
+                cursor += length;
+                if (*cursor == '"') {
+                    cursor++;
+                }
+            } else {
+                length = strcspn(cursor, " \t|");
+                cursor += length;
+            }
+            if (length > 0 && !addKeywordNeedle(query, &term, start, length)) {
+                freeKeywordQuery(query);
+                return false;
+            }
+            if (*cursor != '|') {
+                break;
+            }
+            cursor++;
+        }
+        if (term.needles != 0) {
+            query->terms[query->termCount++] = term;
+        }
+    }
+    return true;
+}
+
+bool keywordTermsSatisfied(const KeywordQuery *query, uint64_t found) {
+    for (size_t i = 0; i < query->termCount; i++) {
+        if (((found & query->terms[i].needles) != 0) == query->terms[i].exclude) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The path is copied into a padded buffer first so the block loads never read past the end
+// of it.
+bool keywordQueryMatches(KeywordQuery *query, const char *path) {
+    if (query->termCount == 0) {
+        return true;
+    }
+    size_t length = strlen(path);
+    size_t padding = query->longestNeedle + MATCH_BLOCK_SIZE;
+    if (length + padding > query->paddedCapacity) {
+        size_t newCapacity = MAX(length + padding, 2 * query->paddedCapacity);
+        unsigned char *grown = realloc(query->padded, newCapacity);
+        if (grown == NULL) {
+            fprintf(stderr, "Error: out of memory while searching\n");
+            return false;
+        }
+        query->padded = grown;
+        query->paddedCapacity = newCapacity;
+    }
+    memcpy(query->padded, path, length);
+
+    uint64_t wanted = query->needleCount == MAX_QUERY_NEEDLES ? UINT64_MAX : (1ULL << query->needleCount) - 1;
+    return keywordTermsSatisfied(query, query->scanner(query, query->padded, length, wanted));
+}
+
+// Iterates over the results whose path matches a keyword query, through the index when one
+// of the required keywords is long enough to narrow the search and otherwise by reading
+// every result. An empty query matches everything.
+typedef struct ResultSearch {
+    ResultReader *reader;
+    const ResultIndex *index;
+    KeywordQuery keywords;
+    bool indexed;
+    // Whether paths inside the ranges still need checking: always unless the query was a
+    // single keyword, that keyword was the fragment the ranges were found for and case
+    // does not matter.
+    bool verify;
+    SearchRange *ranges;
+    size_t rangeCount;
+    size_t range;
+    uint64_t ordinal;
+    bool seekPending;
+    bool atEnd;
+} ResultSearch;
+
+bool beginResultSearch(ResultSearch *search, ResultReader *reader, const ResultIndex *index, const char *query, bool ignoreCase) {
+    memset(search, 0, sizeof(*search));
+    search->reader = reader;
+    if (!compileKeywordQuery(&search->keywords, query, ignoreCase)) {
+        return false;
+    }
+
+    // Every match contains each required keyword that has no alternatives, so the index
+    // is planned on the longest of them.
+    const KeywordNeedle *anchor = NULL;
+    for (size_t i = 0; i < search->keywords.termCount; i++) {
+        const KeywordTerm *term = &search->keywords.terms[i];
+        if (term->exclude || (term->needles & (term->needles - 1)) != 0) {
+            continue;
+        }
+        const KeywordNeedle *needle = &search->keywords.needles[__builtin_ctzll(term->needles)];
+        if (anchor == NULL || needle->length > anchor->length) {
+            anchor = needle;
+        }
+    }
+    if (index != NULL && anchor != NULL) {
+        char *lowerQuery = strdup(anchor->text);
+        if (lowerQuery != NULL) {
+            toLowerString(lowerQuery);
+            search->indexed = planIndexedSearch(index, reader, lowerQuery, &search->ranges, &search->rangeCount);
+            free(lowerQuery);
+        }
+    }
+    if (search->indexed) {
+        search->index = index;
+        search->verify = !ignoreCase || search->keywords.termCount > 1 || strstr(anchor->text, PATH_SEPARATOR) != NULL;
+        search->seekPending = true;
+    } else {
+        resultReaderSeek(reader, 0);
+    }
+    return true;
+}
+
+bool resultSearchMatches(ResultSearch *search, const char *path) {
+    return keywordQueryMatches(&search->keywords, path);
+}
+
+// Fills entry with the next matching result; entry->path stays valid until the next call.
+bool readNextMatch(ResultSearch *search, ResultEntry *entry) {
+    if (!search->indexed) {
+        while (readNextResult(search->reader, entry)) {
+            if (resultSearchMatches(search, entry->path)) {
+                return true;
+            }
+        }
+        search->atEnd = true;
+        return false;
+    }
+
+    while (search->range < search->rangeCount) {
+        const SearchRange *range = &search->ranges[search->range];
+        if (search->ordinal >= range->end) {
+            search->range++;
+            search->seekPending = true;
+            continue;
+        }
+        if (search->ordinal < range->start) {
+            search->ordinal = range->start;
+            search->seekPending = true;
+        }
+        if (search->seekPending) {
+            resultReaderSeek(search->reader, (long long)search->index->positions[search->ordinal]);
+            search->seekPending = false;
+        }
+        if (!readNextResult(search->reader, entry)) {
+            break;
+        }
+        search->ordinal++;
+        if (!search->verify || resultSearchMatches(search, entry->path)) {
+            return true;
+        }
+    }
+    search->atEnd = true;
+    return false;
+}
+
+// Positions are result positions for a full read and ordinals for an indexed search;
+// 0 is always the start.
+long long resultSearchTell(ResultSearch *search) {
+    return search->indexed ? (long long)search->ordinal : resultReaderTell(search->reader);
+}
+
+void resultSearchSeek(ResultSearch *search, long long position) {
+    search->atEnd = false;
+    if (!search->indexed) {
+        resultReaderSeek(search->reader, position);
+        return;
+    }
+    search->ordinal = (uint64_t)position;
+    search->range = 0;
+    while (search->range < search->rangeCount && search->ranges[search->range].end <= search->ordinal) {
+        search->range++;
+    }
+    search->seekPending = true;
+}
+
+void endResultSearch(ResultSearch *search) {
+    freeKeywordQuery(&search->keywords);
+    free(search->ranges);
+    memset(search, 0, sizeof(*search));
+}
+
+// Whether the result at a file ordinal can match an indexed search: only results inside
+// its ranges can, and outside them nothing needs to be read.
+bool resultSearchCovers(const ResultSearch *search, uint64_t ordinal) {
+    if (!search->indexed) {
+        return true;
+    }
+    size_t low = 0;
+    size_t high = search->rangeCount;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (search->ranges[middle].end <= ordinal) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low < search->rangeCount && search->ranges[low].start <= ordinal;
+}
+
+// Sorted views of a result file, kept next to it as <results>.by-size, .by-path or
+// .by-entries so they outlive the session. A view is a header and one OrderEntry per
+// result in the view's order: the result's reader position, so a page is LINES_PER_PAGE
+// seeks, and its ordinal in the file, which an indexed search can rule out without a read.
+// Views are built with the external sorter, so memory stays bounded however large the
+// results are. Text results carry no entry counts; ordered by count they fall back to path.
+typedef enum ResultOrder {
+    RESULT_ORDER_FILE,
+    RESULT_ORDER_SIZE,
+    RESULT_ORDER_PATH,
+    RESULT_ORDER_ENTRIES,
+    RESULT_ORDER_COUNT
+} ResultOrder;
+
+const char *resultOrderNames[RESULT_ORDER_COUNT] = { "file order", "size, largest first", "path", "entry count, largest first" };
+const char *resultOrderSuffixes[RESULT_ORDER_COUNT] = { NULL, ".by-size", ".by-path", ".by-entries" };
+
+typedef struct OrderHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t order;
+    // The result file the view was built from; any other version of it is not covered.
+    uint64_t resultsSize;
+    int64_t resultsMtime;
+    int64_t resultsMtimeNsec;
+    uint64_t count;
+} OrderHeader;
+
+typedef struct OrderEntry {
+    uint64_t position;
+    uint64_t ordinal;
+} OrderEntry;
+
+typedef struct SortedView {
+    ResultOrder order;
+    unsigned char *data;
+    size_t size;
+    const OrderEntry *entries;
+    uint64_t count;
+} SortedView;
+
+// Builds the view of resultsPath in the given order. Returns false and leaves any previous
+// view alone if it cannot be written.
+bool buildSortedView(const char *resultsPath, ResultOrder order) {
+    struct stat resultsStat;
+    ResultReader reader;
+    if (stat(resultsPath, &resultsStat) != 0 || !openResultReader(&reader, resultsPath)) {
+        perror("Error opening the results to sort");
+        return false;
+    }
+
+    ExternalSorter sorter = {0};
+    unsigned char *key = NULL;
+    size_t keyCapacity = 0;
+    uint64_t ordinal = 0;
+    long long position = resultReaderTell(&reader);
+    ResultEntry entry;
+    bool ok = true;
+    while (ok && readNextResult(&reader, &entry)) {
+        // Larger sizes and counts first, then by path.
+        size_t prefixLength = order == RESULT_ORDER_PATH ? 0 : 8;
+        size_t keyLength = prefixLength + strlen(entry.path);
+        if (keyLength > keyCapacity) {
+            unsigned char *grown = realloc(key, keyLength);
+            if (grown == NULL) {
+                fprintf(stderr, "Error: out of memory while sorting\n");
+                ok = false;
+                break;
+            }
+            key = grown;
+            keyCapacity = keyLength;
+        }
+        if (prefixLength > 0) {
+            encodeBigEndian64(key, UINT64_MAX - (order == RESULT_ORDER_SIZE ? entry.size : entry.entryCount));
+        }
+        memcpy(key + prefixLength, entry.path, keyLength - prefixLength);
+        OrderEntry value = { (uint64_t)position, ordinal++ };
+        ok = externalSorterAdd(&sorter, key, keyLength, &value, sizeof(value));
+        position = resultReaderTell(&reader);
+    }
+    closeResultReader(&reader);
+    free(key);
+    ok = ok && externalSorterFinish(&sorter);
+
+    PathBuffer viewPath = {0};
+    PathBuffer tempPath = {0};
+    FILE *file = NULL;
+    if (ok && indexPathFor(resultsPath, resultOrderSuffixes[order], &viewPath) &&
+        indexPathFor(resultsPath, ".sort.tmp", &tempPath)) {
+        file = fopen(tempPath.data, "wb");
+    }
+    if (ok && file == NULL) {
+        perror("Error creating the sorted view");
+    }
+    ok = ok && file != NULL;
+
+    OrderHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ORDER_MAGIC, sizeof(header.magic));
+    header.version = ORDER_VERSION;
+    header.order = order;
+    header.resultsSize = resultsStat.st_size;
+    DirStamp resultsStamp = dirStampFromStat(&resultsStat);
+    header.resultsMtime = resultsStamp.mtime;
+    header.resultsMtimeNsec = resultsStamp.mtimeNsec;
+    header.count = ordinal;
+    ok = ok && fwrite(&header, sizeof(header), 1, file) == 1;
+    const char *sortKey;
+    const char *payload;
+    size_t keyLength;
+    size_t payloadLength;
+    uint64_t written = 0;
+    while (ok && externalSorterNext(&sorter, &sortKey, &keyLength, &payload, &payloadLength)) {
+        ok = payloadLength == sizeof(OrderEntry) && fwrite(payload, payloadLength, 1, file) == 1;
+        written++;
+    }
+    ok = ok && !sorter.failed && written == ordinal;
+    externalSorterFree(&sorter);
+
+    if (file != NULL && fclose(file) == EOF) {
+        ok = false;
+    }
+    if (file != NULL && ok && rename(tempPath.data, viewPath.data) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        fprintf(stderr, "Error writing the sorted view of %s\n", resultsPath);
+        if (file != NULL) {
+            unlink(tempPath.data);
+        }
+    }
+    pathBufferFree(&viewPath);
+    pathBufferFree(&tempPath);
+    return ok;
+}
+
+// Maps the view of resultsPath in the given order. Returns false if there is none or it
+// was built from a different version of the results.
+bool openSortedView(SortedView *view, const char *resultsPath, ResultOrder order) {
+    memset(view, 0, sizeof(*view));
+    PathBuffer viewPath = {0};
+    struct stat resultsStat;
+    struct stat viewStat;
+    int fd = -1;
+    if (stat(resultsPath, &resultsStat) == 0 && indexPathFor(resultsPath, resultOrderSuffixes[order], &viewPath)) {
+        fd = open(viewPath.data, O_RDONLY | O_CLOEXEC);
+    }
+    pathBufferFree(&viewPath);
+    if (fd < 0 || fstat(fd, &viewStat) != 0 || (size_t)viewStat.st_size < sizeof(OrderHeader)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+
+    void *data = mmap(NULL, viewStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    const OrderHeader *header = data;
+    DirStamp resultsStamp = dirStampFromStat(&resultsStat);
+    bool current = memcmp(header->magic, ORDER_MAGIC, sizeof(header->magic)) == 0 &&
+                   header->version == ORDER_VERSION && header->order == (uint32_t)order &&
+                   header->count <= (viewStat.st_size - sizeof(OrderHeader)) / sizeof(OrderEntry) &&
+                   header->resultsSize == (uint64_t)resultsStat.st_size &&
+                   header->resultsMtime == resultsStamp.mtime &&
+                   header->resultsMtimeNsec == resultsStamp.mtimeNsec;
+    if (!current) {
+        munmap(data, viewStat.st_size);
+        return false;
+    }
+
+    view->order = order;
+    view->data = data;
+    view->size = viewStat.st_size;
+    view->entries = (const OrderEntry *)(view->data + sizeof(OrderHeader));
+    view->count = header->count;
+    return true;
+}
+
+// Opens the view, sorting the results first when it is missing or out of date.
+bool loadSortedView(SortedView *view, const char *resultsPath, ResultOrder order) {
+    if (openSortedView(view, resultsPath, order)) {
+        return true;
+    }
+    printf("Sorting the results by %s...\n", resultOrderNames[order]);
+    double start = monotonicSeconds();
+    if (!buildSortedView(resultsPath, order) || !openSortedView(view, resultsPath, order)) {
+        return false;
+    }
+    printf("Sorted %llu results in %.1f ms\n", (unsigned long long)view->count, (monotonicSeconds() - start) * 1e3);
+    return true;
+}
+
+void closeSortedView(SortedView *view) {
+    if (view->data != NULL) {
+        munmap(view->data, view->size);
+    }
+    memset(view, 0, sizeof(*view));
+}
+
+// Reads the viewer page that starts at position and returns where the next one starts.
+// Without a view, positions belong to the search; in a view they are indexes into it, and
+// each result is read from its position and filtered here. By size, the first result
+// below sizeThreshold ends the view.
+long long readResultPage(ResultSearch *search, const SortedView *view, long long position,
+                         unsigned long long sizeThreshold, bool print, bool *atEnd) {
+    int lineCount = 0;
+    ResultEntry entry;
+    if (view->data == NULL) {
+        resultSearchSeek(search, position);
+        while (lineCount < LINES_PER_PAGE && readNextMatch(search, &entry)) {
+            if (entry.size >= sizeThreshold) {
+                if (print) {
+                    printLine(entry.path, entry.size);
+                }
+                lineCount++;
+            }
+        }
+        *atEnd = search->atEnd;
+        return resultSearchTell(search);
+    }
+
+    uint64_t next = (uint64_t)position;
+    while (lineCount < LINES_PER_PAGE && next < view->count) {
+        const OrderEntry *ordered = &view->entries[next++];
+        if (!resultSearchCovers(search, ordered->ordinal)) {
+            continue;
+        }
+        resultReaderSeek(search->reader, (long long)ordered->position);
+        if (!readNextResult(search->reader, &entry)) {
+            next = view->count;
+            break;
+        }
+        if (entry.size < sizeThreshold) {
+            if (view->order == RESULT_ORDER_SIZE) {
+                next = view->count;
+            }
+            continue;
+        }
+        if ((search->indexed && !search->verify) || resultSearchMatches(search, entry.path)) {
+            if (print) {
+                printLine(entry.path, entry.size);
+            }
+            lineCount++;
+        }
+    }
+    *atEnd = next >= view->count;
+    return (long long)next;
+}
+
+int exportResults(const char *inputFilePath, const char *outputFilePath, const char *searchFilter) {
+    if (inputFilePath == NULL || outputFilePath == NULL || searchFilter == NULL) {
+        perror("Error: inputFilePath, outputFilePath, or searchFilter is NULL");
+        return -1;
+    }
+
+    ResultReader reader;
+    if (!openResultReader(&reader, inputFilePath)) {
+        perror("Error opening the input file for reading");
+        return -1;
+    }
+
+    int outputFd = open(outputFilePath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    AsyncWriter writer;
+    if (outputFd < 0 || !asyncWriterStart(&writer, outputFd, scanOptions.directIo)) {
+        perror("Error opening the output file for writing");
+        if (outputFd >= 0) {
+            close(outputFd);
+        }
+        closeResultReader(&reader);
+        return -1;
+    }
+
+    ResultIndex index;
+    bool haveIndex = openResultIndex(&index, inputFilePath);
+    ResultSearch search;
+    if (!beginResultSearch(&search, &reader, haveIndex ? &index : NULL, searchFilter, false)) {
+        asyncWriterFinish(&writer);
+        closeResultIndex(&index);
+        closeResultReader(&reader);
+        close(outputFd);
+        return -1;
+    }
+
+    // Exports are always text, whichever format the scan was written in.
+    ResultEntry entry;
+    bool written = true;
+    double started = statsPhaseStart();
+    while (written && readNextMatch(&search, &entry)) {
+        written = asyncWriterAppendResultLine(&writer, entry.path, entry.size);
+    }
+    written = asyncWriterFinish(&writer) && written;
+    statsPhaseEnd(STATS_PHASE_EXPORT, started);
+    if (!written) {
+        perror("Error writing to the output file");
+    }
+
+    endResultSearch(&search);
+    closeResultIndex(&index);
+    closeResultReader(&reader);
+
+    if (close(outputFd) != 0) {
+        perror("Error closing the output file");
+        return -1;
+    }
+    if (!written) {
+        return -1;
+    }
+
+    printf("Exported results to %s\n", outputFilePath);
+
+    return 0;
+}
+
+// Deletes the directories listed in a selection file, each with everything below it.
+// A pool of workers removes the subtrees bottom-up: every directory is opened relative to
+// its parent's descriptor and emptied with unlinkat relative to its own, so below a
+// selected directory no path is resolved again and a rename or symlink swapped in
+// mid-way cannot redirect the deletion. A directory is removed once its last subdirectory
+// is. Symlinks are unlinked, never followed, and other filesystems mounted below a
+// selected directory are left alone. Each selected directory is appended to
+// <selection>.journal once it is gone, and a rerun over the same selection skips those.
+typedef struct CleanupNode {
+    struct CleanupNode *parent;
+    struct CleanupNode *nextQueued;
+    // The descriptor name is relative to: the parent's, or for a selected directory one
+    // opened on the directory that contains it.
+    int parentFd;
+    DirHandle handle;
+    bool opened;
+    dev_t device;
+    // Subdirectories not removed yet, plus one while this directory is being emptied.
+    atomic_size_t pending;
+    atomic_bool failed;
+    // Set on selected directories only.
+    char *selectedPath;
+    char name[];
+} CleanupNode;
+
+typedef struct Cleanup {
+    bool dryRun;
+    // Unlinks per second over all workers, or 0 for no limit.
+    unsigned long long rate;
+    double started;
+    atomic_ullong operations;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    CleanupNode *queue;
+    int busy;
+    FILE *journal;
+    atomic_ullong files;
+    atomic_ullong directories;
+    atomic_ullong bytes;
+    atomic_ullong errors;
+} Cleanup;
+
+bool cleanupNodePath(const CleanupNode *node, PathBuffer *path) {
+    if (node->parent == NULL) {
+        return pathBufferAppend(path, node->selectedPath, false) != SIZE_MAX;
+    }
+    return cleanupNodePath(node->parent, path) && pathBufferAppend(path, node->name, true) != SIZE_MAX;
+}
+
+// Reports a failure on name inside node, or on node itself when name is NULL, with the
+// errno of the failed call.
+void reportCleanupError(Cleanup *cleanup, const CleanupNode *node, const char *name, const char *action) {
+    int error = errno;
+    PathBuffer path = {0};
+    bool built = cleanupNodePath(node, &path) && (name == NULL || pathBufferAppend(&path, name, true) != SIZE_MAX);
+    fprintf(stderr, "Failed to %s '%s': %s\n", action, built ? path.data : node->name, strerror(error));
+    pathBufferFree(&path);
+    atomic_fetch_add(&cleanup->errors, 1);
+}
+
+// Spaces unlinks evenly at the --delete-rate over all workers.
+void throttleCleanup(Cleanup *cleanup) {
+    if (cleanup->rate == 0) {
+        return;
+    }
+    unsigned long long operation = atomic_fetch_add(&cleanup->operations, 1);
+    double wait = cleanup->started + (double)operation / cleanup->rate - monotonicSeconds();
+    if (wait > 0) {
+        struct timespec delay = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+        nanosleep(&delay, NULL);
+    }
+}
+
+bool cleanupUnlink(Cleanup *cleanup, int dirFd, const char *name, int flags) {
+    throttleCleanup(cleanup);
+    long long started = statsClock();
+    bool removed = unlinkat(dirFd, name, flags) == 0 || errno == ENOENT;
+    statsRecordCall(STATS_CALL_UNLINK, started, !removed);
+    return removed;
+}
+
+CleanupNode *newCleanupNode(CleanupNode *parent, int parentFd, const char *name) {
+    size_t length = strlen(name);
+    CleanupNode *node = malloc(sizeof(CleanupNode) + length + 1);
+    if (node == NULL) {
+        fprintf(stderr, "Error: out of memory while deleting\n");
+        return NULL;
+    }
+    memset(node, 0, sizeof(*node));
+    node->parent = parent;
+    node->parentFd = parentFd;
+    node->handle.fd = -1;
+    node->device = parent != NULL ? parent->device : 0;
+    atomic_init(&node->pending, 1);
+    atomic_init(&node->failed, false);
+    memcpy(node->name, name, length + 1);
+    return node;
+}
+
+void queueCleanupNode(Cleanup *cleanup, CleanupNode *node) {
+    pthread_mutex_lock(&cleanup->lock);
+    node->nextQueued = cleanup->queue;
+    cleanup->queue = node;
+    pthread_cond_signal(&cleanup->wake);
+    pthread_mutex_unlock(&cleanup->lock);
+}
+
+// Removes an emptied directory, then each ancestor it was the last subdirectory of.
+void finishCleanupNode(Cleanup *cleanup, CleanupNode *node) {
+    while (node != NULL) {
+        bool failed = atomic_load(&node->failed);
+        if (node->handle.fd >= 0) {
+            closeDirectory(&node->handle, node->name);
+        }
+        if (node->opened && !failed) {
+            if (cleanup->dryRun || cleanupUnlink(cleanup, node->parentFd, node->name, AT_REMOVEDIR)) {
+                atomic_fetch_add(&cleanup->directories, 1);
+            } else {
+                reportCleanupError(cleanup, node, NULL, "remove");
+                failed = true;
+            }
+        }
+
+        CleanupNode *parent = node->parent;
+        if (parent == NULL) {
+            if (!failed && !cleanup->dryRun && cleanup->journal != NULL) {
+                pthread_mutex_lock(&cleanup->lock);
+                fprintf(cleanup->journal, "%s\n", node->selectedPath);
+                fflush(cleanup->journal);
+                pthread_mutex_unlock(&cleanup->lock);
+            }
+            close(node->parentFd);
+            free(node->selectedPath);
+        } else if (failed) {
+            atomic_store(&parent->failed, true);
+        }
+        free(node);
+        node = parent != NULL && atomic_fetch_sub(&parent->pending, 1) == 1 ? parent : NULL;
+    }
+}
+
+typedef struct CleanupListing {
+    Cleanup *cleanup;
+    CleanupNode *node;
+    NameList files;
+    NameList subdirs;
+    bool ok;
+} CleanupListing;
+
+bool cleanupListingVisitor(void *context, int dirFd, const char *name, unsigned char type) {
+    CleanupListing *listing = context;
+    struct stat statbuf;
+    bool needStat = type == DT_UNKNOWN || (listing->cleanup->dryRun && type != DT_DIR);
+    if (needStat) {
+        long long started = statsClock();
+        bool statted = fstatat(dirFd, name, &statbuf, AT_SYMLINK_NOFOLLOW) == 0;
+        statsRecordCall(STATS_CALL_STAT, started, !statted);
+        if (!statted) {
+            if (errno != ENOENT) {
+                reportCleanupError(listing->cleanup, listing->node, name, "inspect");
+                atomic_store(&listing->node->failed, true);
+            }
+            return true;
+        }
+        type = S_ISDIR(statbuf.st_mode) ? DT_DIR : DT_REG;
+    }
+
+    if (type == DT_DIR) {
+        listing->ok = nameListAppend(&listing->subdirs, name);
+    } else if (listing->cleanup->dryRun) {
+        atomic_fetch_add(&listing->cleanup->files, 1);
+        if (S_ISREG(statbuf.st_mode)) {
+            atomic_fetch_add(&listing->cleanup->bytes, (unsigned long long)statbuf.st_size);
+        }
+    } else {
+        listing->ok = nameListAppend(&listing->files, name);
+    }
+    return listing->ok;
+}
+
+// Empties one directory of everything but its subdirectories, which are queued; it is
+// removed when the last of them is. Names are listed in full before any is unlinked, so
+// the listing never runs over entries removed under it.
+void processCleanupNode(Cleanup *cleanup, CleanupNode *node) {
+    if (!openDirectoryAt(node->parentFd, node->name, false, &node->handle)) {
+        // Already gone, perhaps removed by an interrupted run.
+        if (errno != ENOENT) {
+            reportCleanupError(cleanup, node, NULL, "open");
+            atomic_store(&node->failed, true);
+        }
+        node->handle.fd = -1;
+        atomic_store(&node->pending, 0);
+        finishCleanupNode(cleanup, node);
+        return;
+    }
+    node->opened = true;
+    if (!statDirectoryHandle(&node->handle)) {
+        reportCleanupError(cleanup, node, NULL, "inspect");
+        atomic_store(&node->failed, true);
+    } else if (node->parent == NULL) {
+        node->device = node->handle.stat.st_dev;
+    } else if (node->handle.stat.st_dev != node->device) {
+        PathBuffer path = {0};
+        cleanupNodePath(node, &path);
+        fprintf(stderr, "Not deleting '%s': another filesystem is mounted there\n", path.data != NULL ? path.data : node->name);
+        pathBufferFree(&path);
+        atomic_fetch_add(&cleanup->errors, 1);
+        atomic_store(&node->failed, true);
+    }
+    if (atomic_load(&node->failed)) {
+        atomic_store(&node->pending, 0);
+        finishCleanupNode(cleanup, node);
+        return;
+    }
+
+    CleanupListing listing = { .cleanup = cleanup, .node = node, .ok = true };
+    if (!forEachDirectoryEntry(&node->handle, cleanupListingVisitor, &listing)) {
+        reportCleanupError(cleanup, node, NULL, "read");
+        atomic_store(&node->failed, true);
+    }
+    if (!listing.ok) {
+        atomic_store(&node->failed, true);
+        atomic_fetch_add(&cleanup->errors, 1);
+    }
+    for (size_t i = 0; i < listing.files.count; i++) {
+        if (cleanupUnlink(cleanup, node->handle.fd, listing.files.names[i], 0)) {
+            atomic_fetch_add(&cleanup->files, 1);
+        } else {
+            reportCleanupError(cleanup, node, listing.files.names[i], "remove");
+            atomic_store(&node->failed, true);
+        }
+    }
+
+    atomic_store(&node->pending, listing.subdirs.count + 1);
+    for (size_t i = 0; i < listing.subdirs.count; i++) {
+        CleanupNode *child = newCleanupNode(node, node->handle.fd, listing.subdirs.names[i]);
+        if (child == NULL) {
+            atomic_store(&node->failed, true);
+            atomic_fetch_sub(&node->pending, 1);
+            continue;
+        }
+        queueCleanupNode(cleanup, child);
+    }
+    nameListFree(&listing.files);
+    nameListFree(&listing.subdirs);
+    if (atomic_fetch_sub(&node->pending, 1) == 1) {
+        finishCleanupNode(cleanup, node);
+    }
+}
+
+void *cleanupWorker(void *argument) {
+    Cleanup *cleanup = argument;
+    pthread_mutex_lock(&cleanup->lock);
+    while (true) {
+        while (cleanup->queue == NULL && cleanup->busy > 0) {
+            pthread_cond_wait(&cleanup->wake, &cleanup->lock);
+        }
+        if (cleanup->queue == NULL) {
+            break;
+        }
+        // Newest first, so the walk stays depth-first and few directories are held open.
+        CleanupNode *node = cleanup->queue;
+        cleanup->queue = node->nextQueued;
+        cleanup->busy++;
+        pthread_mutex_unlock(&cleanup->lock);
+        processCleanupNode(cleanup, node);
+        pthread_mutex_lock(&cleanup->lock);
+        cleanup->busy--;
+    }
+    pthread_cond_broadcast(&cleanup->wake);
+    pthread_mutex_unlock(&cleanup->lock);
+    releaseScanThreadState();
+    return NULL;
+}
+
+// Whether the sorted paths hold the first length bytes of path as a whole path.
+bool sortedPathsContain(char **paths, size_t count, const char *path, size_t length) {
+    size_t low = 0;
+    size_t high = count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        int order = strncmp(paths[middle], path, length);
+        if (order == 0) {
+            order = paths[middle][length] == '\0' ? 0 : 1;
+        }
+        if (order == 0) {
+            return true;
+        }
+        if (order < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return false;
+}
+
+// Reads the directories a selection lists, leaving out those below another listed one and
+// those the journal records as removed.
+bool loadCleanupSelection(const char *selectionPath, const char *journalPath, NameList *selected) {
+    ResultReader reader;
+    if (!openResultReader(&reader, selectionPath)) {
+        fprintf(stderr, "Error opening %s: %s\n", selectionPath, strerror(errno));
+        return false;
+    }
+    NameList listed = {0};
+    ResultEntry entry;
+    bool ok = true;
+    while (ok && readNextResult(&reader, &entry)) {
+        ok = nameListAppend(&listed, entry.path);
+    }
+    closeResultReader(&reader);
+
+    NameList journaled = {0};
+    FILE *journal = fopen(journalPath, "r");
+    char *line = NULL;
+    size_t lineCapacity = 0;
+    while (ok && journal != NULL && getline(&line, &lineCapacity, journal) != -1) {
+        line[strcspn(line, "\n")] = '\0';
+        ok = nameListAppend(&journaled, line);
+    }
+    free(line);
+    if (journal != NULL) {
+        fclose(journal);
+    }
+
+    if (ok) {
+        qsort(listed.names, listed.count, sizeof(char *), compareNames);
+        qsort(journaled.names, journaled.count, sizeof(char *), compareNames);
+    }
+    for (size_t i = 0; ok && i < listed.count; i++) {
+        const char *path = listed.names[i];
+        bool covered = sortedPathsContain(journaled.names, journaled.count, path, strlen(path));
+        // Paths sort before the paths below them, so any listed ancestor is already kept.
+        for (const char *separator = strchr(path + 1, PATH_SEPARATOR[0]); !covered && separator != NULL;
+             separator = strchr(separator + 1, PATH_SEPARATOR[0])) {
+            covered = sortedPathsContain(selected->names, selected->count, path, (size_t)(separator - path));
+        }
+        if (!covered) {
+            ok = nameListAppend(selected, path);
+        }
+    }
+    nameListFree(&listed);
+    nameListFree(&journaled);
+    return ok;
+}
+
+// Queues a selected directory, opening the directory that contains it by path; this is
+// the only path resolution in the whole deletion.
+bool queueSelectedDirectory(Cleanup *cleanup, const char *selectedPath) {
+    char *path = strdup(selectedPath);
+    if (path == NULL) {
+        fprintf(stderr, "Error: out of memory while deleting\n");
+        return false;
+    }
+    size_t length = strlen(path);
+    while (length > 1 && path[length - 1] == PATH_SEPARATOR[0]) {
+        path[--length] = '\0';
+    }
+    char *separator = strrchr(path, PATH_SEPARATOR[0]);
+    const char *name = separator != NULL ? separator + 1 : path;
+    if (strcmp(name, "") == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        fprintf(stderr, "Not deleting '%s'\n", selectedPath);
+        free(path);
+        atomic_fetch_add(&cleanup->errors, 1);
+        return true;
+    }
+
+    int parentFd;
+    if (separator == NULL) {
+        parentFd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    } else if (separator == path) {
+        parentFd = open(PATH_SEPARATOR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    } else {
+        *separator = '\0';
+        parentFd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (parentFd < 0) {
+        // Nothing to delete if the parent is gone too.
+        if (errno != ENOENT) {
+            fprintf(stderr, "Failed to open the directory containing '%s': %s\n", selectedPath, strerror(errno));
+            atomic_fetch_add(&cleanup->errors, 1);
+        }
+        free(path);
+        return true;
+    }
+
+    CleanupNode *node = newCleanupNode(NULL, parentFd, name);
+    free(path);
+    if (node == NULL || (node->selectedPath = strdup(selectedPath)) == NULL) {
+        free(node);
+        close(parentFd);
+        return false;
+    }
+    queueCleanupNode(cleanup, node);
+    return true;
+}
+
+// Deletes, or with dryRun only measures, everything selectionPath lists. Uses the
+// --threads workers, or one per CPU, as hashing does.
+bool runCleanup(const char *selectionPath, bool dryRun) {
+    PathBuffer journalPath = {0};
+    NameList selected = {0};
+    if (!indexPathFor(selectionPath, ".journal", &journalPath) ||
+        !loadCleanupSelection(selectionPath, journalPath.data, &selected)) {
+        pathBufferFree(&journalPath);
+        nameListFree(&selected);
+        return false;
+    }
+
+    Cleanup cleanup;
+    memset(&cleanup, 0, sizeof(cleanup));
+    cleanup.dryRun = dryRun;
+    cleanup.rate = scanOptions.deleteRate;
+    pthread_mutex_init(&cleanup.lock, NULL);
+    pthread_cond_init(&cleanup.wake, NULL);
+    atomic_init(&cleanup.operations, 0);
+    atomic_init(&cleanup.files, 0);
+    atomic_init(&cleanup.directories, 0);
+    atomic_init(&cleanup.bytes, 0);
+    atomic_init(&cleanup.errors, 0);
+    bool ok = true;
+    if (!dryRun && (cleanup.journal = fopen(journalPath.data, "a")) == NULL) {
+        fprintf(stderr, "Failed to open the journal '%s': %s\n", journalPath.data, strerror(errno));
+        ok = false;
+    }
+    // Queued last to first, so the workers start from the first.
+    for (size_t i = selected.count; ok && i-- > 0;) {
+        ok = queueSelectedDirectory(&cleanup, selected.names[i]);
+    }
+
+    double phaseStarted = statsPhaseStart();
+    cleanup.started = monotonicSeconds();
+    long threads = scanOptions.threads > 1 ? scanOptions.threads : sysconf(_SC_NPROCESSORS_ONLN);
+    threads = MAX(1, MIN(threads, MAX_SCAN_THREADS));
+    pthread_t workers[MAX_SCAN_THREADS];
+    long started = 0;
+    // Even when queueing failed, what was queued is processed so every descriptor closes.
+    while (started < threads - 1 && pthread_create(&workers[started], NULL, cleanupWorker, &cleanup) == 0) {
+        started++;
+    }
+    cleanupWorker(&cleanup);
+    for (long i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    double elapsed = monotonicSeconds() - cleanup.started;
+    statsPhaseEnd(STATS_PHASE_DELETE, phaseStarted);
+
+    unsigned long long files = atomic_load(&cleanup.files);
+    unsigned long long directories = atomic_load(&cleanup.directories);
+    unsigned long long errors = atomic_load(&cleanup.errors);
+    if (dryRun) {
+        printf("%zu selected directories hold %llu files and %llu directories, %llu bytes in all\n",
+               selected.count, files, directories, atomic_load(&cleanup.bytes));
+    } else {
+        printf("Removed %llu files and %llu directories in %.1f s (%.0f per second)\n", files, directories,
+               elapsed, elapsed > 0 ? (files + directories) / elapsed : 0.0);
+    }
+    if (errors > 0) {
+        printf("%llu entries could not be %s; see the messages above\n", errors, dryRun ? "inspected" : "removed");
+    }
+    if (cleanup.journal != NULL && fclose(cleanup.journal) == EOF) {
+        fprintf(stderr, "Failed to write the journal '%s': %s\n", journalPath.data, strerror(errno));
+        ok = false;
+    }
+    pthread_mutex_destroy(&cleanup.lock);
+    pthread_cond_destroy(&cleanup.wake);
+    pathBufferFree(&journalPath);
+    nameListFree(&selected);
+    return ok && errors == 0;
+}
+
+// Writes the results the viewer's filters select as a text selection for runCleanup,
+// next to the results, and starts a fresh journal for it.
+bool writeCleanupSelection(const char *resultsPath, ResultSearch *search, unsigned long long sizeThreshold, PathBuffer *selectionPath) {
+    PathBuffer journalPath = {0};
+    FILE *file = NULL;
+    if (indexPathFor(resultsPath, ".delete", selectionPath) && indexPathFor(selectionPath->data, ".journal", &journalPath)) {
+        file = fopen(selectionPath->data, "w");
+    }
+    if (file == NULL) {
+        perror("Error creating the deletion list");
+        pathBufferFree(&journalPath);
+        return false;
+    }
+    unlink(journalPath.data);
+    pathBufferFree(&journalPath);
+
+    unsigned long long count = 0;
+    ResultEntry entry;
+    resultSearchSeek(search, 0);
+    while (readNextMatch(search, &entry)) {
+        if (entry.size >= sizeThreshold) {
+            fprintf(file, "%s - %llu bytes\n", entry.path, entry.size);
+            count++;
+        }
+    }
+    if (fclose(file) == EOF) {
+        perror("Error writing the deletion list");
+        return false;
+    }
+    printf("%llu results selected, listed in %s\n", count, selectionPath->data);
+    return count > 0;
+}
+
+void viewLastScanResults(const char *filePath) {
+    if (filePath == NULL) {
+        perror("Error: filePath is NULL");
+        return;
+    }
+
+    ResultReader reader;
+    if (!openResultReader(&reader, filePath)) {
+        perror("Error: Unable to open the file for reading");
+        return;
+    }
+    ResultIndex index;
+    bool haveIndex = openResultIndex(&index, filePath);
+    ResultSearch search;
+    if (!beginResultSearch(&search, &reader, NULL, "", false)) {
+        closeResultIndex(&index);
+        closeResultReader(&reader);
+        return;
+    }
+
+    char searchFilter[256] = "";
+    bool isFilteringActive = false;
+    unsigned long long sizeThreshold = 0;
+    bool useSizeThreshold = false;
+    SortedView view = {0};
+    // Where each page seen so far starts; pageStarts[0] is always 0. An unfiltered view
+    // has fixed-size pages and needs none of them.
+    long long *pageStarts = malloc(sizeof(long long));
+    size_t knownPages = 1;
+    size_t pageCapacity = 1;
+    size_t page = 0;
+    bool atEnd = false;
+    int iterations = 0;
+    if (pageStarts == NULL) {
+        fprintf(stderr, "Error: out of memory\n");
+        endResultSearch(&search);
+        closeResultIndex(&index);
+        closeResultReader(&reader);
+        return;
+    }
+    pageStarts[0] = 0;
+
+    while (iterations < MAX_ITERATIONS) {
+        iterations++;
+        bool fixedPages = view.data != NULL && !isFilteringActive && !useSizeThreshold;
+        long long position = fixedPages ? (long long)(page * LINES_PER_PAGE) : pageStarts[page];
+
+        printf("\n--- Directory Size Scanner - Last Scan Results ---\n");
+        if (view.data != NULL) {
+            printf("Order: %s\n", resultOrderNames[view.order]);
+        }
+        if (isFilteringActive) {
+            printf("Current Filter: %s\n", searchFilter);
+        }
+        if (useSizeThreshold) {
+            printf("Size Threshold: %llu bytes\n", sizeThreshold);
+        }
+        if (fixedPages) {
+            printf("Page %zu of %llu\n", page + 1, (unsigned long long)MAX((view.count + LINES_PER_PAGE - 1) / LINES_PER_PAGE, 1));
+        } else {
+            printf("Page %zu\n", page + 1);
+        }
         printf("-------------------------------------------------\n");
-        printf("Commands: [N]ext, [S]earch, [E]xport, [F]ilter by Size, [Q]uit: ");
+
+        long long nextPosition = readResultPage(&search, &view, position, sizeThreshold, true, &atEnd);
+        if (!fixedPages && page + 1 == knownPages && !atEnd) {
+            if (knownPages == pageCapacity) {
+                long long *grown = realloc(pageStarts, pageCapacity * 2 * sizeof(long long));
+                if (grown != NULL) {
+                    pageStarts = grown;
+                    pageCapacity *= 2;
+                }
+            }
+            if (knownPages < pageCapacity) {
+                pageStarts[knownPages++] = nextPosition;
+            }
+        }
+
+        printf("-------------------------------------------------\n");
+        printf("Commands: [N]ext, [P]revious, [G]o to page, [O]rder, [S]earch, [E]xport, [F]ilter by Size, [L]argest, [D]elete, [Q]uit: ");
         char command = getchar();
         while (getchar() != '\n'); // Clear the buffer
 
-        switch (command) {
-            case 'N':
-            case 'n':
-                if (feof(file)) {
-                    printf("\nEnd of file reached. No more data to display.\n");
-                    continue;
+        switch (command) {
+            case 'N':
+            case 'n':
+                if (atEnd || (!fixedPages && page + 1 >= knownPages)) {
+                    printf("\nEnd of file reached. No more data to display.\n");
+                    continue;
+                }
+                page++;
+                break;
+            case 'P':
+            case 'p':
+                if (page == 0) {
+                    printf("\nAlready at the first page.\n");
+                    continue;
+                }
+                page--;
+                break;
+            case 'G':
+            case 'g':
+                {
+                    char pageText[32];
+                    printf("Go to page: ");
+                    if (fgets(pageText, sizeof(pageText), stdin) == NULL) {
+                        perror("Error reading the page number");
+                        continue;
+                    }
+                    char *end;
+                    long long target = strtoll(pageText, &end, 10);
+                    if (end == pageText || target < 1) {
+                        printf("Invalid page number.\n");
+                        continue;
+                    }
+                    size_t wanted = (size_t)target - 1;
+                    if (fixedPages) {
+                        if (wanted * LINES_PER_PAGE >= MAX(view.count, 1)) {
+                            printf("There are only %llu pages.\n", (unsigned long long)MAX((view.count + LINES_PER_PAGE - 1) / LINES_PER_PAGE, 1));
+                            continue;
+                        }
+                        page = wanted;
+                        break;
+                    }
+                    // With filters, page starts are only known by reading the pages before.
+                    bool pageAtEnd = false;
+                    while (knownPages <= wanted && !pageAtEnd) {
+                        long long start = readResultPage(&search, &view, pageStarts[knownPages - 1], sizeThreshold, false, &pageAtEnd);
+                        if (pageAtEnd) {
+                            break;
+                        }
+                        if (knownPages == pageCapacity) {
+                            long long *grown = realloc(pageStarts, pageCapacity * 2 * sizeof(long long));
+                            if (grown == NULL) {
+                                break;
+                            }
+                            pageStarts = grown;
+                            pageCapacity *= 2;
+                        }
+                        pageStarts[knownPages++] = start;
+                    }
+                    if (wanted >= knownPages) {
+                        printf("There are only %zu pages.\n", knownPages);
+                        continue;
+                    }
+                    page = wanted;
+                }
+                break;
+            case 'O':
+            case 'o':
+                {
+                    printf("Order by [F]ile order, [S]ize, [P]ath or [C]ount of entries: ");
+                    char choice = getchar();
+                    if (choice != '\n') {
+                        while (getchar() != '\n');
+                    }
+                    ResultOrder order = choice == 'S' || choice == 's' ? RESULT_ORDER_SIZE :
+                                        choice == 'P' || choice == 'p' ? RESULT_ORDER_PATH :
+                                        choice == 'C' || choice == 'c' ? RESULT_ORDER_ENTRIES : RESULT_ORDER_FILE;
+                    if (order == RESULT_ORDER_FILE && choice != 'F' && choice != 'f') {
+                        printf("Invalid order. Please try again.\n");
+                        continue;
+                    }
+                    closeSortedView(&view);
+                    if (order != RESULT_ORDER_FILE && !loadSortedView(&view, filePath, order)) {
+                        printf("Could not sort the results; showing them in file order.\n");
+                    }
+                    page = 0;
+                    knownPages = 1;
+                }
+                break;
+            case 'S':
+            case 's':
+                printf("Enter search filter: ");
+                if (fgets(searchFilter, sizeof(searchFilter), stdin) == NULL) {
+                    perror("Error reading search filter");
+                    continue;
+                }
+                searchFilter[strcspn(searchFilter, "\n")] = 0;
+                endResultSearch(&search);
+                if (!beginResultSearch(&search, &reader, haveIndex ? &index : NULL, searchFilter, false)) {
+                    free(pageStarts);
+                    closeSortedView(&view);
+                    closeResultIndex(&index);
+                    closeResultReader(&reader);
+                    return;
+                }
+                isFilteringActive = true;
+                page = 0;
+                knownPages = 1;
+                break;
+            case 'F':
+            case 'f':
+                sizeThreshold = askForSizeThreshold();
+                if (sizeThreshold == -1) {
+                    perror("Error getting size threshold");
+                    continue;
+                }
+                useSizeThreshold = sizeThreshold > 0;
+                page = 0;
+                knownPages = 1;
+                break;
+            case 'L':
+            case 'l':
+                {
+                    char countText[32];
+                    printf("How many directories? ");
+                    if (fgets(countText, sizeof(countText), stdin) == NULL) {
+                        perror("Error reading directory count");
+                        continue;
+                    }
+                    char *end;
+                    long long count = strtoll(countText, &end, 10);
+                    if (end == countText || count < 1 || count > MAX_TOP_COUNT) {
+                        printf("Invalid count. Please enter a number between 1 and %d.\n", MAX_TOP_COUNT);
+                        continue;
+                    }
+                    printf("\n--- Largest Directories ---\n");
+                    printLargestDirectories(filePath, (size_t)count);
+                }
+                break;
+            case 'D':
+            case 'd':
+                {
+                    if (!isFilteringActive && !useSizeThreshold) {
+                        printf("Search or filter by size first to choose what to delete.\n");
+                        continue;
+                    }
+                    PathBuffer selectionPath = {0};
+                    if (writeCleanupSelection(filePath, &search, sizeThreshold, &selectionPath) &&
+                        runCleanup(selectionPath.data, true) && askYesNoQuestion("Delete them?")) {
+                        runCleanup(selectionPath.data, false);
+                        printf("These results are out of date until the next scan.\n");
+                    }
+                    pathBufferFree(&selectionPath);
+                }
+                break;
+            case 'Q':
+            case 'q':
+                free(pageStarts);
+                closeSortedView(&view);
+                endResultSearch(&search);
+                closeResultIndex(&index);
+                closeResultReader(&reader);
+                return;
+            case 'E':
+            case 'e':
+                {
+                    char exportFilePath[256];
+                    printf("Enter export file path: ");
+                    if (fgets(exportFilePath, sizeof(exportFilePath), stdin) == NULL) {
+                        perror("Error reading export file path");
+                        continue;
+                    }
+                    exportFilePath[strcspn(exportFilePath, "\n")] = 0;
+
+                    if (exportResults(filePath, exportFilePath, searchFilter) == -1) {
+                        perror("Error exporting results");
+                        continue;
+                    }
+                }
+                break;
+            default:
+                printf("Invalid command. Please try again.\n");
+                break;
+        }
+    }
+
+    if (iterations == MAX_ITERATIONS) {
+        printf("Maximum number of iterations reached. Exiting...\n");
+    }
+
+    free(pageStarts);
+    closeSortedView(&view);
+    endResultSearch(&search);
+    closeResultIndex(&index);
+    closeResultReader(&reader);
+}
+
+// Prints every result whose path contains keywords, ignoring case. Uses the search index
+// next to the results when there is a current one.
+void searchResults(const char *filePath, char *keywords) {
+    ResultReader reader;
+    if (!openResultReader(&reader, filePath)) {
+        perror("Error opening the output file");
+        return;
+    }
+    ResultIndex index;
+    bool haveIndex = openResultIndex(&index, filePath);
+
+    double start = monotonicSeconds();
+    ResultSearch search;
+    if (beginResultSearch(&search, &reader, haveIndex ? &index : NULL, keywords, true)) {
+        unsigned long long matches = 0;
+        ResultEntry entry;
+        while (readNextMatch(&search, &entry)) {
+            printLine(entry.path, entry.size);
+            matches++;
+        }
+        printf("%llu results in %.1f ms%s\n", matches, (monotonicSeconds() - start) * 1e3,
+               search.indexed ? " (indexed)" : "");
+        endResultSearch(&search);
+    }
+
+    closeResultIndex(&index);
+    closeResultReader(&reader);
+}
+
+// Lists the entries of basePath, and the directories below each, skipping entries whose
+// names the skip rules match.
+void listApps(const char *basePath, FILE *outputFile, const ExcludeRules *skip, int isRoot, int *processedDirs, int totalDirs) {
+    if (basePath == NULL || outputFile == NULL || processedDirs == NULL) {
+        fprintf(stderr, "Invalid arguments to listApps\n");
+        return;
+    }
+
+    DirHandle handle;
+    if (!openDirectoryAt(AT_FDCWD, basePath, true, &handle)) {
+        fprintf(stderr, "Failed to open directory: %s\n", basePath);
+        return;
+    }
+
+    PathBuffer path = {0};
+    if (pathBufferAppend(&path, basePath, false) == SIZE_MAX) {
+        closeDirectory(&handle, basePath);
+        return;
+    }
+
+    DIR *stream = directoryStream(&handle);
+    struct dirent *entry;
+    while (stream != NULL && (entry = readdir(stream)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue; // Skip current and parent directories
+        }
+
+        if (excludeRulesMatch(skip, entry->d_name, entry->d_name)) {
+            continue;
+        }
+
+        size_t baseLength = pathBufferAppend(&path, entry->d_name, true);
+        if (baseLength == SIZE_MAX) {
+            break;
+        }
+
+        // d_type answers the question for nearly every entry; stat only when it can't
+        bool isDirectory = DIRENT_TYPE(entry) == DT_DIR;
+        if (DIRENT_TYPE(entry) == DT_UNKNOWN) {
+            struct stat statbuf;
+            if (fstatat(handle.fd, entry->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) != 0) {
+                fprintf(stderr, "Failed to get file status for: %s\n", path.data);
+                pathBufferTruncate(&path, baseLength);
+                continue;
+            }
+            isDirectory = S_ISDIR(statbuf.st_mode);
+        }
+
+        if (isDirectory) {
+            listDirectories(path.data, outputFile, 0, NULL);
+        } else {
+            fprintf(outputFile, "%s\n", path.data);
+        }
+        pathBufferTruncate(&path, baseLength);
+
+        if (*processedDirs < totalDirs) {
+            (*processedDirs)++;
+            if (isRoot) {
+                printf("\rScanning directories... %d/%d", *processedDirs, totalDirs);
+                fflush(stdout);
+            }
+        } else {
+            fprintf(stderr, "\nError: processedDirs exceeds totalDirs\n");
+            break;
+        }
+    }
+
+    pathBufferFree(&path);
+    closeDirectory(&handle, basePath);
+}
+
+void scanForApps() {
+    char *homeDir = getenv("HOME");
+    if (homeDir == NULL) {
+        perror("Error: HOME environment variable is not set");
+        return;
+    }
+
+    char containersDirPath[256];
+    if (snprintf(containersDirPath, sizeof(containersDirPath), "%s/Library/Containers", homeDir) < 0) {
+        perror("Error formatting containers directory path");
+        return;
+    }
+
+    char appSupportDirPath[256];
+    if (snprintf(appSupportDirPath, sizeof(appSupportDirPath), "%s/Library/Application Support", homeDir) < 0) {
+        perror("Error formatting application support directory path");
+        return;
+    }
+
+    char outputFilePath[256];
+    if (snprintf(outputFilePath, sizeof(outputFilePath), "apps.txt", homeDir) < 0) {
+        perror("Error formatting output file path");
+        return;
+    }
+
+    FILE *outputFile = fopen(outputFilePath, "w");
+    if (outputFile == NULL) {
+        perror("Error opening the output file for writing");
+        return;
+    }
+
+    // Apple's own containers are not apps the user installed.
+    ExcludeRules appleApps = {0};
+    addExcludeRule(&appleApps, "*com.apple*");
+
+    int totalDirectories = countTotalDirectories(containersDirPath, 0);
+    int processedDirectories = 0; // Declare and initialize processedDirectories
+    listApps(containersDirPath, outputFile, &appleApps, 0, &processedDirectories, totalDirectories);
+
+    totalDirectories = countTotalDirectories(appSupportDirPath, 0);
+    listApps(appSupportDirPath, outputFile, &appleApps, 0, &processedDirectories, totalDirectories);
+    freeExcludeRules(&appleApps);
+
+    if (fclose(outputFile) == EOF) {
+        perror("Error closing the output file");
+        return;
+    }
+
+    printf("Scan complete. Results have been written to %s\n", outputFilePath);
+}
+
+void printMenu() {
+    printf("\n+------------------------------------+\n");
+    printf("| Directory Size Scanner Menu:       |\n");
+    printf("+------------------------------------+\n");
+    printf("| 1. Start Scan                      |\n");
+    printf("| 2. Set Output File Path            |\n");
+    printf("| 3. View Last Scan Results          |\n");
+    printf("| 4. Search Apps                     |\n");
+    printf("| 5. Scan Known Dir                  |\n");
+    printf("| 00. Exit                           |\n");
+    printf("+------------------------------------+\n");
+}
+
+void setTerminalTitle(const char *title) {
+    if (title == NULL) {
+        perror("Error: title is NULL");
+        return;
+    }
+
+#ifdef _WIN32
+    SetConsoleTitle(title);
+#else
+    printf("\033]0;%s\007", title);
+    fflush(stdout);
+#endif
+}
+
+// Fills path with the requested number of empty files. A marker next to the directory
+// records a finished fill so repeated benchmark runs reuse it.
+bool createSyntheticDirectory(const char *path, unsigned long long entries) {
+    char marker[MAX_PATH_LEN];
+    snprintf(marker, sizeof(marker), "%s.complete", path);
+    if (access(marker, F_OK) == 0) {
+        return true;
+    }
+
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create directory '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+    int dirFd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd < 0) {
+        fprintf(stderr, "Failed to open directory '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+
+    fprintf(stderr, "Creating %llu entries in %s...\n", entries, path);
+    for (unsigned long long i = 0; i < entries; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "e%010llu", i);
+        int fd = openat(dirFd, name, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "Failed to create '%s/%s': %s\n", path, name, strerror(errno));
+            close(dirFd);
+            return false;
+        }
+        close(fd);
+    }
+    close(dirFd);
+
+    FILE *markerFile = fopen(marker, "w");
+    if (markerFile != NULL) {
+        fclose(markerFile);
+    }
+    return true;
+}
+
+bool countingVisitor(void *context, int dirFd, const char *name, unsigned char type) {
+    (void)dirFd;
+    (void)name;
+    (void)type;
+    (*(unsigned long long *)context)++;
+    return true;
+}
+
+// Best-of-BENCH_LISTING_ROUNDS entries per second for a name-only listing of path.
+double benchmarkListing(const char *path, bool useGetdents) {
+    bool savedUseGetdents = scanOptions.useGetdents;
+    scanOptions.useGetdents = useGetdents;
+
+    double best = 0;
+    for (int round = 0; round < BENCH_LISTING_ROUNDS; round++) {
+        DirHandle handle;
+        if (!openDirectoryAt(AT_FDCWD, path, true, &handle)) {
+            fprintf(stderr, "Failed to open directory '%s': %s\n", path, strerror(errno));
+            break;
+        }
+
+        unsigned long long entries = 0;
+        double start = monotonicSeconds();
+        if (!forEachDirectoryEntry(&handle, countingVisitor, &entries)) {
+            fprintf(stderr, "Failed to read directory '%s': %s\n", path, strerror(errno));
+        }
+        double elapsed = monotonicSeconds() - start;
+        closeDirectory(&handle, path);
+
+        if (elapsed > 0 && entries / elapsed > best) {
+            best = entries / elapsed;
+        }
+    }
+
+    scanOptions.useGetdents = savedUseGetdents;
+    return best;
+}
+
+int runListingBenchmark(const char *root, const char *sizes) {
+    if (mkdir(root, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create directory '%s': %s\n", root, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    printf("%-12s %20s %20s %10s\n", "entries", "readdir (entries/s)", "getdents64 (entries/s)", "speedup");
+    const char *cursor = sizes;
+    while (*cursor != '\0') {
+        char *end;
+        unsigned long long entries = strtoull(cursor, &end, 10);
+        if (end == cursor) {
+            fprintf(stderr, "Invalid benchmark size list '%s'\n", sizes);
+            return EXIT_FAILURE;
+        }
+        cursor = *end == ',' ? end + 1 : end;
+
+        char path[MAX_PATH_LEN];
+        snprintf(path, sizeof(path), "%s%slisting-%llu", root, PATH_SEPARATOR, entries);
+        if (!createSyntheticDirectory(path, entries)) {
+            return EXIT_FAILURE;
+        }
+
+        double readdirRate = benchmarkListing(path, false);
+#ifdef __linux__
+        double getdentsRate = benchmarkListing(path, true);
+        printf("%-12llu %20.0f %20.0f %9.2fx\n", entries, readdirRate, getdentsRate,
+               readdirRate > 0 ? getdentsRate / readdirRate : 0);
+#else
+        printf("%-12llu %20.0f %20s %10s\n", entries, readdirRate, "n/a", "n/a");
+#endif
+    }
+    return EXIT_SUCCESS;
+}
+
+// Synthetic result paths for --bench-match: a few mixed-case components from a fixed
+// vocabulary plus a numbered file name, generated from a fixed seed so runs compare.
+char *buildMatchCorpus(size_t count, size_t **offsetsOut, size_t *bytesOut) {
+    static const char *components[] = {
+        "Users", "home", "Library", "Caches", "src", "node_modules", "Projects", "build",
+        "Documents", "tmp", "Logs", "com.apple.Safari", "Photos Library", "Backup", "lib",
+        "share", "cache", "Trace", "python3", "site-packages", "Downloads", "var", "DerivedData",
+        "Application Support", "locale", "LC_MESSAGES", "doc", "include", "Mail", "Movies"
+    };
+    size_t componentCount = sizeof(components) / sizeof(components[0]);
+    size_t capacity = count * 96;
+    char *corpus = malloc(capacity);
+    size_t *offsets = malloc((count + 1) * sizeof(size_t));
+    if (corpus == NULL || offsets == NULL) {
+        free(corpus);
+        free(offsets);
+        return NULL;
+    }
+
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    size_t used = 0;
+    for (size_t i = 0; i < count; i++) {
+        offsets[i] = used;
+        char path[MAX_PATH_LEN];
+        size_t length = 0;
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        int depth = 2 + (int)(state % 7);
+        for (int level = 0; level < depth; level++) {
+            const char *component = components[(state >> (8 + 5 * level)) % componentCount];
+            length += (size_t)snprintf(path + length, sizeof(path) - length, "/%s", component);
+        }
+        length += (size_t)snprintf(path + length, sizeof(path) - length, "/file%06llu.dat", (unsigned long long)(state % 1000000));
+        if (used + length + 1 > capacity) {
+            break;
+        }
+        memcpy(corpus + used, path, length + 1);
+        used += length + 1;
+    }
+    offsets[count] = used;
+    *offsetsOut = offsets;
+    *bytesOut = used;
+    return corpus;
+}
+
+// The filter loop the viewer and search used before keyword queries: lowercase a copy of
+// the path, then strstr for every keyword.
+bool matchesByLowercasing(const KeywordQuery *query, const char *path, char *copy) {
+    strcpy(copy, path);
+    toLowerString(copy);
+    for (size_t i = 0; i < query->termCount; i++) {
+        bool found = false;
+        for (uint64_t pending = query->terms[i].needles; pending != 0 && !found; pending &= pending - 1) {
+            found = strstr(copy, query->needles[__builtin_ctzll(pending)].text) != NULL;
+        }
+        if (found == query->terms[i].exclude) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int runMatchBenchmark(const char *queryText) {
+    size_t *offsets;
+    size_t bytes;
+    char *corpus = buildMatchCorpus(BENCH_MATCH_PATHS, &offsets, &bytes);
+    KeywordQuery query;
+    if (corpus == NULL) {
+        fprintf(stderr, "Error: out of memory while building the benchmark corpus\n");
+        return EXIT_FAILURE;
+    }
+    if (!compileKeywordQuery(&query, queryText, true)) {
+        free(corpus);
+        free(offsets);
+        return EXIT_FAILURE;
+    }
+
+    struct {
+        const char *name;
+        NeedleScanner scanner;
+    } methods[] = {
+        { "tolower+strstr", NULL },
+        { "scalar", scanNeedlesScalar },
+#if defined(__x86_64__) || defined(__i386__)
+        { "sse2", __builtin_cpu_supports("sse2") ? scanNeedlesSse2 : NULL },
+        { "avx2", __builtin_cpu_supports("avx2") ? scanNeedlesAvx2 : NULL },
+#endif
+    };
+
+    printf("%zu paths, %.1f MB, query '%s'\n", (size_t)BENCH_MATCH_PATHS, bytes / 1e6, queryText);
+    printf("%-16s %10s %12s %10s %10s\n", "method", "matches", "MB/s", "ms", "speedup");
+    char copy[MAX_PATH_LEN];
+    double baseline = 0;
+    unsigned long long expected = 0;
+    int status = EXIT_SUCCESS;
+    for (size_t m = 0; m < sizeof(methods) / sizeof(methods[0]); m++) {
+        if (m > 0 && methods[m].scanner == NULL) {
+            printf("%-16s %10s\n", methods[m].name, "n/a");
+            continue;
+        }
+        query.scanner = methods[m].scanner;
+        double best = 0;
+        unsigned long long matches = 0;
+        for (int round = 0; round < BENCH_MATCH_ROUNDS; round++) {
+            matches = 0;
+            double start = monotonicSeconds();
+            for (size_t i = 0; i < BENCH_MATCH_PATHS; i++) {
+                const char *path = corpus + offsets[i];
+                matches += m == 0 ? matchesByLowercasing(&query, path, copy) : keywordQueryMatches(&query, path);
+            }
+            double elapsed = monotonicSeconds() - start;
+            if (round == 0 || elapsed < best) {
+                best = elapsed;
+            }
+        }
+        if (m == 0) {
+            baseline = best;
+            expected = matches;
+        } else if (matches != expected) {
+            fprintf(stderr, "%s found %llu matches, expected %llu\n", methods[m].name, matches, expected);
+            status = EXIT_FAILURE;
+        }
+        printf("%-16s %10llu %12.0f %10.1f %9.2fx\n", methods[m].name, matches,
+               best > 0 ? bytes / best / 1e6 : 0, best * 1e3, best > 0 ? baseline / best : 0);
+    }
+
+    freeKeywordQuery(&query);
+    free(corpus);
+    free(offsets);
+    return status;
+}
+
+// Synthetic trees for --bench-scan. Every shape is generated from a fixed seed, so two
+// machines, or two builds, scan exactly the same names and sizes.
+typedef enum BenchShape {
+    BENCH_SHAPE_WIDE,
+    BENCH_SHAPE_DEEP,
+    BENCH_SHAPE_SMALL,
+    BENCH_SHAPE_SPARSE,
+    BENCH_SHAPE_HARDLINKS,
+    BENCH_SHAPE_SYMLINKS,
+    BENCH_SHAPE_COUNT
+} BenchShape;
+
+const char *benchShapeNames[BENCH_SHAPE_COUNT] = { "wide", "deep", "small", "sparse", "hardlinks", "symlinks" };
+
+bool createBenchDirectory(const char *path) {
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create directory '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Creates a file of size bytes of which only the first dataBytes are written; the rest is
+// a hole, so shapes that only need sizes cost no disk space or tmpfs memory.
+bool createBenchFile(const char *path, unsigned long long size, unsigned long long dataBytes) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+    char block[4096];
+    memset(block, 'o', sizeof(block));
+    bool created = ftruncate(fd, (off_t)size) == 0;
+    for (unsigned long long offset = 0; created && offset < MIN(dataBytes, size); offset += sizeof(block)) {
+        size_t length = (size_t)MIN(sizeof(block), MIN(dataBytes, size) - offset);
+        created = pwrite(fd, block, length, (off_t)offset) == (ssize_t)length;
+    }
+    if (!created) {
+        fprintf(stderr, "Failed to write '%s': %s\n", path, strerror(errno));
+    }
+    close(fd);
+    return created;
+}
+
+// link and symlink refuse to replace a name, which an interrupted generation may have left.
+bool createBenchLink(const char *target, const char *path, bool symbolic) {
+    unlink(path);
+    if ((symbolic ? symlink(target, path) : link(target, path)) != 0) {
+        fprintf(stderr, "Failed to link '%s' to '%s': %s\n", path, target, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Builds one shape under path. Like createSyntheticDirectory, a marker next to it records
+// a finished tree so later runs reuse it. The counts keep each tree within a small tmpfs.
+bool createBenchTree(const char *path, BenchShape shape) {
+    char marker[MAX_PATH_LEN];
+    snprintf(marker, sizeof(marker), "%s.complete", path);
+    if (access(marker, F_OK) == 0) {
+        return true;
+    }
+    if (!createBenchDirectory(path)) {
+        return false;
+    }
+
+    fprintf(stderr, "Creating the %s tree in %s...\n", benchShapeNames[shape], path);
+    uint64_t state = 0x9e3779b97f4a7c15ULL + shape;
+    char directory[MAX_PATH_LEN];
+    char file[MAX_PATH_LEN + 32];
+    char target[MAX_PATH_LEN + 32];
+    bool created = true;
+    switch (shape) {
+        case BENCH_SHAPE_WIDE:
+            // 2000 sibling directories of 50 files each.
+            for (int d = 0; created && d < 2000; d++) {
+                snprintf(directory, sizeof(directory), "%s/w%04d", path, d);
+                created = createBenchDirectory(directory);
+                for (int f = 0; created && f < 50; f++) {
+                    snprintf(file, sizeof(file), "%s/f%02d", directory, f);
+                    created = createBenchFile(file, xorshiftRandom(&state) % (1 << 20), 0);
                 }
-                lastPosition = ftell(file);
-                break;
-            case 'S':
-            case 's':
-                printf("Enter search filter: ");
-                if (fgets(searchFilter, sizeof(searchFilter), stdin) == NULL) {
-                    perror("Error reading search filter");
-                    continue;
+            }
+            break;
+        case BENCH_SHAPE_DEEP:
+            // 16 chains of 250 nested directories with one file on every level.
+            for (int c = 0; created && c < 16; c++) {
+                size_t length = (size_t)snprintf(directory, sizeof(directory), "%s/c%02d", path, c);
+                for (int level = 0; created && level < 250 && length + 2 < sizeof(directory); level++) {
+                    created = createBenchDirectory(directory);
+                    snprintf(file, sizeof(file), "%s/f", directory);
+                    created = created && createBenchFile(file, xorshiftRandom(&state) % (1 << 16), 0);
+                    length += (size_t)snprintf(directory + length, sizeof(directory) - length, "/d");
                 }
-                searchFilter[strcspn(searchFilter, "\n")] = 0;
-                isFilteringActive = true;
-                lastPosition = 0;
-                break;
-            case 'F':
-            case 'f':
-                sizeThreshold = askForSizeThreshold();
-                if (sizeThreshold == -1) {
-                    perror("Error getting size threshold");
-                    continue;
+            }
+            break;
+        case BENCH_SHAPE_SMALL:
+            // 40 directories of 500 files of 1 to 2048 bytes, all of them written.
+            for (int d = 0; created && d < 40; d++) {
+                snprintf(directory, sizeof(directory), "%s/s%02d", path, d);
+                created = createBenchDirectory(directory);
+                for (int f = 0; created && f < 500; f++) {
+                    unsigned long long size = 1 + xorshiftRandom(&state) % 2048;
+                    snprintf(file, sizeof(file), "%s/f%03d", directory, f);
+                    created = createBenchFile(file, size, size);
                 }
-                useSizeThreshold = sizeThreshold > 0;
-                lastPosition = 0;
+            }
+            break;
+        case BENCH_SHAPE_SPARSE:
+            // 8 files of 1 to 8 GiB with only their first 4 KiB allocated.
+            for (int f = 0; created && f < 8; f++) {
+                snprintf(file, sizeof(file), "%s/sparse%d", path, f);
+                created = createBenchFile(file, (unsigned long long)(f + 1) << 30, 4096);
+            }
+            break;
+        case BENCH_SHAPE_HARDLINKS:
+            // 1000 files of 4 KiB, each linked again from 9 more directories.
+            snprintf(directory, sizeof(directory), "%s/files", path);
+            created = createBenchDirectory(directory);
+            for (int f = 0; created && f < 1000; f++) {
+                snprintf(file, sizeof(file), "%s/f%03d", directory, f);
+                created = createBenchFile(file, 4096, 4096);
+            }
+            for (int d = 1; created && d <= 9; d++) {
+                snprintf(directory, sizeof(directory), "%s/links%d", path, d);
+                created = createBenchDirectory(directory);
+                for (int f = 0; created && f < 1000; f++) {
+                    snprintf(target, sizeof(target), "%s/files/f%03d", path, f);
+                    snprintf(file, sizeof(file), "%s/f%03d", directory, f);
+                    created = createBenchLink(target, file, false);
+                }
+            }
+            break;
+        case BENCH_SHAPE_SYMLINKS:
+            // 200 directories joined in a ring by symlinks, each also linking to itself, its
+            // parent, itself again through a loop and a missing name. None may be followed.
+            for (int d = 0; created && d < 200; d++) {
+                snprintf(directory, sizeof(directory), "%s/l%03d", path, d);
+                created = createBenchDirectory(directory);
+                for (int f = 0; created && f < 5; f++) {
+                    snprintf(file, sizeof(file), "%s/f%d", directory, f);
+                    created = createBenchFile(file, xorshiftRandom(&state) % 4096, 0);
+                }
+                const char *links[][2] = { { ".", "self" }, { "..", "parent" }, { "loop", "loop" }, { "missing", "dangling" } };
+                for (size_t i = 0; created && i < sizeof(links) / sizeof(links[0]); i++) {
+                    snprintf(file, sizeof(file), "%s/%s", directory, links[i][1]);
+                    created = createBenchLink(links[i][0], file, true);
+                }
+                snprintf(target, sizeof(target), "../l%03d", (d + 1) % 200);
+                snprintf(file, sizeof(file), "%s/next", directory);
+                created = created && createBenchLink(target, file, true);
+            }
+            break;
+        default:
+            break;
+    }
+
+    FILE *markerFile = created ? fopen(marker, "w") : NULL;
+    if (markerFile != NULL) {
+        fclose(markerFile);
+    }
+    return created;
+}
+
+// Empties the page, dentry and inode caches so the next scan starts cold. Only root can on
+// Linux, and nothing can elsewhere; tmpfs keeps its contents cached regardless.
+bool dropFileCaches() {
+#ifdef __linux__
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool dropped = write(fd, "3", 1) == 1;
+    close(fd);
+    return dropped;
+#else
+    return false;
+#endif
+}
+
+// Since Linux 4.0 writing 5 to clear_refs restarts the peak resident set size, so every
+// run is measured on its own. Elsewhere the peak covers the whole process.
+void resetPeakRss() {
+#ifdef __linux__
+    FILE *file = fopen("/proc/self/clear_refs", "w");
+    if (file != NULL) {
+        fputs("5", file);
+        fclose(file);
+    }
+#endif
+}
+
+long long peakRssKib() {
+#ifdef __linux__
+    FILE *file = fopen("/proc/self/status", "r");
+    if (file != NULL) {
+        char line[256];
+        long long kib = -1;
+        while (kib < 0 && fgets(line, sizeof(line), file) != NULL) {
+            sscanf(line, "VmHWM: %lld kB", &kib);
+        }
+        fclose(file);
+        if (kib >= 0) {
+            return kib;
+        }
+    }
+#endif
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+typedef struct BenchEngine {
+    const char *name;
+    int threads;
+    // getDirectorySize only totals the tree; listDirectories also formats every record.
+    bool sizeOnly;
+} BenchEngine;
+
+bool runBenchScan(const char *path, const BenchEngine *engine) {
+    int savedThreads = scanOptions.threads;
+    scanOptions.threads = engine->threads;
+    bool scanned = true;
+    if (engine->sizeOnly) {
+        getDirectorySize(path);
+    } else {
+        FILE *sink = fopen("/dev/null", "w");
+        scanned = sink != NULL;
+        if (scanned) {
+            listDirectories(path, sink, 0, NULL);
+            fclose(sink);
+        } else {
+            perror("Error opening /dev/null");
+        }
+    }
+    scanOptions.threads = savedThreads;
+    return scanned;
+}
+
+int compareSeconds(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+void writeScanBenchmarkJson(FILE *file, const char *shape, const BenchEngine *engine, const char *cache,
+                            const ThreadStats *counted, const double *seconds, long long peakKib) {
+    double median = seconds[BENCH_SCAN_ROUNDS / 2];
+    fprintf(file, "{\"benchmark\":\"scan\",\"time\":%lld,\"shape\":", (long long)time(NULL));
+    writeJsonString(file, shape);
+    fprintf(file, ",\"engine\":");
+    writeJsonString(file, engine->name);
+    fprintf(file, ",\"threads\":%d,\"cache\":\"%s\",\"getdents\":%s,\"ioUring\":%s,\"rounds\":%d", engine->threads, cache,
+            scanOptions.useGetdents ? "true" : "false", scanOptions.useIoUring ? "true" : "false", BENCH_SCAN_ROUNDS);
+    fprintf(file, ",\"directories\":%llu,\"entries\":%llu,\"bytes\":%llu,\"bestSeconds\":%.6f,\"medianSeconds\":%.6f",
+            counted->directories, counted->entries, counted->bytes, seconds[0], median);
+    fprintf(file, ",\"entriesPerSecond\":%.1f,\"peakRssKiB\":%lld,\"calls\":{", median > 0 ? counted->entries / median : 0.0, peakKib);
+    bool first = true;
+    for (int call = 0; call < STATS_CALL_COUNT; call++) {
+        if (counted->calls[call] > 0) {
+            fprintf(file, "%s", first ? "" : ",");
+            writeJsonString(file, statsCallNames[call]);
+            fprintf(file, ":%llu", counted->calls[call]);
+            first = false;
+        }
+    }
+    fprintf(file, "}}\n");
+}
+
+// Scans every requested shape with each engine, warm and, when the caches can be dropped,
+// cold. Syscall counts come from one counted run that also warms the caches; the timed
+// runs count nothing, so their times carry none of the counting overhead.
+int runScanBenchmark(const char *root, const char *shapes, const char *jsonPath) {
+    bool selected[BENCH_SHAPE_COUNT] = {false};
+    const char *cursor = shapes;
+    while (*cursor != '\0') {
+        size_t length = strcspn(cursor, ",");
+        int shape = 0;
+        while (shape < BENCH_SHAPE_COUNT &&
+               (strlen(benchShapeNames[shape]) != length || strncmp(cursor, benchShapeNames[shape], length) != 0)) {
+            shape++;
+        }
+        if (shape == BENCH_SHAPE_COUNT) {
+            fprintf(stderr, "Unknown benchmark shape '%.*s'; expected %s\n", (int)length, cursor, DEFAULT_BENCH_SHAPES);
+            return EXIT_FAILURE;
+        }
+        selected[shape] = true;
+        cursor += cursor[length] == ',' ? length + 1 : length;
+    }
+    if (mkdir(root, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create directory '%s': %s\n", root, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int parallelThreads = scanOptions.threads > 1 ? scanOptions.threads : (int)MAX(MIN(cpus, MAX_SCAN_THREADS), 2);
+    BenchEngine engines[] = {
+        { "listDirectories", 1, false },
+        { "listDirectories", parallelThreads, false },
+        { "getDirectorySize", 1, true },
+    };
+    FILE *json = NULL;
+    if (jsonPath != NULL && (json = fopen(jsonPath, "a")) == NULL) {
+        fprintf(stderr, "Failed to open benchmark file '%s': %s\n", jsonPath, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    ThreadStats *counted = malloc(sizeof(ThreadStats));
+    if (counted == NULL) {
+        fprintf(stderr, "Error: out of memory\n");
+        if (json != NULL) {
+            fclose(json);
+        }
+        return EXIT_FAILURE;
+    }
+    bool coldRuns = dropFileCaches();
+    if (!coldRuns) {
+        printf("The file caches cannot be dropped without root on Linux; only warm runs are timed\n");
+    }
+
+    bool savedCollectStats = scanOptions.collectStats;
+    int status = EXIT_SUCCESS;
+    printf("%-10s %-17s %7s %5s %10s %10s %10s %12s %10s %10s\n", "shape", "engine", "threads", "cache", "entries",
+           "best ms", "median ms", "entries/s", "syscalls", "peak MiB");
+    for (int shape = 0; shape < BENCH_SHAPE_COUNT && status == EXIT_SUCCESS; shape++) {
+        if (!selected[shape]) {
+            continue;
+        }
+        char path[MAX_PATH_LEN];
+        snprintf(path, sizeof(path), "%s%sscan-%s", root, PATH_SEPARATOR, benchShapeNames[shape]);
+        if (!createBenchTree(path, (BenchShape)shape)) {
+            status = EXIT_FAILURE;
+            break;
+        }
+
+        unsigned long long expectedBytes = 0;
+        for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]) && status == EXIT_SUCCESS; e++) {
+            scanOptions.collectStats = true;
+            collectThreadStats(counted);
+            bool scanned = runBenchScan(path, &engines[e]);
+            collectThreadStats(counted);
+            scanOptions.collectStats = false;
+            if (!scanned) {
+                status = EXIT_FAILURE;
                 break;
-            case 'Q':
-            case 'q':
-                fclose(file);
-                return;
-            case 'E':
-            case 'e':
-                {
-                    char exportFilePath[256];
-                    printf("Enter export file path: ");
-                    if (fgets(exportFilePath, sizeof(exportFilePath), stdin) == NULL) {
-                        perror("Error reading export file path");
-                        continue;
-                    }
-                    exportFilePath[strcspn(exportFilePath, "\n")] = 0;
+            }
+            if (e == 0) {
+                expectedBytes = counted->bytes;
+            } else if (counted->bytes != expectedBytes) {
+                fprintf(stderr, "%s with %d threads counted %llu bytes in %s, expected %llu\n", engines[e].name,
+                        engines[e].threads, counted->bytes, path, expectedBytes);
+                status = EXIT_FAILURE;
+            }
+            unsigned long long syscalls = 0;
+            for (int call = 0; call < STATS_CALL_COUNT; call++) {
+                syscalls += counted->calls[call];
+            }
 
-                    if (exportResults(filePath, exportFilePath, searchFilter) == -1) {
-                        perror("Error exporting results");
-                        continue;
+            for (int cold = 0; cold <= (coldRuns ? 1 : 0); cold++) {
+                double seconds[BENCH_SCAN_ROUNDS];
+                long long peakKib = 0;
+                for (int round = 0; round < BENCH_SCAN_ROUNDS; round++) {
+                    if (cold) {
+                        dropFileCaches();
                     }
+                    resetPeakRss();
+                    double start = monotonicSeconds();
+                    runBenchScan(path, &engines[e]);
+                    seconds[round] = monotonicSeconds() - start;
+                    peakKib = MAX(peakKib, peakRssKib());
                 }
-                break;
-            default:
-                printf("Invalid command. Please try again.\n");
-                break;
+                qsort(seconds, BENCH_SCAN_ROUNDS, sizeof(double), compareSeconds);
+                double median = seconds[BENCH_SCAN_ROUNDS / 2];
+                const char *cache = cold ? "cold" : "warm";
+                printf("%-10s %-17s %7d %5s %10llu %10.1f %10.1f %12.0f %10llu %10.1f\n", benchShapeNames[shape],
+                       engines[e].name, engines[e].threads, cache, counted->entries, seconds[0] * 1e3, median * 1e3,
+                       median > 0 ? counted->entries / median : 0, syscalls, peakKib / 1024.0);
+                if (json != NULL) {
+                    writeScanBenchmarkJson(json, benchShapeNames[shape], &engines[e], cache, counted, seconds, peakKib);
+                }
+            }
         }
     }
 
-    if (iterations == MAX_ITERATIONS) {
-        printf("Maximum number of iterations reached. Exiting...\n");
+    scanOptions.collectStats = savedCollectStats;
+    free(counted);
+    releaseScanThreadState();
+    if (json != NULL && fclose(json) == EOF) {
+        fprintf(stderr, "Failed to write benchmark file '%s': %s\n", jsonPath, strerror(errno));
+        status = EXIT_FAILURE;
     }
+    return status;
+}
 
-    fclose(file);
+#ifdef __linux__
+// Watch mode keeps every directory below the root in memory with the bytes of its own files
+// and of its whole subtree. inotify events only mark a directory dirty; once the queue is
+// drained each dirty directory is listed again and the change in its own bytes is added to
+// it and every ancestor, so a size query is a walk down the tree with no I/O.
+typedef struct WatchNode {
+    struct WatchNode *parent;
+    char *name;
+    struct WatchNode **children;
+    size_t childCount;
+    size_t childCapacity;
+    int wd;
+    // The watch was removed by the kernel or taken over by a directory moved elsewhere
+    // in the tree, as opposed to never having been added.
+    bool watchLost;
+    // Of a directory that could not be watched, so a refresh can tell it was replaced.
+    bool identified;
+    dev_t device;
+    ino_t inode;
+    unsigned long long ownBytes;
+    unsigned long long totalBytes;
+    bool dirty;
+    bool removed;
+} WatchNode;
+
+typedef struct WatchNodeList {
+    WatchNode **items;
+    size_t count;
+    size_t capacity;
+} WatchNodeList;
+
+typedef struct WatchTree {
+    int inotifyFd;
+    WatchNode *root;
+    // Indexed by watch descriptor.
+    WatchNode **byWatch;
+    size_t byWatchCapacity;
+    WatchNodeList dirty;
+    // Subtrees cut loose during a refresh, freed once the batch is done since later dirty
+    // entries may still point into them.
+    WatchNodeList detached;
+    unsigned long long directoryCount;
+    bool watchLimitReported;
+} WatchTree;
+
+bool watchNodeListAppend(WatchNodeList *list, WatchNode *node) {
+    if (list->count == list->capacity) {
+        size_t newCapacity = list->capacity ? list->capacity * 2 : 16;
+        WatchNode **items = realloc(list->items, newCapacity * sizeof(WatchNode *));
+        if (items == NULL) {
+            fprintf(stderr, "Error: out of memory while watching\n");
+            return false;
+        }
+        list->items = items;
+        list->capacity = newCapacity;
+    }
+    list->items[list->count++] = node;
+    return true;
 }
 
-void listApps(const char *basePath, FILE *outputFile, int isRoot, int *processedDirs, int totalDirs) {
-    if (basePath == NULL || outputFile == NULL || processedDirs == NULL) {
-        fprintf(stderr, "Invalid arguments to listApps\n");
-        return;
+bool buildWatchNodePath(const WatchNode *node, PathBuffer *path) {
+    if (node->parent != NULL && !buildWatchNodePath(node->parent, path)) {
+        return false;
     }
+    return pathBufferAppend(path, node->name, node->parent != NULL) != SIZE_MAX;
+}
 
-    char path[MAX_PATH_LENGTH];
-    DIR *dir = opendir(basePath);
-    struct dirent *entry;
+// Adds bytes to node and all of its ancestors and takes removedBytes away.
+void adjustWatchTotals(WatchNode *node, unsigned long long addedBytes, unsigned long long removedBytes) {
+    for (; node != NULL; node = node->parent) {
+        node->totalBytes = node->totalBytes + addedBytes - removedBytes;
+    }
+}
 
-    if (!dir) {
-        fprintf(stderr, "Failed to open directory: %s\n", basePath);
+void addDirectoryWatch(WatchTree *tree, WatchNode *node, const char *path) {
+    int wd = inotify_add_watch(tree->inotifyFd, path, WATCH_EVENTS);
+    if (wd < 0) {
+        if (errno != ENOSPC) {
+            fprintf(stderr, "Failed to watch '%s': %s\n", path, strerror(errno));
+        } else if (!tree->watchLimitReported) {
+            tree->watchLimitReported = true;
+            fprintf(stderr, "inotify watch limit reached at '%s'; raise fs.inotify.max_user_watches, "
+                            "sizes below unwatched directories will go stale\n", path);
+        }
         return;
     }
 
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue; // Skip current and parent directories
+    if ((size_t)wd >= tree->byWatchCapacity) {
+        size_t newCapacity = tree->byWatchCapacity ? tree->byWatchCapacity : 1024;
+        while (newCapacity <= (size_t)wd) {
+            newCapacity *= 2;
         }
-
-        if (strstr(entry->d_name, "com.apple") != NULL) {
-            continue; // Skip Apple apps
+        WatchNode **byWatch = realloc(tree->byWatch, newCapacity * sizeof(WatchNode *));
+        if (byWatch == NULL) {
+            fprintf(stderr, "Error: out of memory while watching '%s'\n", path);
+            inotify_rm_watch(tree->inotifyFd, wd);
+            return;
         }
+        memset(byWatch + tree->byWatchCapacity, 0, (newCapacity - tree->byWatchCapacity) * sizeof(WatchNode *));
+        tree->byWatch = byWatch;
+        tree->byWatchCapacity = newCapacity;
+    }
+    // A directory moved within the tree keeps its watch; the node for its old place loses it.
+    if (tree->byWatch[wd] != NULL && tree->byWatch[wd] != node) {
+        tree->byWatch[wd]->wd = -1;
+        tree->byWatch[wd]->watchLost = true;
+    }
+    tree->byWatch[wd] = node;
+    node->wd = wd;
+}
 
-        snprintf(path, sizeof(path), "%s/%s", basePath, entry->d_name);
+WatchNode *createWatchNode(WatchNode *parent, const char *name) {
+    WatchNode *node = calloc(1, sizeof(WatchNode));
+    if (node == NULL || (node->name = strdup(name)) == NULL) {
+        free(node);
+        fprintf(stderr, "Error: out of memory while watching\n");
+        return NULL;
+    }
+    node->parent = parent;
+    node->wd = -1;
+    return node;
+}
 
-        // Determine if the entry is a directory using stat instead of d_type
-        struct stat statbuf;
-        if (stat(path, &statbuf) != 0) {
-            fprintf(stderr, "Failed to get file status for: %s\n", path);
-            continue;
+bool attachWatchChild(WatchNode *parent, WatchNode *child) {
+    if (parent->childCount == parent->childCapacity) {
+        size_t newCapacity = parent->childCapacity ? parent->childCapacity * 2 : 4;
+        WatchNode **children = realloc(parent->children, newCapacity * sizeof(WatchNode *));
+        if (children == NULL) {
+            fprintf(stderr, "Error: out of memory while watching\n");
+            return false;
         }
+        parent->children = children;
+        parent->childCapacity = newCapacity;
+    }
+    parent->children[parent->childCount++] = child;
+    return true;
+}
 
-        if (S_ISDIR(statbuf.st_mode)) {
-            // Assuming depth starts from 0 and increments for each level
-            listDirectories(path, outputFile, 0, processedDirs, totalDirs); // Adjust parameters as necessary
-        } else {
-            fprintf(outputFile, "%s\n", path);
-        }
+void freeWatchNode(WatchNode *node) {
+    for (size_t i = 0; i < node->childCount; i++) {
+        freeWatchNode(node->children[i]);
+    }
+    free(node->children);
+    free(node->name);
+    free(node);
+}
 
-        if (*processedDirs < totalDirs) {
-            (*processedDirs)++;
-            if (isRoot) {
-                printf("\rScanning directories... %d/%d", *processedDirs, totalDirs);
-                fflush(stdout);
+// Watches and scans the directory at path into node, which has no children yet. The watch
+// goes on before the listing so that nothing changed after it is missed.
+void scanWatchSubtree(WatchTree *tree, WatchNode *node, PathBuffer *path) {
+    addDirectoryWatch(tree, node, path->data);
+    tree->directoryCount++;
+
+    DirHandle handle;
+    if (!openDirectoryAt(AT_FDCWD, path->data, node->parent == NULL, &handle)) {
+        fprintf(stderr, "Failed to open directory '%s': %s\n", path->data, strerror(errno));
+        return;
+    }
+    if (node->wd < 0 && statDirectoryHandle(&handle)) {
+        node->identified = true;
+        node->device = handle.stat.st_dev;
+        node->inode = handle.stat.st_ino;
+    }
+    ListingOptions options = { .cachedRecord = NO_CACHED_RECORD, .directoryPath = path->data };
+    DirListing listing;
+    readDirectoryListing(&handle, &listing, &options);
+    closeDirectory(&handle, path->data);
+
+    node->ownBytes = listing.fileBytes;
+    node->totalBytes = listing.fileBytes;
+    for (size_t i = 0; i < listing.subdirs.count; i++) {
+        WatchNode *child = createWatchNode(node, listing.subdirs.names[i]);
+        if (child == NULL || !attachWatchChild(node, child)) {
+            if (child != NULL) {
+                freeWatchNode(child);
             }
-        } else {
-            fprintf(stderr, "\nError: processedDirs exceeds totalDirs\n");
             break;
         }
+        size_t parentLength = pathBufferAppend(path, child->name, true);
+        if (parentLength == SIZE_MAX) {
+            break;
+        }
+        scanWatchSubtree(tree, child, path);
+        node->totalBytes += child->totalBytes;
+        pathBufferTruncate(path, parentLength);
     }
+    freeDirectoryListing(&listing);
+}
 
-    closedir(dir);
+// Drops the watches of a subtree that is no longer on disk and marks it removed.
+void detachWatchSubtree(WatchTree *tree, WatchNode *node) {
+    node->removed = true;
+    if (node->wd >= 0 && tree->byWatch[node->wd] == node) {
+        inotify_rm_watch(tree->inotifyFd, node->wd);
+        tree->byWatch[node->wd] = NULL;
+    }
+    node->wd = -1;
+    tree->directoryCount--;
+    for (size_t i = 0; i < node->childCount; i++) {
+        detachWatchSubtree(tree, node->children[i]);
+    }
 }
 
-void scanForApps() {
-    char *homeDir = getenv("HOME");
-    if (homeDir == NULL) {
-        perror("Error: HOME environment variable is not set");
-        return;
+void markWatchNodeDirty(WatchTree *tree, WatchNode *node) {
+    if (!node->dirty && !node->removed && watchNodeListAppend(&tree->dirty, node)) {
+        node->dirty = true;
     }
+}
 
-    char containersDirPath[256];
-    if (snprintf(containersDirPath, sizeof(containersDirPath), "%s/Library/Containers", homeDir) < 0) {
-        perror("Error formatting containers directory path");
-        return;
+void markWatchSubtreeDirty(WatchTree *tree, WatchNode *node) {
+    markWatchNodeDirty(tree, node);
+    for (size_t i = 0; i < node->childCount; i++) {
+        markWatchSubtreeDirty(tree, node->children[i]);
     }
+}
 
-    char appSupportDirPath[256];
-    if (snprintf(appSupportDirPath, sizeof(appSupportDirPath), "%s/Library/Application Support", homeDir) < 0) {
-        perror("Error formatting application support directory path");
+// Whether an unwatched child of the directory at path is no longer the directory it was
+// scanned as. Without a watch, only its inode tells.
+bool unwatchedChildReplaced(const WatchNode *child, PathBuffer *path) {
+    if (!child->identified) {
+        return false;
+    }
+    size_t parentLength = pathBufferAppend(path, child->name, true);
+    if (parentLength == SIZE_MAX) {
+        return false;
+    }
+    struct stat info;
+    bool replaced = fstatat(AT_FDCWD, path->data, &info, AT_SYMLINK_NOFOLLOW) != 0 ||
+                    info.st_dev != child->device || info.st_ino != child->inode;
+    pathBufferTruncate(path, parentLength);
+    return replaced;
+}
+
+int compareWatchNodeNames(const void *a, const void *b) {
+    return strcmp((*(WatchNode *const *)a)->name, (*(WatchNode *const *)b)->name);
+}
+
+// Lists a dirty directory again. The change in its own file bytes goes up the tree;
+// subdirectories that disappeared are detached and new ones scanned in full. A subdirectory
+// whose watch was lost was deleted or replaced, and so was an unwatched one whose inode
+// changed, so those are rescanned as well. One that was never watched, past the watch
+// limit, is otherwise left alone.
+void refreshWatchNode(WatchTree *tree, WatchNode *node) {
+    PathBuffer path = {0};
+    if (!buildWatchNodePath(node, &path)) {
+        pathBufferFree(&path);
         return;
     }
+    DirHandle handle;
+    if (!openDirectoryAt(AT_FDCWD, path.data, node->parent == NULL, &handle)) {
+        // Gone; the parent's refresh takes it out of the tree.
+        pathBufferFree(&path);
+        return;
+    }
+    ListingOptions options = { .cachedRecord = NO_CACHED_RECORD, .directoryPath = path.data };
+    DirListing listing;
+    readDirectoryListing(&handle, &listing, &options);
+    closeDirectory(&handle, path.data);
 
-    char outputFilePath[256];
-    if (snprintf(outputFilePath, sizeof(outputFilePath), "apps.txt", homeDir) < 0) {
-        perror("Error formatting output file path");
+    adjustWatchTotals(node, listing.fileBytes, node->ownBytes);
+    node->ownBytes = listing.fileBytes;
+
+    if (listing.subdirs.count > 0) {
+        qsort(listing.subdirs.names, listing.subdirs.count, sizeof(char *), compareNames);
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < node->childCount; i++) {
+        WatchNode *child = node->children[i];
+        bool present = !child->watchLost && listing.subdirs.count > 0 &&
+                       bsearch(&child->name, listing.subdirs.names, listing.subdirs.count, sizeof(char *), compareNames) != NULL &&
+                       (child->wd >= 0 || !unwatchedChildReplaced(child, &path));
+        if (present) {
+            node->children[kept++] = child;
+        } else {
+            adjustWatchTotals(node, 0, child->totalBytes);
+            detachWatchSubtree(tree, child);
+            watchNodeListAppend(&tree->detached, child);
+        }
+    }
+    node->childCount = kept;
+
+    if (kept > 0) {
+        qsort(node->children, kept, sizeof(WatchNode *), compareWatchNodeNames);
+    }
+    for (size_t i = 0; i < listing.subdirs.count; i++) {
+        WatchNode key = { .name = listing.subdirs.names[i] };
+        WatchNode *keyPointer = &key;
+        if (kept > 0 && bsearch(&keyPointer, node->children, kept, sizeof(WatchNode *), compareWatchNodeNames) != NULL) {
+            continue;
+        }
+        WatchNode *child = createWatchNode(node, listing.subdirs.names[i]);
+        if (child == NULL || !attachWatchChild(node, child)) {
+            if (child != NULL) {
+                freeWatchNode(child);
+            }
+            break;
+        }
+        size_t parentLength = pathBufferAppend(&path, child->name, true);
+        if (parentLength == SIZE_MAX) {
+            break;
+        }
+        scanWatchSubtree(tree, child, &path);
+        adjustWatchTotals(node, child->totalBytes, 0);
+        pathBufferTruncate(&path, parentLength);
+    }
+
+    freeDirectoryListing(&listing);
+    pathBufferFree(&path);
+}
+
+void handleWatchEvent(WatchTree *tree, const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        // Some events were dropped and there is no telling which directories they were
+        // for, so every directory is revalidated against the disk.
+        fprintf(stderr, "inotify queue overflowed; revalidating all %llu directories\n", tree->directoryCount);
+        markWatchSubtreeDirty(tree, tree->root);
+        return;
+    }
+    if (event->wd < 0 || (size_t)event->wd >= tree->byWatchCapacity || tree->byWatch[event->wd] == NULL) {
         return;
     }
 
-    FILE *outputFile = fopen(outputFilePath, "w");
-    if (outputFile == NULL) {
-        perror("Error opening the output file for writing");
+    WatchNode *node = tree->byWatch[event->wd];
+    if (event->mask & IN_IGNORED) {
+        tree->byWatch[event->wd] = NULL;
+        node->wd = -1;
+        node->watchLost = true;
+    }
+    if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+        if (node->parent != NULL) {
+            markWatchNodeDirty(tree, node->parent);
+        }
         return;
     }
+    markWatchNodeDirty(tree, node);
+}
 
-    int totalDirectories = countTotalDirectories(containersDirPath, 0);
-    int processedDirectories = 0; // Declare and initialize processedDirectories
-    listApps(containersDirPath, outputFile, 0, &processedDirectories, totalDirectories);
+// Reads every queued event, then refreshes each directory they touched once.
+void applyWatchEvents(WatchTree *tree) {
+    char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+    while ((length = read(tree->inotifyFd, buffer, sizeof(buffer))) > 0) {
+        for (char *cursor = buffer; cursor < buffer + length;) {
+            const struct inotify_event *event = (const struct inotify_event *)cursor;
+            handleWatchEvent(tree, event);
+            cursor += sizeof(struct inotify_event) + event->len;
+        }
+    }
 
-    totalDirectories = countTotalDirectories(appSupportDirPath, 0);
-    listApps(appSupportDirPath, outputFile, 0, &processedDirectories, totalDirectories);
+    for (size_t i = 0; i < tree->dirty.count; i++) {
+        WatchNode *node = tree->dirty.items[i];
+        node->dirty = false;
+        if (!node->removed) {
+            refreshWatchNode(tree, node);
+        }
+    }
+    tree->dirty.count = 0;
+    for (size_t i = 0; i < tree->detached.count; i++) {
+        freeWatchNode(tree->detached.items[i]);
+    }
+    tree->detached.count = 0;
+}
 
-    if (fclose(outputFile) == EOF) {
-        perror("Error closing the output file");
-        return;
+// Finds the node for query, which must be the watched root or a path below it.
+WatchNode *findWatchNode(const WatchTree *tree, const char *query) {
+    const char *rootPath = tree->root->name;
+    size_t rootLength = strlen(rootPath);
+    while (rootLength > 1 && rootPath[rootLength - 1] == PATH_SEPARATOR[0]) {
+        rootLength--;
+    }
+    if (strncmp(query, rootPath, rootLength) != 0) {
+        return NULL;
+    }
+    const char *rest = query + rootLength;
+    if (*rest != '\0' && *rest != PATH_SEPARATOR[0] && rootPath[rootLength - 1] != PATH_SEPARATOR[0]) {
+        return NULL;
     }
 
-    printf("Scan complete. Results have been written to %s\n", outputFilePath);
+    WatchNode *node = tree->root;
+    while (true) {
+        rest += strspn(rest, PATH_SEPARATOR);
+        if (*rest == '\0') {
+            return node;
+        }
+        size_t length = strcspn(rest, PATH_SEPARATOR);
+        WatchNode *next = NULL;
+        for (size_t i = 0; i < node->childCount && next == NULL; i++) {
+            if (strncmp(node->children[i]->name, rest, length) == 0 && node->children[i]->name[length] == '\0') {
+                next = node->children[i];
+            }
+        }
+        if (next == NULL) {
+            return NULL;
+        }
+        node = next;
+        rest += length;
+    }
 }
 
-void printMenu() {
-    printf("\n+------------------------------------+\n");
-    printf("| Directory Size Scanner Menu:       |\n");
-    printf("+------------------------------------+\n");
-    printf("| 1. Start Scan                      |\n");
-    printf("| 2. Set Output File Path            |\n");
-    printf("| 3. View Last Scan Results          |\n");
-    printf("| 4. Search Apps                     |\n");
-    printf("| 5. Scan Known Dir                  |\n");
-    printf("| 00. Exit                           |\n");
-    printf("+------------------------------------+\n");
+void answerWatchQuery(WatchTree *tree, const char *query) {
+    double start = monotonicSeconds();
+    WatchNode *node = findWatchNode(tree, query);
+    double elapsed = monotonicSeconds() - start;
+    if (node == NULL) {
+        printf("%s is not a directory under %s\n", query, tree->root->name);
+    } else {
+        printf("%s - %llu bytes (%.1f us)\n", query, node->totalBytes, elapsed * 1e6);
+    }
+    fflush(stdout);
 }
+#endif
 
-void setTerminalTitle(const char *title) {
-    if (title == NULL) {
-        perror("Error: title is NULL");
-        return;
+// Scans root once, then keeps its sizes current from inotify events and answers size
+// queries read from standard input, one path per line, until "quit" or end of input.
+int runWatchMode(const char *root) {
+#ifdef __linux__
+    WatchTree tree;
+    memset(&tree, 0, sizeof(tree));
+    tree.inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (tree.inotifyFd < 0) {
+        perror("Error starting inotify");
+        return EXIT_FAILURE;
+    }
+    tree.root = createWatchNode(NULL, root);
+    PathBuffer path = {0};
+    if (tree.root == NULL || pathBufferAppend(&path, root, false) == SIZE_MAX) {
+        close(tree.inotifyFd);
+        return EXIT_FAILURE;
     }
 
-#ifdef _WIN32
-    SetConsoleTitle(title);
-#else
-    printf("\033]0;%s\007", title);
+    double start = monotonicSeconds();
+    scanWatchSubtree(&tree, tree.root, &path);
+    pathBufferFree(&path);
+    printf("Watching %s: %llu bytes in %llu directories (scanned in %.2f s)\n",
+           root, tree.root->totalBytes, tree.directoryCount, monotonicSeconds() - start);
+    printf("Enter a directory path to query its size, or quit to stop.\n");
     fflush(stdout);
+
+    // stdin is read with read() rather than stdio so poll() sees every line that arrives.
+    char input[PATH_MAX + 2];
+    size_t inputLength = 0;
+    bool discarding = false;
+    bool running = true;
+    struct pollfd fds[2] = { { .fd = tree.inotifyFd, .events = POLLIN }, { .fd = STDIN_FILENO, .events = POLLIN } };
+    while (running) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error waiting for events");
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            applyWatchEvents(&tree);
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP)) {
+            ssize_t length = read(STDIN_FILENO, input + inputLength, sizeof(input) - 1 - inputLength);
+            if (length <= 0) {
+                break;
+            }
+            inputLength += length;
+
+            char *lineStart = input;
+            char *newline;
+            while (running && (newline = memchr(lineStart, '\n', input + inputLength - lineStart)) != NULL) {
+                *newline = '\0';
+                if (discarding) {
+                    discarding = false;
+                } else if (strcmp(lineStart, "quit") == 0) {
+                    running = false;
+                } else if (*lineStart != '\0') {
+                    answerWatchQuery(&tree, lineStart);
+                }
+                lineStart = newline + 1;
+            }
+            inputLength -= lineStart - input;
+            memmove(input, lineStart, inputLength);
+            if (inputLength == sizeof(input) - 1) {
+                fprintf(stderr, "Query path too long\n");
+                inputLength = 0;
+                discarding = true;
+            }
+        }
+    }
+
+    freeWatchNode(tree.root);
+    free(tree.byWatch);
+    free(tree.dirty.items);
+    free(tree.detached.items);
+    close(tree.inotifyFd);
+    releaseScanThreadState();
+    return EXIT_SUCCESS;
+#else
+    fprintf(stderr, "Watch mode needs inotify and is only available on Linux\n");
+    return EXIT_FAILURE;
 #endif
 }
 
-int main() {
-    int processedDirectories = 0;
+void printUsage(const char *programName) {
+    printf("Usage: %s [--threads N] [--format text|binary] [--incremental] [--index] [--top K] [--duplicates] [--breakdown] [--disk-usage] [--estimate [--estimate-depth N] [--estimate-probes N]] [--one-file-system] [--exclude-fstype LIST] [--hdd-threads N] [--exclude-from FILE] [--exclude PATTERN] [--count-excluded] [--stats] [--stats-json FILE] [--direct-io] [--no-getdents] [--io-uring [--uring-depth N]]\n", programName);
+    printf("       %s --watch DIR\n", programName);
+    printf("       %s --diff OLD NEW [--diff-threshold BYTES]\n", programName);
+    printf("       %s --delete FILE [--dry-run] [--delete-rate OPS]\n", programName);
+    printf("       %s --bench-listing DIR [--bench-sizes N,N,...]\n", programName);
+    printf("       %s --bench-match [QUERY]\n", programName);
+    printf("       %s --bench-scan DIR [--bench-shapes LIST] [--bench-json FILE]\n", programName);
+    printf("  --threads N          Scan with N worker threads (1-%d, default 1)\n", MAX_SCAN_THREADS);
+    printf("  --format FORMAT      Write scan results as text (default) or a binary snapshot\n");
+    printf("  --incremental        Rescan reusing unchanged directories from the previous snapshot (implies --format binary)\n");
+    printf("  --index              Build a trigram search index next to the results after each scan\n");
+    printf("  --top K              Report only the K largest directories and files instead of writing results\n");
+    printf("  --duplicates         Report groups of identical files instead of writing results\n");
+    printf("  --breakdown          After each scan, report bytes by extension, file age and owner\n");
+    printf("  --disk-usage         Count allocated blocks instead of apparent sizes, and hard-linked files once\n");
+    printf("  --estimate           Estimate sizes by sampling subtrees instead of writing results\n");
+    printf("  --estimate-depth N   Levels listed in full before sampling starts (default %d)\n", DEFAULT_ESTIMATE_DEPTH);
+    printf("  --estimate-probes N  Random probes per sampled subtree in the first round (2-%d, default %d)\n", MAX_ESTIMATE_PROBES, DEFAULT_ESTIMATE_PROBES);
+    printf("  --one-file-system    Do not scan directories on other filesystems than the start directory's\n");
+    printf("  --exclude-fstype L   Skip mounted filesystems of these comma-separated types (default: pseudo-filesystems)\n");
+    printf("  --hdd-threads N      Threads that may read one spinning disk at once with --threads (default %d)\n", DEFAULT_HDD_THREADS);
+    printf("  --exclude-from FILE  Skip directories matching the .gitignore-style rules in FILE\n");
+    printf("  --exclude PATTERN    Skip directories matching PATTERN, after any earlier rules\n");
+    printf("  --count-excluded     Still size skipped directories and report their total separately\n");
+    printf("  --stats              Print syscall counts, latencies and time per phase after each operation\n");
+    printf("  --stats-json FILE    Append the same statistics to FILE, one JSON object per line\n");
+    printf("  --direct-io          Write result files with O_DIRECT where the filesystem supports it\n");
+    printf("  --no-getdents        Read directories with readdir instead of batched getdents64\n");
+    printf("  --io-uring           Batch file stats through io_uring (Linux 5.6+), falling back to stat\n");
+    printf("  --uring-depth N      Stat requests kept in flight per thread (1-%d, default %d)\n", MAX_URING_DEPTH, DEFAULT_URING_DEPTH);
+    printf("  --watch DIR          Keep sizes under DIR current from inotify and answer path queries on stdin\n");
+    printf("  --diff OLD NEW       Report directories added, removed or resized between two result files\n");
+    printf("  --diff-threshold N   Leave out changes smaller than N bytes (default 0)\n");
+    printf("  --delete FILE        Delete every directory listed in FILE, resuming from FILE.journal\n");
+    printf("  --dry-run            With --delete, only report what would be removed\n");
+    printf("  --delete-rate OPS    Remove at most OPS entries per second (default: no limit)\n");
+    printf("  --bench-listing DIR  Benchmark directory listing on synthetic directories under DIR\n");
+    printf("  --bench-sizes LIST   Entry counts for --bench-listing (default %s)\n", DEFAULT_BENCH_LISTING_SIZES);
+    printf("  --bench-match QUERY  Benchmark keyword matching on synthetic paths (default \"%s\")\n", DEFAULT_BENCH_MATCH_QUERY);
+    printf("  --bench-scan DIR     Benchmark the scan engines on synthetic trees generated under DIR\n");
+    printf("  --bench-shapes LIST  Trees for --bench-scan (default %s)\n", DEFAULT_BENCH_SHAPES);
+    printf("  --bench-json FILE    Append each --bench-scan result to FILE, one JSON object per line\n");
+}
+
+bool parseCommandLine(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            char *end;
+            long threads = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || threads < 1 || threads > MAX_SCAN_THREADS) {
+                fprintf(stderr, "Invalid thread count '%s'\n", argv[i]);
+                return false;
+            }
+            scanOptions.threads = (int)threads;
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "text") == 0) {
+                scanOptions.resultFormat = RESULT_FORMAT_TEXT;
+            } else if (strcmp(argv[i], "binary") == 0) {
+                scanOptions.resultFormat = RESULT_FORMAT_SNAPSHOT;
+            } else {
+                fprintf(stderr, "Unknown format '%s'\n", argv[i]);
+                return false;
+            }
+        } else if (strcmp(argv[i], "--incremental") == 0) {
+            scanOptions.incremental = true;
+        } else if (strcmp(argv[i], "--index") == 0) {
+            scanOptions.buildIndex = true;
+        } else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+            char *end;
+            long long count = strtoll(argv[++i], &end, 10);
+            if (*end != '\0' || count < 1 || count > MAX_TOP_COUNT) {
+                fprintf(stderr, "Invalid top count '%s'\n", argv[i]);
+                return false;
+            }
+            scanOptions.topCount = (size_t)count;
+        } else if (strcmp(argv[i], "--duplicates") == 0) {
+            scanOptions.findDuplicates = true;
+        } else if (strcmp(argv[i], "--breakdown") == 0) {
+            scanOptions.breakdown = true;
+        } else if (strcmp(argv[i], "--disk-usage") == 0) {
+            scanOptions.diskUsage = true;
+        } else if (strcmp(argv[i], "--estimate") == 0) {
+            scanOptions.estimate = true;
+        } else if (strcmp(argv[i], "--estimate-depth") == 0 && i + 1 < argc) {
+            char *end;
+            long depth = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || depth < 1 || depth > MAX_DEPTH) {
+                fprintf(stderr, "Invalid estimate depth '%s'\n", argv[i]);
+                return false;
+            }
+            scanOptions.estimateDepth = (int)depth;
+        } else if (strcmp(argv[i], "--estimate-probes") == 0 && i + 1 < argc) {
+            char *end;
+            long long probes = strtoll(argv[++i], &end, 10);
+            if (*end != '\0' || probes < 2 || probes > MAX_ESTIMATE_PROBES) {
+                fprintf(stderr, "Invalid probe count '%s'\n", argv[i]);
+                return false;
+            }
+            scanOptions.estimateProbes = (unsigned long long)probes;
+        } else if (strcmp(argv[i], "--one-file-system") == 0) {
+            scanOptions.oneFileSystem = true;
+        } else if (strcmp(argv[i], "--exclude-fstype") == 0 && i + 1 < argc) {
+            scanOptions.excludedFsTypes = argv[++i];
+        } else if (strcmp(argv[i], "--hdd-threads") == 0 && i + 1 < argc) {
+            char *end;
+            long threads = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || threads < 1 || threads > MAX_SCAN_THREADS) {
+                fprintf(stderr, "Invalid thread count '%s'\n", argv[i]);
+                return false;
+            }
+            scanOptions.hddThreads = (int)threads;
+        } else if (strcmp(argv[i], "--exclude-from") == 0 && i + 1 < argc) {
+            if (!loadExcludeRules(&excludeRules, argv[++i])) {
+                return false;
+            }
+        } else if (strcmp(argv[i], "--exclude") == 0 && i + 1 < argc) {
+            if (!addExcludeRule(&excludeRules, argv[++i])) {
+                fprintf(stderr, "Error: out of memory while adding rule '%s'\n", argv[i]);
+                return false;
+            }
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            scanOptions.printStats = true;
+            scanOptions.collectStats = true;
+        } else if (strcmp(argv[i], "--stats-json") == 0 && i + 1 < argc) {
+            scanOptions.statsJsonPath = argv[++i];
+            scanOptions.collectStats = true;
+        } else if (strcmp(argv[i], "--count-excluded") == 0) {
+            scanOptions.countExcluded = true;
+        } else if (strcmp(argv[i], "--direct-io") == 0) {
+            scanOptions.directIo = true;
+        } else if (strcmp(argv[i], "--no-getdents") == 0) {
+            scanOptions.useGetdents = false;
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            scanOptions.useIoUring = true;
+        } else if (strcmp(argv[i], "--uring-depth") == 0 && i + 1 < argc) {
+            char *end;
+            long depth = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || depth < 1 || depth > MAX_URING_DEPTH) {
+                fprintf(stderr, "Invalid io_uring depth '%s'\n", argv[i]);
+                return false;
+            }
+            scanOptions.uringDepth = (unsigned)depth;
+        } else if (strcmp(argv[i], "--watch") == 0 && i + 1 < argc) {
+            scanOptions.watchRoot = argv[++i];
+        } else if (strcmp(argv[i], "--diff") == 0 && i + 2 < argc) {
+            scanOptions.diffOld = argv[++i];
+            scanOptions.diffNew = argv[++i];
+        } else if (strcmp(argv[i], "--diff-threshold") == 0 && i + 1 < argc) {
+            char *end;
+            scanOptions.diffThreshold = strtoull(argv[++i], &end, 10);
+            if (*end != '\0' || argv[i][0] == '-') {
+                fprintf(stderr, "Invalid diff threshold '%s'\n", argv[i]);
+                return false;
+            }
+        } else if (strcmp(argv[i], "--delete") == 0 && i + 1 < argc) {
+            scanOptions.deletePath = argv[++i];
+        } else if (strcmp(argv[i], "--dry-run") == 0) {
+            scanOptions.dryRun = true;
+        } else if (strcmp(argv[i], "--delete-rate") == 0 && i + 1 < argc) {
+            char *end;
+            scanOptions.deleteRate = strtoull(argv[++i], &end, 10);
+            if (*end != '\0' || argv[i][0] == '-') {
+                fprintf(stderr, "Invalid delete rate '%s'\n", argv[i]);
+                return false;
+            }
+        } else if (strcmp(argv[i], "--bench-listing") == 0 && i + 1 < argc) {
+            scanOptions.benchListingRoot = argv[++i];
+        } else if (strcmp(argv[i], "--bench-sizes") == 0 && i + 1 < argc) {
+            scanOptions.benchListingSizes = argv[++i];
+        } else if (strcmp(argv[i], "--bench-scan") == 0 && i + 1 < argc) {
+            scanOptions.benchScanRoot = argv[++i];
+        } else if (strcmp(argv[i], "--bench-shapes") == 0 && i + 1 < argc) {
+            scanOptions.benchScanShapes = argv[++i];
+        } else if (strcmp(argv[i], "--bench-json") == 0 && i + 1 < argc) {
+            scanOptions.benchJsonPath = argv[++i];
+        } else if (strcmp(argv[i], "--bench-match") == 0) {
+            scanOptions.benchMatchQuery = i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0 ? argv[++i] : DEFAULT_BENCH_MATCH_QUERY;
+        } else {
+            printUsage(argv[0]);
+            return false;
+        }
+    }
+    if (scanOptions.incremental && scanOptions.topCount > 0) {
+        fprintf(stderr, "--top writes no snapshot and cannot be combined with --incremental\n");
+        return false;
+    }
+    if (scanOptions.findDuplicates && (scanOptions.incremental || scanOptions.topCount > 0)) {
+        fprintf(stderr, "--duplicates cannot be combined with --incremental or --top\n");
+        return false;
+    }
+    if (scanOptions.estimate && (scanOptions.incremental || scanOptions.topCount > 0 || scanOptions.findDuplicates)) {
+        fprintf(stderr, "--estimate cannot be combined with --incremental, --top or --duplicates\n");
+        return false;
+    }
+    if (scanOptions.diskUsage && scanOptions.incremental) {
+        fprintf(stderr, "--disk-usage cannot be combined with --incremental: a snapshot has no inodes to tell hard links apart\n");
+        return false;
+    }
+    if (scanOptions.incremental) {
+        // The cache is the previous snapshot, so the new results must be one too.
+        scanOptions.resultFormat = RESULT_FORMAT_SNAPSHOT;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
     int choice;
     char startDir[256];
     char outputFilePath[256] = "output.txt";
     int scanResult;
 
+    if (!parseCommandLine(argc, argv)) {
+        return EXIT_FAILURE;
+    }
+
+    if (scanOptions.benchListingRoot != NULL) {
+        return runListingBenchmark(scanOptions.benchListingRoot, scanOptions.benchListingSizes);
+    }
+    if (scanOptions.benchMatchQuery != NULL) {
+        return runMatchBenchmark(scanOptions.benchMatchQuery);
+    }
+    if (scanOptions.benchScanRoot != NULL) {
+        return runScanBenchmark(scanOptions.benchScanRoot, scanOptions.benchScanShapes, scanOptions.benchJsonPath);
+    }
+    if (scanOptions.watchRoot != NULL) {
+        return runWatchMode(scanOptions.watchRoot);
+    }
+    if (scanOptions.diffOld != NULL) {
+        return runDiffMode(scanOptions.diffOld, scanOptions.diffNew, scanOptions.diffThreshold);
+    }
+    if (scanOptions.deletePath != NULL) {
+        bool deleted = runCleanup(scanOptions.deletePath, scanOptions.dryRun);
+        reportScanStats(scanOptions.dryRun ? "Delete (dry run)" : "Delete");
+        return deleted ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
     setTerminalTitle("OnionClean");
 
     printf("Welcome to OnionClean!\n");
@@ -601,16 +10384,57 @@ int main() {
                     printf("Directory does not exist.\n");
                     break;
                 }
+                ScanProgress progress = {0};
+                if (scanOptions.findDuplicates) {
+                    printf("Starting scan...\n");
+                    if (reportDuplicateFiles(startDir, &progress) && scanOptions.breakdown) {
+                        printFileBreakdown(&fileBreakdown);
+                    }
+                    break;
+                }
+                if (scanOptions.estimate) {
+                    while (getchar() != '\n');
+                    printf("Estimating...\n");
+                    reportEstimate(startDir);
+                    break;
+                }
+                if (scanOptions.topCount > 0) {
+                    while (getchar() != '\n');
+                    unsigned long long threshold = 0;
+                    if (askYesNoQuestion("Only report entries of at least a given size?")) {
+                        threshold = askForSizeThreshold();
+                    }
+                    printf("Starting scan...\n");
+                    if (reportLargestEntries(startDir, threshold, &progress) && scanOptions.breakdown) {
+                        printFileBreakdown(&fileBreakdown);
+                    }
+                    break;
+                }
                 printf("Starting scan...\n");
-                FILE *outputFile = fopen(outputFilePath, "w");
-                if (outputFile == NULL) {
-                    perror("Error opening the output file");
+                if (!writeScanResults(startDir, outputFilePath, &progress)) {
                     break;
                 }
-                totalDirectories = countTotalDirectories(startDir, 0);
-                listDirectories(startDir, outputFile, 0, &processedDirectories, totalDirectories);
-                fclose(outputFile);
+                updateScanProgress(&progress, true);
                 printf("\nScan complete. Results have been written to %s\n", outputFilePath);
+                if (scanOptions.buildIndex && buildResultIndex(outputFilePath)) {
+                    printf("Search index written to %s.idx\n", outputFilePath);
+                }
+                if (progress.rereadDirectories + progress.reusedDirectories > 0) {
+                    printf("%llu directories re-read, %llu reused from the previous scan\n",
+                           progress.rereadDirectories, progress.reusedDirectories);
+                }
+                if (progress.skippedMounts > 0) {
+                    printf("%llu mount points on other or excluded filesystems were not scanned\n", progress.skippedMounts);
+                }
+                if (progress.excludedDirectories > 0 && scanOptions.countExcluded) {
+                    printf("%llu directories matched the exclude rules, holding %llu bytes left out of the totals\n",
+                           progress.excludedDirectories, progress.excludedBytes);
+                } else if (progress.excludedDirectories > 0) {
+                    printf("%llu directories matched the exclude rules and were not scanned\n", progress.excludedDirectories);
+                }
+                if (scanOptions.breakdown) {
+                    printFileBreakdown(&fileBreakdown);
+                }
                 break;
             case 2:
                 printf("Enter new output file path: ");
@@ -637,31 +10461,7 @@ int main() {
                         break;
                     }
                     keywords[strcspn(keywords, "\n")] = 0;
-                    toLowerString(keywords);
-
-                    FILE *outputFile = fopen(outputFilePath, "r");
-                    if (outputFile == NULL) {
-                        perror("Error opening the output file");
-                        break;
-                    }
-
-                    char line[MAX_LINE_LENGTH];
-                    while (fgets(line, sizeof(line), outputFile) != NULL) {
-                        char path[MAX_PATH_LENGTH];
-                        unsigned long long size;
-
-                        if (sscanf(line, "%1023s - %llu", path, &size) == 2) {
-                            toLowerString(path);
-                            if (strstr(path, keywords)) {
-                                printLine(path, size);
-                            }
-                        }
-                    }
-
-                    if (fclose(outputFile) == EOF) {
-                        perror("Error closing the output file");
-                        break;
-                    }
+                    searchResults(outputFilePath, keywords);
                 }
                 break;
             case 5:
@@ -679,6 +10479,7 @@ int main() {
             default:
                 printf("Invalid choice. Please enter a number between 1 and 4.\n");
         }
+        reportScanStats(choice == 1 ? "Start Scan" : choice == 3 ? "View Last Scan Results" : choice == 4 ? "Search Apps" : "Scan Known Dir");
     }
 
     return EXIT_SUCCESS;
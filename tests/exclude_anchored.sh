@@ -0,0 +1,42 @@
+#!/bin/bash
+# An exclude rule with a leading slash matches only from the start of the scan, whether it
+# is a literal name or a glob: "/build*" must skip build1 but not src/build3 or a build2
+# nested below another directory.
+set -eu
+
+root="$(cd "$(dirname "$0")/.." && pwd)"
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+
+cc -O2 -o "$work/scanner" "$root/src/main.c" -lm -pthread 2>/dev/null
+
+tree="$work/tree"
+for dir in build1/x/build2 buildA/buildA src/build3 src/buildA keep/build1; do
+    mkdir -p "$tree/$dir"
+    head -c 1000 /dev/zero > "$tree/$dir/file"
+done
+
+# Prints the directories a scan with the given exclude rule reports, relative to the tree.
+scan() {
+    printf '2\n%s\n1\n%s\n00\n' "$work/out.txt" "$tree" | timeout 60 "$work/scanner" "$@" > /dev/null
+    sed -n "s|^$tree/\(.*\) - [0-9]* bytes$|\1|p" "$work/out.txt" | sort | tr '\n' ' '
+}
+
+check() {
+    local rule="$1" expected="$2"
+    for threads in 1 4; do
+        local actual
+        actual="$(scan --exclude "$rule" --threads "$threads")"
+        if [ "$actual" != "$expected" ]; then
+            echo "FAIL: --exclude '$rule' --threads $threads kept: $actual"
+            echo "      expected: $expected"
+            exit 1
+        fi
+    done
+}
+
+check '/build*' "keep keep/build1 src src/build3 src/buildA "
+check '/buildA' "build1 build1/x build1/x/build2 keep keep/build1 src src/build3 src/buildA "
+check '/src/build*' "build1 build1/x build1/x/build2 buildA buildA/buildA keep keep/build1 src "
+check 'build*' "keep src "
+echo "PASS: exclude_anchored"
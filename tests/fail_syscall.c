@@ -0,0 +1,36 @@
+// LD_PRELOAD shim for the tests: makes the FAIL_AT'th syscall() with number FAIL_SYSCALL
+// fail with errno FAIL_ERRNO (EIO by default), and every other call go through.
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+static atomic_long matchingCalls;
+
+long syscall(long number, ...) {
+    static long (*realSyscall)(long, ...);
+    if (realSyscall == NULL) {
+        realSyscall = (long (*)(long, ...))dlsym(RTLD_NEXT, "syscall");
+    }
+
+    va_list arguments;
+    va_start(arguments, number);
+    long a = va_arg(arguments, long);
+    long b = va_arg(arguments, long);
+    long c = va_arg(arguments, long);
+    long d = va_arg(arguments, long);
+    long e = va_arg(arguments, long);
+    long f = va_arg(arguments, long);
+    va_end(arguments);
+
+    const char *target = getenv("FAIL_SYSCALL");
+    const char *failAt = getenv("FAIL_AT");
+    if (target != NULL && failAt != NULL && atol(target) == number && atomic_fetch_add(&matchingCalls, 1) + 1 == atol(failAt)) {
+        const char *error = getenv("FAIL_ERRNO");
+        errno = error != NULL ? atoi(error) : EIO;
+        return -1;
+    }
+    return realSyscall(number, a, b, c, d, e, f);
+}
@@ -0,0 +1,40 @@
+#!/bin/bash
+# Hard-linked files must be charged to the same directory whatever the thread count: a
+# --disk-usage scan with many threads must write exactly what a single-threaded scan does.
+set -eu
+
+root="$(cd "$(dirname "$0")/.." && pwd)"
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+
+cc -O2 -o "$work/scanner" "$root/src/main.c" -lm -pthread 2>/dev/null
+
+tree="$work/tree"
+mkdir -p "$tree/files"
+for file in $(seq 1 200); do
+    head -c 40000 /dev/urandom > "$tree/files/$file"
+done
+for dir in $(seq 1 40); do
+    mkdir -p "$tree/d$dir/sub"
+    for file in $(seq 1 200); do
+        ln "$tree/files/$file" "$tree/d$dir/sub/$file"
+    done
+done
+
+scan() {
+    printf '2\n%s\n1\n%s\n00\n' "$1" "$tree" | timeout 60 "$work/scanner" --disk-usage "${@:2}" > /dev/null
+}
+
+scan "$work/expected.txt" --threads 1
+for run in 1 2 3 4 5; do
+    for options in "--threads 8" "--threads 8 --io-uring"; do
+        # shellcheck disable=SC2086
+        scan "$work/actual.txt" $options
+        if ! cmp -s "$work/expected.txt" "$work/actual.txt"; then
+            echo "FAIL: $options charged hard links differently from --threads 1 (run $run)"
+            diff "$work/expected.txt" "$work/actual.txt" | head
+            exit 1
+        fi
+    done
+done
+echo "PASS: hardlink_threads"
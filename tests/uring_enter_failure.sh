@@ -0,0 +1,42 @@
+#!/bin/bash
+# A scan whose io_uring_enter fails for good must neither hang nor lose entries: the
+# listing falls back to synchronous stat and the results match a scan without io_uring.
+set -eu
+
+root="$(cd "$(dirname "$0")/.." && pwd)"
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+
+cc -O2 -o "$work/scanner" "$root/src/main.c" -lm -pthread 2>/dev/null
+cc -shared -fPIC -o "$work/fail_syscall.so" "$root/tests/fail_syscall.c" -ldl
+
+tree="$work/tree"
+for dir in a a/b a/b/c d e/f; do
+    mkdir -p "$tree/$dir"
+    for file in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20; do
+        head -c $((file * 100)) /dev/zero > "$tree/$dir/$file"
+    done
+done
+
+scan() {
+    printf '2\n%s\n1\n%s\n00\n' "$1" "$tree" | timeout 60 "$work/scanner" "${@:2}" > /dev/null 2> "$1.err"
+}
+
+scan "$work/expected.txt"
+number="$(printf '#include <sys/syscall.h>\nSYS_io_uring_enter\n' | cc -E -P - | tail -n 1)"
+for failAt in 1 2 3 5 8; do
+    for error in 12 9 14; do
+        FAIL_SYSCALL="$number" FAIL_AT="$failAt" FAIL_ERRNO="$error" LD_PRELOAD="$work/fail_syscall.so" \
+            scan "$work/actual.txt" --io-uring --uring-depth 4 --threads 2
+        if ! grep -q 'io_uring_enter failed' "$work/actual.txt.err" && ! grep -q 'io_uring statx is unavailable' "$work/actual.txt.err"; then
+            echo "FAIL: no io_uring_enter failure reported (call $failAt, errno $error)"
+            exit 1
+        fi
+        if ! cmp -s "$work/expected.txt" "$work/actual.txt"; then
+            echo "FAIL: results differ after io_uring_enter failed (call $failAt, errno $error)"
+            diff "$work/expected.txt" "$work/actual.txt" | head
+            exit 1
+        fi
+    done
+done
+echo "PASS: uring_enter_failure"